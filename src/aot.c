@@ -0,0 +1,99 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "aot.h"
+
+/* Ritorna non zero se il programma compilato è quello della macchina,
+ * con le stesse quirk */
+int chip8_aot_match(const chip8_aot_t *aot, const chip8_machine_t *ctx){
+	return ctx->image && ctx->quirks == aot->quirks && ctx->image->len == aot->len
+		&& !memcmp(ctx->image->ram + 0x200, aot->rom, aot->len);
+}
+
+/* Esegue fino a count istruzioni: i blocchi compilati col codice
+ * nativo, il resto con l'interprete un'istruzione alla volta. Come chi
+ * esegue chip8_exec in un ciclo, si ferma dopo un'istruzione che
+ * disegna o che aspetta un tasto; con il debugger armato usa solo
+ * l'interprete. In done mette le istruzioni eseguite.
+ * Ritorna 0, o il codice di errore di chip8_exec */
+int chip8_aot_run(chip8_machine_t *ctx, const chip8_aot_t *aot, unsigned count, unsigned *done){
+	unsigned n;
+	int status, native;
+
+	native = ctx->quirks == aot->quirks && ctx->exec == chip8_exec_variant(ctx->quirks);
+	status = 0;
+	n = 0;
+
+	while (n < count){
+		if (native && !ctx->wait){
+			ctx->drawn = 0;
+			n += aot->run(ctx, count - n, &status);
+			if (status || ctx->drawn || ctx->wait || n == count){
+				break;
+			}
+		}
+
+		/* Il codice nativo si è fermato: un blocco non compilato, un
+		 * salto calcolato, codice modificato o budget troppo piccolo */
+		if ((status = chip8_exec(ctx)) != 0){
+			break;
+		}
+		n += ctx->retired;
+
+		if (ctx->drawn || ctx->wait){
+			break;
+		}
+	}
+
+	*done = n;
+	return status;
+}
+
+/* Carica un modulo compilato da c8aot, col chip8_aot_t di nome symbol,
+ * o CHIP8_AOT_SYMBOL se è NULL; ritorna NULL in caso di errore, dopo
+ * averlo segnalato. Il modulo non viene mai scaricato */
+const chip8_aot_t *chip8_aot_load(const char *path, const char *symbol){
+	const chip8_aot_t *aot;
+	void *handle;
+
+	if (!symbol){
+		symbol = CHIP8_AOT_SYMBOL;
+	}
+
+	if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL){
+		fprintf(stderr, "Impossibile caricare %s: %s\n", path, dlerror());
+		return NULL;
+	}
+
+	if ((aot = dlsym(handle, symbol)) == NULL){
+		fprintf(stderr, "%s non contiene il programma di c8aot %s\n", path, symbol);
+		dlclose(handle);
+		return NULL;
+	}
+
+	if (aot->version != CHIP8_AOT_VERSION || aot->machine_size != sizeof(chip8_machine_t)){
+		fprintf(stderr, "%s è stato compilato per un'altra versione\n", path);
+		dlclose(handle);
+		return NULL;
+	}
+
+	return aot;
+}
@@ -0,0 +1,72 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _AOT_H_
+#define _AOT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8.h"
+
+/* Programmi compilati in anticipo da c8aot: ogni ROM diventa una
+ * funzione C che esegue direttamente i suoi blocchi base, con i
+ * registri in variabili locali, e torna all'interprete per tutto quello
+ * che non sa eseguire. Il file generato definisce un chip8_aot_t di
+ * nome CHIP8_AOT_SYMBOL, o quello scelto con c8aot -n, da cui un
+ * modulo viene caricato con dlopen */
+#define CHIP8_AOT_VERSION 1
+#define CHIP8_AOT_SYMBOL  "chip8_aot_program"
+
+/* Esegue blocchi interi finché restano almeno le loro istruzioni in
+ * budget, si ferma quando il codice nativo non può proseguire; in
+ * status mette il codice di errore di chip8_exec, se c'è.
+ * Ritorna il numero di istruzioni eseguite */
+typedef unsigned (*chip8_aot_fn)(chip8_machine_t *ctx, unsigned budget, int *status);
+
+typedef struct chip8_aot {
+	unsigned version;           /* CHIP8_AOT_VERSION */
+	unsigned machine_size;      /* sizeof(chip8_machine_t) del generatore */
+	const char *name;
+	const uint8_t *rom;
+	size_t len;
+	unsigned quirks;            /* Quirk per cui è stato compilato */
+	chip8_aot_fn run;
+} chip8_aot_t;
+
+/* Ritorna non zero se i byte del programma tra start ed end non sono
+ * più quelli compilati, usata dal codice generato quando il programma
+ * può scrivere sul proprio codice */
+static inline int chip8_aot_changed(const chip8_machine_t *ctx, const uint8_t *rom,
+									uint16_t start, uint16_t end){
+	uint16_t addr;
+
+	for (addr=start; addr<end; addr++){
+		if (chip8_peek(ctx, addr) != rom[addr - 0x200]){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Funzioni da aot.c */
+extern int chip8_aot_match(const chip8_aot_t *aot, const chip8_machine_t *ctx);
+extern int chip8_aot_run(chip8_machine_t *ctx, const chip8_aot_t *aot, unsigned count, unsigned *done);
+extern const chip8_aot_t *chip8_aot_load(const char *path, const char *symbol);
+
+#endif /* _AOT_H_ */
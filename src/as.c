@@ -18,196 +18,494 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "util.h"
+#include "c8as.h"
 #include "as.h"
+#include "debuginfo.h"
+#include "catalog.h"
 
-#ifndef MAX_LABELS
-#define MAX_LABELS 256
-#endif
-
-extern int yyparse();
-extern FILE *yyin;
-
-struct asm_label {
-	uint16_t addr;
-	char *name;
-};
-
-enum asm_state {
-	LABEL_SCAN, ASSEMBLY
-};
-
-static uint8_t *prog;
-static size_t bufsize, used;
-static struct asm_label labels[MAX_LABELS];
-static unsigned nlabels;
-static enum asm_state asm_state;
+/* Spazio iniziale per il programma, ingrandito se non basta */
+#define PROG_SIZE 0x0E00
 
 static void disas(const char *file);
+static int read_source(const char *file, outbuf_t *src);
+static int report(const char *name, const c8as_result_t *res);
+static void print_stats(const struct asm_opt_stats *stats);
+static int save_debuginfo(dbginfo_t *dbg, const char *outfile);
+static int save_file(const char *path, const void *data, size_t len);
+static uint8_t *assemble(const char *file, const outbuf_t *src, unsigned flags,
+						 dbginfo_t *dbg, c8as_result_t *res);
+static int link_files(const char *outfile, char **files, int count, int debuginfo);
+static int build(const char *outfile, const char *dir, char **files, int count, int debuginfo);
 
 int main(int argc, char **argv){
-	char *infile, *outfile;
-	FILE *out;
+	char *infile, *outfile, *corpus, *dir, *catfile;
+	int opt, dis, optimize, debuginfo, object, linking, building, status;
+	unsigned threads;
+	c8as_result_t res;
+	catalog_t cat;
+	dbginfo_t dbg;
+	outbuf_t src;
+	uint8_t *prog;
 
-	if (argc < 2){
-		fprintf(stderr, "Assembler: %s INFILE OUTFILE\n", argv[0]);
-		fprintf(stderr, "Disassembler: %s -d INFILE\n", argv[0]);
-		return 0;
-	} else if (argc < 3){
-		disas(argv[1]);
-		return 0;
+	dis = optimize = debuginfo = object = linking = building = 0;
+	corpus = dir = catfile = NULL;
+	threads = 0;
+	while ((opt = getopt(argc, argv, "bc:C:dgj:lo:Or")) != -1){
+		switch (opt){
+		case 'b':
+			building = 1;
+			break;
+		case 'l':
+			linking = 1;
+			break;
+		case 'r':
+			object = 1;
+			break;
+		case 'c':
+			corpus = optarg;
+			break;
+		case 'C':
+			catfile = optarg;
+			break;
+		case 'd':
+			dis = 1;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			dir = optarg;
+			break;
+		case 'g':
+			debuginfo = 1;
+			break;
+		case 'O':
+			optimize = 1;
+			break;
+		default:
+			goto usage;
+		}
 	}
 
-	infile = argv[1];
-	outfile = argv[2];
-	
-	if ((yyin = fopen(infile, "r")) == NULL){
-		err("impossibile leggere il file %s", infile);
-		return EXIT_FAILURE;
+	if (object + linking + building > 1 || (optimize && (object || linking || building))){
+		goto usage;
+	} else if (linking || building){
+		if (argc - optind < 2){
+			goto usage;
+		}
+		status = linking ? link_files(argv[optind], argv + optind + 1, argc - optind - 1, debuginfo)
+			: build(argv[optind], dir, argv + optind + 1, argc - optind - 1, debuginfo);
+		return status ? EXIT_FAILURE : 0;
+	} else if (corpus && catfile){
+		if (optind != argc){
+			goto usage;
+		}
+		if (catalog_open(&cat, catfile)){
+			return EXIT_FAILURE;
+		}
+		status = asm_corpus(corpus, dir, threads, NULL, cat.hdr->count, &cat);
+		catalog_close(&cat);
+		return status ? EXIT_FAILURE : 0;
+	} else if (corpus){
+		if (optind >= argc){
+			goto usage;
+		}
+		return asm_corpus(corpus, dir, threads, argv + optind, argc - optind, NULL) ? EXIT_FAILURE : 0;
+	} else if (argc - optind == 1){
+		disas(argv[optind]);
+		return 0;
+	} else if (dis || argc - optind != 2){
+		goto usage;
 	}
-	
-	asm_state = LABEL_SCAN;
-	if (yyparse()){
-		fclose(yyin);
+
+	infile = argv[optind];
+	outfile = argv[optind + 1];
+
+	if (read_source(infile, &src)){
 		return EXIT_FAILURE;
 	}
-	
-	asm_state = ASSEMBLY;
-	bufsize = 4096;
-	used = 0;
-	prog = malloc(bufsize);
-	fseek(yyin, 0, SEEK_SET);
-	if (yyparse()){
-		fclose(yyin);
-		return EXIT_FAILURE;
+
+	dbginfo_init(&dbg);
+
+	if ((prog = assemble(infile, &src, (optimize ? C8AS_OPTIMIZE : 0) | (object ? C8AS_OBJECT : 0),
+						 debuginfo && !object ? &dbg : NULL, &res)) == NULL){
+		goto fail;
 	}
 
-	fclose(yyin);
+	if (optimize){
+		print_stats(&res.stats);
+	}
 
-	if ((out = fopen(outfile, "wb")) == NULL){
-		err("impossibile scrivere il file %s", outfile);
-		return EXIT_FAILURE;
+	if (debuginfo && !object && save_debuginfo(&dbg, outfile)){
+		goto fail;
 	}
 
-	if (fwrite(prog, 1, used, out) < used){
-		err("impossibile scrivere il file %s", outfile);
-		fclose(out);
-		free(prog);
-		return EXIT_FAILURE;
+	if (save_file(outfile, prog, res.len)){
+		goto fail;
 	}
-	
-	fclose(out);
+
 	free(prog);
+	outbuf_free(&src);
+	dbginfo_free(&dbg);
 
-	fprintf(stderr, "Scritti %ld bytes\n", used);
+	fprintf(stderr, "Scritti %ld bytes\n", (long) res.len);
 	
 	return 0;
+
+ fail:
+	free(prog);
+	outbuf_free(&src);
+	dbginfo_free(&dbg);
+	return EXIT_FAILURE;
+
+ usage:
+	fprintf(stderr, "Assembler: %s [-O] [-g] INFILE OUTFILE\n", argv[0]);
+	fprintf(stderr, "  -O  ottimizza il programma\n");
+	fprintf(stderr, "  -g  scrive etichette e righe del sorgente in OUTFILE.sym\n");
+	fprintf(stderr, "Oggetto rilocabile: %s -r INFILE OUTFILE\n", argv[0]);
+	fprintf(stderr, "Linker: %s -l [-g] OUTFILE OGGETTO...\n", argv[0]);
+	fprintf(stderr, "Compilazione a moduli: %s -b [-g] [-o DIR] OUTFILE SORGENTE...\n", argv[0]);
+	fprintf(stderr, "  -b  riassembla solo i sorgenti cambiati, negli oggetti in DIR o accanto\n");
+	fprintf(stderr, "Disassembler: %s -d INFILE\n", argv[0]);
+	fprintf(stderr, "Analisi di più ROM: %s -c OUT.json [-j THREADS] [-o DIR] ROM...\n", argv[0]);
+	fprintf(stderr, "                    %s -c OUT.json -C CATALOGO [-j THREADS] [-o DIR]\n", argv[0]);
+	fprintf(stderr, "  -j  numero di thread (predefinito: numero di CPU)\n");
+	fprintf(stderr, "  -o  scrive il sorgente di ogni ROM in DIR\n");
+	fprintf(stderr, "Con -d e -c l'analisi di ogni ROM viene salvata in $XDG_CACHE_HOME/chip8\n");
+	fprintf(stderr, "o ~/.cache/chip8; CHIP8_CACHE_DIR sceglie un'altra directory, vuota la disattiva\n");
+	return 0;
 }
 
+/* Stampa il sorgente di un programma */
 static void disas(const char *file){
-	char buf[128];
-	unsigned index;
+	uint8_t *prog;
+	outbuf_t ob;
 	size_t count;
-	uint16_t opcode;
 
-	prog = malloc(4096);
-	
-	if (!(count = read_file(file, prog, 4096))){
+	prog = malloc(PROG_SIZE);
+
+	if (!prog || outbuf_init(&ob, stdout, 65536)){
+		err("impossibile allocare memoria");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!(count = read_file(file, prog, PROG_SIZE))){
 		exit(EXIT_FAILURE);
 	}
 
-	for (index=0; index<count; index+=2){
-		opcode = ((prog[index & 0x0FFF] << 8)
-				  | (prog[(index + 1) & 0x0FFF] & 0xFF));
-		chip8_decode(opcode, buf, 128);
-		printf("%04X\t%02X %02X\t%s\n", index+0x200, prog[index & 0x0FFF], prog[(index + 1) & 0x0FFF], buf);
+	if (chip8_disassemble(prog, count, file, &ob, NULL) || outbuf_flush(&ob)){
+		err("impossibile scrivere il sorgente di %s", file);
+		exit(EXIT_FAILURE);
 	}
+
+	outbuf_free(&ob);
+	free(prog);
 }
 
-static void check_buffer(int needed){
-	if (used + needed >= bufsize){
-		bufsize += needed + (bufsize / 2);
-		if ((prog = realloc(prog, bufsize)) == NULL){
-			err("impossibile allocare memoria");
-			fclose(yyin);
-			exit(EXIT_FAILURE);
-		}
+/* Legge tutto il sorgente in memoria, ritorna non zero in caso di errore */
+static int read_source(const char *file, outbuf_t *src){
+	char buf[8192];
+	size_t count;
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL){
+		err("impossibile leggere il file %s", file);
+		return 1;
+	}
+
+	if (outbuf_init(src, NULL, 65536)){
+		err("impossibile allocare memoria");
+		fclose(fp);
+		return 1;
+	}
+
+	while ((count = fread(buf, 1, sizeof(buf), fp)) > 0){
+		outbuf_write(src, buf, count);
+	}
+
+	if (ferror(fp) || src->error){
+		err("impossibile leggere il file %s", file);
+		outbuf_free(src);
+		fclose(fp);
+		return 1;
 	}
+
+	fclose(fp);
+	return 0;
 }
 
-void push_resb(uint16_t count){
-	int i;
+/* Stampa gli errori dell'assemblaggio del file name, o del collegamento
+ * se è NULL; ritorna non zero se ce ne sono */
+static int report(const char *name, const c8as_result_t *res){
+	const c8as_error_t *e;
+	unsigned i;
 
-	if (asm_state != ASSEMBLY){
-		used += count;
-		return;
+	for (i=0; i<res->nerrors && i<C8AS_MAX_ERRORS; i++){
+		e = &res->errors[i];
+		if (name && e->line){
+			fprintf(stderr, "%s, riga %d: %s\n", name, e->line, e->msg);
+		} else if (name){
+			fprintf(stderr, "%s: %s\n", name, e->msg);
+		} else if (e->line){
+			fprintf(stderr, "Errore alla riga %d: %s\n", e->line, e->msg);
+		} else {
+			fprintf(stderr, "Errore: %s\n", e->msg);
+		}
 	}
-	
-	check_buffer(count);
 
-	for (i=0; i<count; i++){
-		prog[used + i] = 0;
-		used++;
+	if (res->nerrors > C8AS_MAX_ERRORS){
+		fprintf(stderr, "... e altri %u errori\n", res->nerrors - C8AS_MAX_ERRORS);
 	}
-	logd("RESB %ud\n", count);
+
+	return res->nerrors != 0;
+}
+
+static void print_stats(const struct asm_opt_stats *stats){
+	/* Le istruzioni irraggiungibili non costavano cicli, i salti accorciati sì */
+	fprintf(stderr, "Ottimizzazione: %u istruzioni rimosse (%u byte): %u irraggiungibili, "
+			"%u assegnamenti inutili, %u somme unite, %u skip invertiti; %u salti accorciati\n",
+			stats->removed, stats->removed * 2, stats->unreachable, stats->dead,
+			stats->folded, stats->inverted, stats->threaded);
+	fprintf(stderr, "Cicli risparmiati ad ogni passaggio sul codice ottimizzato: fino a %u\n",
+			stats->removed - stats->unreachable + stats->threaded);
 }
 
-void push_byte(uint8_t byte){
-	if (asm_state != ASSEMBLY){
-		used++;
-		return;
+/* Scrive len byte nel file path, ritorna non zero in caso di errore */
+static int save_file(const char *path, const void *data, size_t len){
+	FILE *out;
+
+	if ((out = fopen(path, "wb")) == NULL){
+		err("impossibile scrivere il file %s", path);
+		return 1;
 	}
-	
-	check_buffer(0);
-	prog[used++] = byte;
-	logd("PUSHb %02X\n", byte);
+
+	if (fwrite(data, 1, len, out) < len){
+		err("impossibile scrivere il file %s", path);
+		fclose(out);
+		return 1;
+	}
+
+	if (fclose(out)){
+		err("impossibile scrivere il file %s", path);
+		return 1;
+	}
+
+	return 0;
 }
 
-void push_label(const char *label){
-	if (asm_state != LABEL_SCAN){
-		return;
+/* Assembla il sorgente di file, ritorna il programma (o l'oggetto, con
+ * C8AS_OBJECT) in un buffer da liberare, o NULL dopo aver stampato gli
+ * errori. In res->len la sua lunghezza */
+static uint8_t *assemble(const char *file, const outbuf_t *src, unsigned flags,
+						 dbginfo_t *dbg, c8as_result_t *res){
+	uint8_t *prog;
+	size_t size;
+	int status;
+
+	/* Se il programma non entra nel buffer c8as_assemble dice
+	 * quanto spazio serve, quindi basta riprovare una volta */
+	status = C8AS_E_OVERFLOW;
+	res->len = PROG_SIZE;
+	prog = NULL;
+	while (status == C8AS_E_OVERFLOW){
+		size = res->len;
+		free(prog);
+		if (dbg){
+			dbginfo_free(dbg);
+			dbginfo_init(dbg);
+			dbg->source = file;
+		}
+		if ((prog = malloc(size)) == NULL){
+			err("impossibile allocare memoria");
+			return NULL;
+		}
+		status = c8as_assemble(src->data, src->used, prog, size, flags, dbg, res);
 	}
-	
-	if (nlabels == MAX_LABELS){
-		fprintf(stderr, "Errore: limite di %d label raggiunto", MAX_LABELS);
-		fclose(yyin);
+
+	if (report((flags & C8AS_OBJECT) ? file : NULL, res)){
 		free(prog);
-		exit(EXIT_FAILURE);
+		return NULL;
 	}
-	
-	labels[nlabels++] = (struct asm_label) { 0x200 + used, label };
-	logd("PUSHl %s = %04Xh\n", label, 0x200 + used);
+
+	return prog;
 }
 
-void push_instr(asm_instr_t instr){
-	unsigned i;
+/* Collega gli oggetti in outfile, con le etichette in OUTFILE.sym se
+ * debuginfo non è zero; gli oggetti devono restare validi fino alla
+ * fine. Ritorna non zero in caso di errore */
+static int link_objects(const char *outfile, const c8as_object_t *objs, int count, int debuginfo){
+	c8as_result_t res;
+	dbginfo_t dbg;
+	uint8_t *prog;
+	size_t size;
+	int status;
+
+	dbginfo_init(&dbg);
 
-	if (asm_state != ASSEMBLY){
-		used += 2;
-		return;
+	status = C8AS_E_OVERFLOW;
+	res.len = PROG_SIZE;
+	prog = NULL;
+	while (status == C8AS_E_OVERFLOW){
+		size = res.len;
+		free(prog);
+		dbginfo_free(&dbg);
+		dbginfo_init(&dbg);
+		if ((prog = malloc(size)) == NULL){
+			err("impossibile allocare memoria");
+			dbginfo_free(&dbg);
+			return 1;
+		}
+		status = c8as_link(objs, count, prog, size, debuginfo ? &dbg : NULL, &res);
 	}
-	
-	if (instr.label != NULL){
-		for (i=0; i<nlabels; i++){
-			if (!strcmp(labels[i].name, instr.label)){
-				instr.opcode |= labels[i].addr;
-				instr.label = NULL;
-				break;
-			}
+
+	status = report(NULL, &res) || (debuginfo && save_debuginfo(&dbg, outfile))
+		|| save_file(outfile, prog, res.len);
+	if (!status){
+		fprintf(stderr, "Scritti %ld bytes\n", (long) res.len);
+	}
+
+	free(prog);
+	dbginfo_free(&dbg);
+	return status;
+}
+
+/* Collega gli oggetti dei file indicati */
+static int link_files(const char *outfile, char **files, int count, int debuginfo){
+	c8as_object_t *objs;
+	outbuf_t *bufs;
+	int i, status;
+
+	objs = calloc(count, sizeof(c8as_object_t));
+	bufs = calloc(count, sizeof(outbuf_t));
+	if (!objs || !bufs){
+		err("impossibile allocare memoria");
+		free(objs);
+		free(bufs);
+		return 1;
+	}
+
+	for (i=0, status=0; i<count && !status; i++){
+		status = read_source(files[i], &bufs[i]);
+		objs[i] = (c8as_object_t) { files[i], bufs[i].data, bufs[i].used };
+	}
+
+	if (!status){
+		status = link_objects(outfile, objs, count, debuginfo);
+	}
+
+	for (i=0; i<count; i++){
+		outbuf_free(&bufs[i]);
+	}
+	free(objs);
+	free(bufs);
+	return status;
+}
+
+/* Percorso dell'oggetto di un sorgente: lo stesso nome con estensione
+ * .c8o, nella directory dir se non è NULL, altrimenti accanto */
+static char *object_path(const char *dir, const char *file){
+	const char *base, *ext;
+	char *path;
+	size_t len;
+
+	base = (dir && strrchr(file, '/')) ? strrchr(file, '/') + 1 : file;
+	ext = strrchr(base, '.');
+	len = (ext && ext != base && !strchr(ext, '/')) ? (size_t) (ext - base) : strlen(base);
+
+	if ((path = malloc((dir ? strlen(dir) + 1 : 0) + len + 5)) == NULL){
+		err("impossibile allocare memoria");
+		return NULL;
+	}
+
+	sprintf(path, "%s%s%.*s.c8o", dir ? dir : "", dir ? "/" : "", (int) len, base);
+	return path;
+}
+
+/* Assembla in un oggetto ogni sorgente cambiato dall'ultima volta, cioè
+ * quelli il cui oggetto manca o ha un hash diverso da quello del
+ * sorgente, e collega tutti gli oggetti in outfile.
+ * Ritorna non zero in caso di errore */
+static int build(const char *outfile, const char *dir, char **files, int count, int debuginfo){
+	const c8as_obj_header_t *hdr;
+	c8as_result_t res;
+	c8as_object_t *objs;
+	outbuf_t *bufs, src;
+	int i, status, rebuilt;
+	char *path;
+	uint8_t *obj;
+
+	objs = calloc(count, sizeof(c8as_object_t));
+	bufs = calloc(count, sizeof(outbuf_t));
+	if (!objs || !bufs){
+		err("impossibile allocare memoria");
+		free(objs);
+		free(bufs);
+		return 1;
+	}
+
+	rebuilt = 0;
+	for (i=0, status=0; i<count && !status; i++){
+		if ((path = object_path(dir, files[i])) == NULL){
+			status = 1;
+			break;
+		}
+
+		if (read_source(files[i], &src)){
+			free(path);
+			status = 1;
+			break;
 		}
 
-		if (instr.label){
-			fprintf(stderr, "Errore: label sconosciuto: %s", instr.label);
-			fclose(yyin);
-			exit(EXIT_FAILURE);
+		/* L'oggetto è ancora buono se viene dallo stesso sorgente */
+		if (access(path, R_OK) || read_source(path, &bufs[i])
+			|| (hdr = c8as_object_header(bufs[i].data, bufs[i].used)) == NULL
+			|| hdr->hash != c8as_hash(src.data, src.used)){
+			outbuf_free(&bufs[i]);
+			if ((obj = assemble(files[i], &src, C8AS_OBJECT, NULL, &res)) == NULL
+				|| save_file(path, obj, res.len)){
+				free(obj);
+				status = 1;
+			} else {
+				/* Il buffer dell'oggetto passa a bufs, che lo libera */
+				bufs[i] = (outbuf_t) { (char *) obj, res.len, res.len, NULL, 0 };
+				rebuilt++;
+			}
 		}
+
+		objs[i] = (c8as_object_t) { files[i], bufs[i].data, bufs[i].used };
+		outbuf_free(&src);
+		free(path);
 	}
 
-    check_buffer(0);
+	if (!status){
+		fprintf(stderr, "Riassemblati %d moduli su %d\n", rebuilt, count);
+		status = link_objects(outfile, objs, count, debuginfo);
+	}
 
-	prog[used++] = (instr.opcode >> 8) & 0xFF;
-	prog[used++] = instr.opcode & 0xFF;
-	
-	logd("PUSHi %04Xh\n", instr.opcode);
+	for (i=0; i<count; i++){
+		outbuf_free(&bufs[i]);
+	}
+	free(objs);
+	free(bufs);
+	return status;
+}
+
+/* Scrive etichette e righe in OUTFILE.sym, ritorna non zero in caso di errore */
+static int save_debuginfo(dbginfo_t *dbg, const char *outfile){
+	char *path;
+	int failed;
+
+	if ((path = malloc(strlen(outfile) + 5)) == NULL){
+		err("impossibile allocare memoria");
+		return 1;
+	}
+
+	sprintf(path, "%s.sym", outfile);
+	failed = dbginfo_save(dbg, path);
+	free(path);
+
+	return failed;
 }
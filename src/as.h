@@ -19,16 +19,80 @@
 #define _AS_H_
 
 #include <stdint.h>
+#include <stddef.h>
+
+#include "c8as.h"
+#include "symtab.h"
+#include "util.h"
 
 typedef struct asm_instr {
 	uint16_t opcode;
 	char *label;
+	int line;               /* Riga del sorgente */
 } asm_instr_t;
 
-extern void push_label(const char *label);
-extern void push_instr(asm_instr_t instr);
-extern void push_resb(uint16_t count);
-extern void push_byte(uint8_t byte);
-extern void chip8_decode(uint16_t opcode, char *buf, size_t len);
+/* Tipi di elemento del programma */
+#define ASM_ITEM_INSTR 0
+#define ASM_ITEM_LABEL 1
+#define ASM_ITEM_BYTE  2
+#define ASM_ITEM_RESB  3
+
+/* Elemento del programma registrato prima di essere scritto,
+ * così che l'ottimizzatore possa lavorare sulle istruzioni */
+typedef struct asm_item {
+	uint8_t type;           /* ASM_ITEM_* */
+	uint8_t deleted;        /* Non zero se rimosso dall'ottimizzatore */
+	uint16_t addr;          /* Indirizzo prima dell'ottimizzazione */
+	uint16_t value;         /* Opcode, byte o numero di byte di RESB */
+	symbol_t *sym;          /* Etichetta definita o usata dall'istruzione */
+	int line;
+} asm_item_t;
+
+/* Visibilità di un'etichetta negli oggetti rilocabili; senza nessuna
+ * delle due resta privata del modulo */
+#define ASM_SYM_GLOBAL 1    /* Definita qui, usabile dagli altri moduli */
+#define ASM_SYM_EXTERN 2    /* Definita in un altro modulo */
+
+/* Stato di un assemblaggio, definito in libc8as.c */
+struct asm_ctx;
+
+extern char *asm_strdup(struct asm_ctx *as, const char *str);
+extern void asm_error(struct asm_ctx *as, int code, int line, const char *fmt, ...);
+extern int push_label(struct asm_ctx *as, const char *label, int line);
+extern int push_instr(struct asm_ctx *as, asm_instr_t instr);
+extern int push_resb(struct asm_ctx *as, uint16_t count, int line);
+extern int push_byte(struct asm_ctx *as, uint8_t byte, int line);
+extern int push_section(struct asm_ctx *as, const char *name, int line);
+extern int push_visibility(struct asm_ctx *as, const char *name, int visibility, int line);
+extern void asm_optimize(asm_item_t *items, size_t count, struct asm_opt_stats *stats);
+
+/* Classi di istruzioni del disassembler */
+enum chip8_class {
+	CHIP8_CLS, CHIP8_RET, CHIP8_EXEC, CHIP8_JP, CHIP8_CALL,
+	CHIP8_SKIPE_NN, CHIP8_SKIPNE_NN, CHIP8_SKIPE_V, CHIP8_LD_NN, CHIP8_ADD_NN,
+	CHIP8_LD_V, CHIP8_OR, CHIP8_AND, CHIP8_XOR, CHIP8_ADD_V,
+	CHIP8_SUB, CHIP8_SHR, CHIP8_RSB, CHIP8_SHL, CHIP8_SKIPNE_V,
+	CHIP8_LD_I, CHIP8_JP_V0, CHIP8_RAND, CHIP8_DRAW, CHIP8_SKIPDN,
+	CHIP8_SKIPUP, CHIP8_LD_VDT, CHIP8_IN, CHIP8_LD_DT, CHIP8_LD_ST,
+	CHIP8_ADD_I, CHIP8_SPRITE, CHIP8_BCD, CHIP8_STOR, CHIP8_LOAD,
+	CHIP8_INVALID,
+	CHIP8_CLASSES
+};
+
+/* Statistiche raccolte dal disassembler */
+struct chip8_dis_stats {
+	unsigned blocks, procs, calls;
+	unsigned code, data;                    /* Byte di codice e di dati */
+	unsigned long hist[CHIP8_CLASSES];      /* Istruzioni per classe */
+};
+
+extern size_t chip8_decode(uint16_t opcode, const char *label, char *buf, size_t len);
+extern unsigned chip8_decode_class(uint16_t opcode);
+extern const char *chip8_class_name(unsigned cls);
+extern int chip8_disassemble(const uint8_t *prog, size_t len, const char *name,
+							 outbuf_t *ob, struct chip8_dis_stats *stats);
+struct catalog;
+extern int asm_corpus(const char *outfile, const char *dir, unsigned threads,
+					  char **files, int count, const struct catalog *cat);
 
 #endif /* _AS_H_ */
@@ -15,23 +15,37 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-%{
-#include <stdio.h>
+%code requires {
+#include "as.h"
+
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+}
+
+%code {
 #include <stdint.h>
 #include <string.h>
-#include "as.h"
 
-extern int yylex();
-extern int yyparse();
-extern FILE *yyin;
-extern int linenum;
-extern int yylineno;
+extern int asm_yylex(ASM_YYSTYPE *lval, ASM_YYLTYPE *lloc, yyscan_t scanner);
+
+/* Istruzione con la riga del sorgente da cui viene */
+#define INSTR(op, sym, loc) ((asm_instr_t) { .opcode = (op), .label = (sym), .line = (loc).first_line })
 
-void yyerror(const char *s) {
-	printf("Error at line %d: %s\n", yylineno, s);
-} 
-%}
+static void asm_yyerror(ASM_YYLTYPE *lloc, yyscan_t scanner, struct asm_ctx *as, const char *s){
+	(void) scanner;
+	asm_error(as, C8AS_E_SYNTAX, lloc->first_line, "%s", s);
+}
+}
 
+/* Parser rientrante: lo stato è tutto in scanner e as */
+%define api.pure full
+%define api.prefix {asm_yy}
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner} {struct asm_ctx *as}
+
+%locations
 %define parse.lac full
 %define parse.error verbose
 
@@ -46,6 +60,7 @@ void yyerror(const char *s) {
 						T_LD T_ADD T_SUB T_RSB T_OR T_AND T_XOR T_SHR T_SHL
 						T_RAND T_DRAW T_SKIPDN T_SKIPUP T_IN T_SPRITE T_BCD T_PLUS
 						T_STOR T_LOAD T_IREG T_DT T_ST T_COLON T_DB T_RESB T_QUOTE
+						T_SECTION T_GLOBAL T_EXTERN
 %token	<text>			T_LITERAL T_ASCII
 %token	<byte>			T_BYTE T_DREG
 %token	<word>			T_WORD
@@ -63,9 +78,10 @@ stmts:			stmt
 		|		stmts stmt
 		;
 
-stmt:			label { push_label($1); }
-		|		command { push_instr($1); }
+stmt:			label { if (push_label(as, $1, @1.first_line)) YYABORT; }
+		|		command { if (push_instr(as, $1)) YYABORT; }
 		|		data
+		|		directive
 		;
 
 label:			T_LITERAL T_COLON { $$ = $1; }
@@ -82,98 +98,100 @@ command:		ret
 		|		misc
 		;
 
-ret:			T_RET { $$ = (asm_instr_t) { 0x00EE, NULL }; }
+ret:			T_RET { $$ = INSTR(0x00EE, NULL, @$); }
 		;
 
-jp:				T_JP T_WORD { $$ = (asm_instr_t) { 0x1000 | $2, NULL }; }
-		|		T_JP T_LITERAL { $$ = (asm_instr_t) { 0x1000, $2 }; }
+jp:				T_JP T_WORD { $$ = INSTR(0x1000 | $2, NULL, @$); }
+		|		T_JP T_LITERAL { $$ = INSTR(0x1000, $2, @$); }
 		|		T_JP T_WORD T_PLUS T_DREG
 				{
 					if ($4 != 0){
-						yyerror("only V0 is valid for offset jump");
+						asm_error(as, C8AS_E_OPERAND, @4.first_line, "only V0 is valid for offset jump");
 						YYABORT;
 					}
-					$$ = (asm_instr_t) { 0xB000 | $2, NULL };
+					$$ = INSTR(0xB000 | $2, NULL, @$);
 				}
 		|		T_JP T_LITERAL T_PLUS T_DREG
 				{
 					if ($4 != 0){
-						yyerror("only V0 is valid for offset jump");
+						asm_error(as, C8AS_E_OPERAND, @4.first_line, "only V0 is valid for offset jump");
 						YYABORT;
 					}
-					$$ = (asm_instr_t) { 0xB000, $2 };
+					$$ = INSTR(0xB000, $2, @$);
 				}
 		;
 
-call:			T_CALL T_WORD { $$ = (asm_instr_t) { 0x2000 | $2, NULL }; }
-		|		T_CALL T_LITERAL { $$ = (asm_instr_t) { 0x2000, $2 }; }
+call:			T_CALL T_WORD { $$ = INSTR(0x2000 | $2, NULL, @$); }
+		|		T_CALL T_LITERAL { $$ = INSTR(0x2000, $2, @$); }
 		;
 
-skip:			T_SKIPE T_DREG T_COMMA T_BYTE { $$ = (asm_instr_t) { 0x3000 | ($2 << 8) | $4, NULL }; }
-		|		T_SKIPNE T_DREG T_COMMA T_BYTE { $$ = (asm_instr_t) { 0x4000 | ($2 << 8) | $4, NULL }; }
-		|		T_SKIPE T_DREG T_COMMA T_DREG { $$ = (asm_instr_t) { 0x5000 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_SKIPNE T_DREG T_COMMA T_DREG { $$ = (asm_instr_t) { 0x9000 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_SKIPDN T_DREG { $$ = (asm_instr_t) { 0xE09E | ($2 << 8), NULL }; }
-		|		T_SKIPUP T_DREG { $$ = (asm_instr_t) { 0xE0A1 | ($2 << 8), NULL }; }
+skip:			T_SKIPE T_DREG T_COMMA T_BYTE { $$ = INSTR(0x3000 | ($2 << 8) | $4, NULL, @$); }
+		|		T_SKIPNE T_DREG T_COMMA T_BYTE { $$ = INSTR(0x4000 | ($2 << 8) | $4, NULL, @$); }
+		|		T_SKIPE T_DREG T_COMMA T_DREG { $$ = INSTR(0x5000 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_SKIPNE T_DREG T_COMMA T_DREG { $$ = INSTR(0x9000 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_SKIPDN T_DREG { $$ = INSTR(0xE09E | ($2 << 8), NULL, @$); }
+		|		T_SKIPUP T_DREG { $$ = INSTR(0xE0A1 | ($2 << 8), NULL, @$); }
 		;
 
-ld:				T_LD T_DREG T_COMMA T_BYTE { $$ = (asm_instr_t) { 0x6000 | ($2 << 8) | $4, NULL }; }
+ld:				T_LD T_DREG T_COMMA T_BYTE { $$ = INSTR(0x6000 | ($2 << 8) | $4, NULL, @$); }
 		|		T_LD T_DREG T_COMMA T_WORD
 				{
 					if ($4 > 255){
-						yyerror("integer value too large for a byte");
+						asm_error(as, C8AS_E_OPERAND, @4.first_line, "integer value too large for a byte");
 						YYABORT;
 					}
-					$$ = (asm_instr_t) { 0x6000 | ($2 << 8) | $4, NULL };
+					$$ = INSTR(0x6000 | ($2 << 8) | $4, NULL, @$);
 				}
-		|		T_LD T_DREG T_COMMA T_DREG { $$ = (asm_instr_t) { 0x8000 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_LD T_IREG T_COMMA T_WORD { $$ = (asm_instr_t) { 0xA000 | $4, NULL }; }
-		|		T_LD T_IREG T_COMMA T_LITERAL { $$ = (asm_instr_t) { 0xA000, $4 }; }
-		|		T_LD T_DT T_COMMA T_DREG { $$ = (asm_instr_t) { 0xF015 | ($4 << 8) , NULL }; }
-		|		T_LD T_DREG T_COMMA T_DT { $$ = (asm_instr_t) { 0xF007 | ($2 << 8) , NULL }; }
-		|		T_LD T_ST T_COMMA T_DREG { $$ = (asm_instr_t) { 0xF018 | ($4 << 8) , NULL }; }
+		|		T_LD T_DREG T_COMMA T_DREG { $$ = INSTR(0x8000 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_LD T_IREG T_COMMA T_WORD { $$ = INSTR(0xA000 | $4, NULL, @$); }
+		|		T_LD T_IREG T_COMMA T_LITERAL { $$ = INSTR(0xA000, $4, @$); }
+		|		T_LD T_DT T_COMMA T_DREG { $$ = INSTR(0xF015 | ($4 << 8), NULL, @$); }
+		|		T_LD T_DREG T_COMMA T_DT { $$ = INSTR(0xF007 | ($2 << 8), NULL, @$); }
+		|		T_LD T_ST T_COMMA T_DREG { $$ = INSTR(0xF018 | ($4 << 8), NULL, @$); }
 		;
 
-mathop:			T_ADD T_DREG T_COMMA T_BYTE { $$ = (asm_instr_t) { 0x7000 | ($2 << 8) | $4, NULL }; }
-		|		T_ADD T_DREG T_COMMA T_DREG { $$ = (asm_instr_t) { 0x8004 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_SUB T_DREG T_COMMA T_DREG { $$ = (asm_instr_t) { 0x8005 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_RSB T_DREG T_COMMA T_DREG { $$ = (asm_instr_t) { 0x8005 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_ADD T_IREG T_COMMA T_DREG { $$ = (asm_instr_t) { 0xF01E | ($4 << 8), NULL }; }
+mathop:			T_ADD T_DREG T_COMMA T_BYTE { $$ = INSTR(0x7000 | ($2 << 8) | $4, NULL, @$); }
+		|		T_ADD T_DREG T_COMMA T_DREG { $$ = INSTR(0x8004 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_SUB T_DREG T_COMMA T_DREG { $$ = INSTR(0x8005 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_RSB T_DREG T_COMMA T_DREG { $$ = INSTR(0x8007 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_ADD T_IREG T_COMMA T_DREG { $$ = INSTR(0xF01E | ($4 << 8), NULL, @$); }
 		;
 
-bitop:			T_OR T_DREG T_COMMA T_DREG  { $$ = (asm_instr_t) { 0x8001 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_AND T_DREG T_COMMA T_DREG  { $$ = (asm_instr_t) { 0x8002 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_XOR T_DREG T_COMMA T_DREG  { $$ = (asm_instr_t) { 0x8003 | ($2 << 8) | ($4 << 4), NULL }; }
-		|		T_SHR T_DREG { $$ = (asm_instr_t) { 0x8006 | ($2 << 8), NULL }; }
-		|		T_SHL T_DREG { $$ = (asm_instr_t) { 0x800E | ($2 << 8), NULL }; }
-		|		T_RAND T_DREG T_COMMA T_BYTE  { $$ = (asm_instr_t) { 0xC000 | ($2 << 8) | $4, NULL }; }
+bitop:			T_OR T_DREG T_COMMA T_DREG  { $$ = INSTR(0x8001 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_AND T_DREG T_COMMA T_DREG  { $$ = INSTR(0x8002 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_XOR T_DREG T_COMMA T_DREG  { $$ = INSTR(0x8003 | ($2 << 8) | ($4 << 4), NULL, @$); }
+		|		T_SHR T_DREG { $$ = INSTR(0x8006 | ($2 << 8), NULL, @$); }
+		|		T_SHL T_DREG { $$ = INSTR(0x800E | ($2 << 8), NULL, @$); }
+		|		T_RAND T_DREG T_COMMA T_BYTE  { $$ = INSTR(0xC000 | ($2 << 8) | $4, NULL, @$); }
 		;
 
-memop:			T_STOR T_DREG { $$ = (asm_instr_t) { 0xF055 | ($2 << 8), NULL }; }
-		|		T_LOAD T_DREG { $$ = (asm_instr_t) { 0xF065 | ($2 << 8), NULL }; }
+memop:			T_STOR T_DREG { $$ = INSTR(0xF055 | ($2 << 8), NULL, @$); }
+		|		T_LOAD T_DREG { $$ = INSTR(0xF065 | ($2 << 8), NULL, @$); }
 		;
 
-misc:			T_CLS { $$ = (asm_instr_t) { 0x00E0, NULL }; }
-		|		T_BCD T_DREG { $$ = (asm_instr_t) { 0xF033 | ($2 << 8), NULL }; }
-		|		T_IN T_DREG { $$ = (asm_instr_t) { 0xF00A | ($2 << 8), NULL }; }
-		|		T_SPRITE T_DREG { $$ = (asm_instr_t) { 0xF029 | ($2 << 8), NULL }; }
-		|		T_DRAW T_DREG T_COMMA T_DREG T_COMMA T_BYTE { $$ = (asm_instr_t) { 0xD000 | ($2 << 8) | ($4 << 4) | ($6 & 0x0F), NULL }; }
+misc:			T_CLS { $$ = INSTR(0x00E0, NULL, @$); }
+		|		T_BCD T_DREG { $$ = INSTR(0xF033 | ($2 << 8), NULL, @$); }
+		|		T_IN T_DREG { $$ = INSTR(0xF00A | ($2 << 8), NULL, @$); }
+		|		T_SPRITE T_DREG { $$ = INSTR(0xF029 | ($2 << 8), NULL, @$); }
+		|		T_DRAW T_DREG T_COMMA T_DREG T_COMMA T_BYTE { $$ = INSTR(0xD000 | ($2 << 8) | ($4 << 4) | ($6 & 0x0F), NULL, @$); }
 		;
 
 data:			db
-		|		resb { push_resb($1); }
+		|		resb { if (push_resb(as, $1, @1.first_line)) YYABORT; }
 		;
 
 db:				T_DB bytes
 		;
 
-bytes:			bytes T_BYTE { push_byte($2); }
-		|		T_BYTE { push_byte($1); }
+bytes:			bytes T_BYTE { if (push_byte(as, $2, @2.first_line)) YYABORT; }
+		|		T_BYTE { if (push_byte(as, $1, @1.first_line)) YYABORT; }
 		|		T_QUOTE T_ASCII T_QUOTE
 				{
-					int i;
+					size_t i;
 					for (i=0; i<strlen($2); i++){
-						push_byte((uint8_t) $2[i]);
+						if (push_byte(as, (uint8_t) $2[i], @2.first_line)){
+							YYABORT;
+						}
 					}
 				}
 		;
@@ -182,4 +200,17 @@ resb:			T_RESB T_BYTE { $$ = $2; }
 		|		T_RESB T_WORD { $$ = $2; }
 		;
 
+directive:		T_SECTION T_LITERAL { if (push_section(as, $2, @1.first_line)) YYABORT; }
+		|		T_GLOBAL globals
+		|		T_EXTERN externs
+		;
+
+globals:		globals T_COMMA T_LITERAL { if (push_visibility(as, $3, ASM_SYM_GLOBAL, @3.first_line)) YYABORT; }
+		|		T_LITERAL { if (push_visibility(as, $1, ASM_SYM_GLOBAL, @1.first_line)) YYABORT; }
+		;
+
+externs:		externs T_COMMA T_LITERAL { if (push_visibility(as, $3, ASM_SYM_EXTERN, @3.first_line)) YYABORT; }
+		|		T_LITERAL { if (push_visibility(as, $1, ASM_SYM_EXTERN, @1.first_line)) YYABORT; }
+		;
+
 %%
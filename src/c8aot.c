@@ -0,0 +1,484 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> /* getopt */
+
+#include "util.h"
+#include "chip8.h"
+#include "flow.h"
+#include "tcache.h"
+#include "as.h"
+
+/*
+ * c8aot: compila una ROM in un file C, usando l'analisi del flusso di
+ * controllo per trovare i blocchi base. Ogni blocco diventa un'etichetta
+ * e ogni istruzione qualche riga di C sui registri, tenuti in variabili
+ * locali; i salti e le chiamate con destinazione nota sono goto, RET e
+ * i salti calcolati passano da uno switch su PC. Il codice generato
+ * torna all'interprete (vedi chip8_aot_run) per le destinazioni che non
+ * conosce, per DRW e RND, che restano in cpu.c, e per i blocchi il cui
+ * codice è stato modificato dal programma; il controllo viene generato
+ * solo se il programma ha scritture che possono toccare il codice.
+ */
+
+/* Istruzioni tra due scatti dei timer nell'eseguibile generato con -x */
+#define AOT_TICK 1000
+
+static void emit_header(FILE *out, const uint8_t *prog, size_t len, const char *name,
+						const flow_t *flow, unsigned quirks, int checks, int dispatch);
+static void emit_block(FILE *out, const flow_t *flow, const uint8_t *prog,
+					   const flow_block_t *block, unsigned quirks);
+static void emit_main(FILE *out, const char *symbol);
+
+int main(int argc, char **argv){
+	uint8_t prog[0x0E00];
+	const char *symbol, *name;
+	unsigned quirks, b;
+	int opt, checks, dispatch, exe;
+	uint16_t addr;
+	size_t len;
+	tcache_entry_t entry;
+	const flow_t *flow;
+	FILE *out;
+
+	quirks = CHIP8_PROFILE_DEFAULT;
+	symbol = "chip8_aot_program";
+	exe = 0;
+
+	while ((opt = getopt(argc, argv, "n:q:x")) != -1){
+		switch (opt){
+		case 'n':
+			symbol = optarg;
+			break;
+		case 'q':
+			if (chip8_parse_quirks(optarg, &quirks)){
+				fprintf(stderr, "Profilo di quirk non valido: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'x':
+			exe = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 2){
+		goto usage;
+	}
+
+	if (!(len = read_file(argv[optind], prog, sizeof(prog)))){
+		return EXIT_FAILURE;
+	}
+
+	/* Come il disassembler, l'analisi viene dalla cache su disco */
+	if (tcache_open(&entry, prog, len, quirks)){
+		err("impossibile allocare memoria");
+		return EXIT_FAILURE;
+	}
+	flow = entry.flow;
+
+	/* Basta una scrittura che può toccare il codice per dover
+	 * controllare i blocchi ad ogni ingresso */
+	for (checks=0, addr=0x200; addr<flow->end && !checks; addr++){
+		checks = (flow->map[addr] & (FLOW_SMC | FLOW_WILD_STORE)) != 0;
+	}
+
+	/* RET e i salti calcolati tornano allo switch su PC */
+	for (dispatch=0, b=0; b<flow->nblocks; b++){
+		dispatch |= flow->blocks[b].exit == FLOW_OP_RET || flow->blocks[b].exit == FLOW_OP_COMPUTED;
+	}
+
+	if ((out = fopen(argv[optind + 1], "w")) == NULL){
+		err("impossibile scrivere il file %s", argv[optind + 1]);
+		tcache_close(&entry);
+		return EXIT_FAILURE;
+	}
+
+	name = strrchr(argv[optind], '/') ? strrchr(argv[optind], '/') + 1 : argv[optind];
+	emit_header(out, prog, len, name, flow, quirks, checks, dispatch);
+	for (b=0; b<flow->nblocks; b++){
+		emit_block(out, flow, prog, &flow->blocks[b], quirks);
+	}
+
+	fprintf(out, "\n out:\n\tSAVE();\n\treturn n;\n}\n\n");
+	fprintf(out, "const chip8_aot_t %s = {\n", symbol);
+	fprintf(out, "\tCHIP8_AOT_VERSION, sizeof(chip8_machine_t), \"%s\", rom, sizeof(rom), 0x%02X, run\n};\n",
+			name, quirks);
+
+	if (exe){
+		emit_main(out, symbol);
+	}
+
+	if (fclose(out)){
+		err("impossibile scrivere il file %s", argv[optind + 1]);
+		tcache_close(&entry);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "%s: %u blocchi%s\n", name, flow->nblocks,
+			checks ? ", con controllo del codice modificato" : "");
+	tcache_close(&entry);
+	return 0;
+
+ usage:
+	fprintf(stderr, "Uso: %s [-q QUIRK] [-n SIMBOLO] [-x] ROM OUT.c\n", argv[0]);
+	fprintf(stderr, "  -q  profilo di quirk per cui compilare (predefinito: default)\n");
+	fprintf(stderr, "  -n  nome del chip8_aot_t generato, da dare a c8d -A MODULO:NOME (predefinito: chip8_aot_program)\n");
+	fprintf(stderr, "  -x  aggiunge un main che esegue la ROM senza finestra\n");
+	fprintf(stderr, "L'analisi della ROM viene salvata nella cache di c8as, come c8as -d\n");
+	return EXIT_FAILURE;
+}
+
+/* Ritorna non zero se addr è l'inizio di un blocco compilato */
+static int is_block(const flow_t *flow, uint16_t addr){
+	const flow_block_t *block;
+
+	return (block = flow_block_at(flow, addr)) != NULL && block->start == addr;
+}
+
+static void emit_header(FILE *out, const uint8_t *prog, size_t len, const char *name,
+						const flow_t *flow, unsigned quirks, int checks, int dispatch){
+	unsigned k, b;
+
+	fprintf(out, "/* Generato da c8aot da %s: %u blocchi, quirk 0x%02X. Non modificare */\n",
+			name, flow->nblocks, quirks);
+	fprintf(out, "#include <string.h>\n\n#include \"aot.h\"\n\n");
+
+	fprintf(out, "static const uint8_t rom[%zu] = {", len);
+	for (k=0; k<len; k++){
+		fprintf(out, "%s0x%02X,", (k % 12) ? " " : "\n\t", prog[k]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "#define LOAD() do {");
+	for (k=0; k<16; k++){
+		fprintf(out, " v%X = ctx->v[%u];", k, k);
+	}
+	fprintf(out, " i = ctx->i; } while (0)\n");
+	fprintf(out, "#define SAVE() do {");
+	for (k=0; k<16; k++){
+		fprintf(out, " ctx->v[%u] = v%X;", k, k);
+	}
+	fprintf(out, " ctx->i = i; } while (0)\n\n");
+
+	fprintf(out, "/* Torna all'interprete con PC a pc_, togliendo le undo istruzioni\n"
+			" * contate all'ingresso del blocco ma non eseguite */\n");
+	fprintf(out, "#define EXIT(pc_, undo) do { ctx->pc = (pc_); n -= (undo); goto out; } while (0)\n");
+	fprintf(out, "#define FAIL(pc_, undo) do { *status = 6; EXIT(pc_, undo); } while (0)\n\n");
+
+	fprintf(out, "/* Ingresso in un blocco: servono count istruzioni di budget%s */\n",
+			checks ? "\n * e il suo codice deve essere ancora quello compilato" : "");
+	if (checks){
+		fprintf(out, "#define CHANGED(start, end, pages) ((ctx->dirty & (pages)) && chip8_aot_changed(ctx, rom, start, end))\n");
+		fprintf(out, "#define ENTER(start, end, count, pages) do { \\\n"
+				"\tif (budget - n < (count) || CHANGED(start, end, pages)) EXIT(start, 0); \\\n"
+				"\tn += (count); } while (0)\n\n");
+	} else {
+		fprintf(out, "#define ENTER(start, end, count, pages) do { \\\n"
+				"\tif (budget - n < (count)) EXIT(start, 0); \\\n"
+				"\tn += (count); } while (0)\n\n");
+	}
+
+	fprintf(out, "static unsigned run(chip8_machine_t *ctx, unsigned budget, int *status){\n");
+	fprintf(out, "\tuint8_t v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, vA, vB, vC, vD, vE, vF;\n");
+	fprintf(out, "\tuint16_t i;\n\tunsigned n, t;\n\n");
+	fprintf(out, "\t(void) t;\n\t(void) status;\n\tn = 0;\n\tLOAD();\n\n");
+
+	fprintf(out, "%s\tswitch (ctx->pc){\n", dispatch ? " dispatch:\n" : "");
+	for (b=0; b<flow->nblocks; b++){
+		fprintf(out, "\tcase 0x%03X: goto L%03X;\n", flow->blocks[b].start, flow->blocks[b].start);
+	}
+	fprintf(out, "\tdefault: goto out;\n\t}\n");
+}
+
+/* Prosegue a addr: col goto se è un blocco compilato, altrimenti
+ * tornando all'interprete */
+static void emit_goto(FILE *out, const flow_t *flow, uint16_t addr){
+	addr &= 0x0FFF;
+	if (is_block(flow, addr)){
+		fprintf(out, "\tgoto L%03X;\n", addr);
+	} else {
+		fprintf(out, "\tEXIT(0x%03X, 0);\n", addr);
+	}
+}
+
+/* Condizione di uno skip */
+static void emit_cond(FILE *out, uint16_t opcode){
+	unsigned x, y, nn;
+
+	x = (opcode >> 8) & 0x0F;
+	y = (opcode >> 4) & 0x0F;
+	nn = opcode & 0xFF;
+
+	switch (opcode & 0xF000){
+	case 0x3000:
+		fprintf(out, "v%X == 0x%02X", x, nn);
+		break;
+	case 0x4000:
+		fprintf(out, "v%X != 0x%02X", x, nn);
+		break;
+	case 0x5000:
+		fprintf(out, "v%X == v%X", x, y);
+		break;
+	case 0x9000:
+		fprintf(out, "v%X != v%X", x, y);
+		break;
+	default:
+		fprintf(out, "%sctx->keys[v%X & 0x0F]", (nn == 0xA1) ? "!" : "", x);
+		break;
+	}
+}
+
+/* Un'istruzione che prosegue alla successiva; rem sono le istruzioni
+ * del blocco che la seguono, end e pages la fine e le pagine del blocco */
+static void emit_instr(FILE *out, uint16_t addr, uint16_t opcode, unsigned rem, uint16_t end,
+					   uint16_t pages, unsigned quirks, int check){
+	unsigned x, y, n, nn, k;
+	uint16_t next;
+
+	x = (opcode >> 8) & 0x0F;
+	y = (opcode >> 4) & 0x0F;
+	n = opcode & 0x0F;
+	nn = opcode & 0xFF;
+	next = (addr + 2) & 0x0FFF;
+
+	switch (opcode & 0xF000){
+	case 0x0000:
+		/* Solo CLS, il resto non è codice */
+		fprintf(out, "\tmemset(ctx->vram, 0, CHIP8_VRAM_SIZE);\n\tctx->vram_hashed = 0;\n\tctx->drawn = 1;\n");
+		fprintf(out, "\tEXIT(0x%03X, %u);\n", next, rem);
+		return;
+	case 0x6000:
+		fprintf(out, "\tv%X = 0x%02X;\n", x, nn);
+		return;
+	case 0x7000:
+		fprintf(out, "\tv%X += 0x%02X;\n", x, nn);
+		return;
+	case 0x8000:
+		switch (n){
+		case 0x0:
+			fprintf(out, "\tv%X = v%X;\n", x, y);
+			break;
+		case 0x1: case 0x2: case 0x3:
+			fprintf(out, "\tv%X %c= v%X;\n", x, "|&^"[n - 1], y);
+			if (quirks & CHIP8_QUIRK_VF_RESET){
+				fprintf(out, "\tvF = 0;\n");
+			}
+			break;
+		case 0x4:
+			fprintf(out, "\tt = v%X + v%X;\n\tv%X = t;\n\tvF = t >> 8;\n", x, y, x);
+			break;
+		case 0x5:
+			fprintf(out, "\tt = v%X >= v%X;\n\tv%X -= v%X;\n\tvF = t;\n", x, y, x, y);
+			break;
+		case 0x6:
+			fprintf(out, "\tt = v%X;\n\tv%X = t >> 1;\n\tvF = t & 1;\n",
+					(quirks & CHIP8_QUIRK_SHIFT_VY) ? y : x, x);
+			break;
+		case 0x7:
+			fprintf(out, "\tt = v%X >= v%X;\n\tv%X = v%X - v%X;\n\tvF = t;\n", y, x, x, y, x);
+			break;
+		case 0xE:
+			fprintf(out, "\tt = v%X;\n\tv%X = t << 1;\n\tvF = t >> 7;\n",
+					(quirks & CHIP8_QUIRK_SHIFT_VY) ? y : x, x);
+			break;
+		}
+		return;
+	case 0xA000:
+		fprintf(out, "\ti = 0x%03X;\n", opcode & 0x0FFF);
+		return;
+	case 0xC000:
+	case 0xD000:
+		/* Numeri casuali e disegno restano all'interprete */
+		fprintf(out, "\tctx->pc = 0x%03X;\n\tSAVE();\n\tchip8_exec(ctx);\n\tLOAD();\n", addr);
+		if ((opcode & 0xF000) == 0xD000){
+			fprintf(out, "\tEXIT(0x%03X, %u);\n", next, rem);
+		}
+		return;
+	}
+
+	/* FXNN */
+	switch (nn){
+	case 0x07:
+		fprintf(out, "\tv%X = ctx->dt;\n", x);
+		break;
+	case 0x0A:
+		fprintf(out, "\tctx->last_key = 0;\n\tctx->wait = %u;\n\tEXIT(0x%03X, %u);\n", x + 1, next, rem);
+		break;
+	case 0x15:
+		fprintf(out, "\tctx->dt = v%X;\n", x);
+		break;
+	case 0x18:
+		fprintf(out, "\tctx->st = v%X;\n", x);
+		break;
+	case 0x1E:
+		fprintf(out, "\ti = (i + v%X) & 0x0FFF;\n", x);
+		break;
+	case 0x29:
+		fprintf(out, "\ti = 0x%03X + (v%X & 0x0F) * 5;\n", FONT_ADDR, x);
+		break;
+	case 0x33:
+		fprintf(out, "\tif (chip8_poke(ctx, i, v%X / 100) || chip8_poke(ctx, i + 1, v%X / 10 %% 10)\n"
+				"\t\t|| chip8_poke(ctx, i + 2, v%X %% 10)) FAIL(0x%03X, %u);\n", x, x, x, addr, rem + 1);
+		break;
+	case 0x55:
+		fprintf(out, "\tif (");
+		for (k=0; k<=x; k++){
+			fprintf(out, "%schip8_poke(ctx, i + %u, v%X)", k ? "\n\t\t|| " : "", k, k);
+		}
+		fprintf(out, ") FAIL(0x%03X, %u);\n", addr, rem + 1);
+		if (quirks & CHIP8_QUIRK_MEM_INC_I){
+			fprintf(out, "\ti = (i + %u) & 0x0FFF;\n", x + 1);
+		}
+		break;
+	case 0x65:
+		for (k=0; k<=x; k++){
+			fprintf(out, "\tv%X = chip8_peek(ctx, i + %u);\n", k, k);
+		}
+		if (quirks & CHIP8_QUIRK_MEM_INC_I){
+			fprintf(out, "\ti = (i + %u) & 0x0FFF;\n", x + 1);
+		}
+		break;
+	}
+
+	/* Una scrittura che può toccare il codice può aver cambiato il
+	 * resto del blocco */
+	if (check && rem && (nn == 0x33 || nn == 0x55)){
+		fprintf(out, "\tif (CHANGED(0x%03X, 0x%03X, 0x%04X)) EXIT(0x%03X, %u);\n",
+				next, end, pages, next, rem);
+	}
+}
+
+static void emit_block(FILE *out, const flow_t *flow, const uint8_t *prog,
+					   const flow_block_t *block, unsigned quirks){
+	char buf[64];
+	uint16_t addr, opcode, pages, last, next, flags, end;
+	unsigned count, k;
+
+	count = (block->end - block->start) / 2;
+	last = block->end - 2;
+	/* Un programma di lunghezza dispari finisce a metà istruzione */
+	end = (block->end > flow->end) ? flow->end : block->end;
+	pages = 0;
+	for (addr=block->start; addr<block->end; addr+=CHIP8_PAGE_SIZE - (addr & (CHIP8_PAGE_SIZE - 1))){
+		pages |= 1u << (addr >> CHIP8_PAGE_SHIFT);
+	}
+	pages |= 1u << ((block->end - 1) >> CHIP8_PAGE_SHIFT);
+
+	fprintf(out, "\n L%03X:\n\tENTER(0x%03X, 0x%03X, %u, 0x%04X);\n",
+			block->start, block->start, end, count, pages);
+
+	for (k=0, addr=block->start; addr<block->end; k++, addr+=2){
+		opcode = (prog[addr - 0x200] << 8) | ((addr + 1 < flow->end) ? prog[addr + 1 - 0x200] : 0);
+		next = (addr + 2) & 0x0FFF;
+		flags = flow->map[addr];
+
+		chip8_decode(opcode, NULL, buf, sizeof(buf));
+		fprintf(out, "\t/* %03X: %s */\n", addr, buf);
+
+		if (addr != last){
+			emit_instr(out, addr, opcode, count - k - 1, end, pages, quirks,
+					   (flags & (FLOW_SMC | FLOW_WILD_STORE)) != 0);
+			continue;
+		}
+
+		switch (block->exit){
+		case FLOW_OP_NEXT:
+		case FLOW_OP_STORE:
+			emit_instr(out, addr, opcode, 0, end, pages, quirks, 0);
+			emit_goto(out, flow, next);
+			break;
+		case FLOW_OP_SKIP:
+			fprintf(out, "\tif (");
+			emit_cond(out, opcode);
+			fprintf(out, ")\n\t");
+			emit_goto(out, flow, next + 2);
+			emit_goto(out, flow, next);
+			break;
+		case FLOW_OP_JUMP:
+			emit_goto(out, flow, opcode);
+			break;
+		case FLOW_OP_CALL:
+			fprintf(out, "\tctx->stack[ctx->sp] = 0x%03X;\n\tctx->sp = (ctx->sp + 1) & 0x0F;\n", next);
+			emit_goto(out, flow, opcode);
+			break;
+		case FLOW_OP_RET:
+			fprintf(out, "\tctx->sp = (ctx->sp - 1) & 0x0F;\n\tctx->pc = ctx->stack[ctx->sp];\n\tgoto dispatch;\n");
+			break;
+		case FLOW_OP_COMPUTED:
+			fprintf(out, "\tctx->pc = (0x%03X + v%X) & 0x0FFF;\n\tgoto dispatch;\n", opcode & 0x0FFF,
+					(quirks & CHIP8_QUIRK_JUMP_VX) ? (opcode >> 8) & 0x0F : 0);
+			break;
+		default:
+			/* L'interprete segnala l'istruzione non valida */
+			fprintf(out, "\tEXIT(0x%03X, 1);\n", addr);
+			break;
+		}
+	}
+}
+
+/* main dell'eseguibile: esegue la ROM senza finestra né tastiera */
+static void emit_main(FILE *out, const char *symbol){
+	fprintf(out, "\n#ifndef CHIP8_AOT_MODULE\n"
+			"#include <stdio.h>\n#include <stdlib.h>\n#include <time.h>\n\n#include \"state.h\"\n\n"
+			"/* Istruzioni tra due scatti dei timer */\n#define TICK %d\n\n", AOT_TICK);
+	fprintf(out,
+			"int main(int argc, char **argv){\n"
+			"\tunsigned long count, total, since;\n"
+			"\tstruct timespec t0, t1;\n"
+			"\tchip8_machine_t m;\n"
+			"\tunsigned done;\n"
+			"\tdouble secs;\n"
+			"\tint status;\n\n"
+			"\tcount = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000000;\n\n"
+			"\tif (chip8_try_init(&m)){\n"
+			"\t\tfprintf(stderr, \"impossibile allocare memoria\\n\");\n"
+			"\t\treturn 1;\n"
+			"\t}\n"
+			"\t/* Seme fisso, così lo stato finale si può confrontare */\n"
+			"\tchip8_seed(&m, 1);\n"
+			"\tchip8_set_quirks(&m, %s.quirks);\n"
+			"\tif (chip8_load(&m, rom, sizeof(rom)) < 0){\n"
+			"\t\tfprintf(stderr, \"impossibile allocare memoria\\n\");\n"
+			"\t\treturn 1;\n"
+			"\t}\n\n"
+			"\tclock_gettime(CLOCK_MONOTONIC, &t0);\n"
+			"\tfor (total=0, since=0, status=0; total<count && !status; total+=done){\n"
+			"\t\tstatus = chip8_aot_run(&m, &%s, (count - total < TICK - since) ? count - total : TICK - since, &done);\n"
+			"\t\tif ((since += done) >= TICK){\n"
+			"\t\t\tchip8_update_timers(&m, 17);\n"
+			"\t\t\tsince = 0;\n"
+			"\t\t}\n"
+			"\t\t/* Senza tastiera nessun tasto arriverà */\n"
+			"\t\tif (m.wait && !m.last_key){\n"
+			"\t\t\tbreak;\n"
+			"\t\t}\n"
+			"\t}\n"
+			"\tclock_gettime(CLOCK_MONOTONIC, &t1);\n\n"
+			"\tsecs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;\n"
+			"\tprintf(\"%%s: %%lu istruzioni in %%.3fs, %%.0f al secondo, stato %%016llx%%s\\n\",\n"
+			"\t\t   %s.name, total, secs, secs > 0 ? total / secs : 0,\n"
+			"\t\t   (unsigned long long) chip8_hash(&m), status ? \" (errore)\" : \"\");\n\n"
+			"\tchip8_release(&m);\n"
+			"\treturn status != 0;\n"
+			"}\n#endif\n", symbol, symbol, symbol);
+}
@@ -0,0 +1,143 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _C8AS_H_
+#define _C8AS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* libc8as: assembla un sorgente in memoria in un buffer del chiamante.
+ * Non usa variabili globali, quindi più thread possono assemblare
+ * sorgenti diversi contemporaneamente */
+
+/* Flag di c8as_assemble */
+#define C8AS_OPTIMIZE 0x01      /* Passa il programma all'ottimizzatore */
+#define C8AS_OBJECT   0x02      /* Scrive un oggetto rilocabile, senza ottimizzare */
+
+/* Numero massimo di errori conservati nel risultato */
+#define C8AS_MAX_ERRORS 16
+
+/* Tipi di errore */
+enum c8as_status {
+	C8AS_OK,
+	C8AS_E_SYNTAX,          /* Errore di sintassi */
+	C8AS_E_OPERAND,         /* Operando non valido per l'istruzione */
+	C8AS_E_UNDEFINED,       /* Etichetta usata ma mai definita */
+	C8AS_E_REDEFINED,       /* Etichetta definita due volte */
+	C8AS_E_OVERFLOW,        /* Il programma non entra nel buffer */
+	C8AS_E_NOMEM,           /* Memoria esaurita */
+	C8AS_E_OBJECT           /* Oggetto rilocabile non valido */
+};
+
+typedef struct c8as_error {
+	int code;               /* enum c8as_status */
+	int line;               /* Riga del sorgente, 0 se non legato ad una riga */
+	char msg[112];
+} c8as_error_t;
+
+/* Statistiche dell'ottimizzatore */
+struct asm_opt_stats {
+	unsigned removed;       /* Istruzioni rimosse */
+	unsigned threaded;      /* Salti a salti accorciati */
+	unsigned dead;          /* Assegnamenti inutili rimossi */
+	unsigned folded;        /* Somme unite */
+	unsigned unreachable;   /* Istruzioni irraggiungibili rimosse */
+	unsigned inverted;      /* Skip su salto invertiti */
+};
+
+typedef struct c8as_result {
+	size_t len;             /* Byte del programma, anche se non entrano nel buffer */
+	unsigned nerrors;       /* Errori trovati, solo i primi C8AS_MAX_ERRORS sono in errors */
+	c8as_error_t errors[C8AS_MAX_ERRORS];
+	struct asm_opt_stats stats; /* Solo con C8AS_OPTIMIZE */
+} c8as_result_t;
+
+/* Oggetto rilocabile, scritto da c8as_assemble con C8AS_OBJECT e letto
+ * da c8as_link. Il file contiene:
+ *
+ *   c8as_obj_header_t
+ *   c8as_obj_section_t sections[nsections]
+ *   c8as_obj_symbol_t  symbols[nsymbols]
+ *   c8as_obj_reloc_t   relocs[nrelocs]
+ *   nomi, terminati da zero (strsize byte)
+ *   contenuto delle sezioni
+ *
+ * Le sezioni con lo stesso nome di tutti i moduli vengono messe una dopo
+ * l'altra, nell'ordine in cui i nomi compaiono; le etichette sono private
+ * del modulo se non sono dichiarate GLOBAL. Ogni riferimento ad
+ * un'etichetta è una rilocazione che scrive i 12 bit bassi
+ * dell'istruzione. I campi sono nell'ordine dei byte dell'host */
+
+#define C8AS_OBJ_MAGIC    "C8ASOBJ"
+#define C8AS_OBJ_VERSION  1
+#define C8AS_MAX_SECTIONS 16
+#define C8AS_SECTION_SIZE 0x0E00 /* Una sezione non può superare la memoria */
+#define C8AS_SECTION_TEXT ".text" /* Sezione iniziale di ogni sorgente */
+
+/* Flag dei simboli */
+#define C8AS_SYM_GLOBAL 0x01    /* Visibile dagli altri moduli */
+#define C8AS_SYM_EXTERN 0x02    /* Definito in un altro modulo, section e value non valgono */
+
+typedef struct c8as_obj_header {
+	char magic[8];
+	uint32_t version;       /* C8AS_OBJ_VERSION */
+	uint32_t nsections, nsymbols, nrelocs;
+	uint32_t strsize;
+	uint32_t size;          /* Dimensione dell'oggetto */
+	uint64_t hash;          /* c8as_hash del sorgente */
+} c8as_obj_header_t;
+
+typedef struct c8as_obj_section {
+	uint32_t name;          /* Posizione del nome tra i nomi */
+	uint32_t offset;        /* Posizione del contenuto nell'oggetto */
+	uint32_t size;
+} c8as_obj_section_t;
+
+typedef struct c8as_obj_symbol {
+	uint32_t name;
+	uint16_t value;         /* Posizione nella sezione */
+	uint8_t section;
+	uint8_t flags;          /* C8AS_SYM_* */
+} c8as_obj_symbol_t;
+
+typedef struct c8as_obj_reloc {
+	uint32_t symbol;        /* Indice del simbolo */
+	uint32_t line;          /* Riga del sorgente, per gli errori */
+	uint16_t offset;        /* Posizione dell'istruzione nella sezione */
+	uint8_t section;
+	uint8_t pad;
+} c8as_obj_reloc_t;
+
+/* Un oggetto da collegare, già in memoria */
+typedef struct c8as_object {
+	const char *name;       /* Nome del modulo, per gli errori */
+	const void *data;
+	size_t len;
+} c8as_object_t;
+
+struct dbginfo;
+
+extern int c8as_assemble(const char *src, size_t len, uint8_t *out, size_t size,
+						 unsigned flags, struct dbginfo *dbg, c8as_result_t *res);
+extern uint64_t c8as_hash(const char *src, size_t len);
+extern const c8as_obj_header_t *c8as_object_header(const void *data, size_t len);
+extern int c8as_link(const c8as_object_t *objs, unsigned count, uint8_t *out, size_t size,
+					 struct dbginfo *dbg, c8as_result_t *res);
+extern const char *c8as_strerror(int code);
+
+#endif /* _C8AS_H_ */
@@ -0,0 +1,248 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "chip8.h"
+#include "state.h"
+#include "catalog.h"
+
+/* Voci lette dalla lista, ingrandite quando serve */
+static catalog_entry_t *entries;
+static const char **names;
+static const uint8_t **roms;
+static uint32_t count, size;
+static arena_t arena;
+
+static int build(const char *outfile, const char *list);
+static int parse_line(char *line, const char *list, unsigned lineno);
+static void show(const catalog_t *cat, const catalog_entry_t *entry);
+
+int main(int argc, char **argv){
+	const catalog_entry_t *entry;
+	catalog_t cat;
+	char *outfile;
+	uint32_t k;
+	int opt, i, failed;
+
+	outfile = NULL;
+	while ((opt = getopt(argc, argv, "o:")) != -1){
+		switch (opt){
+		case 'o':
+			outfile = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (outfile){
+		if (argc - optind != 1){
+			goto usage;
+		}
+		return build(outfile, argv[optind]) ? EXIT_FAILURE : 0;
+	}
+
+	if (optind >= argc){
+		goto usage;
+	}
+	if (catalog_open(&cat, argv[optind])){
+		return EXIT_FAILURE;
+	}
+
+	failed = 0;
+	if (argc - optind == 1){
+		for (k=0; k<cat.hdr->count; k++){
+			if ((entry = catalog_get(&cat, k)) != NULL){
+				show(&cat, entry);
+			}
+		}
+	}
+
+	for (i=optind + 1; i<argc; i++){
+		if ((entry = catalog_find_name(&cat, argv[i])) != NULL){
+			show(&cat, entry);
+		} else {
+			fprintf(stderr, "%s non è nel catalogo\n", argv[i]);
+			failed = 1;
+		}
+	}
+
+	catalog_close(&cat);
+	return failed ? EXIT_FAILURE : 0;
+
+ usage:
+	fprintf(stderr, "Creazione: %s -o CATALOGO LISTA\n", argv[0]);
+	fprintf(stderr, "  LISTA ha una ROM per riga, seguita dalle impostazioni:\n");
+	fprintf(stderr, "  FILE [name=NOME] [quirks=QUIRK] [speed=ISTRUZIONI] [keys=TASTI]\n");
+	fprintf(stderr, "Contenuto: %s CATALOGO [NOME...]\n", argv[0]);
+	return EXIT_FAILURE;
+}
+
+/* Stampa una voce nel formato della lista */
+static void show(const catalog_t *cat, const catalog_entry_t *entry){
+	printf("%s", catalog_name(cat, entry));
+	if (entry->flags & CATALOG_QUIRKS){
+		printf(" quirks=0x%02X", entry->quirks);
+	}
+	if (entry->speed){
+		printf(" speed=%u", entry->speed);
+	}
+	if (entry->flags & CATALOG_KEYMAP){
+		printf(" keys=%.16s", entry->keymap);
+	}
+	printf(" # %u byte, %016llX\n", entry->len, (unsigned long long) entry->hash);
+}
+
+/* Legge la lista delle ROM e scrive il catalogo */
+static int build(const char *outfile, const char *list){
+	char line[4096];
+	unsigned lineno;
+	int failed;
+	FILE *fp;
+
+	if ((fp = fopen(list, "r")) == NULL){
+		err("impossibile leggere il file %s", list);
+		return 1;
+	}
+
+	arena_init(&arena);
+	failed = 0;
+
+	for (lineno=1; fgets(line, sizeof(line), fp); lineno++){
+		if (parse_line(line, list, lineno)){
+			failed = 1;
+			break;
+		}
+	}
+
+	if (ferror(fp)){
+		err("impossibile leggere il file %s", list);
+		failed = 1;
+	}
+	fclose(fp);
+
+	if (!failed){
+		failed = catalog_write(outfile, entries, count, names, roms);
+	}
+
+	if (!failed){
+		fprintf(stderr, "Scritte %lu ROM in %s\n", (unsigned long) count, outfile);
+	}
+
+	free(entries);
+	free(names);
+	free(roms);
+	arena_free(&arena);
+
+	return failed;
+}
+
+/* Aggiunge la ROM di una riga della lista, ritorna non zero in caso
+ * di errore; le righe vuote e i commenti (#) vengono saltati */
+static int parse_line(char *line, const char *list, unsigned lineno){
+	static uint8_t buf[0x0E00];
+	catalog_entry_t *entry;
+	const char *file, *name;
+	char *tok, *save;
+	unsigned quirks;
+	uint8_t *rom;
+	size_t len;
+	void *p;
+	int k;
+
+	if ((tok = strchr(line, '#')) != NULL){
+		*tok = '\0';
+	}
+
+	if ((file = strtok_r(line, " \t\r\n", &save)) == NULL){
+		return 0;
+	}
+
+	if (count == size){
+		size = size ? size * 2 : 256;
+		if ((p = realloc(entries, size * sizeof(catalog_entry_t))) != NULL){
+			entries = p;
+		}
+		if (p && (p = realloc(names, size * sizeof(char *))) != NULL){
+			names = p;
+		}
+		if (p && (p = realloc(roms, size * sizeof(uint8_t *))) != NULL){
+			roms = p;
+		}
+		if (!p){
+			err("impossibile allocare memoria");
+			return 1;
+		}
+	}
+
+	entry = &entries[count];
+	memset(entry, 0, sizeof(*entry));
+
+	name = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+
+	while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL){
+		if (!strncmp(tok, "name=", 5) && tok[5]){
+			name = tok + 5;
+		} else if (!strncmp(tok, "quirks=", 7) && !chip8_parse_quirks(tok + 7, &quirks)){
+			entry->quirks = quirks;
+			entry->flags |= CATALOG_QUIRKS;
+		} else if (!strncmp(tok, "speed=", 6) && atoi(tok + 6) > 0 && atoi(tok + 6) <= 0xFFFF){
+			entry->speed = atoi(tok + 6);
+		} else if (!strncmp(tok, "keys=", 5) && strlen(tok + 5) == 16){
+			for (k=0; k<16; k++){
+				if (!islower((unsigned char) tok[5 + k]) && !isdigit((unsigned char) tok[5 + k])){
+					break;
+				}
+				entry->keymap[k] = tok[5 + k];
+			}
+			if (k < 16){
+				goto invalid;
+			}
+			entry->flags |= CATALOG_KEYMAP;
+		} else {
+			goto invalid;
+		}
+	}
+
+	if (!(len = read_file(file, buf, sizeof(buf)))){
+		return 1;
+	}
+
+	if ((rom = arena_alloc(&arena, len)) == NULL
+		|| (names[count] = arena_strdup(&arena, name)) == NULL){
+		err("impossibile allocare memoria");
+		return 1;
+	}
+
+	memcpy(rom, buf, len);
+	roms[count] = rom;
+	entry->len = len;
+	entry->hash = chip8_hash_bytes(rom, len);
+	count++;
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "%s:%u: impostazione non valida: %s\n", list, lineno, tok);
+	return 1;
+}
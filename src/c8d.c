@@ -0,0 +1,951 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "chip8.h"
+#include "aot.h"
+#include "c8d.h"
+#include "frames.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+/* c8d: esegue molte macchine senza finestra in un solo processo e le
+ * serve su un socket Unix, vedi c8d.h per il protocollo.
+ * Tutto gira in un solo thread: un ciclo epoll legge un pacchetto di
+ * richieste alla volta da ogni client, le esegue e risponde con un solo
+ * pacchetto, così il costo di una sessione è quello delle sue istruzioni */
+
+/* Numero predefinito e massimo di sessioni */
+#define SESSIONS_DEFAULT 1024
+#define SESSIONS_MAX     65535
+
+/* Immagini tenute in memoria per riusarle tra sessioni con la stessa ROM */
+#define IMAGE_CACHE 16
+
+#define MAX_EVENTS 64
+
+/* Programmi compilati caricabili con -A */
+#define AOT_MAX 64
+
+/* Istruzioni eseguite dal codice compilato tra due controlli di chip8_idle */
+#define AOT_CHUNK 1024
+
+/* Attesa massima di epoll quando si esportano le metriche, in ms */
+#define METRICS_POLL 100
+
+struct client;
+
+/* Una sessione: la macchina, l'eventuale stato salvato e i tasti premuti */
+struct session {
+	chip8_machine_t machine;
+	chip8_machine_t snap;
+	struct client *owner;   /* Le sessioni si chiudono con il loro client */
+	uint32_t id;
+	uint16_t keys;          /* Un bit per tasto */
+	uint8_t has_snap;
+	const chip8_aot_t *aot; /* Programma compilato della ROM, o NULL */
+
+	/* Metriche della sessione */
+	uint64_t idle;          /* L'ultimo step si è fermato in attesa */
+	uint64_t instructions;
+	uint64_t steps;
+	uint64_t draws;
+	uint64_t exported;      /* Istruzioni all'esportazione precedente */
+};
+
+/* Un client collegato; se il socket non accetta la risposta, questa
+ * resta in pending e il client non viene letto finché non parte */
+struct client {
+	int fd;
+	uint8_t *pending;
+	size_t npending;
+	int pending_map;        /* La risposta in attesa porta il descrittore */
+};
+
+static struct session **sessions;       /* Indicizzate per slot */
+static uint16_t *generation;            /* Per slot, per non riusare gli id */
+static unsigned nslots;
+
+static frames_t frames;                 /* Memoria condivisa degli schermi */
+
+static chip8_image_t *images[IMAGE_CACHE];
+
+static const chip8_aot_t *modules[AOT_MAX];
+static unsigned nmodules;
+
+static uint8_t request[C8D_MAX_PACKET];
+static uint8_t reply[C8D_MAX_PACKET];
+
+static volatile sig_atomic_t quit;
+
+static metrics_export_t exporter;
+static int exporting;
+
+/* Metriche del demone */
+static struct {
+	uint64_t packets;
+	uint64_t instructions;
+	uint64_t clients;
+	metrics_hist_t packet_time; /* Esecuzione delle richieste di un pacchetto */
+} stats;
+
+static int open_socket(const char *path);
+static void set_keys(struct session *s, uint16_t mask);
+static void serve(int lfd);
+static void export_metrics(uint64_t now);
+
+static void on_signal(int sig){
+	(void) sig;
+	quit = 1;
+}
+
+int main(int argc, char **argv){
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	struct sigaction sa;
+	const char *env, *mspec, *shm;
+	char *symbol;
+	int opt, lfd, keys;
+
+	path[0] = '\0';
+	mspec = shm = NULL;
+	keys = 0;
+	nslots = SESSIONS_DEFAULT;
+	while ((opt = getopt(argc, argv, "A:Km:n:s:S:")) != -1){
+		switch (opt){
+		case 'A':
+			if (nmodules == AOT_MAX){
+				fprintf(stderr, "Troppi programmi compilati, al massimo %d\n", AOT_MAX);
+				return EXIT_FAILURE;
+			}
+			/* MODULO:SIMBOLO per i moduli compilati con c8aot -n */
+			symbol = strrchr(optarg, ':');
+			if (symbol && symbol[1] && !strchr(symbol, '/')){
+				*symbol++ = '\0';
+			} else {
+				symbol = NULL;
+			}
+			if ((modules[nmodules] = chip8_aot_load(optarg, symbol)) == NULL){
+				return EXIT_FAILURE;
+			}
+			nmodules++;
+			break;
+		case 'n':
+			nslots = strtoul(optarg, NULL, 10);
+			if (!nslots || nslots > SESSIONS_MAX){
+				goto usage;
+			}
+			break;
+		case 's':
+			if (strlen(optarg) >= sizeof(path)){
+				err("percorso troppo lungo: %s", optarg);
+				return EXIT_FAILURE;
+			}
+			strcpy(path, optarg);
+			break;
+		case 'm':
+			mspec = optarg;
+			break;
+		case 'S':
+			shm = optarg;
+			break;
+		case 'K':
+			keys = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind != argc){
+		goto usage;
+	}
+
+	if (!path[0]){
+		if ((env = getenv("XDG_RUNTIME_DIR")) != NULL && *env){
+			snprintf(path, sizeof(path), "%s/" C8D_SOCKET_NAME, env);
+		} else {
+			snprintf(path, sizeof(path), "/tmp/c8d-%u.sock", (unsigned) getuid());
+		}
+	}
+
+	sessions = calloc(nslots, sizeof(struct session *));
+	generation = calloc(nslots, sizeof(uint16_t));
+	if (!sessions || !generation){
+		err("impossibile allocare memoria");
+		return EXIT_FAILURE;
+	}
+
+	if (frames_open(&frames, shm, nslots, keys) || (lfd = open_socket(path)) < 0){
+		return EXIT_FAILURE;
+	}
+
+	if (mspec){
+		if (metrics_export_open(&exporter, mspec)){
+			return EXIT_FAILURE;
+		}
+		exporting = 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "c8d: %u sessioni su %s\n", nslots, path);
+	serve(lfd);
+
+	close(lfd);
+	unlink(path);
+	frames_close(&frames);
+	if (exporting){
+		metrics_export_close(&exporter);
+	}
+	return 0;
+
+ usage:
+	fprintf(stderr, "Uso: %s [-n SESSIONI] [-s SOCKET] [-S NOME] [-K] [-m METRICHE] [-A MODULO[:SIMBOLO]]...\n", argv[0]);
+	fprintf(stderr, "  -n  numero massimo di sessioni (predefinito: %d)\n", SESSIONS_DEFAULT);
+	fprintf(stderr, "  -s  socket (predefinito: $XDG_RUNTIME_DIR/" C8D_SOCKET_NAME ")\n");
+	fprintf(stderr, "  -S  schermi nella memoria condivisa POSIX NOME invece che in una memfd\n");
+	fprintf(stderr, "  -K  i client possono premere i tasti scrivendo nella memoria condivisa\n");
+	fprintf(stderr, "  -m  esporta le metriche nel file METRICHE, o sul socket se è unix:SOCKET\n");
+	fprintf(stderr, "  -A  esegue con il codice di MODULO, compilato da c8aot, le sessioni con la sua ROM\n");
+	fprintf(stderr, "      SIMBOLO è il nome dato con c8aot -n (predefinito: " CHIP8_AOT_SYMBOL ")\n");
+	return EXIT_FAILURE;
+}
+
+/* Crea il socket in ascolto, ritorna -1 in caso di errore */
+static int open_socket(const char *path){
+	struct sockaddr_un addr;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+		err("impossibile creare il socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Un socket rimasto da un'esecuzione precedente */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, SOMAXCONN)){
+		err("impossibile ascoltare su %s", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Copia lo schermo della sessione nel suo slot, vedi frames_publish */
+static void publish_frame(uint32_t id, const uint8_t *vram){
+	frames_publish(&frames, id & 0xFFFF, id & 0xFFFF0000 ? id : 0, vram);
+}
+
+static void publish(const struct session *s){
+	publish_frame(s->id, s->machine.vram);
+}
+
+/* Cerca la sessione di un id, NULL se non esiste più */
+static struct session *lookup(uint32_t id){
+	struct session *s;
+
+	if ((id & 0xFFFF) >= nslots || (s = sessions[id & 0xFFFF]) == NULL || s->id != id){
+		return NULL;
+	}
+
+	return s;
+}
+
+/* Immagine di una ROM, presa dalla cache se un'altra sessione usa la
+ * stessa; il chiamante riceve un riferimento. NULL se la memoria è esaurita */
+static chip8_image_t *get_image(const uint8_t *rom, size_t len){
+	chip8_image_t *image, **slot;
+
+	slot = &images[chip8_hash_bytes(rom, len) % IMAGE_CACHE];
+	image = *slot;
+
+	if (!image || image->len != len || memcmp(image->ram + 0x200, rom, len)){
+		if ((image = chip8_image_new(rom, len)) == NULL){
+			return NULL;
+		}
+		chip8_image_release(*slot);
+		*slot = image;
+	}
+
+	__sync_add_and_fetch(&image->refs, 1);
+	return image;
+}
+
+/* Riavvia la macchina di una sessione con una nuova ROM */
+static int reset(struct session *s, const uint8_t *rom, size_t len, unsigned quirks){
+	chip8_machine_t fresh;
+	chip8_image_t *image;
+	unsigned k;
+
+	if ((image = get_image(rom, len)) == NULL){
+		return C8D_E_NOMEM;
+	}
+
+	/* Se la memoria è esaurita la sessione resta com'era */
+	if (chip8_try_init(&fresh)){
+		chip8_image_release(image);
+		return C8D_E_NOMEM;
+	}
+	chip8_release(&s->machine);
+	s->machine = fresh;
+
+	chip8_set_quirks(&s->machine, quirks % CHIP8_QUIRKS_MAX);
+	chip8_attach(&s->machine, image);
+	chip8_image_release(image);
+	s->keys = 0;
+
+	for (s->aot=NULL, k=0; k<nmodules && !s->aot; k++){
+		if (chip8_aot_match(modules[k], &s->machine)){
+			s->aot = modules[k];
+		}
+	}
+
+	publish(s);
+	return C8D_OK;
+}
+
+static void destroy(struct session *s){
+	unsigned slot;
+
+	/* Lo slot libero ha lo schermo vuoto e nessuna sessione */
+	slot = s->id & 0xFFFF;
+	memset(s->machine.vram, 0, CHIP8_VRAM_SIZE);
+	publish_frame(slot, s->machine.vram);
+
+	chip8_release(&s->machine);
+	if (s->has_snap){
+		chip8_release(&s->snap);
+	}
+
+	sessions[slot] = NULL;
+	free(s);
+}
+
+static int create(struct client *c, const uint8_t *rom, size_t len, unsigned quirks, c8d_msg_t *res){
+	struct session *s;
+	unsigned slot;
+	int status;
+
+	for (slot=0; slot<nslots && sessions[slot]; slot++);
+
+	if (slot == nslots){
+		return C8D_E_FULL;
+	}
+
+	if (posix_memalign((void **) &s, 64, sizeof(struct session))){
+		return C8D_E_NOMEM;
+	}
+
+	memset(s, 0, sizeof(struct session));
+	if (chip8_try_init(&s->machine)){
+		free(s);
+		return C8D_E_NOMEM;
+	}
+
+	/* La generazione non è mai zero, così neanche l'id */
+	if (!++generation[slot]){
+		generation[slot] = 1;
+	}
+	s->id = (uint32_t) generation[slot] << 16 | slot;
+	s->owner = c;
+
+	if ((status = reset(s, rom, len, quirks)) != C8D_OK){
+		chip8_release(&s->machine);
+		free(s);
+		return status;
+	}
+
+	sessions[slot] = s;
+	res->session = s->id;
+	res->arg = slot;
+	return C8D_OK;
+}
+
+/* Il ciclo di step per le sessioni con un programma compilato: il
+ * codice nativo non passa di qui ad ogni istruzione, quindi chip8_idle
+ * si controlla dopo ogni pezzo di AOT_CHUNK istruzioni */
+static uint32_t step_aot(struct session *s, uint32_t count, c8d_msg_t *res, uint8_t *drawn){
+	chip8_machine_t *m;
+	unsigned done;
+	uint32_t n;
+	int status;
+
+	m = &s->machine;
+	n = 0;
+
+	while (n < count){
+		if (m->wait && !m->last_key){
+			res->flags |= C8D_R_WAIT;
+			break;
+		}
+
+		status = chip8_aot_run(m, s->aot, (count - n < AOT_CHUNK) ? count - n : AOT_CHUNK, &done);
+		n += done;
+		*drawn |= m->drawn;
+
+		if (status == 6){
+			res->status = C8D_E_NOMEM;
+			break;
+		}
+
+		/* Come in step, un'istruzione non valida conta e si prosegue */
+		if (status){
+			n++;
+		} else if (!m->wait && chip8_idle(m)){
+			res->flags |= C8D_R_IDLE;
+			break;
+		}
+	}
+
+	return n;
+}
+
+/* Esegue fino a count istruzioni, fermandosi prima se la macchina
+ * aspetta un tasto o gira a vuoto: il resto delle istruzioni non
+ * cambierebbe lo stato, quindi non serve eseguirlo */
+static int step(struct session *s, uint32_t count, uint32_t flags, c8d_msg_t *res){
+	chip8_machine_t *m;
+	uint32_t n, laps, check;
+	uint16_t pc, head, mask;
+	uint8_t drawn;
+
+	m = &s->machine;
+	drawn = 0;
+
+	/* Con -K i tasti possono arrivare anche dalla memoria condivisa */
+	if (frames_keys(&frames, s->id & 0xFFFF, &mask)){
+		set_keys(s, mask);
+	}
+
+	if (count > C8D_STEP_MAX){
+		count = C8D_STEP_MAX;
+	}
+
+	head = 0xFFFF;
+	laps = 0;
+	check = 4;
+
+	for (n=0; n<count && !s->aot; ){
+		if (m->wait && !m->last_key){
+			res->flags |= C8D_R_WAIT;
+			break;
+		}
+
+		pc = m->pc;
+		if (chip8_exec(m) == 6){
+			res->status = C8D_E_NOMEM;
+			break;
+		}
+		n += m->retired;
+		drawn |= m->drawn;
+
+		/* chip8_idle costa qualche istruzione: lo chiamiamo solo quando
+		 * lo stesso ciclo ha fatto un numero di giri che raddoppia */
+		if (m->pc < pc){
+			if (m->pc != head){
+				head = m->pc;
+				laps = 0;
+				check = 4;
+			} else if (++laps == check){
+				check *= 2;
+				if (chip8_idle(m)){
+					res->flags |= C8D_R_IDLE;
+					break;
+				}
+			}
+		}
+	}
+
+	if (s->aot){
+		n = step_aot(s, count, res, &drawn);
+	}
+
+	if (flags & C8D_STEP_TICK){
+		chip8_update_timers(m, 17);
+	}
+
+	if (drawn){
+		res->flags |= C8D_R_DRAWN;
+		publish(s);
+	}
+
+	if (m->st){
+		res->flags |= C8D_R_BEEP;
+	}
+
+	s->idle = (res->flags & (C8D_R_WAIT | C8D_R_IDLE)) != 0;
+	METRIC_ADD(s->instructions, n);
+	METRIC_ADD(s->steps, 1);
+	METRIC_ADD(s->draws, drawn != 0);
+	METRIC_ADD(stats.instructions, n);
+
+	res->arg = n;
+	return res->status;
+}
+
+static void set_keys(struct session *s, uint16_t mask){
+	uint8_t keys[16];
+	unsigned k;
+
+	for (k=0; k<16; k++){
+		keys[k] = (mask >> k) & 1;
+	}
+
+	chip8_update_keys(&s->machine, keys);
+	if (mask & ~s->keys){
+		chip8_pressed(&s->machine, ffs(mask & ~s->keys) - 1);
+	}
+	s->keys = mask;
+}
+
+static int snapshot(struct session *s){
+	if (s->has_snap){
+		chip8_release(&s->snap);
+		s->has_snap = 0;
+	}
+
+	if (chip8_fork(&s->snap, &s->machine)){
+		return C8D_E_NOMEM;
+	}
+
+	s->has_snap = 1;
+	return C8D_OK;
+}
+
+static int restore(struct session *s){
+	chip8_machine_t machine;
+
+	if (!s->has_snap){
+		return C8D_E_NOSNAP;
+	}
+
+	if (chip8_fork(&machine, &s->snap)){
+		return C8D_E_NOMEM;
+	}
+
+	chip8_release(&s->machine);
+	s->machine = machine;
+	publish(s);
+	return C8D_OK;
+}
+
+/* Esegue una richiesta, scrivendo l'esito in res e gli eventuali dati
+ * della risposta in data (al massimo room byte) */
+static void handle(struct client *c, const c8d_msg_t *req, const uint8_t *payload,
+				   c8d_msg_t *res, uint8_t *data, size_t room){
+	struct session *s;
+
+	s = NULL;
+	if (req->op != C8D_OP_CREATE && req->op != C8D_OP_MAP
+		&& (s = lookup(req->session)) == NULL){
+		res->status = C8D_E_SESSION;
+		return;
+	}
+
+	switch (req->op){
+	case C8D_OP_CREATE:
+		res->status = create(c, payload, req->len, req->arg, res);
+		break;
+	case C8D_OP_LOAD:
+		res->status = reset(s, payload, req->len, req->arg);
+		break;
+	case C8D_OP_STEP:
+		step(s, req->arg, req->flags, res);
+		break;
+	case C8D_OP_KEYS:
+		set_keys(s, req->arg);
+		break;
+	case C8D_OP_FRAME:
+		if (room < CHIP8_VRAM_SIZE){
+			res->status = C8D_E_FULL;
+			break;
+		}
+		memcpy(data, s->machine.vram, CHIP8_VRAM_SIZE);
+		res->len = CHIP8_VRAM_SIZE;
+		break;
+	case C8D_OP_SNAPSHOT:
+		res->status = snapshot(s);
+		break;
+	case C8D_OP_RESTORE:
+		res->status = restore(s);
+		break;
+	case C8D_OP_SEED:
+		chip8_seed(&s->machine, req->arg);
+		break;
+	case C8D_OP_DESTROY:
+		destroy(s);
+		break;
+	case C8D_OP_MAP:
+		c->pending_map = 1;
+		res->arg = nslots;
+		break;
+	default:
+		res->status = C8D_E_REQUEST;
+		break;
+	}
+}
+
+/* Esegue tutte le richieste di un pacchetto, ritorna la lunghezza
+ * della risposta in reply. Ogni richiesta ha almeno la sua
+ * intestazione nella risposta: i dati di una risposta non possono
+ * usare lo spazio delle intestazioni delle richieste che seguono, che
+ * sono al massimo una ogni sizeof(c8d_msg_t) byte del pacchetto; dato
+ * che richiesta e risposta hanno la stessa dimensione massima, lo
+ * spazio c'è sempre */
+static size_t handle_packet(struct client *c, size_t len){
+	c8d_msg_t req, *res;
+	size_t in, out, rest;
+
+	in = out = 0;
+	while (in < len && out + sizeof(c8d_msg_t) <= sizeof(reply)){
+		res = (c8d_msg_t *) (reply + out);
+		memset(res, 0, sizeof(c8d_msg_t));
+
+		if (len - in < sizeof(c8d_msg_t)){
+			res->status = C8D_E_REQUEST;
+			out += sizeof(c8d_msg_t);
+			break;
+		}
+
+		memcpy(&req, request + in, sizeof(c8d_msg_t));
+		in += sizeof(c8d_msg_t);
+		res->op = req.op;
+		res->session = req.session;
+
+		/* Con una lunghezza sbagliata il resto del pacchetto non ha senso */
+		if (req.len > len - in){
+			res->status = C8D_E_REQUEST;
+			out += sizeof(c8d_msg_t);
+			break;
+		}
+
+		in += req.len;
+		rest = (len - in + sizeof(c8d_msg_t) - 1) / sizeof(c8d_msg_t) * sizeof(c8d_msg_t);
+		handle(c, &req, request + in - req.len, res, reply + out + sizeof(c8d_msg_t),
+			   sizeof(reply) - out - sizeof(c8d_msg_t) - rest);
+		out += sizeof(c8d_msg_t) + res->len;
+	}
+
+	return out;
+}
+
+/* Invia una risposta, con il descrittore degli schermi se richiesto;
+ * ritorna 1 se il socket è pieno, -1 se il client se n'è andato */
+static int send_reply(struct client *c, const uint8_t *data, size_t len){
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *) data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (c->pending_map){
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &frames.fd, sizeof(int));
+	}
+
+	if (sendmsg(c->fd, &msg, MSG_NOSIGNAL) < 0){
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+	}
+
+	c->pending_map = 0;
+	return 0;
+}
+
+static void drop_client(int epfd, struct client *c){
+	unsigned slot;
+
+	for (slot=0; slot<nslots; slot++){
+		if (sessions[slot] && sessions[slot]->owner == c){
+			destroy(sessions[slot]);
+		}
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	METRIC_ADD(stats.clients, -1);
+	close(c->fd);
+	free(c->pending);
+	free(c);
+}
+
+/* Legge ed esegue un pacchetto; ritorna -1 se il client va chiuso */
+static int client_read(int epfd, struct client *c){
+	struct epoll_event ev;
+	struct msghdr msg;
+	struct iovec iov;
+	uint64_t start;
+	ssize_t len;
+	size_t out;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = request;
+	iov.iov_len = sizeof(request);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if ((len = recvmsg(c->fd, &msg, 0)) < 0){
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	} else if (len == 0){
+		return -1;
+	}
+
+	if (msg.msg_flags & MSG_TRUNC){
+		memset(reply, 0, sizeof(c8d_msg_t));
+		((c8d_msg_t *) reply)->status = C8D_E_REQUEST;
+		out = sizeof(c8d_msg_t);
+	} else {
+		start = metrics_now();
+		out = handle_packet(c, len);
+		metrics_record(&stats.packet_time, metrics_now() - start);
+	}
+	METRIC_ADD(stats.packets, 1);
+
+	if ((ret = send_reply(c, reply, out)) <= 0){
+		return ret;
+	}
+
+	/* Socket pieno: teniamo la risposta e smettiamo di leggere */
+	if ((c->pending = malloc(out)) == NULL){
+		return -1;
+	}
+	memcpy(c->pending, reply, out);
+	c->npending = out;
+
+	ev.events = EPOLLOUT;
+	ev.data.ptr = c;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) ? -1 : 0;
+}
+
+/* Invia la risposta rimasta in attesa; ritorna -1 se il client va chiuso */
+static int client_write(int epfd, struct client *c){
+	struct epoll_event ev;
+	int ret;
+
+	if ((ret = send_reply(c, c->pending, c->npending)) != 0){
+		return ret < 0 ? -1 : 0;
+	}
+
+	free(c->pending);
+	c->pending = NULL;
+	c->npending = 0;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) ? -1 : 0;
+}
+
+static void accept_clients(int epfd, int lfd){
+	struct epoll_event ev;
+	struct client *c;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+		if ((c = calloc(1, sizeof(struct client))) == NULL){
+			close(fd);
+			continue;
+		}
+
+		c->fd = fd;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)){
+			close(fd);
+			free(c);
+			continue;
+		}
+		METRIC_ADD(stats.clients, 1);
+	}
+}
+
+static void serve(int lfd){
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct client *c;
+	uint64_t now;
+	int epfd, n, i, ret;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+		err("impossibile creare epoll");
+		return;
+	}
+
+	/* Il socket in ascolto ha data.ptr NULL */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev)){
+		err("impossibile creare epoll");
+		close(epfd);
+		return;
+	}
+
+	while (!quit){
+		/* Con le metriche ci svegliamo anche senza client, per
+		 * riscrivere il file o rispondere a chi si collega */
+		if (exporting && metrics_export_due(&exporter, now = metrics_now())){
+			export_metrics(now);
+		}
+
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, exporting ? METRICS_POLL : -1)) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			err("errore di epoll");
+			break;
+		}
+
+		for (i=0; i<n; i++){
+			if ((c = events[i].data.ptr) == NULL){
+				accept_clients(epfd, lfd);
+				continue;
+			}
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP)){
+				ret = -1;
+			} else if (c->pending){
+				ret = client_write(epfd, c);
+			} else {
+				ret = client_read(epfd, c);
+			}
+
+			if (ret < 0){
+				drop_client(epfd, c);
+			}
+		}
+	}
+
+	close(epfd);
+}
+
+/* Scrive le metriche del demone e di ogni sessione; le istruzioni al
+ * secondo sono calcolate dall'esportazione precedente */
+static void export_metrics(uint64_t now){
+	static const struct {
+		const char *name, *type, *help;
+		size_t offset;
+	} counters[] = {
+		{ "c8d_session_instructions_total", "counter", "Istruzioni eseguite dalla sessione",
+		  offsetof(struct session, instructions) },
+		{ "c8d_session_steps_total", "counter", "Richieste di esecuzione della sessione",
+		  offsetof(struct session, steps) },
+		{ "c8d_session_draws_total", "counter", "Esecuzioni che hanno cambiato lo schermo",
+		  offsetof(struct session, draws) },
+		{ "c8d_session_idle", "gauge", "1 se l'ultima esecuzione aspettava timer o tastiera",
+		  offsetof(struct session, idle) },
+	};
+	static uint64_t last_time, last_instr;
+	struct session *s;
+	char labels[32];
+	uint64_t instr;
+	unsigned slot, active, k;
+	int last;
+	double elapsed;
+	outbuf_t ob;
+
+	if (outbuf_init(&ob, NULL, 65536)){
+		return;
+	}
+
+	elapsed = (last_time && now > last_time) ? (now - last_time) / 1e6 : 0;
+	instr = METRIC_GET(stats.instructions);
+	for (active=0, slot=0; slot<nslots; slot++){
+		active += sessions[slot] != NULL;
+	}
+
+	metrics_family(&ob, "c8d_sessions", "gauge", "Sessioni aperte");
+	metrics_value(&ob, "c8d_sessions", NULL, active);
+	metrics_family(&ob, "c8d_clients", "gauge", "Client collegati");
+	metrics_value(&ob, "c8d_clients", NULL, METRIC_GET(stats.clients));
+	metrics_family(&ob, "c8d_packets_total", "counter", "Pacchetti di richieste ricevuti");
+	metrics_value(&ob, "c8d_packets_total", NULL, METRIC_GET(stats.packets));
+	metrics_family(&ob, "c8d_instructions_total", "counter", "Istruzioni eseguite da tutte le sessioni");
+	metrics_value(&ob, "c8d_instructions_total", NULL, instr);
+	metrics_family(&ob, "c8d_instructions_per_second", "gauge", "Istruzioni al secondo dall'esportazione precedente");
+	metrics_value(&ob, "c8d_instructions_per_second", NULL, elapsed ? (instr - last_instr) / elapsed : 0);
+	metrics_family(&ob, "c8d_packet_seconds", "histogram", "Tempo di esecuzione di un pacchetto di richieste");
+	metrics_hist(&ob, "c8d_packet_seconds", NULL, &stats.packet_time);
+
+	/* Per sessione: una famiglia alla volta, come vuole il formato;
+	 * l'ultima famiglia sono le istruzioni al secondo */
+	for (k=0; k<=sizeof(counters) / sizeof(counters[0]); k++){
+		last = k == sizeof(counters) / sizeof(counters[0]);
+		if (last){
+			metrics_family(&ob, "c8d_session_instructions_per_second", "gauge",
+						   "Istruzioni al secondo della sessione");
+		} else {
+			metrics_family(&ob, counters[k].name, counters[k].type, counters[k].help);
+		}
+
+		for (slot=0; slot<nslots; slot++){
+			if ((s = sessions[slot]) == NULL){
+				continue;
+			}
+
+			snprintf(labels, sizeof(labels), "session=\"%u\"", (unsigned) s->id);
+			if (last){
+				metrics_value(&ob, "c8d_session_instructions_per_second", labels,
+							  elapsed ? (s->instructions - s->exported) / elapsed : 0);
+				s->exported = s->instructions;
+			} else {
+				metrics_value(&ob, counters[k].name, labels,
+							  *(const uint64_t *) ((const char *) s + counters[k].offset));
+			}
+		}
+	}
+
+	metrics_export_send(&exporter, &ob);
+	outbuf_free(&ob);
+
+	last_time = now;
+	last_instr = instr;
+}
@@ -0,0 +1,114 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _C8D_H_
+#define _C8D_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "c8shm.h"
+
+/* Protocollo di c8d: il demone che esegue molte macchine senza
+ * finestra in un solo processo.
+ *
+ * I client si collegano ad un socket Unix SOCK_SEQPACKET: ogni
+ * pacchetto contiene una o più richieste consecutive, ognuna un
+ * c8d_msg_t seguito da len byte di dati, e riceve un pacchetto con una
+ * risposta per ogni richiesta, nello stesso ordine; se i dati delle
+ * risposte non ci stanno tutti, quelle che non entrano hanno solo
+ * l'intestazione con C8D_E_FULL. Tutti i campi sono
+ * nell'ordine dei byte dell'host, dato che client e demone girano
+ * sulla stessa macchina.
+ *
+ * Gli schermi delle sessioni stanno in una memoria condivisa, un
+ * array di c8d_frame_t indicizzato dallo slot della sessione: il
+ * descrittore arriva con la risposta a C8D_OP_MAP (SCM_RIGHTS), dopo
+ * di che un client legge lo schermo senza passare dal socket. Con
+ * c8d -S la memoria è anche un oggetto POSIX con un nome, che si apre
+ * senza collegarsi, e con -K i client premono i tasti di una sessione
+ * scrivendo nel suo slot, vedi c8shm.h */
+
+/* Socket predefinito, in $XDG_RUNTIME_DIR o in /tmp con lo UID */
+#define C8D_SOCKET_NAME "c8d.sock"
+
+/* Dimensione massima di un pacchetto di richieste o di risposte */
+#define C8D_MAX_PACKET 65536
+
+/* Operazioni */
+enum c8d_op {
+	C8D_OP_CREATE = 1,  /* Nuova sessione con la ROM nei dati e le quirk in arg;
+						 * risposta: session, e in arg lo slot dello schermo */
+	C8D_OP_LOAD,        /* Riavvia la sessione con la ROM nei dati e le quirk in arg */
+	C8D_OP_STEP,        /* Esegue fino ad arg istruzioni, al massimo C8D_STEP_MAX,
+						 * poi con C8D_STEP_TICK fa scattare i timer una volta
+						 * (1/60 di secondo); risposta: in arg le istruzioni
+						 * eseguite */
+	C8D_OP_KEYS,        /* Tasti premuti, un bit per tasto in arg */
+	C8D_OP_FRAME,       /* Risposta: lo schermo, CHIP8_VRAM_SIZE byte di dati */
+	C8D_OP_SNAPSHOT,    /* Salva lo stato della sessione */
+	C8D_OP_RESTORE,     /* Torna all'ultimo stato salvato */
+	C8D_OP_SEED,        /* Seme del generatore pseudocasuale in arg */
+	C8D_OP_DESTROY,     /* Chiude la sessione */
+	C8D_OP_MAP          /* Risposta: il descrittore degli schermi, in arg il numero di slot */
+};
+
+/* Flag delle richieste */
+#define C8D_STEP_TICK  0x01
+
+/* Istruzioni eseguite al massimo da una C8D_OP_STEP, perché una sola
+ * richiesta non fermi a lungo le altre sessioni; per andare oltre si
+ * mandano più richieste */
+#define C8D_STEP_MAX   100000
+
+/* Flag delle risposte a C8D_OP_STEP */
+#define C8D_R_DRAWN    0x01 /* Lo schermo è cambiato */
+#define C8D_R_WAIT     0x02 /* La macchina aspetta un tasto (FX0A) */
+#define C8D_R_IDLE     0x04 /* Il programma gira a vuoto, vedi chip8_idle */
+#define C8D_R_BEEP     0x08 /* Il sound timer è attivo */
+
+/* Esito di una richiesta */
+enum c8d_status {
+	C8D_OK,
+	C8D_E_REQUEST,      /* Richiesta malformata o operazione sconosciuta */
+	C8D_E_SESSION,      /* Sessione inesistente */
+	C8D_E_FULL,         /* Niente slot liberi, o risposta troppo grande */
+	C8D_E_NOMEM,        /* Memoria esaurita */
+	C8D_E_NOSNAP        /* Nessuno stato salvato */
+};
+
+/* Intestazione di richieste e risposte */
+typedef struct c8d_msg {
+	uint8_t op;         /* enum c8d_op, ripetuta nella risposta */
+	uint8_t status;     /* Nelle risposte, enum c8d_status */
+	uint16_t len;       /* Byte di dati che seguono */
+	uint32_t session;
+	uint32_t arg;
+	uint32_t flags;     /* C8D_STEP_* nelle richieste, C8D_R_* nelle risposte */
+} c8d_msg_t;
+
+/* Schermo di una sessione nella memoria condivisa, vedi c8shm.h; con
+ * c8d -K lo slot accetta anche i tasti */
+typedef c8shm_frame_t c8d_frame_t;
+
+/* Copia lo schermo di uno slot, ritentando se il demone lo sta scrivendo;
+ * ritorna il numero di sequenza della copia, che cresce ad ogni cambio */
+static inline uint32_t c8d_read_frame(const c8d_frame_t *frame, uint8_t *vram){
+	return c8shm_read_frame(frame, vram);
+}
+
+#endif /* _C8D_H_ */
@@ -0,0 +1,97 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _C8ENV_H_
+#define _C8ENV_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* libc8env: molte macchine con la stessa ROM viste come un ambiente
+ * vettoriale per l'apprendimento per rinforzo. Ad ogni passo ogni
+ * ambiente riceve un'azione (i tasti da tenere premuti), esegue
+ * frame_skip frame e scrive la sua osservazione, la ricompensa e se
+ * l'episodio è finito in array del chiamante, uno dopo l'altro per
+ * indice di ambiente; il lavoro è diviso tra più thread.
+ *
+ * Un frame è un tick dei timer: fino a ipf istruzioni, meno se il
+ * programma si mette ad aspettare un tasto o i timer, poi i timer
+ * scattano una volta. Tutto dipende solo dal seme e dalle azioni,
+ * quindi due ambienti con la stessa storia sono identici */
+
+/* Istruzioni per frame predefinite */
+#define C8ENV_IPF 15
+
+/* Flag della configurazione */
+#define C8ENV_UNPACKED  0x01    /* Un byte (0 o 1) per pixel invece di 8 pixel per byte */
+#define C8ENV_AUTORESET 0x02    /* Un ambiente finito riparte subito, vedi c8env_step */
+
+/* Byte di un'osservazione */
+#define C8ENV_OBS_PACKED   256  /* La VRAM così com'è, 8 byte per riga */
+#define C8ENV_OBS_UNPACKED 2048 /* 64x32 byte, riga per riga */
+
+/* Valori di dones, combinabili */
+#define C8ENV_DONE      0x01    /* Una condizione di fine è scattata, o il programma è fermo */
+#define C8ENV_TRUNCATED 0x02    /* L'episodio ha raggiunto max_frames */
+
+/* Registro VX come indirizzo di sonde e condizioni */
+#define C8ENV_REG(x) (0x1000 | ((x) & 0xF))
+
+#define C8ENV_MAX_PROBES 8
+#define C8ENV_MAX_CONDS  4
+
+/* Sonda di ricompensa: un numero in RAM, di len byte in big endian o
+ * cifre BCD (come scritte da FX33), oppure un registro. La ricompensa
+ * di un passo è la somma delle variazioni delle sonde per il loro peso */
+typedef struct c8env_probe {
+	uint16_t addr;          /* Indirizzo, o C8ENV_REG(x) */
+	uint8_t len;            /* Byte letti, da 1 a 4; ignorato per i registri */
+	uint8_t bcd;            /* Non zero se ogni byte è una cifra decimale */
+	float scale;            /* Peso della variazione */
+} c8env_probe_t;
+
+/* Condizione di fine episodio su un byte della RAM o un registro;
+ * scatta quando passa da falsa a vera, come quelle del debugger */
+typedef struct c8env_cond {
+	uint16_t addr;          /* Indirizzo, o C8ENV_REG(x) */
+	uint8_t op;             /* CHIP8_COND_EQ, _NE, _LT o _GT */
+	uint8_t value;
+} c8env_cond_t;
+
+typedef struct c8env_config {
+	unsigned quirks;        /* CHIP8_QUIRK_* */
+	unsigned ipf;           /* Istruzioni per frame, 0 per C8ENV_IPF */
+	unsigned max_frames;    /* Frame per episodio, 0 senza limite */
+	unsigned threads;       /* Thread di lavoro, 0 per uno per CPU */
+	unsigned flags;         /* C8ENV_UNPACKED, C8ENV_AUTORESET */
+	uint32_t seed;          /* L'ambiente k usa seed + k al primo episodio */
+	c8env_probe_t probes[C8ENV_MAX_PROBES];
+	unsigned nprobes;
+	c8env_cond_t conds[C8ENV_MAX_CONDS];
+	unsigned nconds;
+} c8env_config_t;
+
+typedef struct c8env c8env_t;
+
+extern c8env_t *c8env_new(const void *rom, size_t len, unsigned count, const c8env_config_t *config);
+extern void c8env_free(c8env_t *env);
+extern size_t c8env_obs_size(const c8env_t *env);
+extern int c8env_reset(c8env_t *env, uint8_t *obs);
+extern int c8env_step(c8env_t *env, const uint16_t *actions, unsigned frame_skip,
+					  uint8_t *obs, float *rewards, uint8_t *dones);
+
+#endif /* _C8ENV_H_ */
@@ -0,0 +1,68 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _C8SHM_H_
+#define _C8SHM_H_
+
+#include <stdint.h>
+
+/* Schermi e tastiere condivisi: chi esegue le macchine (c8emu, c8d)
+ * pubblica ogni frame in un array di c8shm_frame_t in memoria
+ * condivisa, una memfd passata con SCM_RIGHTS o un oggetto POSIX aperto
+ * con shm_open; il numero di slot è la dimensione diviso
+ * sizeof(c8shm_frame_t). Un processo esterno legge gli schermi senza
+ * copie intermedie né round trip su un socket, e se lo slot ha
+ * C8SHM_KEYS può anche premere i tasti scrivendo in keys */
+
+/* Flag degli slot */
+#define C8SHM_KEYS 0x01 /* Chi esegue la macchina legge keys */
+
+/* Uno slot, grande 5 linee di cache. seq è dispari mentre lo schermo
+ * viene scritto e cresce di 2 ad ogni frame pubblicato, quindi seq / 2
+ * conta i frame; vedi c8shm_read_frame */
+typedef struct c8shm_frame {
+	uint32_t seq;
+	uint32_t session;   /* Chi usa lo slot, 0 se libero */
+	uint32_t keys;      /* Tasti premuti, un bit per tasto, scritti da fuori */
+	uint32_t flags;     /* C8SHM_* */
+	uint8_t pad[48];
+	uint8_t vram[256];
+} c8shm_frame_t;
+
+/* Copia lo schermo di uno slot, ritentando se lo si sta scrivendo;
+ * ritorna il numero di sequenza della copia, che cresce ad ogni frame */
+static inline uint32_t c8shm_read_frame(const c8shm_frame_t *frame, uint8_t *vram){
+	uint32_t seq;
+
+	do {
+		while ((seq = __atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE)) & 1);
+		__builtin_memcpy(vram, frame->vram, sizeof(frame->vram));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&frame->seq, __ATOMIC_RELAXED) != seq);
+
+	return seq;
+}
+
+/* Preme i tasti di mask (un bit per tasto) e rilascia gli altri; la
+ * macchina li vede entro il prossimo frame, e solo se lo slot ha
+ * C8SHM_KEYS. Quando lo slot passa ad un'altra sessione i tasti
+ * vengono rilasciati */
+static inline void c8shm_set_keys(c8shm_frame_t *frame, uint16_t mask){
+	__atomic_store_n(&frame->keys, mask, __ATOMIC_RELEASE);
+}
+
+#endif /* _C8SHM_H_ */
@@ -0,0 +1,260 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "state.h"
+#include "catalog.h"
+
+/* All'apertura viene controllato solo l'header; ogni voce viene
+ * controllata quando viene trovata, così aprire un catalogo con
+ * decine di migliaia di ROM non costa niente */
+
+/* Apre e mappa un catalogo, ritorna non zero se non è valido */
+int catalog_open(catalog_t *cat, const char *path){
+	const catalog_header_t *hdr;
+	struct stat st;
+	size_t tables;
+	void *map;
+	int fd;
+
+	memset(cat, 0, sizeof(*cat));
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st)){
+		err("impossibile aprire il catalogo %s", path);
+		if (fd >= 0){
+			close(fd);
+		}
+		return 1;
+	}
+
+	if ((size_t) st.st_size < sizeof(catalog_header_t)){
+		close(fd);
+		goto invalid;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED){
+		err("impossibile mappare il catalogo %s", path);
+		return 1;
+	}
+
+	cat->map = map;
+	cat->size = st.st_size;
+	cat->hdr = hdr = map;
+
+	if (memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) || hdr->version != CATALOG_VERSION
+		|| hdr->entry_size != sizeof(catalog_entry_t) || hdr->size != cat->size
+		|| !hdr->buckets || (hdr->buckets & (hdr->buckets - 1)) || hdr->count >= hdr->buckets){
+		goto invalid_map;
+	}
+
+	tables = sizeof(catalog_header_t) + (size_t) hdr->count * sizeof(catalog_entry_t)
+		+ (size_t) hdr->buckets * 2 * sizeof(uint32_t);
+	if (tables > cat->size){
+		goto invalid_map;
+	}
+
+	cat->entries = (const catalog_entry_t *) (cat->map + sizeof(catalog_header_t));
+	cat->by_hash = (const uint32_t *) (cat->entries + hdr->count);
+	cat->by_name = cat->by_hash + hdr->buckets;
+
+	return 0;
+
+ invalid_map:
+	catalog_close(cat);
+ invalid:
+	fprintf(stderr, "Catalogo non valido: %s\n", path);
+	return 1;
+}
+
+void catalog_close(catalog_t *cat){
+	if (cat->map){
+		munmap((void *) cat->map, cat->size);
+	}
+	memset(cat, 0, sizeof(*cat));
+}
+
+/* Ritorna la voce idx, o NULL se non esiste o punta fuori dal file */
+const catalog_entry_t *catalog_get(const catalog_t *cat, uint32_t idx){
+	const catalog_entry_t *entry;
+
+	if (idx >= cat->hdr->count){
+		return NULL;
+	}
+
+	entry = &cat->entries[idx];
+	if (entry->rom > cat->size || entry->len > cat->size - entry->rom
+		|| entry->name >= cat->size || !memchr(cat->map + entry->name, 0, cat->size - entry->name)){
+		return NULL;
+	}
+
+	return entry;
+}
+
+/* Cerca una ROM per contenuto, NULL se non è nel catalogo */
+const catalog_entry_t *catalog_find(const catalog_t *cat, const void *rom, size_t len){
+	const catalog_entry_t *entry;
+	uint32_t mask, k, n;
+	uint64_t hash;
+
+	hash = chip8_hash_bytes(rom, len);
+	mask = cat->hdr->buckets - 1;
+
+	for (k=hash & mask, n=0; n<=mask && cat->by_hash[k]; k=(k + 1) & mask, n++){
+		entry = catalog_get(cat, cat->by_hash[k] - 1);
+		if (entry && entry->hash == hash && entry->len == len
+			&& !memcmp(cat->map + entry->rom, rom, len)){
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Cerca una ROM per nome, NULL se non è nel catalogo */
+const catalog_entry_t *catalog_find_name(const catalog_t *cat, const char *name){
+	const catalog_entry_t *entry;
+	uint32_t mask, k, n;
+
+	mask = cat->hdr->buckets - 1;
+
+	for (k=chip8_hash_bytes(name, strlen(name)) & mask, n=0; n<=mask && cat->by_name[k];
+		 k=(k + 1) & mask, n++){
+		entry = catalog_get(cat, cat->by_name[k] - 1);
+		if (entry && !strcmp(catalog_name(cat, entry), name)){
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Ritorna la ROM di una voce, direttamente dalla mappatura */
+const uint8_t *catalog_rom(const catalog_t *cat, const catalog_entry_t *entry){
+	return cat->map + entry->rom;
+}
+
+const char *catalog_name(const catalog_t *cat, const catalog_entry_t *entry){
+	return (const char *) cat->map + entry->name;
+}
+
+/* Inserisce la voce idx nell'indice table */
+static void index_insert(uint32_t *table, uint32_t mask, uint64_t hash, uint32_t idx){
+	uint32_t k;
+
+	for (k=hash & mask; table[k]; k=(k + 1) & mask);
+	table[k] = idx + 1;
+}
+
+/* Scrive un catalogo con count voci, i cui nomi e ROM sono in names e
+ * roms; rom e name delle voci vengono calcolati qui. Il file viene
+ * scritto con un nome temporaneo e poi rinominato, quindi chi lo sta
+ * usando continua a vedere quello vecchio
+ * Ritorna non zero in caso di errore */
+int catalog_write(const char *path, const catalog_entry_t *entries, uint32_t count,
+				  const char *const *names, const uint8_t *const *roms){
+	catalog_header_t hdr;
+	catalog_entry_t *out;
+	uint32_t *tables, buckets, k;
+	size_t pos, names_size;
+	char *tmp;
+	FILE *fp;
+	int failed;
+
+	/* Indici pieni al massimo per metà */
+	for (buckets=16; buckets < 2 * (size_t) count; buckets*=2);
+
+	out = malloc((size_t) count * sizeof(catalog_entry_t) + 1);
+	tables = calloc(2 * (size_t) buckets, sizeof(uint32_t));
+	tmp = malloc(strlen(path) + 8);
+	if (!out || !tables || !tmp){
+		err("impossibile allocare memoria");
+		failed = 1;
+		goto done;
+	}
+
+	memcpy(out, entries, (size_t) count * sizeof(catalog_entry_t));
+
+	pos = sizeof(hdr) + (size_t) count * sizeof(catalog_entry_t) + 2 * (size_t) buckets * sizeof(uint32_t);
+	for (k=0, names_size=0; k<count; k++){
+		out[k].name = pos + names_size;
+		names_size += strlen(names[k]) + 1;
+	}
+	pos += names_size;
+
+	for (k=0; k<count; k++){
+		out[k].rom = pos;
+		pos += out[k].len;
+
+		index_insert(tables, buckets - 1, out[k].hash, k);
+		index_insert(tables + buckets, buckets - 1, chip8_hash_bytes(names[k], strlen(names[k])), k);
+	}
+
+	if (pos > UINT32_MAX){
+		fprintf(stderr, "Catalogo troppo grande: %s\n", path);
+		failed = 1;
+		goto done;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CATALOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = CATALOG_VERSION;
+	hdr.count = count;
+	hdr.buckets = buckets;
+	hdr.entry_size = sizeof(catalog_entry_t);
+	hdr.size = pos;
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	if ((fp = fdopen(mkstemp(tmp), "wb")) == NULL){
+		err("impossibile scrivere il catalogo %s", path);
+		failed = 1;
+		goto done;
+	}
+	fchmod(fileno(fp), 0644);
+
+	failed = fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+		|| fwrite(out, sizeof(catalog_entry_t), count, fp) != count
+		|| fwrite(tables, sizeof(uint32_t), 2 * (size_t) buckets, fp) != 2 * (size_t) buckets;
+	for (k=0; k<count && !failed; k++){
+		failed = fwrite(names[k], strlen(names[k]) + 1, 1, fp) != 1;
+	}
+	for (k=0; k<count && !failed; k++){
+		failed = out[k].len && fwrite(roms[k], out[k].len, 1, fp) != 1;
+	}
+
+	if (fclose(fp) || failed || rename(tmp, path)){
+		err("impossibile scrivere il catalogo %s", path);
+		unlink(tmp);
+		failed = 1;
+	}
+
+ done:
+	free(out);
+	free(tables);
+	free(tmp);
+	return failed;
+}
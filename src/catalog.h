@@ -0,0 +1,85 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Catalogo di ROM con le impostazioni di ognuna, scritto da c8cat e
+ * mappato in memoria in sola lettura. Il file contiene:
+ *
+ *   catalog_header_t
+ *   catalog_entry_t    entries[count]
+ *   uint32_t           by_hash[buckets]    indice per hash della ROM
+ *   uint32_t           by_name[buckets]    indice per hash del nome
+ *   nomi, terminati da zero
+ *   ROM
+ *
+ * Gli indici sono tabelle hash ad indirizzamento aperto: ogni elemento
+ * è l'indice della voce più uno, o zero se vuoto. I campi sono
+ * nell'ordine dei byte dell'host, come per la cache delle analisi */
+
+#define CATALOG_MAGIC   "C8CATLOG"
+#define CATALOG_VERSION 1
+
+/* Flag delle voci */
+#define CATALOG_QUIRKS 0x01 /* quirks è indicato */
+#define CATALOG_KEYMAP 0x02 /* keymap è indicata */
+
+typedef struct catalog_header {
+	char magic[8];
+	uint32_t version;       /* CATALOG_VERSION */
+	uint32_t count;         /* Voci nel catalogo */
+	uint32_t buckets;       /* Dimensione degli indici, potenza di due */
+	uint32_t entry_size;    /* sizeof(catalog_entry_t) */
+	uint64_t size;          /* Dimensione del file */
+} catalog_header_t;
+
+typedef struct catalog_entry {
+	uint64_t hash;          /* chip8_hash_bytes della ROM */
+	uint32_t rom;           /* Posizione della ROM nel file */
+	uint32_t name;          /* Posizione del nome nel file */
+	uint16_t len;           /* Lunghezza della ROM */
+	uint16_t speed;         /* Istruzioni per ciclo, 0 se non indicato */
+	uint8_t quirks;         /* CHIP8_QUIRK_*, con CATALOG_QUIRKS */
+	uint8_t flags;          /* CATALOG_* */
+	char keymap[16];        /* Tasto del PC per ogni tasto CHIP-8, con CATALOG_KEYMAP */
+	uint8_t pad[2];
+} catalog_entry_t;
+
+/* Catalogo aperto */
+typedef struct catalog {
+	const uint8_t *map;
+	size_t size;
+	const catalog_header_t *hdr;
+	const catalog_entry_t *entries;
+	const uint32_t *by_hash, *by_name;
+} catalog_t;
+
+extern int catalog_open(catalog_t *cat, const char *path);
+extern void catalog_close(catalog_t *cat);
+extern const catalog_entry_t *catalog_find(const catalog_t *cat, const void *rom, size_t len);
+extern const catalog_entry_t *catalog_find_name(const catalog_t *cat, const char *name);
+extern const catalog_entry_t *catalog_get(const catalog_t *cat, uint32_t idx);
+extern const uint8_t *catalog_rom(const catalog_t *cat, const catalog_entry_t *entry);
+extern const char *catalog_name(const catalog_t *cat, const catalog_entry_t *entry);
+extern int catalog_write(const char *path, const catalog_entry_t *entries, uint32_t count,
+						 const char *const *names, const uint8_t *const *roms);
+
+#endif /* _CATALOG_H_ */
@@ -19,31 +19,189 @@
 #define _CHIP8_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define FONT_ADDR 0x000
 
-typedef struct {
+/* La RAM è divisa in pagine: quelle mai scritte restano condivise
+ * con l'immagine del programma, le altre vengono copiate alla prima
+ * scrittura e diventano private della macchina */
+#define CHIP8_PAGE_SHIFT 8
+#define CHIP8_PAGE_SIZE  (1 << CHIP8_PAGE_SHIFT)
+#define CHIP8_PAGES      (4096 / CHIP8_PAGE_SIZE)
+#define CHIP8_VRAM_SIZE  256
+
+/* Allineamento della macchina ad una linea di cache, e avviso per
+ * chi ignora il risultato di funzioni che possono fallire */
+#ifdef __GNUC__
+#define CHIP8_ALIGNED __attribute__((aligned(64)))
+#define CHIP8_MUST_CHECK __attribute__((warn_unused_result))
+#else
+#define CHIP8_ALIGNED
+#define CHIP8_MUST_CHECK
+#endif
+
+/* Quirk: comportamenti che cambiano tra le varie implementazioni
+ * storiche del CHIP-8, selezionabili per ogni programma */
+#define CHIP8_QUIRK_SHIFT_VY  0x01 /* 8XY6/8XYE spostano V[y] invece di V[x] */
+#define CHIP8_QUIRK_MEM_INC_I 0x02 /* FX55/FX65 incrementano I */
+#define CHIP8_QUIRK_JUMP_VX   0x04 /* BXNN salta a XNN + V[x] invece di NNN + V0 */
+#define CHIP8_QUIRK_CLIP      0x08 /* Gli sprite vengono tagliati ai bordi invece di ripetersi */
+#define CHIP8_QUIRK_VF_RESET  0x10 /* 8XY1/8XY2/8XY3 azzerano VF */
+#define CHIP8_QUIRKS_MAX      0x20 /* Numero di combinazioni possibili */
+
+/* Profili predefiniti */
+#define CHIP8_PROFILE_DEFAULT 0
+#define CHIP8_PROFILE_COSMAC  (CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_MEM_INC_I \
+							   | CHIP8_QUIRK_CLIP | CHIP8_QUIRK_VF_RESET)
+#define CHIP8_PROFILE_SCHIP   (CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP)
+
+/* Motivi di attesa ritornati da chip8_idle */
+#define CHIP8_IDLE_TIMER 0x01 /* Il ciclo aspetta che DT cambi */
+#define CHIP8_IDLE_KEYS  0x02 /* Il ciclo aspetta un tasto */
+#define CHIP8_IDLE_HALT  0x04 /* Il ciclo non finirà mai */
+
+/* Idiomi riconosciuti nel programma ed eseguiti come una sola operazione */
+#define CHIP8_FUSE_SPRITE 1 /* LD I, NNN; ADD I, VX; DRAW */
+#define CHIP8_FUSE_COPY   2 /* LD I, A; LOAD VX; LD I, B; STOR VX */
+#define CHIP8_FUSE_BCD    3 /* BCD VX; LOAD V2 */
+#define CHIP8_FUSE_KINDS  3
+
+struct chip8_machine;
+
+/* Motivi di arresto del debugger, in chip8_debug_t.reason */
+#define CHIP8_BREAK_PC    1 /* Breakpoint sull'indirizzo dell'istruzione */
+#define CHIP8_BREAK_READ  2 /* L'istruzione legge un indirizzo osservato */
+#define CHIP8_BREAK_WRITE 3 /* L'istruzione scrive un indirizzo osservato */
+#define CHIP8_BREAK_COND  4 /* Una condizione sui registri è diventata vera */
+#define CHIP8_BREAK_OVER  5 /* Ritorno dalla CALL saltata con step over */
+
+/* Operatori delle condizioni */
+#define CHIP8_COND_EQ 0
+#define CHIP8_COND_NE 1
+#define CHIP8_COND_LT 2
+#define CHIP8_COND_GT 3
+
+#define CHIP8_COND_I 16     /* Registro I, gli altri sono V0-VF */
+#define CHIP8_DEBUG_CONDS 8
+
+/* Condizione su un registro; scatta quando passa da falsa a vera */
+typedef struct chip8_cond {
+	uint8_t reg;        /* 0-15 per V0-VF, o CHIP8_COND_I */
+	uint8_t op;         /* CHIP8_COND_* */
+	uint8_t was;        /* Valore al controllo precedente */
+	uint16_t value;
+} chip8_cond_t;
+
+/* Stato del debugger: una bitmap da 4096 bit per tipo di controllo.
+ * Finché niente è armato la macchina usa l'interprete normale, vedi
+ * chip8_debug_update */
+typedef struct chip8_debug {
+	uint8_t exec[4096 / 8];     /* Breakpoint sul PC */
+	uint8_t read[4096 / 8];     /* Watchpoint in lettura */
+	uint8_t write[4096 / 8];    /* Watchpoint in scrittura */
+	chip8_cond_t conds[CHIP8_DEBUG_CONDS];
+	unsigned nconds;
+	uint16_t over_pc;           /* Step over: dove fermarsi... */
+	uint8_t over_sp;            /* ...con questo stack pointer */
+	uint8_t over;               /* Non zero se lo step over è attivo */
+	uint8_t skip;               /* La prossima istruzione non viene controllata */
+	unsigned reason;            /* CHIP8_BREAK_* dell'ultimo arresto */
+	uint16_t addr;              /* Indirizzo che l'ha causato */
+} chip8_debug_t;
+
+/* Immagine in sola lettura di font e programma, condivisa da tutte
+ * le macchine che eseguono lo stesso programma */
+typedef struct chip8_image {
+	uint8_t ram[4096];  /* Contenuto iniziale della RAM */
+	uint64_t hash[CHIP8_PAGES]; /* Hash di ogni pagina, vedi chip8_page_hash */
+	uint8_t fuse[4096]; /* Idioma CHIP8_FUSE_* che inizia ad ogni indirizzo */
+	size_t len;         /* Lunghezza del programma */
+	unsigned refs;      /* Macchine che usano l'immagine */
+} chip8_image_t;
+
+/* Variante dell'interprete, specializzata per un insieme di quirk */
+typedef int (*chip8_exec_fn)(struct chip8_machine *ctx);
+
+/* Lo stato della macchina è ordinato per frequenza d'uso: la prima
+ * linea di cache contiene tutto ciò che serve ad ogni istruzione, le
+ * due successive la tabella delle pagine; VRAM e pagine private sono
+ * blocchi da 256 byte presi da un pool, così quando si eseguono molte
+ * macchine a turno ognuna tocca poche linee di cache. Un blocco
+ * liberato va nella lista del thread che lo libera, anche se l'aveva
+ * preso un altro thread; l'eccesso passa alla lista condivisa */
+typedef struct chip8_machine {
+	/* Prima linea: stato usato ad ogni istruzione */
 	uint8_t v[16];      /* Registri V0-VF */
 	uint16_t i;         /* Registro I */
+	uint16_t pc;        /* Program counter */
+	uint8_t sp;         /* Stack pointer */
 	uint8_t dt, st;     /* Delay timer e sound timer */
-	unsigned sp, pc;    /* Stack pointer e program counter */
-	uint16_t stack[16]; /* Stack */
-	uint8_t ram[4096];  /* RAM */
-	uint8_t vram[256];  /* Memoria video (VRAM) */
-	int wait;           /* Non zero se in attesa di input */
-	int drawn;          /* Non zero se lo schermo va aggiornato */
+	uint8_t wait;       /* Non zero se in attesa di input */
+	uint8_t drawn;      /* Non zero se lo schermo va aggiornato */
 	uint8_t last_key;   /* Primo tasto premuto se in attesa */
+	uint16_t dirty;     /* Pagine private, un bit per pagina */
+	uint32_t rng;       /* Stato del generatore pseudocasuale */
+	unsigned quirks;    /* Quirk attive */
+	uint8_t retired;    /* Istruzioni eseguite dall'ultimo chip8_exec */
+	uint8_t vram_hashed; /* Non zero se vram_hash vale per la VRAM */
+	uint16_t hashed;    /* Pagine private con page_hash valido */
+	chip8_exec_fn exec; /* Variante dell'interprete per le quirk attive */
+	uint8_t *vram;      /* Memoria video (VRAM), CHIP8_VRAM_SIZE byte */
+	chip8_image_t *image; /* Immagine del programma, o NULL */
+
+	/* Seconda e terza linea: pagine di RAM, condivise o private */
+	const uint8_t *pages[CHIP8_PAGES];
+
+	/* Stato usato solo da alcune istruzioni */
+	uint16_t stack[16]; /* Stack */
 	uint8_t keys[16];   /* Stato della tastiera */
-} chip8_machine_t;
+	uint32_t fused[CHIP8_FUSE_KINDS]; /* Idiomi eseguiti, per tipo */
+
+	/* Hash già calcolati da chip8_hash, validi secondo hashed e
+	 * vram_hashed; chi scrive la VRAM senza chip8_exec azzera vram_hashed */
+	uint64_t page_hash[CHIP8_PAGES];
+	uint64_t vram_hash;
+
+	/* Usato solo dalla variante di debug dell'interprete */
+	struct chip8_debug *debug; /* Breakpoint e watchpoint, o NULL */
+} CHIP8_ALIGNED chip8_machine_t;
 
 extern const uint8_t font[80];
 
+/* Legge un byte della RAM */
+static inline uint8_t chip8_peek(const chip8_machine_t *ctx, uint16_t addr){
+	return ctx->pages[(addr >> CHIP8_PAGE_SHIFT) & (CHIP8_PAGES - 1)][addr & (CHIP8_PAGE_SIZE - 1)];
+}
+
 /* Funzioni da cpu.c */
+extern int chip8_try_init(chip8_machine_t *ctx) CHIP8_MUST_CHECK;
 extern void chip8_init(chip8_machine_t *ctx);
 extern int chip8_load(chip8_machine_t *ctx, const void *prog, size_t len);
+extern void chip8_release(chip8_machine_t *ctx);
+extern chip8_image_t *chip8_image_new(const void *prog, size_t len);
+extern void chip8_image_release(chip8_image_t *image);
+extern void chip8_image_update(chip8_image_t *image, const void *prog, size_t len);
+extern void chip8_attach(chip8_machine_t *ctx, chip8_image_t *image);
+extern int chip8_poke(chip8_machine_t *ctx, uint16_t addr, uint8_t value);
 extern void chip8_pressed(chip8_machine_t *ctx, uint8_t key);
 extern void chip8_update_keys(chip8_machine_t *ctx, const uint8_t *keys);
 extern int chip8_update_timers(chip8_machine_t *ctx, long delta);
 extern int chip8_exec(chip8_machine_t *ctx);
+extern unsigned chip8_idle(const chip8_machine_t *ctx);
+extern const char *chip8_fuse_name(unsigned kind);
+extern chip8_exec_fn chip8_exec_variant(unsigned quirks);
+extern void chip8_set_quirks(chip8_machine_t *ctx, unsigned quirks);
+extern int chip8_parse_quirks(const char *str, unsigned *quirks);
+extern void chip8_seed(chip8_machine_t *ctx, uint32_t seed);
+extern int chip8_fork(chip8_machine_t *dst, const chip8_machine_t *src);
+extern int chip8_copy(chip8_machine_t *dst, const chip8_machine_t *src);
+extern void chip8_reset(chip8_machine_t *ctx, uint32_t seed);
+extern int chip8_patch(chip8_machine_t *ctx, const void *prog, size_t len);
+extern void chip8_debug_attach(chip8_machine_t *ctx, chip8_debug_t *debug);
+extern void chip8_debug_update(chip8_machine_t *ctx);
+extern void chip8_debug_mark(uint8_t *map, uint16_t start, uint16_t end, int on);
+extern int chip8_debug_add_cond(chip8_machine_t *ctx, uint8_t reg, uint8_t op, uint16_t value);
+extern int chip8_debug_step(chip8_machine_t *ctx);
 
 #endif /* _CHIP8_H_ */
@@ -0,0 +1,334 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "as.h"
+#include "catalog.h"
+
+/* Analisi di molte ROM in parallelo: ogni thread prende la prossima ROM
+ * dalla lista, la disassembla in memoria e prepara la sua parte del
+ * rapporto JSON; alla fine le parti vengono scritte in ordine */
+
+struct corpus_job {
+	const char *file;
+	const uint8_t *rom;     /* ROM già in memoria, dal catalogo */
+	size_t size;
+	int failed;
+	struct chip8_dis_stats stats;
+	outbuf_t json;
+};
+
+struct corpus {
+	struct corpus_job *jobs;
+	int count;
+	int next;               /* Prossima ROM da analizzare */
+	const char *dir;        /* Directory dei sorgenti, o NULL */
+};
+
+/* Scrive str come stringa JSON */
+static void json_string(outbuf_t *ob, const char *str){
+	outbuf_putc(ob, '"');
+	for (; *str; str++){
+		if (*str == '"' || *str == '\\'){
+			outbuf_putc(ob, '\\');
+			outbuf_putc(ob, *str);
+		} else if ((unsigned char) *str < 0x20){
+			outbuf_puts(ob, "\\u00");
+			outbuf_hex(ob, (unsigned char) *str, 2);
+		} else {
+			outbuf_putc(ob, *str);
+		}
+	}
+	outbuf_putc(ob, '"');
+}
+
+/* Scrive l'istogramma delle classi di istruzioni come oggetto JSON */
+static void json_hist(outbuf_t *ob, const unsigned long *hist){
+	unsigned cls;
+	int first;
+
+	outbuf_putc(ob, '{');
+	for (cls=0, first=1; cls<CHIP8_CLASSES; cls++){
+		if (!hist[cls]){
+			continue;
+		}
+		if (!first){
+			outbuf_puts(ob, ", ");
+		}
+		first = 0;
+		json_string(ob, chip8_class_name(cls));
+		outbuf_puts(ob, ": ");
+		outbuf_dec(ob, hist[cls]);
+	}
+	outbuf_putc(ob, '}');
+}
+
+/* Scrive il sorgente disassemblato in DIR/NOME.asm */
+static int save_source(const char *dir, const char *file, outbuf_t *src){
+	const char *base;
+	char *path;
+	FILE *fp;
+	int ret;
+
+	base = strrchr(file, '/');
+	base = base ? base + 1 : file;
+
+	if ((path = malloc(strlen(dir) + strlen(base) + 6)) == NULL){
+		return 1;
+	}
+	sprintf(path, "%s/%s.asm", dir, base);
+
+	ret = 1;
+	if ((fp = fopen(path, "w")) == NULL){
+		err("impossibile scrivere il file %s", path);
+	} else {
+		src->fp = fp;
+		ret = outbuf_flush(src);
+		src->fp = NULL;
+		if (fclose(fp) || ret){
+			err("impossibile scrivere il file %s", path);
+			ret = 1;
+		}
+	}
+
+	free(path);
+	return ret;
+}
+
+/* Analizza una ROM */
+static void corpus_run(struct corpus *corpus, struct corpus_job *job, uint8_t *prog){
+	const uint8_t *rom;
+	outbuf_t src;
+	outbuf_t *ob;
+
+	ob = &job->json;
+	job->failed = 1;
+
+	if (outbuf_init(ob, NULL, 1024)){
+		return;
+	}
+
+	outbuf_puts(ob, "    {\"name\": ");
+	json_string(ob, job->file);
+
+	if (job->rom){
+		rom = job->rom;
+	} else if ((job->size = read_file(job->file, prog, 0x0E00)) != 0){
+		rom = prog;
+	} else {
+		outbuf_puts(ob, ", \"error\": true}");
+		return;
+	}
+
+	if (outbuf_init(&src, NULL, 65536)){
+		outbuf_puts(ob, ", \"error\": true}");
+		return;
+	}
+
+	if (chip8_disassemble(rom, job->size, job->file, &src, &job->stats)
+		|| (corpus->dir && save_source(corpus->dir, job->file, &src))){
+		outbuf_free(&src);
+		outbuf_puts(ob, ", \"error\": true}");
+		return;
+	}
+
+	outbuf_free(&src);
+
+	outbuf_puts(ob, ", \"size\": ");
+	outbuf_dec(ob, job->size);
+	outbuf_puts(ob, ", \"blocks\": ");
+	outbuf_dec(ob, job->stats.blocks);
+	outbuf_puts(ob, ", \"procs\": ");
+	outbuf_dec(ob, job->stats.procs);
+	outbuf_puts(ob, ", \"calls\": ");
+	outbuf_dec(ob, job->stats.calls);
+	outbuf_puts(ob, ", \"code\": ");
+	outbuf_dec(ob, job->stats.code);
+	outbuf_puts(ob, ", \"data\": ");
+	outbuf_dec(ob, job->stats.data);
+	outbuf_puts(ob, ",\n     \"classes\": ");
+	json_hist(ob, job->stats.hist);
+	outbuf_putc(ob, '}');
+
+	job->failed = ob->error;
+}
+
+/* Thread di lavoro: analizza ROM finché ce ne sono */
+static void *corpus_worker(void *arg){
+	struct corpus *corpus;
+	uint8_t *prog;
+	int idx;
+
+	corpus = arg;
+	if ((prog = malloc(0x0E00)) == NULL){
+		return NULL;
+	}
+
+	while ((idx = __sync_fetch_and_add(&corpus->next, 1)) < corpus->count){
+		corpus_run(corpus, &corpus->jobs[idx], prog);
+	}
+
+	free(prog);
+	return NULL;
+}
+
+/* Disassembla le count ROM in files con threads thread (0 per usarne uno
+ * per CPU) e scrive un rapporto JSON in outfile; se dir non è NULL vi
+ * scrive anche i sorgenti. Con cat non NULL vengono invece analizzate
+ * tutte le ROM del catalogo, senza leggere file.
+ * Ritorna non zero se qualche ROM non è stata analizzata */
+int asm_corpus(const char *outfile, const char *dir, unsigned threads,
+			   char **files, int count, const catalog_t *cat){
+	const catalog_entry_t *entry;
+	struct corpus corpus;
+	struct chip8_dis_stats total;
+	pthread_t *tids;
+	outbuf_t ob;
+	unsigned started, t, cls;
+	int i, failed;
+	FILE *out;
+
+	if (!threads){
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	}
+	if (threads > (unsigned) count){
+		threads = count;
+	}
+
+	corpus.jobs = calloc(count, sizeof(struct corpus_job));
+	tids = malloc(threads * sizeof(pthread_t));
+	corpus.count = count;
+	corpus.next = 0;
+	corpus.dir = dir;
+
+	if (!corpus.jobs || !tids){
+		err("impossibile allocare memoria");
+		free(corpus.jobs);
+		free(tids);
+		return 1;
+	}
+
+	for (i=0; i<count; i++){
+		if (!cat){
+			corpus.jobs[i].file = files[i];
+		} else if ((entry = catalog_get(cat, i)) != NULL){
+			corpus.jobs[i].file = catalog_name(cat, entry);
+			corpus.jobs[i].rom = catalog_rom(cat, entry);
+			corpus.jobs[i].size = entry->len;
+		} else {
+			corpus.jobs[i].file = "";
+		}
+	}
+
+	/* Se un thread non parte, gli altri si divideranno il lavoro */
+	for (started=0; started<threads; started++){
+		if (pthread_create(&tids[started], NULL, corpus_worker, &corpus)){
+			break;
+		}
+	}
+
+	if (!started){
+		corpus_worker(&corpus);
+	}
+
+	for (t=0; t<started; t++){
+		pthread_join(tids[t], NULL);
+	}
+
+	free(tids);
+
+	if ((out = fopen(outfile, "w")) == NULL || outbuf_init(&ob, out, 65536)){
+		err("impossibile scrivere il file %s", outfile);
+		if (out){
+			fclose(out);
+		}
+		goto fail;
+	}
+
+	memset(&total, 0, sizeof(total));
+	failed = 0;
+
+	outbuf_puts(&ob, "{\n  \"roms\": [\n");
+	for (i=0; i<count; i++){
+		if (corpus.jobs[i].json.data){
+			outbuf_write(&ob, corpus.jobs[i].json.data, corpus.jobs[i].json.used);
+		} else {
+			outbuf_puts(&ob, "    {\"name\": ");
+			json_string(&ob, corpus.jobs[i].file);
+			outbuf_puts(&ob, ", \"error\": true}");
+		}
+		outbuf_puts(&ob, i + 1 < count ? ",\n" : "\n");
+
+		if (corpus.jobs[i].failed){
+			failed++;
+			continue;
+		}
+
+		total.code += corpus.jobs[i].stats.code;
+		total.data += corpus.jobs[i].stats.data;
+		for (cls=0; cls<CHIP8_CLASSES; cls++){
+			total.hist[cls] += corpus.jobs[i].stats.hist[cls];
+		}
+	}
+
+	outbuf_puts(&ob, "  ],\n  \"total\": {\"roms\": ");
+	outbuf_dec(&ob, count - failed);
+	outbuf_puts(&ob, ", \"failed\": ");
+	outbuf_dec(&ob, failed);
+	outbuf_puts(&ob, ", \"code\": ");
+	outbuf_dec(&ob, total.code);
+	outbuf_puts(&ob, ", \"data\": ");
+	outbuf_dec(&ob, total.data);
+	outbuf_puts(&ob, ",\n    \"classes\": ");
+	json_hist(&ob, total.hist);
+	outbuf_puts(&ob, "}\n}\n");
+
+	if (outbuf_flush(&ob) | fclose(out)){
+		err("impossibile scrivere il file %s", outfile);
+		outbuf_free(&ob);
+		goto fail;
+	}
+
+	outbuf_free(&ob);
+
+	for (i=0; i<count; i++){
+		outbuf_free(&corpus.jobs[i].json);
+	}
+	free(corpus.jobs);
+
+	fprintf(stderr, "Analizzate %d ROM con %u thread", count - failed, started ? started : 1);
+	if (failed){
+		fprintf(stderr, ", %d non riuscite", failed);
+	}
+	fprintf(stderr, "\n");
+
+	return failed != 0;
+
+ fail:
+	for (i=0; i<count; i++){
+		outbuf_free(&corpus.jobs[i].json);
+	}
+	free(corpus.jobs);
+	return 1;
+}
@@ -15,59 +15,621 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <stdlib.h> /* srand, rand */
-#include <string.h> /* memset, memcpy */
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* malloc, free, abort */
+#include <string.h> /* memset, memcpy, strcmp */
 #include <stdint.h> /* uint8_t, uint16_t */
 #include <time.h> /* time */
+#include <pthread.h> /* pool condiviso tra i thread */
 
 #include "chip8.h"
+#include "state.h"
 #include "util.h"
 
-const uint8_t font[80] = {
-	0xF0, 0x90, 0x90, 0x90, 0xF0,
-	0x20, 0x60, 0x20, 0x20, 0x70,
-	0xF0, 0x10, 0xF0, 0x80, 0xF0,
-	0xF0, 0x10, 0xF0, 0x10, 0xF0,
-	0x90, 0x90, 0xF0, 0x10, 0x10,
-	0xF0, 0x80, 0xF0, 0x10, 0xF0,
-	0xF0, 0x80, 0xF0, 0x90, 0xF0,
-	0xF0, 0x10, 0x20, 0x40, 0x40,
-	0xF0, 0x90, 0xF0, 0x90, 0xF0,
-	0xF0, 0x90, 0xF0, 0x10, 0xF0,
-	0xF0, 0x90, 0xF0, 0x90, 0x90,
-	0xE0, 0x90, 0xE0, 0x90, 0xE0,
-	0xF0, 0x80, 0x80, 0x80, 0xF0,
-	0xE0, 0x90, 0x90, 0x90, 0xE0,
-	0xF0, 0x80, 0xF0, 0x80, 0xF0,
+/* Il font di sistema, usato sia da solo che come inizio di ogni immagine */
+#define FONT_DATA \
+	0xF0, 0x90, 0x90, 0x90, 0xF0, \
+	0x20, 0x60, 0x20, 0x20, 0x70, \
+	0xF0, 0x10, 0xF0, 0x80, 0xF0, \
+	0xF0, 0x10, 0xF0, 0x10, 0xF0, \
+	0x90, 0x90, 0xF0, 0x10, 0x10, \
+	0xF0, 0x80, 0xF0, 0x10, 0xF0, \
+	0xF0, 0x80, 0xF0, 0x90, 0xF0, \
+	0xF0, 0x10, 0x20, 0x40, 0x40, \
+	0xF0, 0x90, 0xF0, 0x90, 0xF0, \
+	0xF0, 0x90, 0xF0, 0x10, 0xF0, \
+	0xF0, 0x90, 0xF0, 0x90, 0x90, \
+	0xE0, 0x90, 0xE0, 0x90, 0xE0, \
+	0xF0, 0x80, 0x80, 0x80, 0xF0, \
+	0xE0, 0x90, 0x90, 0x90, 0xE0, \
+	0xF0, 0x80, 0xF0, 0x80, 0xF0, \
 	0xF0, 0x80, 0xF0, 0x80, 0x80
-};
 
-/* Inizializza una macchina CHIP-8 */
-void chip8_init(chip8_machine_t *ctx){
+const uint8_t font[80] = { FONT_DATA };
+
+/* Immagine con il solo font, usata dalle macchine senza programma;
+ * il font di sistema può avere una posizione in memoria in base
+ * all'implementazione, nel nostro caso si troverà a 0x000 */
+static const chip8_image_t blank_image = { .ram = { FONT_DATA } };
+
+/* Pool di blocchi da 256 byte per VRAM e pagine private: ogni thread
+ * tiene una piccola lista di blocchi liberi, usata senza lock; quando
+ * supera POOL_CACHE blocchi metà passa alla lista condivisa, e quando è
+ * vuota ne riprende da lì prima di allocare un nuovo gruppo. Così un
+ * blocco liberato da un thread diverso da quello che l'ha preso torna
+ * comunque a disposizione di tutti, e la memoria del pool resta quella
+ * del massimo di blocchi usati insieme. All'uscita di un thread la sua
+ * lista passa a quella condivisa. I gruppi nuovi sono allineati alle
+ * linee di cache; la memoria del pool non viene restituita al sistema */
+#define POOL_BLOCK CHIP8_PAGE_SIZE /* Uguale a CHIP8_VRAM_SIZE */
+#define POOL_SLAB  64       /* Blocchi allocati insieme */
+#define POOL_CACHE 128      /* Blocchi liberi tenuti da ogni thread */
+
+typedef union pool_block {
+	union pool_block *next;
+	uint8_t data[POOL_BLOCK];
+} pool_block_t;
+
+static __thread pool_block_t *pool_free;
+static __thread unsigned pool_count;
+static __thread int pool_registered;
+
+static pool_block_t *pool_shared;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* Passa alla lista condivisa count blocchi della lista del thread */
+static void pool_give(unsigned count){
+	pool_block_t *first, *last;
+	unsigned k;
+
+	first = last = pool_free;
+	for (k=1; k<count; k++){
+		last = last->next;
+	}
+	pool_free = last->next;
+	pool_count -= count;
+
+	pthread_mutex_lock(&pool_lock);
+	last->next = pool_shared;
+	pool_shared = first;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* All'uscita di un thread i suoi blocchi liberi non vanno persi */
+static void pool_exit(void *arg){
+	(void) arg;
+
+	if (pool_count){
+		pool_give(pool_count);
+	}
+}
+
+static void pool_init(void){
+	pthread_key_create(&pool_key, pool_exit);
+}
+
+/* Registra il thread perché pool_exit venga chiamata alla sua uscita */
+static void pool_register(void){
+	pthread_once(&pool_once, pool_init);
+	pthread_setspecific(pool_key, &pool_registered);
+	pool_registered = 1;
+}
+
+/* Ritorna un blocco di POOL_BLOCK byte, o NULL se la memoria è esaurita */
+static uint8_t *block_alloc(void){
+	pool_block_t *block, *slab;
+	unsigned k;
+
+	if (!pool_free){
+		if (!pool_registered){
+			pool_register();
+		}
+
+		/* Prima i blocchi liberati da altri thread */
+		pthread_mutex_lock(&pool_lock);
+		for (k=0; k<POOL_CACHE / 2 && pool_shared; k++){
+			block = pool_shared;
+			pool_shared = block->next;
+			block->next = pool_free;
+			pool_free = block;
+		}
+		pthread_mutex_unlock(&pool_lock);
+		pool_count = k;
+	}
+
+	if (!pool_free){
+		if (posix_memalign((void **) &slab, 64, POOL_SLAB * sizeof(pool_block_t))){
+			return NULL;
+		}
+
+		for (k=0; k<POOL_SLAB - 1; k++){
+			slab[k].next = &slab[k + 1];
+		}
+		slab[POOL_SLAB - 1].next = NULL;
+		pool_free = slab;
+		pool_count = POOL_SLAB;
+	}
+
+	block = pool_free;
+	pool_free = block->next;
+	pool_count--;
+
+	return block->data;
+}
+
+/* Rimette un blocco nel pool, anche se preso da un altro thread: va
+ * nella lista del thread che lo libera, e l'eccesso in quella condivisa */
+static void block_free(uint8_t *data){
+	pool_block_t *block;
+
+	if (!data){
+		return;
+	}
+
+	if (!pool_registered){
+		pool_register();
+	}
+
+	block = (pool_block_t *) data;
+	block->next = pool_free;
+	pool_free = block;
+
+	if (++pool_count > POOL_CACHE){
+		pool_give(POOL_CACHE / 2);
+	}
+}
+
+/* Fa puntare tutte le pagine della macchina all'immagine */
+static void map_image(chip8_machine_t *ctx, const chip8_image_t *image){
+	unsigned page;
+
+	for (page=0; page<CHIP8_PAGES; page++){
+		ctx->pages[page] = image->ram + page * CHIP8_PAGE_SIZE;
+	}
+}
+
+/* Libera le pagine private, tornando a quelle dell'immagine */
+static void drop_pages(chip8_machine_t *ctx){
+	unsigned page;
+
+	for (page=0; page<CHIP8_PAGES; page++){
+		if (ctx->dirty & (1u << page)){
+			block_free((uint8_t *) ctx->pages[page]);
+		}
+	}
+
+	ctx->dirty = 0;
+	ctx->hashed = 0;
+	map_image(ctx, ctx->image ? ctx->image : &blank_image);
+}
+
+/* Rende privata una pagina copiandola, prima di scriverci
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita */
+static int own_page(chip8_machine_t *ctx, unsigned page){
+	uint8_t *copy;
+
+	if ((copy = block_alloc()) == NULL){
+		return -1;
+	}
+
+	memcpy(copy, ctx->pages[page], CHIP8_PAGE_SIZE);
+	ctx->pages[page] = copy;
+	ctx->dirty |= 1u << page;
+
+	return 0;
+}
+
+/* Rende private le pagine che contengono i count byte a partire da addr,
+ * che verranno scritte: il loro hash non vale più
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita */
+static inline int own_range(chip8_machine_t *ctx, uint16_t addr, unsigned count){
+	unsigned page, last;
+
+	page = (addr & 0x0FFF) >> CHIP8_PAGE_SHIFT;
+	last = ((addr + count - 1) & 0x0FFF) >> CHIP8_PAGE_SHIFT;
+
+	for (;; page=(page + 1) % CHIP8_PAGES){
+		if (!(ctx->dirty & (1u << page)) && own_page(ctx, page)){
+			return -1;
+		}
+		ctx->hashed &= ~(1u << page);
+		if (page == last){
+			return 0;
+		}
+	}
+}
+
+/* Scrive in una pagina già resa privata */
+static inline void poke_owned(chip8_machine_t *ctx, uint16_t addr, uint8_t value){
+	((uint8_t *) ctx->pages[(addr >> CHIP8_PAGE_SHIFT) & (CHIP8_PAGES - 1)])[addr & (CHIP8_PAGE_SIZE - 1)] = value;
+}
+
+/* Scrive un byte della RAM, copiando la pagina se è ancora condivisa
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita */
+int chip8_poke(chip8_machine_t *ctx, uint16_t addr, uint8_t value){
+	if (own_range(ctx, addr, 1)){
+		return -1;
+	}
+
+	poke_owned(ctx, addr, value);
+	return 0;
+}
+
+/* Generatore pseudocasuale xorshift32: lo stato è nella macchina,
+ * così che una copia prosegua con la stessa sequenza */
+static inline uint32_t next_random(chip8_machine_t *ctx){
+	uint32_t x;
+
+	x = ctx->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return ctx->rng = x;
+}
+
+/* Imposta il seme del generatore pseudocasuale, per avere esecuzioni
+ * ripetibili */
+void chip8_seed(chip8_machine_t *ctx, uint32_t seed){
+	/* Lo stato di xorshift non può essere zero */
+	ctx->rng = seed ? seed : 0x9E3779B9;
+}
+
+/* Inizializza una macchina CHIP-8 con il solo font in memoria,
+ * va liberata con chip8_release
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita */
+int chip8_try_init(chip8_machine_t *ctx){
 	memset(ctx, 0, sizeof(chip8_machine_t));
 
+	if ((ctx->vram = block_alloc()) == NULL){
+		return -1;
+	}
+	memset(ctx->vram, 0, CHIP8_VRAM_SIZE);
+
 	/* I programmi CHIP-8 iniziano all'indirizzo 0x200 */
 	ctx->pc = 0x200;
+	chip8_seed(ctx, (uint32_t) time(NULL));
+
+	map_image(ctx, &blank_image);
 
-	/* Il font di sistema può avere una posizione in memoria in base
-	 * all'implementazione, nel nostro caso si troverà a 0x000 */
-	memcpy(ctx->ram + FONT_ADDR, font, sizeof(font));
+	chip8_set_quirks(ctx, CHIP8_PROFILE_DEFAULT);
+
+	return 0;
 }
 
-/* Carica un programma CHIP-8 in memoria, tagliandolo se necessario
- * Ritorna 0 se il programma è stato caricato interamente,
- * o 1 se è stato tagliato */
-int chip8_load(chip8_machine_t *ctx, const void *prog, size_t len){
-	size_t actual;
+/* Come chip8_try_init, per il codice scritto quando l'inizializzazione
+ * non poteva fallire: se la memoria è esaurita termina il processo */
+void chip8_init(chip8_machine_t *ctx){
+	if (chip8_try_init(ctx)){
+		fprintf(stderr, "chip8_init: memoria esaurita\n");
+		abort();
+	}
+}
+
+/* Libera le pagine private e il riferimento all'immagine,
+ * lasciando in memoria il solo font */
+static void detach(chip8_machine_t *ctx){
+	chip8_image_t *image;
+
+	image = ctx->image;
+	ctx->image = NULL;
+	drop_pages(ctx);
+	chip8_image_release(image);
+}
+
+/* Libera la memoria della macchina: VRAM, pagine private e il
+ * riferimento all'immagine */
+void chip8_release(chip8_machine_t *ctx){
+	detach(ctx);
+	block_free(ctx->vram);
+	ctx->vram = NULL;
+}
+
+/* Cerca nel programma gli idiomi da eseguire come una sola operazione,
+ * scrivendoli nella tabella fuse dell'immagine */
+static void find_idioms(chip8_image_t *image){
+	uint16_t addr, op[4];
+	unsigned k;
+
+	memset(image->fuse, 0, sizeof(image->fuse));
+
+	/* Gli idiomi sono lunghi al massimo 8 byte e devono stare in RAM;
+	 * le istruzioni possono iniziare anche ad indirizzi dispari */
+	for (addr=0x200; addr<0x200 + image->len && addr + 4 <= 0x1000; addr++){
+		for (k=0; k<4; k++){
+			op[k] = (addr + 2 * k + 1 < 0x1000)
+				? (image->ram[addr + 2 * k] << 8) | image->ram[addr + 2 * k + 1] : 0;
+		}
+
+		if ((op[0] & 0xF000) == 0xA000 && (op[1] & 0xF0FF) == 0xF01E
+			&& (op[2] & 0xF000) == 0xD000 && addr + 6 <= 0x1000){
+			image->fuse[addr] = CHIP8_FUSE_SPRITE;
+		} else if ((op[0] & 0xF000) == 0xA000 && (op[1] & 0xF0FF) == 0xF065
+				   && (op[2] & 0xF000) == 0xA000 && (op[3] & 0xF0FF) == 0xF055
+				   && (op[1] & 0x0F00) == (op[3] & 0x0F00) && addr + 8 <= 0x1000){
+			image->fuse[addr] = CHIP8_FUSE_COPY;
+		} else if ((op[0] & 0xF0FF) == 0xF033 && op[1] == 0xF265){
+			image->fuse[addr] = CHIP8_FUSE_BCD;
+		}
+	}
+}
+
+/* Scrive il programma nell'immagine, tagliandolo se necessario; la RAM
+ * oltre i primi old byte del programma precedente è già a zero */
+static void fill_image(chip8_image_t *image, const void *prog, size_t len, size_t old){
+	unsigned page, last;
 
 	/* Abbiamo solo 0x1000 - 0x200 = 0xE00 byte di RAM,
 	 * se len è maggiore limitiamoci a quelli. */
-	actual = (len > 0x0E00) ? 0x0E00 : len;
+	image->len = (len > 0x0E00) ? 0x0E00 : len;
+
+	memcpy(image->ram + 0x200, prog, image->len);
+	if (old > image->len){
+		memset(image->ram + 0x200 + image->len, 0, old - image->len);
+	}
+
+	/* Vanno ricalcolati solo gli hash delle pagine cambiate */
+	last = (0x200 + ((old > image->len) ? old : image->len) + CHIP8_PAGE_SIZE - 1) >> CHIP8_PAGE_SHIFT;
+	for (page=0x200 >> CHIP8_PAGE_SHIFT; page<last && page<CHIP8_PAGES; page++){
+		image->hash[page] = chip8_page_hash(image->ram + page * CHIP8_PAGE_SIZE);
+	}
+
+	find_idioms(image);
+}
+
+/* Crea un'immagine con font e programma, tagliandolo se necessario;
+ * l'immagine appartiene al chiamante, che la libera con chip8_image_release
+ * Ritorna NULL se la memoria è esaurita */
+chip8_image_t *chip8_image_new(const void *prog, size_t len){
+	chip8_image_t *image;
+	unsigned page;
+
+	if ((image = malloc(sizeof(chip8_image_t))) == NULL){
+		return NULL;
+	}
+
+	image->refs = 1;
+
+	memcpy(image->ram, blank_image.ram, 0x200);
+	for (page=0; page<(0x200 >> CHIP8_PAGE_SHIFT); page++){
+		image->hash[page] = chip8_page_hash(image->ram + page * CHIP8_PAGE_SIZE);
+	}
+
+	fill_image(image, prog, len, 0x0E00);
+
+	return image;
+}
+
+/* Sostituisce il programma di un'immagine senza allocarne un'altra,
+ * riscrivendo solo i byte cambiati di lunghezza; le macchine che la
+ * usano vanno riportate all'inizio con chip8_reset, e nessun altro
+ * deve eseguirla o averne uno snapshot. Serve a chi prova moltissimi
+ * programmi uno dopo l'altro sulla stessa macchina, come il fuzzer */
+void chip8_image_update(chip8_image_t *image, const void *prog, size_t len){
+	fill_image(image, prog, len, image->len);
+}
+
+/* Sostituisce il programma di una macchina in esecuzione lasciando
+ * registri, stack, timer e VRAM come sono: le pagine condivise passano
+ * ad una nuova immagine, in quelle private vengono riscritti solo i
+ * byte diversi tra il vecchio programma e il nuovo, così i dati scritti
+ * dal programma durante l'esecuzione restano. PC e stack vanno
+ * sistemati dal chiamante se il codice si è spostato
+ * Ritorna il numero di byte cambiati, -1 se la memoria è esaurita */
+int chip8_patch(chip8_machine_t *ctx, const void *prog, size_t len){
+	const chip8_image_t *old;
+	chip8_image_t *image;
+	const uint8_t *a, *b;
+	unsigned page, k;
+	int changed;
+
+	if ((image = chip8_image_new(prog, len)) == NULL){
+		return -1;
+	}
+
+	old = ctx->image ? ctx->image : &blank_image;
+	changed = 0;
+
+	for (page=0; page<CHIP8_PAGES; page++){
+		a = old->ram + page * CHIP8_PAGE_SIZE;
+		b = image->ram + page * CHIP8_PAGE_SIZE;
+
+		if (!(ctx->dirty & (1u << page))){
+			ctx->pages[page] = b;
+		}
+
+		if (old->hash[page] == image->hash[page] && !memcmp(a, b, CHIP8_PAGE_SIZE)){
+			continue;
+		}
+
+		for (k=0; k<CHIP8_PAGE_SIZE; k++){
+			if (a[k] != b[k]){
+				changed++;
+				if (ctx->dirty & (1u << page)){
+					((uint8_t *) ctx->pages[page])[k] = b[k];
+					ctx->hashed &= ~(1u << page);
+				}
+			}
+		}
+	}
+
+	/* Il riferimento di chip8_image_new passa alla macchina */
+	chip8_image_release(ctx->image);
+	ctx->image = image;
+
+	return changed;
+}
+
+/* Rilascia un riferimento all'immagine, liberandola con l'ultimo;
+ * può essere chiamata da più thread */
+void chip8_image_release(chip8_image_t *image){
+	if (image && !__sync_sub_and_fetch(&image->refs, 1)){
+		free(image);
+	}
+}
+
+/* Fa usare l'immagine alla macchina, che ne prende un riferimento;
+ * la memoria privata e l'immagine precedente vengono rilasciate */
+void chip8_attach(chip8_machine_t *ctx, chip8_image_t *image){
+	__sync_add_and_fetch(&image->refs, 1);
+	detach(ctx);
+	ctx->image = image;
+	map_image(ctx, image);
+}
+
+/* Copia la macchina src in dst, che non deve essere inizializzata:
+ * l'immagine resta condivisa e vengono copiate solo le pagine private,
+ * così il costo dipende dalle pagine scritte e non dalla RAM intera.
+ * Anche la VRAM viene copiata.
+ * dst va liberata con chip8_release; più thread possono copiare la
+ * stessa macchina se nessuno la sta eseguendo o ne calcola lo hash
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita */
+int chip8_fork(chip8_machine_t *dst, const chip8_machine_t *src){
+	uint8_t *copy;
+	unsigned page;
+
+	memcpy(dst, src, sizeof(chip8_machine_t));
+
+	/* Il debugger resta della macchina originale */
+	if (dst->debug){
+		chip8_debug_attach(dst, NULL);
+	}
+
+	if (dst->image){
+		__sync_add_and_fetch(&dst->image->refs, 1);
+	}
+
+	if ((dst->vram = block_alloc()) == NULL){
+		dst->dirty = 0;
+		chip8_release(dst);
+		return -1;
+	}
+	memcpy(dst->vram, src->vram, CHIP8_VRAM_SIZE);
+
+	for (page=0; page<CHIP8_PAGES; page++){
+		if (!(src->dirty & (1u << page))){
+			continue;
+		}
+
+		if ((copy = block_alloc()) == NULL){
+			/* Le pagine non ancora copiate sono ancora di src */
+			dst->dirty &= (1u << page) - 1;
+			chip8_release(dst);
+			return -1;
+		}
+
+		memcpy(copy, src->pages[page], CHIP8_PAGE_SIZE);
+		dst->pages[page] = copy;
+	}
+
+	return 0;
+}
+
+/* Come chip8_fork, ma dst è già una macchina inizializzata e i suoi
+ * blocchi vengono riusati: la VRAM e le pagine private di entrambe
+ * vengono sovrascritte, quelle solo di dst tornano al pool. Serve a
+ * chi salva e ripristina lo stato ad ogni frame, come il run-ahead
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita; in quel
+ * caso dst resta com'era */
+int chip8_copy(chip8_machine_t *dst, const chip8_machine_t *src){
+	const uint8_t *pages[CHIP8_PAGES];
+	uint8_t *fresh[CHIP8_PAGES], *vram;
+	uint16_t dirty, keep;
+	unsigned page, n, k;
+
+	/* I blocchi mancanti vengono presi prima di toccare dst */
+	for (n=0, dirty=src->dirty & ~dst->dirty; dirty; dirty&=dirty - 1){
+		if ((fresh[n++] = block_alloc()) == NULL){
+			for (k=0; k<n - 1; k++){
+				block_free(fresh[k]);
+			}
+			return -1;
+		}
+	}
+
+	for (dirty=dst->dirty & ~src->dirty; dirty; dirty&=dirty - 1){
+		block_free((uint8_t *) dst->pages[__builtin_ctz(dirty)]);
+	}
+
+	if (src->image){
+		__sync_add_and_fetch(&src->image->refs, 1);
+	}
+	chip8_image_release(dst->image);
+
+	keep = dst->dirty;
+	memcpy(pages, dst->pages, sizeof(pages));
+	vram = dst->vram;
+
+	memcpy(dst, src, sizeof(chip8_machine_t));
+
+	/* Il debugger resta della macchina originale */
+	if (dst->debug){
+		chip8_debug_attach(dst, NULL);
+	}
+
+	dst->vram = vram;
+	memcpy(dst->vram, src->vram, CHIP8_VRAM_SIZE);
+
+	for (n=0, dirty=src->dirty; dirty; dirty&=dirty - 1){
+		page = __builtin_ctz(dirty);
+		dst->pages[page] = (keep & (1u << page)) ? pages[page] : fresh[n++];
+		memcpy((uint8_t *) dst->pages[page], src->pages[page], CHIP8_PAGE_SIZE);
+	}
+
+	return 0;
+}
+
+/* Riporta la macchina allo stato iniziale del programma senza passare
+ * da chip8_init: tornano all'immagine solo le pagine private, e vengono
+ * azzerati VRAM, registri, stack e tasti. Quirk, immagine e debugger
+ * restano quelli impostati */
+void chip8_reset(chip8_machine_t *ctx, uint32_t seed){
+	const chip8_image_t *image;
+	unsigned page;
+	uint16_t dirty;
+
+	image = ctx->image ? ctx->image : &blank_image;
+
+	for (dirty=ctx->dirty; dirty; dirty&=dirty - 1){
+		page = __builtin_ctz(dirty);
+		block_free((uint8_t *) ctx->pages[page]);
+		ctx->pages[page] = image->ram + page * CHIP8_PAGE_SIZE;
+	}
+	ctx->dirty = ctx->hashed = 0;
+
+	memset(ctx->v, 0, sizeof(ctx->v));
+	ctx->i = 0;
+	ctx->pc = 0x200;
+	ctx->sp = ctx->dt = ctx->st = 0;
+	ctx->wait = ctx->drawn = ctx->last_key = 0;
+	chip8_seed(ctx, seed);
+
+	memset(ctx->vram, 0, CHIP8_VRAM_SIZE);
+	ctx->vram_hashed = 0;
+	memset(ctx->stack, 0, sizeof(ctx->stack));
+	memset(ctx->keys, 0, sizeof(ctx->keys));
+	memset(ctx->fused, 0, sizeof(ctx->fused));
+}
+
+/* Carica un programma CHIP-8 in memoria, tagliandolo se necessario;
+ * per eseguire lo stesso programma su molte macchine conviene creare
+ * una sola immagine e usare chip8_attach
+ * Ritorna 0 se il programma è stato caricato interamente,
+ * o 1 se è stato tagliato, -1 se la memoria è esaurita */
+int chip8_load(chip8_machine_t *ctx, const void *prog, size_t len){
+	chip8_image_t *image;
+
+	if ((image = chip8_image_new(prog, len)) == NULL){
+		return -1;
+	}
 
-	memcpy(ctx->ram + 0x200, prog, actual);
+	chip8_attach(ctx, image);
+	chip8_image_release(image);
 
 	/* Ritorniamo 1 per segnalare che il programma è stato tagliato */
-	return (actual == len);
+	return (ctx->image->len == len);
 }
 
 /* Imposta l'ultimo tasto premuto */
@@ -108,6 +670,172 @@ int chip8_update_timers(chip8_machine_t *ctx, long delta){
 	return 0;
 }
 
+
+/* Le varianti dell'interprete vengono generate a compile-time, una per
+ * ogni combinazione di quirk: il corpo è una funzione inline che riceve
+ * le quirk come costante, così il compilatore elimina i rami inutili
+ * e ogni variante equivale ad un interprete scritto a mano per quel profilo */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define QUIRK(q) (quirks & CHIP8_QUIRK_##q)
+
+/* Bit oltre le quirk che seleziona la variante di debug: le istruzioni
+ * vengono controllate ed eseguite una alla volta, senza idiomi */
+#define EXEC_DEBUG CHIP8_QUIRKS_MAX
+
+/* Disegna lo sprite 8xN puntato da I alla posizione (V[x], V[y])
+ * L'operazione consiste in uno XOR bitwise tra i byte dello schermo
+ * e dello sprite; se durante l'operazione draw viene cancellato un pixel
+ * (portato da uno a zero), il registro VF avrà valore uno, altrimenti zero,
+ * questo serve per implementare una rudimentale forma di collision detection */
+static ALWAYS_INLINE void exec_draw(chip8_machine_t *ctx, uint8_t x, uint8_t y, uint8_t n,
+									const unsigned quirks){
+	uint8_t px, py, row, shift, left, right, collision;
+	unsigned line, offset;
+
+	/* La posizione iniziale si ripete sempre sullo schermo 64x32 */
+	px = ctx->v[x] & 63;
+	py = ctx->v[y] & 31;
+	shift = px % 8;
+	collision = 0;
+
+	logd("DRAW %02Xh %02Xh %02Xh", ctx->v[x], ctx->v[y], n);
+	ctx->vram_hashed = 0;
+
+	/* Per ogni riga */
+	for (row=0; row<n; row++){
+		line = py + row;
+
+		/* Le righe oltre il bordo inferiore vengono tagliate o ripetute in alto */
+		if (line > 31){
+			if (QUIRK(CLIP)){
+				break;
+			}
+			line &= 31;
+		}
+
+		/* Trovo la posizione nella memoria video, 8 byte per riga */
+		offset = line * 8 + px / 8;
+
+		/* Lo sprite può stare "in mezzo" a due byte, applico prima la parte sinistra */
+		left = chip8_peek(ctx, ctx->i + row) >> shift;
+		collision |= ctx->vram[offset] & left;
+		ctx->vram[offset] ^= left;
+
+		/* e poi i rimanenti bit, che oltre il bordo destro vengono tagliati
+		 * o ripetuti a sinistra */
+		if (shift){
+			right = (chip8_peek(ctx, ctx->i + row) << (8 - shift)) & 0xFF;
+
+			if (px / 8 == 7){
+				if (QUIRK(CLIP)){
+					continue;
+				}
+				offset = line * 8;
+			} else {
+				offset++;
+			}
+
+			collision |= ctx->vram[offset] & right;
+			ctx->vram[offset] ^= right;
+		}
+	}
+
+	ctx->v[0x0F] = (collision != 0);
+	ctx->drawn = 1;
+}
+
+/* Ritorna l'idioma che inizia a PC, o zero; la tabella vale solo
+ * finché le pagine dell'idioma non sono state scritte */
+static inline unsigned fuse_at(const chip8_machine_t *ctx){
+	unsigned kind, pc;
+
+	pc = ctx->pc & 0x0FFF;
+	if (!ctx->image || !(kind = ctx->image->fuse[pc])){
+		return 0;
+	}
+
+	if (ctx->dirty & ((1u << (pc >> CHIP8_PAGE_SHIFT))
+					  | (1u << (((pc + 7) >> CHIP8_PAGE_SHIFT) & (CHIP8_PAGES - 1))))){
+		return 0;
+	}
+
+	return kind;
+}
+
+/* Esegue l'idioma che inizia a PC come una sola operazione, lasciando
+ * la macchina nello stesso stato delle singole istruzioni
+ * Ritorna non zero se l'idioma è stato eseguito, zero se a PC non c'è
+ * un idioma o se va eseguito un'istruzione alla volta */
+static ALWAYS_INLINE int exec_fused(chip8_machine_t *ctx, const unsigned quirks){
+	uint16_t op[4], src, dst;
+	uint8_t x, k, val;
+	unsigned kind;
+
+	if ((quirks & EXEC_DEBUG) || !(kind = fuse_at(ctx))){
+		return 0;
+	}
+
+	for (k=0; k<4; k++){
+		op[k] = (chip8_peek(ctx, ctx->pc + 2 * k) << 8) | chip8_peek(ctx, ctx->pc + 2 * k + 1);
+	}
+
+	switch (kind){
+	case CHIP8_FUSE_SPRITE:
+		/* Sprite preso da una tabella: I = NNN + V[x], poi DRAW */
+		ctx->i = ((op[0] & 0x0FFF) + ctx->v[(op[1] >> 8) & 0x0F]) & 0x0FFF;
+		exec_draw(ctx, (op[2] >> 8) & 0x0F, (op[2] >> 4) & 0x0F, op[2] & 0x0F, quirks);
+		ctx->pc = (ctx->pc + 6) & 0x0FFF;
+		ctx->retired = 3;
+		break;
+	case CHIP8_FUSE_COPY:
+		/* Copia di V[0]-V[x] byte da A a B, passando per i registri */
+		x = (op[1] >> 8) & 0x0F;
+		src = op[0] & 0x0FFF;
+		dst = op[2] & 0x0FFF;
+		if (own_range(ctx, dst, x + 1)){
+			return 0;
+		}
+		for (k=0; k<=x; k++){
+			ctx->v[k] = chip8_peek(ctx, src + k);
+		}
+		for (k=0; k<=x; k++){
+			poke_owned(ctx, dst + k, ctx->v[k]);
+		}
+		ctx->i = QUIRK(MEM_INC_I) ? (dst + x + 1) & 0x0FFF : dst;
+		ctx->pc = (ctx->pc + 8) & 0x0FFF;
+		ctx->retired = 4;
+		break;
+	case CHIP8_FUSE_BCD:
+		/* Cifre decimali di V[x] in memoria e in V0-V2; se BCD
+		 * scrive sopra a LOAD va eseguita un'istruzione alla volta */
+		if (((ctx->pc + 2 - ctx->i) & 0x0FFF) < 3 || ((ctx->pc + 3 - ctx->i) & 0x0FFF) < 3
+			|| own_range(ctx, ctx->i, 3)){
+			return 0;
+		}
+		val = ctx->v[(op[0] >> 8) & 0x0F];
+		ctx->v[0] = val / 100;
+		ctx->v[1] = (val / 10) % 10;
+		ctx->v[2] = val % 10;
+		for (k=0; k<3; k++){
+			poke_owned(ctx, ctx->i + k, ctx->v[k]);
+		}
+		if (QUIRK(MEM_INC_I)){
+			ctx->i = (ctx->i + 3) & 0x0FFF;
+		}
+		ctx->pc = (ctx->pc + 4) & 0x0FFF;
+		ctx->retired = 2;
+		break;
+	}
+
+	ctx->fused[kind - 1]++;
+	return 1;
+}
+
 /* Esegue la prossima istruzione in memoria
  * Ritorna:
  * 0 in caso di successo
@@ -115,11 +843,19 @@ int chip8_update_timers(chip8_machine_t *ctx, long delta){
  * 2 in caso di istruzione 8xxx non valida
  * 3 in caso di istruzione 9xxx non valida 
  * 4 in caso di istruzione Exxx non valida
- * 5 in caso di istruzione Fxxx non valida */
-int chip8_exec(chip8_machine_t *ctx){
-	uint8_t x, y, n, nn, tmp8, offset;
+ * 5 in caso di istruzione Fxxx non valida
+ * 6 se la memoria per scrivere in RAM è esaurita, l'istruzione
+ *   non viene eseguita e può essere ripetuta
+ * 7 se il debugger ha fermato la macchina prima dell'istruzione,
+ *   solo nella variante di debug (vedi debug_check)
+ * In retired lascia quante istruzioni del programma sono state
+ * eseguite, più di una se a PC c'era un idioma */
+static ALWAYS_INLINE int exec_body(chip8_machine_t *ctx, const unsigned quirks){
+	uint8_t x, y, n, nn;
 	uint16_t opcode, nnn, tmp;
-	int jump, ret, c;
+	int jump, ret;
+
+	ctx->retired = 1;
 
 	/* Se siamo in attesa di input */
 	if (ctx->wait){
@@ -139,8 +875,8 @@ int chip8_exec(chip8_machine_t *ctx){
 	/* Gli opcode CHIP-8 sono a 16 bit big-endian,
 	 * quindi vanno letti in maniera indipendente
 	 * dall'architettura dell'host */
-	opcode = ((ctx->ram[ctx->pc & 0x0FFF] << 8)
-			  | (ctx->ram[(ctx->pc + 1) & 0x0FFF] & 0xFF));
+	opcode = ((chip8_peek(ctx, ctx->pc) << 8)
+			  | chip8_peek(ctx, ctx->pc + 1));
 
 	x = (opcode >> 8) & 0x0F;
 	y = (opcode >> 4) & 0x0F;
@@ -156,12 +892,15 @@ int chip8_exec(chip8_machine_t *ctx){
 		switch (opcode & 0x0FFF){
 		case 0x00E0:
 			/* Pulisci schermo */
-			memset(ctx->vram, 0, sizeof(ctx->vram));
+			memset(ctx->vram, 0, CHIP8_VRAM_SIZE);
+			ctx->vram_hashed = 0;
 			ctx->drawn = 1;
 			break;
 		case 0x00EE:
-			/* Ritorna da procedura */
-			ctx->pc = ctx->stack[--ctx->sp];
+			/* Ritorna da procedura, lo stack si ripete su 16 livelli
+			 * così che un programma sbagliato non scriva fuori */
+			ctx->sp = (ctx->sp - 1) & 0x0F;
+			ctx->pc = ctx->stack[ctx->sp];
 			jump = 1;
 			break;
 		default:
@@ -177,7 +916,8 @@ int chip8_exec(chip8_machine_t *ctx){
 		break;
 	case 0x2000:
 		/* Chiamata a procedura */
-		ctx->stack[ctx->sp++] = (ctx->pc + 2) & 0x0FFF;
+		ctx->stack[ctx->sp] = (ctx->pc + 2) & 0x0FFF;
+		ctx->sp = (ctx->sp + 1) & 0x0F;
 		ctx->pc = nnn;
 		jump = 1;
 		break;
@@ -217,14 +957,23 @@ int chip8_exec(chip8_machine_t *ctx){
 		case 0x01:
 			/* Imposta il valore di V[x] uguale all'OR bitwise tra V[x] e V[y] */
 			ctx->v[x] |= ctx->v[y];
+			if (QUIRK(VF_RESET)){
+				ctx->v[0x0F] = 0;
+			}
 			break;
 		case 0x02:
 			/* Imposta il valore di V[x] uguale all'AND bitwise tra V[x] e V[y] */
 			ctx->v[x] &= ctx->v[y];
+			if (QUIRK(VF_RESET)){
+				ctx->v[0x0F] = 0;
+			}
 			break;
 		case 0x03:
 			/* Imposta il valore di V[x] uguale allo XOR bitwise tra V[x] e V[y] */
 			ctx->v[x] ^= ctx->v[y];
+			if (QUIRK(VF_RESET)){
+				ctx->v[0x0F] = 0;
+			}
 			break;
 		case 0x04:
 			/* Somma V[y] a V[x], imposta V[0xF] a 1 se c'è resto, altrimenti a zero */
@@ -234,25 +983,27 @@ int chip8_exec(chip8_machine_t *ctx){
 			break;
 		case 0x05:
 			/* Sottrai V[y] da V[x], imposta V[0xF] a zero se c'è prestito, altrimenti a 1 */
-			tmp = (ctx->v[x] <= ctx->v[y]);
+			tmp = (ctx->v[x] >= ctx->v[y]);
 			ctx->v[x] -= ctx->v[y];
 			ctx->v[0x0F] = tmp;
 			break;
 		case 0x06:
-			/* Shift a destra di uno V[x], imposta V[0xF] al valore del bit meno significativo di V[x] */
-			ctx->v[0x0F] = ctx->v[x] & 0x01;
-			ctx->v[x] >>= 1;
+			/* Shift a destra di uno V[x] (o V[y]), imposta V[0xF] al valore del bit meno significativo */
+			tmp = QUIRK(SHIFT_VY) ? ctx->v[y] : ctx->v[x];
+			ctx->v[x] = tmp >> 1;
+			ctx->v[0x0F] = tmp & 0x01;
 			break;
 		case 0x07:
 			/* Imposta V[x] come V[y] meno V[x], imposta V[0xF] a zero se c'è prestito, altrimenti a 1 */
-			tmp = (ctx->v[y] <= ctx->v[x]);
+			tmp = (ctx->v[y] >= ctx->v[x]);
 			ctx->v[x] = ctx->v[y] - ctx->v[x];
 			ctx->v[0x0F] = tmp;
 			break;
 		case 0x0E:
-			/* Shift a sinistra di uno V[x], imposta V[0xF] al valore del bit più significativo di V[x] */
-			ctx->v[0x0F] = (ctx->v[x] & 0x80) >> 7;
-			ctx->v[x] <<= 1;
+			/* Shift a sinistra di uno V[x] (o V[y]), imposta V[0xF] al valore del bit più significativo */
+			tmp = QUIRK(SHIFT_VY) ? ctx->v[y] : ctx->v[x];
+			ctx->v[x] = tmp << 1;
+			ctx->v[0x0F] = (tmp & 0x80) >> 7;
 			break;
 		default:
 			/* Istruzione 8xxx non valida */
@@ -273,56 +1024,28 @@ int chip8_exec(chip8_machine_t *ctx){
 			ret = 3;
 			break;
 		}
+		break;
 	case 0xA000:
+		/* Idiomi che iniziano impostando I */
+		if (exec_fused(ctx, quirks)){
+			jump = 1;
+			break;
+		}
+
 		/* Imposta I a NNN */
 		ctx->i = nnn;
 		break;
 	case 0xB000:
-		/* Salta a NNN + V0 */
-		ctx->pc = (nnn + ctx->v[0]) & 0x0FFF;
+		/* Salta a NNN + V0, o a XNN + V[x] */
+		ctx->pc = (nnn + ctx->v[QUIRK(JUMP_VX) ? x : 0]) & 0x0FFF;
 		jump = 1;
 		break;
 	case 0xC000:
 		/* Imposta V[x] al risultato di AND logico tra NN ed un numero casuale */
-		srand(time(NULL));
-		ctx->v[x] = nn & (rand() & 0xFF);
+		ctx->v[x] = nn & (next_random(ctx) & 0xFF);
 		break;
 	case 0xD000:
-		/* Disegna lo sprite 8xN puntato da I alla posizione (V[x], V[y])
-		 * L'operazione consiste in uno XOR bitwise tra i byte dello schermo
-		 * e dello sprite; se durante l'operazione draw viene cancellato un pixel
-		 * (portato da uno a zero), il registro VF avrà valore uno, altrimenti zero,
-		 * questo serve per implementare una rudimentale forma di  collision detection */
-
-		// x = ctx->v[x]
-		// y = ctx->v[y]
-		// r = n
-
-		logd("DRAW %02Xh %02Xh %02Xh", ctx->v[x], ctx->v[y], n);
-		
-		/* Per ogni riga */
-		for (tmp=0; tmp<n; tmp++){
-			/* Leggo il byte della riga */
-			tmp8 = ctx->ram[(ctx->i + tmp) & 0x0FFF];
-
-			/* Trovo la posizione nella memoria video */
-			offset = (ctx->v[y] + tmp) * 8 + ctx->v[x] / 8;
-
-			/* Se lo sprite sta "in mezzo" a due byte, applico uno alla volta */
-			if (ctx->v[x] % 8){
-				c = popcount(ctx->vram[offset]) + popcount(ctx->vram[offset + 1]);
-				ctx->vram[offset] ^= tmp8 >> (ctx->v[x] % 8); /* XOR col primo byte */
-				ctx->vram[offset + 1] ^= tmp8 << (8 - (ctx->v[x] % 8)); /* XOR coi rimanenti */
-				ctx->v[0x0F] = (c > (popcount(ctx->vram[offset]) + popcount(ctx->vram[offset + 1])));
-			} else {
-				/* Altrimenti applico direttamente */
-				c = popcount(ctx->vram[offset]);
-				ctx->vram[offset] ^= tmp8;
-				ctx->v[0x0F] = (c > popcount(ctx->vram[offset]));
-			}
-		}
-		
-		ctx->drawn = 1;
+		exec_draw(ctx, x, y, n, quirks);
 		break;
 	case 0xE000:
 		/* Salti condizionati in base all'input */
@@ -383,20 +1106,40 @@ int chip8_exec(chip8_machine_t *ctx){
 			/* Scrivi in memoria all'indirizzo contenuto in I
 			 * la rappresentazione NBCD unpacked di V[x],
 			 * partendo dalla cifra più significativa */
-			ctx->ram[ctx->i & 0x0FFF] = ctx->v[x] / 100;
-			ctx->ram[(ctx->i + 1) & 0x0FFF] = (ctx->v[x] / 10) % 10;
-			ctx->ram[(ctx->i + 2) & 0x0FFF] = ctx->v[x] % 10;
+			if (exec_fused(ctx, quirks)){
+				jump = 1;
+				break;
+			}
+			if (own_range(ctx, ctx->i, 3)){
+				ret = 6;
+				jump = 1;
+				break;
+			}
+			poke_owned(ctx, ctx->i, ctx->v[x] / 100);
+			poke_owned(ctx, ctx->i + 1, (ctx->v[x] / 10) % 10);
+			poke_owned(ctx, ctx->i + 2, ctx->v[x] % 10);
 			break;
 		case 0x55:
 			/* Scrivi i valori dei registri da V[0] a V[x] in memoria all'indirizzo contenuto in I */
+			if (own_range(ctx, ctx->i, x + 1)){
+				ret = 6;
+				jump = 1;
+				break;
+			}
 			for (tmp=0; tmp<=x; tmp++){
-				ctx->ram[(ctx->i + tmp) & 0x0FFF] = ctx->v[tmp];
+				poke_owned(ctx, ctx->i + tmp, ctx->v[tmp]);
+			}
+			if (QUIRK(MEM_INC_I)){
+				ctx->i = (ctx->i + x + 1) & 0x0FFF;
 			}
 			break;
 		case 0x65:
 			/* Scrivi i valori in memoria all'indirizzo contenuto in I nei registri da V[0] a V[x] */
 			for (tmp=0; tmp<=x; tmp++){
-				 ctx->v[tmp] = ctx->ram[(ctx->i + tmp) & 0x0FFF];
+				 ctx->v[tmp] = chip8_peek(ctx, ctx->i + tmp);
+			}
+			if (QUIRK(MEM_INC_I)){
+				ctx->i = (ctx->i + x + 1) & 0x0FFF;
 			}
 			break;
 		default:
@@ -413,3 +1156,355 @@ int chip8_exec(chip8_machine_t *ctx){
 
 	return ret;
 }
+
+/* Bit di una bitmap da 4096 indirizzi del debugger */
+#define DEBUG_TEST(map, addr) ((map)[((addr) & 0x0FFF) >> 3] & (1u << ((addr) & 7)))
+
+/* Ritorna il primo indirizzo osservato tra start e start + count - 1,
+ * o -1 se nessuno lo è */
+static int debug_range(const uint8_t *map, uint16_t start, unsigned count){
+	unsigned k;
+
+	for (k=0; k<count; k++){
+		if (DEBUG_TEST(map, start + k)){
+			return (start + k) & 0x0FFF;
+		}
+	}
+
+	return -1;
+}
+
+static int debug_cond(const chip8_machine_t *ctx, const chip8_cond_t *cond){
+	uint16_t val;
+
+	val = (cond->reg == CHIP8_COND_I) ? ctx->i : ctx->v[cond->reg & 0x0F];
+
+	switch (cond->op){
+	case CHIP8_COND_EQ:
+		return val == cond->value;
+	case CHIP8_COND_NE:
+		return val != cond->value;
+	case CHIP8_COND_LT:
+		return val < cond->value;
+	default:
+		return val > cond->value;
+	}
+}
+
+static int debug_stop(chip8_debug_t *debug, unsigned reason, uint16_t addr){
+	debug->reason = reason;
+	debug->addr = addr;
+	return 7;
+}
+
+/* Controlli della variante di debug prima dell'istruzione a PC: le
+ * letture e scritture vengono ricavate dall'opcode, così l'interprete
+ * resta quello normale. Ritorna 7 se la macchina deve fermarsi */
+static int debug_check(chip8_machine_t *ctx){
+	chip8_debug_t *debug;
+	uint16_t opcode;
+	unsigned k, now;
+	int addr;
+
+	debug = ctx->debug;
+
+	/* In attesa di FX0A non viene eseguito niente */
+	if (ctx->wait && !ctx->last_key){
+		return 0;
+	}
+
+	/* Ripartenza dopo un arresto: l'istruzione va eseguita */
+	if (debug->skip){
+		debug->skip = 0;
+		return 0;
+	}
+
+	if (DEBUG_TEST(debug->exec, ctx->pc)){
+		return debug_stop(debug, CHIP8_BREAK_PC, ctx->pc);
+	}
+
+	if (debug->over && ctx->pc == debug->over_pc && ctx->sp == debug->over_sp){
+		debug->over = 0;
+		chip8_debug_update(ctx);
+		return debug_stop(debug, CHIP8_BREAK_OVER, ctx->pc);
+	}
+
+	for (k=0; k<debug->nconds; k++){
+		now = debug_cond(ctx, &debug->conds[k]);
+		if (now && !debug->conds[k].was){
+			debug->conds[k].was = 1;
+			return debug_stop(debug, CHIP8_BREAK_COND, ctx->pc);
+		}
+		debug->conds[k].was = now;
+	}
+
+	opcode = (chip8_peek(ctx, ctx->pc) << 8) | chip8_peek(ctx, ctx->pc + 1);
+	addr = -1;
+
+	if ((opcode & 0xF000) == 0xD000){
+		addr = debug_range(debug->read, ctx->i, opcode & 0x0F);
+	} else if ((opcode & 0xF0FF) == 0xF065){
+		addr = debug_range(debug->read, ctx->i, ((opcode >> 8) & 0x0F) + 1);
+	} else if ((opcode & 0xF0FF) == 0xF055){
+		if ((addr = debug_range(debug->write, ctx->i, ((opcode >> 8) & 0x0F) + 1)) >= 0){
+			return debug_stop(debug, CHIP8_BREAK_WRITE, addr);
+		}
+	} else if ((opcode & 0xF0FF) == 0xF033){
+		if ((addr = debug_range(debug->write, ctx->i, 3)) >= 0){
+			return debug_stop(debug, CHIP8_BREAK_WRITE, addr);
+		}
+	}
+
+	return (addr >= 0) ? debug_stop(debug, CHIP8_BREAK_READ, addr) : 0;
+}
+
+/* Genera una variante dell'interprete per ogni combinazione di quirk,
+ * più la sua versione di debug */
+#define EXEC_VARIANT(q)												\
+	static int chip8_exec_##q(chip8_machine_t *ctx){				\
+		return exec_body(ctx, q);									\
+	}																\
+	static int chip8_debug_##q(chip8_machine_t *ctx){				\
+		return debug_check(ctx) ? 7 : exec_body(ctx, q | EXEC_DEBUG);	\
+	}
+#define EXEC_ENTRY(q) chip8_exec_##q,
+#define DEBUG_ENTRY(q) chip8_debug_##q,
+#define EXEC_VARIANTS(V)											\
+	V(0)  V(1)  V(2)  V(3)  V(4)  V(5)  V(6)  V(7)					\
+	V(8)  V(9)  V(10) V(11) V(12) V(13) V(14) V(15)					\
+	V(16) V(17) V(18) V(19) V(20) V(21) V(22) V(23)					\
+	V(24) V(25) V(26) V(27) V(28) V(29) V(30) V(31)
+
+EXEC_VARIANTS(EXEC_VARIANT)
+
+static const chip8_exec_fn exec_variants[CHIP8_QUIRKS_MAX] = {
+	EXEC_VARIANTS(EXEC_ENTRY)
+};
+
+static const chip8_exec_fn debug_variants[CHIP8_QUIRKS_MAX] = {
+	EXEC_VARIANTS(DEBUG_ENTRY)
+};
+
+/* Ritorna la variante dell'interprete specializzata per le quirk indicate,
+ * utile a chi vuole chiamarla direttamente senza passare da chip8_exec */
+chip8_exec_fn chip8_exec_variant(unsigned quirks){
+	return exec_variants[quirks & (CHIP8_QUIRKS_MAX - 1)];
+}
+
+/* Ritorna non zero se il debugger ha qualcosa da controllare */
+static int debug_armed(const chip8_debug_t *debug){
+	unsigned k;
+
+	if (debug->nconds || debug->over){
+		return 1;
+	}
+
+	for (k=0; k<sizeof(debug->exec); k++){
+		if (debug->exec[k] | debug->read[k] | debug->write[k]){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Sceglie la variante dell'interprete: quella di debug solo finché
+ * c'è qualcosa di armato, così senza breakpoint non costa niente */
+static void select_exec(chip8_machine_t *ctx){
+	if (ctx->debug && debug_armed(ctx->debug)){
+		ctx->exec = debug_variants[ctx->quirks];
+	} else {
+		ctx->exec = exec_variants[ctx->quirks];
+	}
+}
+
+/* Imposta le quirk della macchina e sceglie la variante dell'interprete,
+ * va chiamata dopo chip8_init e prima di eseguire il programma */
+void chip8_set_quirks(chip8_machine_t *ctx, unsigned quirks){
+	ctx->quirks = quirks & (CHIP8_QUIRKS_MAX - 1);
+	select_exec(ctx);
+}
+
+/* Collega (o scollega, con NULL) lo stato del debugger alla macchina */
+void chip8_debug_attach(chip8_machine_t *ctx, chip8_debug_t *debug){
+	ctx->debug = debug;
+	select_exec(ctx);
+}
+
+/* Va chiamata dopo aver cambiato breakpoint, watchpoint o condizioni */
+void chip8_debug_update(chip8_machine_t *ctx){
+	select_exec(ctx);
+}
+
+/* Segna (o libera, con on zero) gli indirizzi da start a end compresi
+ * in una delle bitmap del debugger */
+void chip8_debug_mark(uint8_t *map, uint16_t start, uint16_t end, int on){
+	uint16_t addr;
+
+	for (addr=start & 0x0FFF; ; addr=(addr + 1) & 0x0FFF){
+		if (on){
+			map[addr >> 3] |= 1u << (addr & 7);
+		} else {
+			map[addr >> 3] &= ~(1u << (addr & 7));
+		}
+
+		if (addr == (end & 0x0FFF)){
+			break;
+		}
+	}
+}
+
+/* Aggiunge una condizione sui registri, che scatta solo quando passa
+ * da falsa a vera; va seguita da chip8_debug_update
+ * Ritorna 0 in caso di successo, -1 se non c'è più posto */
+int chip8_debug_add_cond(chip8_machine_t *ctx, uint8_t reg, uint8_t op, uint16_t value){
+	chip8_debug_t *debug;
+	chip8_cond_t *cond;
+
+	debug = ctx->debug;
+	if (debug->nconds == CHIP8_DEBUG_CONDS){
+		return -1;
+	}
+
+	cond = &debug->conds[debug->nconds++];
+	cond->reg = reg;
+	cond->op = op;
+	cond->value = value;
+	cond->was = debug_cond(ctx, cond);
+
+	return 0;
+}
+
+/* Esegue una sola istruzione senza controlli, anche se niente è armato:
+ * la variante di debug non esegue gli idiomi come un'unica operazione
+ * Ritorna come chip8_exec */
+int chip8_debug_step(chip8_machine_t *ctx){
+	int ret;
+
+	ctx->debug->skip = 1;
+	ret = debug_variants[ctx->quirks](ctx);
+	ctx->debug->skip = 0;
+
+	return ret;
+}
+
+/* Converte il nome di un profilo (default, cosmac, schip) o una maschera
+ * numerica di quirk nel valore corrispondente
+ * Ritorna 0 in caso di successo, -1 se la stringa non è valida */
+int chip8_parse_quirks(const char *str, unsigned *quirks){
+	char *end;
+	unsigned long val;
+
+	if (!strcmp(str, "default")){
+		*quirks = CHIP8_PROFILE_DEFAULT;
+	} else if (!strcmp(str, "cosmac")){
+		*quirks = CHIP8_PROFILE_COSMAC;
+	} else if (!strcmp(str, "schip")){
+		*quirks = CHIP8_PROFILE_SCHIP;
+	} else {
+		val = strtoul(str, &end, 0);
+		if (!*str || *end || val >= CHIP8_QUIRKS_MAX){
+			return -1;
+		}
+		*quirks = (unsigned) val;
+	}
+
+	return 0;
+}
+
+/* Ritorna il nome di un idioma CHIP8_FUSE_* */
+const char *chip8_fuse_name(unsigned kind){
+	static const char *names[CHIP8_FUSE_KINDS] = {
+		"LD I; ADD I; DRAW",
+		"LD I; LOAD; LD I; STOR",
+		"BCD; LOAD V2"
+	};
+
+	return (kind >= 1 && kind <= CHIP8_FUSE_KINDS) ? names[kind - 1] : NULL;
+}
+
+/* Numero massimo di istruzioni di un ciclo di attesa */
+#define IDLE_MAX_LEN 16
+
+/* Classifica un'istruzione ai fini dell'attesa: ritorna CHIP8_IDLE_*
+ * per le letture di timer e tastiera, 0 per le istruzioni senza effetti
+ * fuori dai registri, -1 per quelle che escludono un ciclo di attesa */
+static int idle_class(uint16_t opcode){
+	switch (opcode & 0xF000){
+	case 0x1000: case 0x3000: case 0x4000: case 0x5000:
+	case 0x6000: case 0x7000: case 0x8000: case 0x9000:
+	case 0xA000: case 0xB000:
+		return 0;
+	case 0xE000:
+		return CHIP8_IDLE_KEYS;
+	case 0xF000:
+		switch (opcode & 0x00FF){
+		case 0x07:
+			return CHIP8_IDLE_TIMER;
+		case 0x1E: case 0x29: case 0x65:
+			return 0;
+		}
+		return -1;
+	default:
+		/* Chiamate, disegno, RAND e scritture in memoria */
+		return -1;
+	}
+}
+
+/* Controlla se la macchina è in un ciclo di attesa: un ciclo che parte
+ * da PC, non ha effetti fuori dai registri e, eseguito una volta su una
+ * copia, lascia lo stato identico; finché timer e tastiera non cambiano
+ * ripeterlo non cambierebbe niente, quindi chi esegue la macchina può
+ * saltare direttamente al prossimo scatto del timer o al prossimo input
+ * con risultati identici. Il controllo costa un'iterazione del ciclo,
+ * conviene farlo solo dopo un salto all'indietro o in attesa di FX0A.
+ * Ritorna 0 se la macchina non è in attesa, altrimenti CHIP8_IDLE_TIMER
+ * e/o CHIP8_IDLE_KEYS per indicare cosa legge il ciclo, o CHIP8_IDLE_HALT
+ * se il ciclo non legge niente e non potrà mai uscire */
+unsigned chip8_idle(const chip8_machine_t *ctx){
+	chip8_machine_t scratch;
+	uint16_t opcode;
+	unsigned reads, n;
+	int cls;
+
+	if (ctx->wait){
+		return CHIP8_IDLE_KEYS;
+	}
+
+	/* La copia condivide pagine e VRAM, ma nessuna delle istruzioni
+	 * ammesse scrive in memoria */
+	memcpy(&scratch, ctx, sizeof(scratch));
+	reads = 0;
+
+	for (n=0; n<IDLE_MAX_LEN; n++){
+		opcode = (chip8_peek(&scratch, scratch.pc) << 8) | chip8_peek(&scratch, scratch.pc + 1);
+
+		/* Gli idiomi possono disegnare o scrivere in memoria */
+		if ((cls = idle_class(opcode)) < 0 || fuse_at(&scratch)
+			|| exec_variants[scratch.quirks](&scratch)){
+			return 0;
+		}
+		reads |= cls;
+
+		if (scratch.pc == ctx->pc){
+			break;
+		}
+	}
+
+	if (n == IDLE_MAX_LEN){
+		return 0;
+	}
+
+	if (memcmp(scratch.v, ctx->v, sizeof(ctx->v)) || scratch.i != ctx->i
+		|| scratch.sp != ctx->sp || memcmp(scratch.stack, ctx->stack, sizeof(ctx->stack))){
+		return 0;
+	}
+
+	return reads ? reads : CHIP8_IDLE_HALT;
+}
+
+/* Esegue la prossima istruzione con la variante scelta per la macchina,
+ * i valori di ritorno sono quelli descritti per exec_body */
+int chip8_exec(chip8_machine_t *ctx){
+	return ctx->exec(ctx);
+}
@@ -0,0 +1,559 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "as.h"
+#include "debugger.h"
+
+/*
+ * Il debugger lavora sopra chip8_debug_t: i comandi segnano le bitmap
+ * e chiamano chip8_debug_update, che passa alla variante di debug
+ * dell'interprete solo finché c'è qualcosa di armato. Gli arresti
+ * arrivano al ciclo di emulazione come valore 7 di chip8_exec.
+ */
+
+#define MAX_ARGS 5
+
+static void command(debugger_t *d, char *line);
+static void say(debugger_t *d, const char *fmt, ...);
+
+static const char *const reasons[] = {
+	"pausa", "breakpoint", "lettura", "scrittura", "condizione", "ritorno dalla CALL"
+};
+
+static const char *const ops[] = { "==", "!=", "<", ">" };
+
+/* Prepara il debugger: con path NULL i comandi arrivano da stdin,
+ * altrimenti da un client alla volta sul socket Unix path.
+ * La macchina parte in pausa, così si possono mettere i breakpoint
+ * prima della prima istruzione. Ritorna non zero in caso di errore */
+int debugger_init(debugger_t *d, chip8_machine_t *machine,
+				  const dbginfo_t *info, const char *path){
+	struct sockaddr_un addr;
+
+	memset(d, 0, sizeof(*d));
+	d->machine = machine;
+	d->info = info;
+	d->listen = -1;
+	d->list = machine->pc;
+	d->paused = 1;
+
+	if (!path){
+		d->in = STDIN_FILENO;
+		d->out = STDOUT_FILENO;
+	} else {
+		d->in = d->out = -1;
+
+		if (strlen(path) >= sizeof(addr.sun_path)){
+			err("percorso del socket troppo lungo: %s", path);
+			return 1;
+		}
+
+		if ((d->listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+			err("impossibile creare il socket");
+			return 1;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path);
+		unlink(path);
+
+		if (bind(d->listen, (struct sockaddr *) &addr, sizeof(addr)) || listen(d->listen, 1)){
+			err("impossibile ascoltare su %s", path);
+			close(d->listen);
+			return 1;
+		}
+
+		d->path = path;
+		fprintf(stderr, "Debugger in attesa su %s\n", path);
+	}
+
+	chip8_debug_attach(machine, &d->state);
+	say(d, "Macchina in pausa, \"h\" per l'aiuto\n");
+
+	return 0;
+}
+
+/* Chiude il socket e scollega il debugger dalla macchina */
+void debugger_free(debugger_t *d){
+	chip8_debug_attach(d->machine, NULL);
+
+	if (d->listen >= 0){
+		if (d->in >= 0){
+			close(d->in);
+		}
+		close(d->listen);
+		unlink(d->path);
+	}
+}
+
+/* Scrive una risposta al client; sul socket MSG_NOSIGNAL evita SIGPIPE
+ * se il client se n'è andato nel frattempo */
+static void say(debugger_t *d, const char *fmt, ...){
+	char buf[512];
+	va_list ap;
+	int n;
+
+	if (d->out < 0){
+		return;
+	}
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (n < 0){
+		return;
+	} else if ((size_t) n >= sizeof(buf)){
+		n = sizeof(buf) - 1;
+	}
+
+	if (d->listen >= 0){
+		send(d->out, buf, n, MSG_NOSIGNAL);
+	} else if (write(d->out, buf, n) < 0){
+		d->out = -1;
+	}
+}
+
+/* Il client ha chiuso: con stdin la macchina riparte senza controlli,
+ * con il socket si aspetta il prossimo client */
+static void disconnect(debugger_t *d){
+	if (d->listen >= 0){
+		close(d->in);
+	}
+
+	d->in = d->out = -1;
+	d->used = 0;
+
+	if (d->listen < 0){
+		memset(&d->state, 0, sizeof(d->state));
+		chip8_debug_update(d->machine);
+		d->paused = 0;
+	}
+}
+
+/* Esegue i comandi arrivati senza bloccare
+ * Ritorna 1 se la macchina è in pausa, -1 se va chiusa, 0 altrimenti */
+int debugger_poll(debugger_t *d){
+	struct pollfd pfd;
+	char *nl, *line;
+	ssize_t count;
+	int fd;
+
+	if (d->in < 0 && d->listen >= 0){
+		if ((fd = accept4(d->listen, NULL, NULL, SOCK_CLOEXEC)) < 0){
+			return d->paused;
+		}
+		d->in = d->out = fd;
+		say(d, "Macchina %s, \"h\" per l'aiuto\n", d->paused ? "in pausa" : "in esecuzione");
+	}
+
+	while (d->in >= 0){
+		pfd.fd = d->in;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) <= 0){
+			break;
+		}
+
+		count = read(d->in, d->line + d->used, sizeof(d->line) - 1 - d->used);
+		if (count <= 0){
+			disconnect(d);
+			break;
+		}
+		d->used += count;
+		d->line[d->used] = '\0';
+
+		line = d->line;
+		while ((nl = strchr(line, '\n')) != NULL){
+			*nl = '\0';
+			command(d, line);
+			if (d->paused < 0){
+				return -1;
+			}
+			line = nl + 1;
+		}
+
+		/* Una riga più lunga del buffer viene scartata */
+		d->used -= line - d->line;
+		if (d->used == sizeof(d->line) - 1){
+			say(d, "Riga troppo lunga\n");
+			d->used = 0;
+		}
+		memmove(d->line, line, d->used);
+	}
+
+	return d->paused;
+}
+
+/* Scrive in buf l'istruzione all'indirizzo addr, con il nome
+ * dell'etichetta al posto della destinazione se c'è */
+static void disasm(debugger_t *d, uint16_t addr, char *buf, size_t len){
+	const dbg_label_t *label;
+	uint16_t opcode;
+
+	opcode = (chip8_peek(d->machine, addr) << 8) | chip8_peek(d->machine, addr + 1);
+	label = dbginfo_label(d->info, opcode & 0x0FFF);
+	if (label && label->addr != (opcode & 0x0FFF)){
+		label = NULL;
+	}
+
+	chip8_decode(opcode, label ? label->name : NULL, buf, len);
+}
+
+static void show_instr(debugger_t *d, uint16_t addr){
+	char where[128], instr[64];
+
+	where[0] = '\0';
+	if (d->info->nlabels || d->info->nlines){
+		dbginfo_format(d->info, addr, where, sizeof(where));
+	}
+	disasm(d, addr, instr, sizeof(instr));
+	say(d, "%c%03X %04X  %-24s %s\n", (addr == d->machine->pc) ? '>' : ' ', addr,
+		(chip8_peek(d->machine, addr) << 8) | chip8_peek(d->machine, addr + 1), instr, where);
+}
+
+static void show_regs(debugger_t *d){
+	chip8_machine_t *m;
+	unsigned k;
+
+	m = d->machine;
+	for (k=0; k<16; k++){
+		say(d, "V%X=%02X%c", k, m->v[k], (k == 7 || k == 15) ? '\n' : ' ');
+	}
+	say(d, "I=%03X PC=%03X SP=%X DT=%02X ST=%02X%s\n", m->i, m->pc, m->sp,
+		m->dt, m->st, m->wait ? " (in attesa di un tasto)" : "");
+	for (k=0; k<m->sp && k<16; k++){
+		say(d, "  stack[%u] = %03X\n", k, m->stack[k]);
+	}
+}
+
+/* Da chiamare quando chip8_exec ritorna 7: mette in pausa e dice perché */
+void debugger_stopped(debugger_t *d){
+	chip8_debug_t *s;
+
+	s = &d->state;
+	d->paused = 1;
+	d->list = d->machine->pc;
+
+	if (s->reason == CHIP8_BREAK_READ || s->reason == CHIP8_BREAK_WRITE){
+		say(d, "Fermo: %s di %03X\n", reasons[s->reason], s->addr);
+	} else {
+		say(d, "Fermo: %s\n", reasons[s->reason]);
+	}
+	show_instr(d, d->machine->pc);
+}
+
+/* Converte un indirizzo, esadecimale o nome di un'etichetta
+ * Ritorna non zero se non è valido */
+static int parse_addr(debugger_t *d, const char *str, uint16_t *addr){
+	unsigned long val;
+	size_t k;
+	char *end;
+
+	for (k=0; k<d->info->nlabels; k++){
+		if (!strcmp(d->info->labels[k].name, str)){
+			*addr = d->info->labels[k].addr;
+			return 0;
+		}
+	}
+
+	val = strtoul(str, &end, 16);
+	if (end == str || *end || val > 0xFFFF){
+		say(d, "Indirizzo non valido: %s\n", str);
+		return 1;
+	}
+
+	*addr = val;
+	return 0;
+}
+
+/* Imposta o cancella breakpoint e watchpoint: "b ADDR", "w[r|w] DA [A]"
+ * e "d [DA [A]]" */
+static void mark(debugger_t *d, char **argv, int argc){
+	uint16_t start, end;
+	chip8_debug_t *s;
+	int on;
+
+	s = &d->state;
+	on = argv[0][0] != 'd';
+
+	if (argc == 1 && !on){
+		memset(s->exec, 0, sizeof(s->exec));
+		memset(s->read, 0, sizeof(s->read));
+		memset(s->write, 0, sizeof(s->write));
+		chip8_debug_update(d->machine);
+		return;
+	}
+
+	if (argc < 2 || argc > 3 || parse_addr(d, argv[1], &start)){
+		say(d, "Uso: %s INDIRIZZO%s\n", argv[0], (argv[0][0] == 'b') ? "" : " [FINE]");
+		return;
+	}
+
+	end = start;
+	if (argc == 3 && (argv[0][0] == 'b' || parse_addr(d, argv[2], &end))){
+		return;
+	}
+
+	if (argv[0][0] == 'b' || !on){
+		chip8_debug_mark(s->exec, start, end, on);
+	}
+	if ((!strcmp(argv[0], "w") || !strcmp(argv[0], "wr")) || !on){
+		chip8_debug_mark(s->read, start, end, on);
+	}
+	if ((!strcmp(argv[0], "w") || !strcmp(argv[0], "ww")) || !on){
+		chip8_debug_mark(s->write, start, end, on);
+	}
+
+	chip8_debug_update(d->machine);
+}
+
+/* "c REG OP VALORE", ad esempio "c v3 == 5" o "c i > 300" */
+static void cond(debugger_t *d, char **argv, int argc){
+	uint16_t value;
+	unsigned reg, op;
+	char *end;
+
+	if (argc != 4){
+		goto usage;
+	}
+
+	if (!strcasecmp(argv[1], "i")){
+		reg = CHIP8_COND_I;
+	} else if ((argv[1][0] == 'v' || argv[1][0] == 'V') && argv[1][1] && !argv[1][2]){
+		reg = strtoul(argv[1] + 1, &end, 16);
+		if (*end){
+			goto usage;
+		}
+	} else {
+		goto usage;
+	}
+
+	for (op=0; op<4 && strcmp(argv[2], ops[op]); op++);
+	if (op == 4 || parse_addr(d, argv[3], &value)){
+		goto usage;
+	}
+
+	if (chip8_debug_add_cond(d->machine, reg, op, value)){
+		say(d, "Troppe condizioni, al massimo %d\n", CHIP8_DEBUG_CONDS);
+		return;
+	}
+
+	chip8_debug_update(d->machine);
+	return;
+
+ usage:
+	say(d, "Uso: c V0-VF|I ==|!=|<|> VALORE\n");
+}
+
+/* Stampa gli intervalli segnati in una bitmap */
+static void list_map(debugger_t *d, const char *name, const uint8_t *map){
+	unsigned addr, start;
+
+	for (addr=0; addr<4096; addr++){
+		if (!(map[addr >> 3] & (1u << (addr & 7)))){
+			continue;
+		}
+
+		for (start=addr; addr + 1 < 4096 && (map[(addr + 1) >> 3] & (1u << ((addr + 1) & 7))); addr++);
+
+		if (start == addr){
+			say(d, "%s %03X\n", name, start);
+		} else {
+			say(d, "%s %03X-%03X\n", name, start, addr);
+		}
+	}
+}
+
+static void info(debugger_t *d){
+	const chip8_cond_t *c;
+	unsigned k;
+
+	list_map(d, "breakpoint", d->state.exec);
+	list_map(d, "lettura   ", d->state.read);
+	list_map(d, "scrittura ", d->state.write);
+
+	for (k=0; k<d->state.nconds; k++){
+		c = &d->state.conds[k];
+		if (c->reg == CHIP8_COND_I){
+			say(d, "condizione I %s %X\n", ops[c->op], c->value);
+		} else {
+			say(d, "condizione V%X %s %X\n", c->reg, ops[c->op], c->value);
+		}
+	}
+}
+
+/* Esegue un'istruzione; con over una CALL viene eseguita fino al ritorno */
+static void step(debugger_t *d, int over){
+	chip8_machine_t *m;
+	uint16_t opcode;
+	int ret;
+
+	m = d->machine;
+	opcode = (chip8_peek(m, m->pc) << 8) | chip8_peek(m, m->pc + 1);
+
+	if (over && (opcode & 0xF000) == 0x2000 && !m->wait){
+		d->state.over_pc = m->pc + 2;
+		d->state.over_sp = m->sp;
+		d->state.over = 1;
+		chip8_debug_update(m);
+		d->state.skip = 1;
+		d->paused = 0;
+		return;
+	}
+
+	if ((ret = chip8_debug_step(m)) != 0){
+		say(d, "Errore %d all'indirizzo %03X\n", ret, m->pc);
+	}
+
+	d->list = m->pc;
+	show_instr(d, m->pc);
+}
+
+static void help(debugger_t *d){
+	say(d,
+		"Indirizzi e valori in esadecimale, o nomi di etichette\n"
+		"  b ADDR           breakpoint\n"
+		"  w DA [A]         watchpoint su letture e scritture\n"
+		"  wr DA [A]        watchpoint sulle letture\n"
+		"  ww DA [A]        watchpoint sulle scritture\n"
+		"  c REG OP VAL     condizione, es. \"c v3 == 5\" o \"c i > 300\"\n"
+		"  d [DA [A]]       cancella breakpoint e watchpoint\n"
+		"  dc               cancella le condizioni\n"
+		"  i                elenca breakpoint, watchpoint e condizioni\n"
+		"  s                esegue un'istruzione\n"
+		"  n                come s, ma esegue le CALL fino al ritorno\n"
+		"  g                continua\n"
+		"  p                pausa\n"
+		"  r                registri\n"
+		"  x ADDR [N]       mostra N byte di memoria\n"
+		"  l [ADDR] [N]     mostra N istruzioni\n"
+		"  q                chiude l'emulatore\n");
+}
+
+/* Mostra count byte di memoria da addr, 16 per riga */
+static void dump(debugger_t *d, uint16_t addr, unsigned count){
+	char buf[8 + 16 * 3];
+	unsigned k, n;
+
+	for (k=0; k<count; k+=16){
+		n = sprintf(buf, "%03X:", (addr + k) & 0x0FFF);
+		for (; n < 4 + 3 * 16 && k + (n - 4) / 3 < count; n+=3){
+			sprintf(buf + n, " %02X", chip8_peek(d->machine, addr + k + (n - 4) / 3));
+		}
+		say(d, "%s\n", buf);
+	}
+}
+
+/* Esegue una riga di comando */
+static void command(debugger_t *d, char *line){
+	char *argv[MAX_ARGS], *save;
+	unsigned long count, k;
+	uint16_t addr;
+	int argc;
+
+	for (argc=0; argc<MAX_ARGS && (argv[argc] = strtok_r(argc ? NULL : line, " \t\r", &save)); argc++);
+	if (!argc){
+		return;
+	}
+
+	/* Tutti i comandi sono di una lettera, tranne wr, ww e dc */
+	if (argv[0][1] && strcmp(argv[0], "wr") && strcmp(argv[0], "ww") && strcmp(argv[0], "dc")){
+		help(d);
+		return;
+	}
+
+	switch (argv[0][0]){
+	case 'b':
+	case 'w':
+		mark(d, argv, argc);
+		break;
+	case 'c':
+		cond(d, argv, argc);
+		break;
+	case 'd':
+		if (!strcmp(argv[0], "dc")){
+			d->state.nconds = 0;
+			chip8_debug_update(d->machine);
+		} else {
+			mark(d, argv, argc);
+		}
+		break;
+	case 'i':
+		info(d);
+		break;
+	case 's':
+	case 'n':
+		if (!d->paused){
+			say(d, "La macchina non è in pausa\n");
+		} else {
+			step(d, argv[0][0] == 'n');
+		}
+		break;
+	case 'g':
+		/* L'istruzione su cui ci siamo fermati va eseguita */
+		d->state.skip = d->paused;
+		d->paused = 0;
+		break;
+	case 'p':
+		if (!d->paused){
+			d->paused = 1;
+			d->list = d->machine->pc;
+			show_instr(d, d->machine->pc);
+		}
+		break;
+	case 'r':
+		show_regs(d);
+		break;
+	case 'x':
+		count = (argc > 2) ? strtoul(argv[2], NULL, 16) : 16;
+		if (argc < 2 || parse_addr(d, argv[1], &addr)){
+			say(d, "Uso: x ADDR [N]\n");
+			break;
+		}
+		dump(d, addr, (count < 4096) ? count : 4096);
+		break;
+	case 'l':
+		if (argc > 1 && parse_addr(d, argv[1], &d->list)){
+			break;
+		}
+		count = (argc > 2) ? strtoul(argv[2], NULL, 16) : 8;
+		for (k=0; k<count && k<2048; k++){
+			show_instr(d, d->list & 0x0FFF);
+			d->list += 2;
+		}
+		break;
+	case 'q':
+		d->paused = -1;
+		break;
+	default:
+		help(d);
+	}
+}
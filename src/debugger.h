@@ -0,0 +1,45 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _DEBUGGER_H_
+#define _DEBUGGER_H_
+
+#include "chip8.h"
+#include "debuginfo.h"
+
+/* Debugger interattivo di c8emu: legge comandi di una riga da stdin o
+ * da un socket Unix, senza mai bloccare il ciclo di emulazione */
+typedef struct debugger {
+	chip8_debug_t state;        /* Breakpoint e watchpoint della macchina */
+	chip8_machine_t *machine;
+	const dbginfo_t *info;      /* Simboli del programma */
+	const char *path;           /* Percorso del socket */
+	int listen;                 /* Socket in ascolto, o -1 se si usa stdin */
+	int in, out;                /* Client attuale, -1 se non c'è */
+	char line[256];             /* Riga in arrivo */
+	size_t used;
+	uint16_t list;              /* Prossimo indirizzo mostrato da "l" */
+	int paused;
+} debugger_t;
+
+extern int debugger_init(debugger_t *d, chip8_machine_t *machine,
+						 const dbginfo_t *info, const char *path);
+extern int debugger_poll(debugger_t *d);
+extern void debugger_stopped(debugger_t *d);
+extern void debugger_free(debugger_t *d);
+
+#endif /* _DEBUGGER_H_ */
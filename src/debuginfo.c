@@ -0,0 +1,225 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h> /* FILE, fopen, fprintf, fgets, sscanf */
+#include <stdlib.h> /* realloc, free, qsort */
+#include <string.h> /* strlen, strchr */
+
+#include "debuginfo.h"
+
+/* Inizializza informazioni di debug vuote */
+void dbginfo_init(dbginfo_t *info){
+	memset(info, 0, sizeof(dbginfo_t));
+	arena_init(&info->arena);
+}
+
+/* Aggiunge un'etichetta, ritorna non zero se la memoria è esaurita */
+int dbginfo_add_label(dbginfo_t *info, uint16_t addr, const char *name){
+	dbg_label_t *labels;
+
+	if (info->nlabels == info->labelsize){
+		info->labelsize = info->labelsize ? info->labelsize * 2 : 256;
+		if ((labels = realloc(info->labels, info->labelsize * sizeof(dbg_label_t))) == NULL){
+			return 1;
+		}
+		info->labels = labels;
+	}
+
+	if ((name = arena_strdup(&info->arena, name)) == NULL){
+		return 1;
+	}
+
+	info->labels[info->nlabels++] = (dbg_label_t) { addr, name };
+	return 0;
+}
+
+/* Aggiunge la riga di sorgente che genera il codice da addr in poi;
+ * righe uguali consecutive vengono registrate una volta sola */
+int dbginfo_add_line(dbginfo_t *info, uint16_t addr, uint32_t line){
+	dbg_line_t *lines;
+
+	if (info->nlines && info->lines[info->nlines - 1].line == line){
+		return 0;
+	}
+
+	if (info->nlines == info->linesize){
+		info->linesize = info->linesize ? info->linesize * 2 : 1024;
+		if ((lines = realloc(info->lines, info->linesize * sizeof(dbg_line_t))) == NULL){
+			return 1;
+		}
+		info->lines = lines;
+	}
+
+	info->lines[info->nlines++] = (dbg_line_t) { addr, line };
+	return 0;
+}
+
+static int compare_labels(const void *a, const void *b){
+	return (int) ((const dbg_label_t *) a)->addr - (int) ((const dbg_label_t *) b)->addr;
+}
+
+static int compare_lines(const void *a, const void *b){
+	return (int) ((const dbg_line_t *) a)->addr - (int) ((const dbg_line_t *) b)->addr;
+}
+
+/* Ordina le tabelle per indirizzo, così da poterle cercare; va
+ * chiamata dopo averle riempite con dbginfo_add_label e dbginfo_add_line */
+void dbginfo_sort(dbginfo_t *info){
+	if (info->nlabels){
+		qsort(info->labels, info->nlabels, sizeof(dbg_label_t), compare_labels);
+	}
+	if (info->nlines){
+		qsort(info->lines, info->nlines, sizeof(dbg_line_t), compare_lines);
+	}
+}
+
+/* Scrive le informazioni nel file path, ritorna non zero in caso di errore */
+int dbginfo_save(dbginfo_t *info, const char *path){
+	FILE *fp;
+	size_t i;
+
+	if ((fp = fopen(path, "w")) == NULL){
+		err("impossibile scrivere il file %s", path);
+		return 1;
+	}
+
+	dbginfo_sort(info);
+
+	fprintf(fp, "CHIP8SYM %d\n", DBGINFO_VERSION);
+	if (info->source){
+		fprintf(fp, "F %s\n", info->source);
+	}
+	for (i=0; i<info->nlabels; i++){
+		fprintf(fp, "L %03X %s\n", info->labels[i].addr, info->labels[i].name);
+	}
+	for (i=0; i<info->nlines; i++){
+		fprintf(fp, "S %03X %u\n", info->lines[i].addr, (unsigned) info->lines[i].line);
+	}
+
+	if (fclose(fp)){
+		err("impossibile scrivere il file %s", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Legge le informazioni dal file path, ritorna non zero in caso di errore */
+int dbginfo_load(dbginfo_t *info, const char *path){
+	char buf[512], name[256], *nl;
+	unsigned addr, line;
+	int version;
+	FILE *fp;
+
+	dbginfo_init(info);
+
+	if ((fp = fopen(path, "r")) == NULL){
+		return 1;
+	}
+
+	if (!fgets(buf, sizeof(buf), fp) || sscanf(buf, "CHIP8SYM %d", &version) != 1
+		|| version != DBGINFO_VERSION){
+		fprintf(stderr, "Attenzione: %s non è un file di simboli valido\n", path);
+		fclose(fp);
+		return 1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)){
+		if ((nl = strchr(buf, '\n')) != NULL){
+			*nl = '\0';
+		}
+
+		if (buf[0] == 'F' && buf[1] == ' '){
+			info->source = arena_strdup(&info->arena, buf + 2);
+		} else if (sscanf(buf, "L %x %255s", &addr, name) == 2){
+			dbginfo_add_label(info, addr & 0x0FFF, name);
+		} else if (sscanf(buf, "S %x %u", &addr, &line) == 2){
+			dbginfo_add_line(info, addr & 0x0FFF, line);
+		}
+	}
+
+	fclose(fp);
+	dbginfo_sort(info);
+
+	return 0;
+}
+
+/* Ritorna l'ultima etichetta ad un indirizzo minore o uguale ad addr */
+const dbg_label_t *dbginfo_label(const dbginfo_t *info, uint16_t addr){
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = info->nlabels;
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (info->labels[mid].addr <= addr){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? &info->labels[lo - 1] : NULL;
+}
+
+/* Ritorna la riga di sorgente che ha generato addr, o -1 */
+long dbginfo_line(const dbginfo_t *info, uint16_t addr){
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = info->nlines;
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (info->lines[mid].addr <= addr){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? (long) info->lines[lo - 1].line : -1;
+}
+
+/* Scrive in buf la posizione di addr come "etichetta+offset (file:riga)" */
+void dbginfo_format(const dbginfo_t *info, uint16_t addr, char *buf, size_t len){
+	const dbg_label_t *label;
+	long line;
+	int n;
+
+	label = dbginfo_label(info, addr);
+	if (!label){
+		n = snprintf(buf, len, "%03X", addr);
+	} else if (label->addr == addr){
+		n = snprintf(buf, len, "%s", label->name);
+	} else {
+		n = snprintf(buf, len, "%s+%u", label->name, addr - label->addr);
+	}
+
+	if (n >= 0 && (size_t) n < len && (line = dbginfo_line(info, addr)) >= 0){
+		snprintf(buf + n, len - n, " (%s:%ld)", info->source ? info->source : "", line);
+	}
+}
+
+/* Libera la memoria delle informazioni di debug */
+void dbginfo_free(dbginfo_t *info){
+	free(info->labels);
+	free(info->lines);
+	arena_free(&info->arena);
+	info->labels = NULL;
+	info->lines = NULL;
+	info->nlabels = info->nlines = info->labelsize = info->linesize = 0;
+}
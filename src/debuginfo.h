@@ -0,0 +1,67 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _DEBUGINFO_H_
+#define _DEBUGINFO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "util.h"
+
+/* Informazioni di debug prodotte da c8as: le etichette con il loro
+ * indirizzo e, per ogni istruzione o dato, la riga del sorgente.
+ * Il file è testuale, una voce per riga:
+ *
+ *   CHIP8SYM 1
+ *   F sorgente.txt
+ *   L 200 inizio
+ *   S 200 12
+ */
+#define DBGINFO_VERSION 1
+
+typedef struct dbg_label {
+	uint16_t addr;
+	const char *name;
+} dbg_label_t;
+
+typedef struct dbg_line {
+	uint16_t addr;          /* Primo indirizzo generato dalla riga */
+	uint32_t line;
+} dbg_line_t;
+
+typedef struct dbginfo {
+	const char *source;     /* Nome del file sorgente */
+	dbg_label_t *labels;    /* Ordinate per indirizzo */
+	size_t nlabels, labelsize;
+	dbg_line_t *lines;      /* Ordinate per indirizzo */
+	size_t nlines, linesize;
+	arena_t arena;          /* Memoria per i nomi */
+} dbginfo_t;
+
+extern void dbginfo_init(dbginfo_t *info);
+extern int dbginfo_add_label(dbginfo_t *info, uint16_t addr, const char *name);
+extern int dbginfo_add_line(dbginfo_t *info, uint16_t addr, uint32_t line);
+extern int dbginfo_save(dbginfo_t *info, const char *path);
+extern int dbginfo_load(dbginfo_t *info, const char *path);
+extern const dbg_label_t *dbginfo_label(const dbginfo_t *info, uint16_t addr);
+extern long dbginfo_line(const dbginfo_t *info, uint16_t addr);
+extern void dbginfo_format(const dbginfo_t *info, uint16_t addr, char *buf, size_t len);
+extern void dbginfo_sort(dbginfo_t *info);
+extern void dbginfo_free(dbginfo_t *info);
+
+#endif /* _DEBUGINFO_H_ */
@@ -17,203 +17,229 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
-void chip8_decode(uint16_t opcode, char *buf, size_t len){
-	uint8_t x, y, n, nn;
-	uint16_t nnn;
-	
-	x = (opcode >> 8) & 0x0F;
-	y = (opcode >> 4) & 0x0F;
-	n = opcode & 0x0F;
-	nn = opcode & 0xFF;
-	nnn = opcode & 0x0FFF;
-	
+#include "util.h"
+#include "as.h"
+
+/* Il disassembler è guidato da una tabella: per ognuno dei 65536 opcode
+ * viene calcolata una volta sola la classe di istruzione, che indica un
+ * modello di testo con dei segnaposti per gli operandi */
+
+/* Segnaposti nei modelli */
+#define SLOT_X    '\x01' /* Registro X, una cifra */
+#define SLOT_Y    '\x02' /* Registro Y, una cifra */
+#define SLOT_N    '\x03' /* N, una cifra */
+#define SLOT_NN   '\x04' /* NN, due cifre */
+#define SLOT_NNN  '\x05' /* Indirizzo NNN, o etichetta se presente */
+#define SLOT_OP   '\x06' /* Opcode intero, quattro cifre */
+#define SLOT_ADDR '\x07' /* Indirizzo NNN, sempre in esadecimale */
+
+static const struct {
+	const char *name;   /* Nome della classe, usato negli istogrammi */
+	const char *fmt;    /* Modello del testo */
+} classes[CHIP8_CLASSES] = {
+	[CHIP8_CLS]       = { "CLS",           "CLS" },
+	[CHIP8_RET]       = { "RET",           "RET" },
+	[CHIP8_EXEC]      = { "EXEC",          "EXEC \x07" },
+	[CHIP8_JP]        = { "JP",            "JP \x05" },
+	[CHIP8_CALL]      = { "CALL",          "CALL \x05" },
+	[CHIP8_SKIPE_NN]  = { "SKIPE Vx, nn",  "SKIPE V\x01, \x04h" },
+	[CHIP8_SKIPNE_NN] = { "SKIPNE Vx, nn", "SKIPNE V\x01, \x04h" },
+	[CHIP8_SKIPE_V]   = { "SKIPE Vx, Vy",  "SKIPE V\x01, V\x02" },
+	[CHIP8_LD_NN]     = { "LD Vx, nn",     "LD V\x01, \x04h" },
+	[CHIP8_ADD_NN]    = { "ADD Vx, nn",    "ADD V\x01, \x04h" },
+	[CHIP8_LD_V]      = { "LD Vx, Vy",     "LD V\x01, V\x02" },
+	[CHIP8_OR]        = { "OR",            "OR V\x01, V\x02" },
+	[CHIP8_AND]       = { "AND",           "AND V\x01, V\x02" },
+	[CHIP8_XOR]       = { "XOR",           "XOR V\x01, V\x02" },
+	[CHIP8_ADD_V]     = { "ADD Vx, Vy",    "ADD V\x01, V\x02" },
+	[CHIP8_SUB]       = { "SUB",           "SUB V\x01, V\x02" },
+	[CHIP8_SHR]       = { "SHR",           "SHR V\x01" },
+	[CHIP8_RSB]       = { "RSB",           "RSB V\x01, V\x02" },
+	[CHIP8_SHL]       = { "SHL",           "SHL V\x01" },
+	[CHIP8_SKIPNE_V]  = { "SKIPNE Vx, Vy", "SKIPNE V\x01, V\x02" },
+	[CHIP8_LD_I]      = { "LD I",          "LD I, \x05" },
+	[CHIP8_JP_V0]     = { "JP V0",         "JP \x05 + V0" },
+	[CHIP8_RAND]      = { "RAND",          "RAND V\x01, \x04h" },
+	[CHIP8_DRAW]      = { "DRAW",          "DRAW V\x01, V\x02, \x03h" },
+	[CHIP8_SKIPDN]    = { "SKIPDN",        "SKIPDN V\x01" },
+	[CHIP8_SKIPUP]    = { "SKIPUP",        "SKIPUP V\x01" },
+	[CHIP8_LD_VDT]    = { "LD Vx, DT",     "LD V\x01, DT" },
+	[CHIP8_IN]        = { "IN",            "IN V\x01" },
+	[CHIP8_LD_DT]     = { "LD DT, Vx",     "LD DT, V\x01" },
+	[CHIP8_LD_ST]     = { "LD ST, Vx",     "LD ST, V\x01" },
+	[CHIP8_ADD_I]     = { "ADD I, Vx",     "ADD I, V\x01" },
+	[CHIP8_SPRITE]    = { "SPRITE",        "SPRITE V\x01" },
+	[CHIP8_BCD]       = { "BCD",           "BCD V\x01" },
+	[CHIP8_STOR]      = { "STOR",          "STOR V\x01" },
+	[CHIP8_LOAD]      = { "LOAD",          "LOAD V\x01" },
+	[CHIP8_INVALID]   = { "INVALID",       "; Invalid \x06h" }
+};
+
+static uint8_t decode_table[65536];
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+/* Calcola la classe di un'istruzione, usato solo per riempire la tabella */
+static uint8_t classify(uint16_t opcode){
 	/* Il primo nibble (4 bit) dell'opcode specifica il tipo di istruzione */
 	switch (opcode & 0xF000){
 	case 0x0000:
-		/* Pulisci schermo e return */
 		switch (opcode & 0x0FFF){
 		case 0x00E0:
 			/* Pulisci schermo */
-			snprintf(buf, len, "CLS");
-			break;
+			return CHIP8_CLS;
 		case 0x00EE:
 			/* Ritorna da procedura */
-			snprintf(buf, len, "RET");
-			break;
-		default:
-			/* Esegui programma RCA1802 a NNN (obsoleto) */
-			snprintf(buf, len, "EXEC %03Xh", nnn);
-			break;
+			return CHIP8_RET;
 		}
-		break;
+		/* Esegui programma RCA1802 a NNN (obsoleto) */
+		return CHIP8_EXEC;
 	case 0x1000:
-		/* Salto incondizionato */
-		snprintf(buf, len, "JP %03Xh", nnn);
-		/* TODO: label? */
-		break;
+		return CHIP8_JP;
 	case 0x2000:
-		/* Chiamata a procedura */
-		snprintf(buf, len, "CALL %03Xh", nnn);
-		/* TODO: label? */
-		break;
+		return CHIP8_CALL;
 	case 0x3000:
-		/* Salta la prossima istruzione se V[x] == NN */
-		snprintf(buf, len, "SKIPE V%1X, %02Xh", x, nn);
-		break;
+		return CHIP8_SKIPE_NN;
 	case 0x4000:
-		/* Salta la prossima istruzione se V[x] != NN */
-		snprintf(buf, len, "SKIPNE V%1X, %02Xh", x, nn);
-		break;
+		return CHIP8_SKIPNE_NN;
 	case 0x5000:
-		/* Salta la prossima istruzione se V[x] == V[y] */
-		snprintf(buf, len, "SKIPE V%1X, V%1X", x, y);
-		break;
+		return CHIP8_SKIPE_V;
 	case 0x6000:
-		/* Imposta V[x] a NN */
-		snprintf(buf, len, "LD V%1X, %02Xh", x, nn);
-		break;
+		return CHIP8_LD_NN;
 	case 0x7000:
-		/* Somma NN a V[x] */
-		snprintf(buf, len, "ADD V%1X, %02Xh", x, nn);
-		break;
+		return CHIP8_ADD_NN;
 	case 0x8000:
 		/* Operazioni tra registri */
 		switch (opcode & 0x000F){
-		case 0x00:
-			/* Imposta il valore di V[x] uguale a quello di V[y] */
-			snprintf(buf, len, "LD V%1X, V%1X", x, y);
-			break;
-		case 0x01:
-			/* Imposta il valore di V[x] uguale all'OR bitwise tra V[x] e V[y] */
-			snprintf(buf, len, "OR V%1X, V%1X", x, y);
-			break;
-		case 0x02:
-			/* Imposta il valore di V[x] uguale all'AND bitwise tra V[x] e V[y] */
-			snprintf(buf, len, "AND V%1X, V%1X", x, y);
-			break;
-		case 0x03:
-			/* Imposta il valore di V[x] uguale allo XOR bitwise tra V[x] e V[y] */
-			snprintf(buf, len, "XOR V%1X, V%1X", x, y);
-			break;
-		case 0x04:
-			/* Somma V[y] a V[x], imposta V[0xF] a 1 se c'è resto, altrimenti a zero */
-			snprintf(buf, len, "ADD V%1X, V%1X", x, y);
-			break;
-		case 0x05:
-			/* Sottrai V[y] da V[x], imposta V[0xF] a zero se c'è prestito, altrimenti a 1 */
-			snprintf(buf, len, "SUB V%1X, V%1X", x, y);
-			break;
-		case 0x06:
-			/* Shift a destra di uno V[x], imposta V[0xF] al valore del bit meno significativo di V[x] */
-			snprintf(buf, len, "SHR V%1X", x);
-			break;
-		case 0x07:
-			/* Imposta V[x] come V[y] meno V[x], imposta V[0xF] a zero se c'è prestito, altrimenti a 1 */
-			snprintf(buf, len, "RSB V%1X, V%1X", x, y);
-			break;
-		case 0x0E:
-			/* Shift a sinistra di uno V[x], imposta V[0xF] al valore del bit più significativo di V[x] */
-			snprintf(buf, len, "SHL V%1X", x);
-			break;
-		default:
-			/* Istruzione 8xxx non valida */
-			snprintf(buf, len, "; Invalid %04Xh", opcode);
-			break;
+		case 0x00: return CHIP8_LD_V;
+		case 0x01: return CHIP8_OR;
+		case 0x02: return CHIP8_AND;
+		case 0x03: return CHIP8_XOR;
+		case 0x04: return CHIP8_ADD_V;
+		case 0x05: return CHIP8_SUB;
+		case 0x06: return CHIP8_SHR;
+		case 0x07: return CHIP8_RSB;
+		case 0x0E: return CHIP8_SHL;
 		}
-		break;
+		return CHIP8_INVALID;
 	case 0x9000:
-		if (n){
-			/* Istruzione 9xxx non valida */
-			snprintf(buf, len, "; Invalid %04Xh", opcode);
-			break;
-		}
-
-		/* Salta la prossima istruzione se V[x] != V[y] */
-		snprintf(buf, len, "SKIPNE V%1X, V%1X", x, y);
-		break;
+		return (opcode & 0x000F) ? CHIP8_INVALID : CHIP8_SKIPNE_V;
 	case 0xA000:
-		/* Imposta I a NNN */
-	    snprintf(buf, len, "LD I, %03Xh", nnn);
-		break;
+		return CHIP8_LD_I;
 	case 0xB000:
-		/* Salta a NNN + V0 */
-		snprintf(buf, len, "JP %03Xh + V0", nnn);
-		/* TODO: label? */
-		break;
+		return CHIP8_JP_V0;
 	case 0xC000:
-		/* Imposta V[x] al risultato di AND logico tra NN ed un numero casuale */
-		snprintf(buf, len, "RAND V%1X", x);
-		break;
+		return CHIP8_RAND;
 	case 0xD000:
-		/* Disegna N righe dello sprite puntato da I alla posizione (V[x], V[y]) */
-		snprintf(buf, len, "DRAW V%1X, V%1X, %1Xh", x, y, n);
-		break;
+		return CHIP8_DRAW;
 	case 0xE000:
 		/* Salti condizionati in base all'input */
 		switch (opcode & 0x00FF){
-		case 0x9E:
-			/* Salta la prossima istruzione se il tasto con valore V[x] è premuto */
-			snprintf(buf, len, "SKIPDN V%1X", x);
-			break;
-		case 0xA1:
-			/* Salta la prossima istruzione se il tasto con valore V[x] NON è premuto */
-			snprintf(buf, len, "SKIPUP V%1X", x);
-			break;
-		default:
-			/* Istruzione Exxx non valida */
-			snprintf(buf, len, "; Invalid %04Xh", opcode);
-			break;
+		case 0x9E: return CHIP8_SKIPDN;
+		case 0xA1: return CHIP8_SKIPUP;
 		}
-		break;
-	case 0xF000:
+		return CHIP8_INVALID;
+	default:
 		/* Funzioni miste input, timer, BCD e memoria */
 		switch (opcode & 0x00FF){
-		case 0x07:
-			/* Imposta V[x] con valore uguale al delay timer */
-			snprintf(buf, len, "LD V%1X, DT", x);
-			break;
-		case 0x0A:
-			/* Attendi la pressione di un tasto e scrivi il valore in V[x] */
-			snprintf(buf, len, "IN V%1X", x);
-			break;
-		case 0x15:
-			/* Imposta il delay timer con valore uguale a V[x] */
-			snprintf(buf, len, "LD DT, V%1X", x);
-			break;
-		case 0x18:
-			/* Imposta il sound timer con valore uguale a V[x] */
-			snprintf(buf, len, "LD ST, V%1X", x);
-			break;
-		case 0x1E:
-			/* Somma V[x] ad I */
-			snprintf(buf, len, "ADD I, V%1X", x);
-			break;
-		case 0x29:
-			/* Imposta I con valore uguale all'indirizzo dello sprite 4x5
-			 * per il carattere hex di V[x] */
-			snprintf(buf, len, "SPRITE V%1X", x);
-			break;
-		case 0x33:
-			/* Scrivi in memoria all'indirizzo contenuto in I
-			 * la rappresentazione NBCD unpacked di V[x],
-			 * partendo dalla cifra più significativa */
-			snprintf(buf, len, "BCD V%1X", x);
-			break;
-		case 0x55:
-			/* Scrivi i valori dei registri da V[0] a V[x] in memoria all'indirizzo contenuto in I */
-			snprintf(buf, len, "STOR V%1X", x);
-			break;
-		case 0x65:
-			/* Scrivi i valori in memoria all'indirizzo contenuto in I nei registri da V[0] a V[x] */
-			snprintf(buf, len, "LOAD V%1X", x);
+		case 0x07: return CHIP8_LD_VDT;
+		case 0x0A: return CHIP8_IN;
+		case 0x15: return CHIP8_LD_DT;
+		case 0x18: return CHIP8_LD_ST;
+		case 0x1E: return CHIP8_ADD_I;
+		case 0x29: return CHIP8_SPRITE;
+		case 0x33: return CHIP8_BCD;
+		case 0x55: return CHIP8_STOR;
+		case 0x65: return CHIP8_LOAD;
+		}
+		return CHIP8_INVALID;
+	}
+}
+
+static void build_table(void){
+	unsigned op;
+
+	for (op=0; op<65536; op++){
+		decode_table[op] = classify(op);
+	}
+}
+
+/* Ritorna la classe dell'istruzione opcode */
+unsigned chip8_decode_class(uint16_t opcode){
+	pthread_once(&decode_once, build_table);
+	return decode_table[opcode];
+}
+
+/* Ritorna il nome di una classe di istruzioni */
+const char *chip8_class_name(unsigned cls){
+	return (cls < CHIP8_CLASSES) ? classes[cls].name : NULL;
+}
+
+/* Scrive in buf il mnemonico dell'istruzione opcode; se label non è NULL,
+ * viene usato al posto dell'indirizzo per JP, CALL, BNNN e LD I.
+ * Ritorna il numero di caratteri scritti, senza il terminatore */
+size_t chip8_decode(uint16_t opcode, const char *label, char *buf, size_t len){
+	static const char hex[] = "0123456789ABCDEF";
+	const char *fmt;
+	char tmp[8];
+	size_t used, n, k;
+
+	if (!len){
+		return 0;
+	}
+
+	fmt = classes[chip8_decode_class(opcode)].fmt;
+
+	for (used=0; *fmt; fmt++){
+		n = 0;
+		switch (*fmt){
+		case SLOT_X:
+			tmp[n++] = hex[(opcode >> 8) & 0x0F];
+			break;
+		case SLOT_Y:
+			tmp[n++] = hex[(opcode >> 4) & 0x0F];
+			break;
+		case SLOT_N:
+			tmp[n++] = hex[opcode & 0x0F];
+			break;
+		case SLOT_NN:
+			tmp[n++] = hex[(opcode >> 4) & 0x0F];
+			tmp[n++] = hex[opcode & 0x0F];
+			break;
+		case SLOT_NNN:
+			if (label){
+				for (; *label && used + 1 < len; label++){
+					buf[used++] = *label;
+				}
+				continue;
+			}
+			/* Senza etichetta, come SLOT_ADDR */
+			/* fall through */
+		case SLOT_ADDR:
+			tmp[n++] = hex[(opcode >> 8) & 0x0F];
+			tmp[n++] = hex[(opcode >> 4) & 0x0F];
+			tmp[n++] = hex[opcode & 0x0F];
+			tmp[n++] = 'h';
+			break;
+		case SLOT_OP:
+			tmp[n++] = hex[(opcode >> 12) & 0x0F];
+			tmp[n++] = hex[(opcode >> 8) & 0x0F];
+			tmp[n++] = hex[(opcode >> 4) & 0x0F];
+			tmp[n++] = hex[opcode & 0x0F];
 			break;
 		default:
-			/* Istruzione Fxxx non valida */
-			snprintf(buf, len, "; Invalid %04Xh", opcode);
+			tmp[n++] = *fmt;
 			break;
 		}
-		break;
+
+		for (k=0; k<n && used + 1 < len; k++){
+			buf[used++] = tmp[k];
+		}
 	}
+
+	buf[used] = '\0';
+	return used;
 }
@@ -0,0 +1,495 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "chip8.h"
+#include "c8env.h"
+
+/* Ambienti dati ad un thread alla volta: abbastanza da pagare il
+ * contatore condiviso, pochi perché i thread finiscano insieme */
+#define ENV_CHUNK 32
+
+/* Un ambiente: la macchina e quello che serve tra un passo e l'altro */
+struct env {
+	chip8_machine_t machine;
+	int64_t probes[C8ENV_MAX_PROBES]; /* Valori delle sonde alla fine del passo precedente */
+	uint8_t was[C8ENV_MAX_CONDS];   /* Condizioni vere alla fine del frame precedente */
+	uint16_t keys;          /* Azione del passo precedente */
+	uint16_t head;          /* Destinazione dell'ultimo salto all'indietro */
+	uint32_t laps, check;   /* Giri del ciclo che inizia a head, e quando controllarlo */
+	uint32_t frames;        /* Frame dall'inizio dell'episodio */
+	uint32_t seed;          /* Seme dell'episodio */
+} CHIP8_ALIGNED;
+
+struct c8env {
+	struct env *envs;
+	unsigned count;
+	c8env_config_t config;
+	chip8_image_t *image;
+
+	/* Passo in corso */
+	const uint16_t *actions;
+	unsigned skip;
+	uint8_t *obs;
+	float *rewards;
+	uint8_t *dones;
+	unsigned next;          /* Primo ambiente non ancora preso */
+	int failed;
+
+	/* Thread di lavoro, che aspettano una nuova generazione */
+	pthread_t *tids;
+	unsigned nthreads;
+	unsigned running;       /* Thread che non hanno finito il passo */
+	unsigned generation;
+	int quit;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+};
+
+/* Ogni byte della VRAM in 8 byte da 0 o 1, per le osservazioni espanse */
+static uint64_t unpack[256];
+static pthread_once_t unpack_once = PTHREAD_ONCE_INIT;
+
+static void init_unpack(void){
+	unsigned k, bit;
+
+	for (k=0; k<256; k++){
+		for (bit=0; bit<8; bit++){
+			((uint8_t *) &unpack[k])[bit] = (k >> (7 - bit)) & 1;
+		}
+	}
+}
+
+/* Legge il byte di una sonda o condizione, RAM o registro */
+static inline uint8_t probe_byte(const chip8_machine_t *m, uint16_t addr){
+	return (addr & 0x1000) ? m->v[addr & 0xF] : chip8_peek(m, addr);
+}
+
+static int64_t probe_value(const chip8_machine_t *m, const c8env_probe_t *p){
+	int64_t value;
+	unsigned k;
+
+	if (p->addr & 0x1000){
+		return m->v[p->addr & 0xF];
+	}
+
+	for (value=0, k=0; k<p->len; k++){
+		value = p->bcd ? value * 10 + chip8_peek(m, p->addr + k)
+			: value << 8 | chip8_peek(m, p->addr + k);
+	}
+
+	return value;
+}
+
+static int cond_true(const chip8_machine_t *m, const c8env_cond_t *c){
+	uint8_t value;
+
+	value = probe_byte(m, c->addr);
+	switch (c->op){
+	case CHIP8_COND_EQ:
+		return value == c->value;
+	case CHIP8_COND_NE:
+		return value != c->value;
+	case CHIP8_COND_LT:
+		return value < c->value;
+	case CHIP8_COND_GT:
+		return value > c->value;
+	}
+
+	return 0;
+}
+
+/* Registra sonde e condizioni all'inizio di un episodio */
+static void observe(const c8env_t *env, struct env *e){
+	unsigned k;
+
+	for (k=0; k<env->config.nprobes; k++){
+		e->probes[k] = probe_value(&e->machine, &env->config.probes[k]);
+	}
+	for (k=0; k<env->config.nconds; k++){
+		e->was[k] = cond_true(&e->machine, &env->config.conds[k]);
+	}
+}
+
+/* Fa partire un nuovo episodio, ognuno con il suo seme */
+static void restart(c8env_t *env, struct env *e){
+	chip8_reset(&e->machine, e->seed);
+	e->seed += env->count;
+	e->keys = 0;
+	e->head = 0xFFFF;
+	e->laps = 0;
+	e->check = 4;
+	e->frames = 0;
+	observe(env, e);
+}
+
+static void write_obs(const c8env_t *env, const struct env *e, uint8_t *obs){
+	unsigned k;
+
+	if (!(env->config.flags & C8ENV_UNPACKED)){
+		memcpy(obs, e->machine.vram, C8ENV_OBS_PACKED);
+		return;
+	}
+
+	for (k=0; k<CHIP8_VRAM_SIZE; k++){
+		memcpy(obs + k * 8, &unpack[e->machine.vram[k]], 8);
+	}
+}
+
+/* Applica l'azione: i tasti nuovi contano anche per FX0A */
+static void set_keys(struct env *e, uint16_t mask){
+	uint8_t keys[16];
+	unsigned k;
+
+	if (mask == e->keys){
+		return;
+	}
+
+	for (k=0; k<16; k++){
+		keys[k] = (mask >> k) & 1;
+	}
+
+	chip8_update_keys(&e->machine, keys);
+	if (mask & ~e->keys){
+		chip8_pressed(&e->machine, __builtin_ctz(mask & ~e->keys));
+	}
+	e->keys = mask;
+}
+
+/* Esegue un frame; come in c8d, chip8_idle si controlla solo quando lo
+ * stesso ciclo ha fatto un numero di giri che raddoppia, e se la
+ * macchina aspetta il resto del frame non cambierebbe niente
+ * Ritorna 1 se il programma non può più andare avanti, -1 se la memoria
+ * è esaurita, 0 altrimenti */
+static int run_frame(struct env *e, unsigned ipf){
+	chip8_machine_t *m;
+	unsigned n, idle;
+	uint16_t pc;
+	int halted;
+
+	m = &e->machine;
+	halted = 0;
+
+	for (n=0; n<ipf; n += m->retired){
+		if (m->wait && !m->last_key){
+			break;
+		}
+
+		pc = m->pc;
+		if (chip8_exec(m) == 6){
+			return -1;
+		}
+
+		/* Anche un salto a sé stesso conta come ciclo */
+		if (m->pc <= pc){
+			if (m->pc != e->head){
+				e->head = m->pc;
+				e->laps = 0;
+				e->check = 4;
+			} else if (++e->laps == e->check){
+				e->check *= 2;
+				if ((idle = chip8_idle(m)) != 0){
+					halted = (idle == CHIP8_IDLE_HALT);
+					break;
+				}
+			}
+		}
+	}
+
+	chip8_update_timers(m, 17);
+	e->frames++;
+
+	return halted;
+}
+
+/* Passo di un ambiente: frame, ricompensa, fine episodio e osservazione
+ * Ritorna -1 se la memoria è esaurita, 0 altrimenti */
+static int step_env(c8env_t *env, unsigned idx){
+	const c8env_config_t *cfg;
+	struct env *e;
+	unsigned f, k;
+	int64_t value;
+	float reward;
+	uint8_t done, now;
+	int status;
+
+	cfg = &env->config;
+	e = &env->envs[idx];
+	done = 0;
+
+	set_keys(e, env->actions[idx]);
+
+	for (f=0; f<env->skip && !done; f++){
+		if ((status = run_frame(e, cfg->ipf)) < 0){
+			return -1;
+		}
+		if (status){
+			done |= C8ENV_DONE;
+		}
+
+		for (k=0; k<cfg->nconds; k++){
+			now = cond_true(&e->machine, &cfg->conds[k]);
+			if (now && !e->was[k]){
+				done |= C8ENV_DONE;
+			}
+			e->was[k] = now;
+		}
+
+		if (cfg->max_frames && e->frames >= cfg->max_frames){
+			done |= C8ENV_TRUNCATED;
+		}
+	}
+
+	for (reward=0, k=0; k<cfg->nprobes; k++){
+		value = probe_value(&e->machine, &cfg->probes[k]);
+		reward += cfg->probes[k].scale * (float) (value - e->probes[k]);
+		e->probes[k] = value;
+	}
+
+	/* L'osservazione di un ambiente appena ripartito è la prima del
+	 * nuovo episodio, come nelle altre API vettoriali */
+	if (done && (cfg->flags & C8ENV_AUTORESET)){
+		restart(env, e);
+	}
+
+	if (env->rewards){
+		env->rewards[idx] = reward;
+	}
+	if (env->dones){
+		env->dones[idx] = done;
+	}
+	if (env->obs){
+		write_obs(env, e, env->obs + idx * c8env_obs_size(env));
+	}
+
+	return 0;
+}
+
+/* Prende blocchi di ambienti finché ce ne sono */
+static void run_chunks(c8env_t *env){
+	unsigned first, idx, end;
+
+	while ((first = __sync_fetch_and_add(&env->next, ENV_CHUNK)) < env->count){
+		end = (first + ENV_CHUNK < env->count) ? first + ENV_CHUNK : env->count;
+		for (idx=first; idx<end; idx++){
+			if (step_env(env, idx)){
+				env->failed = 1;
+			}
+		}
+	}
+}
+
+/* Thread di lavoro: ad ogni nuova generazione partecipa al passo */
+static void *env_worker(void *arg){
+	c8env_t *env;
+	unsigned seen;
+
+	env = arg;
+	seen = 0;
+
+	pthread_mutex_lock(&env->lock);
+	while (1){
+		while (env->generation == seen && !env->quit){
+			pthread_cond_wait(&env->start, &env->lock);
+		}
+		if (env->quit){
+			break;
+		}
+		seen = env->generation;
+		pthread_mutex_unlock(&env->lock);
+
+		run_chunks(env);
+
+		pthread_mutex_lock(&env->lock);
+		if (!--env->running){
+			pthread_cond_signal(&env->done);
+		}
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	return NULL;
+}
+
+/* Crea count ambienti che eseguono la ROM; la configurazione viene
+ * copiata. Ritorna NULL se la memoria è esaurita o la configurazione
+ * non è valida */
+c8env_t *c8env_new(const void *rom, size_t len, unsigned count, const c8env_config_t *config){
+	c8env_t *env;
+	unsigned k, threads;
+
+	if (!count || config->nprobes > C8ENV_MAX_PROBES || config->nconds > C8ENV_MAX_CONDS){
+		return NULL;
+	}
+	for (k=0; k<config->nprobes; k++){
+		if (config->probes[k].len < 1 || config->probes[k].len > 4){
+			return NULL;
+		}
+	}
+
+	pthread_once(&unpack_once, init_unpack);
+
+	if ((env = calloc(1, sizeof(c8env_t))) == NULL){
+		return NULL;
+	}
+
+	env->count = count;
+	env->config = *config;
+	if (!env->config.ipf){
+		env->config.ipf = C8ENV_IPF;
+	}
+	pthread_mutex_init(&env->lock, NULL);
+	pthread_cond_init(&env->start, NULL);
+	pthread_cond_init(&env->done, NULL);
+
+	if ((env->image = chip8_image_new(rom, len)) == NULL
+		|| posix_memalign((void **) &env->envs, 64, count * sizeof(struct env))){
+		env->envs = NULL;
+		goto fail;
+	}
+	memset(env->envs, 0, count * sizeof(struct env));
+
+	for (k=0; k<count; k++){
+		if (chip8_try_init(&env->envs[k].machine)){
+			goto fail;
+		}
+		chip8_set_quirks(&env->envs[k].machine, config->quirks);
+		chip8_attach(&env->envs[k].machine, env->image);
+		env->envs[k].seed = config->seed + k;
+		restart(env, &env->envs[k]);
+	}
+
+	/* Anche il chiamante lavora, quindi un thread in meno */
+	threads = config->threads;
+	if (!threads){
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	}
+	if (threads > (count + ENV_CHUNK - 1) / ENV_CHUNK){
+		threads = (count + ENV_CHUNK - 1) / ENV_CHUNK;
+	}
+
+	if ((env->tids = malloc(threads * sizeof(pthread_t))) == NULL){
+		goto fail;
+	}
+
+	/* Se un thread non parte, gli altri si divideranno il lavoro */
+	for (env->nthreads=0; env->nthreads<threads - 1; env->nthreads++){
+		if (pthread_create(&env->tids[env->nthreads], NULL, env_worker, env)){
+			break;
+		}
+	}
+
+	return env;
+
+ fail:
+	c8env_free(env);
+	return NULL;
+}
+
+void c8env_free(c8env_t *env){
+	unsigned k;
+
+	if (!env){
+		return;
+	}
+
+	pthread_mutex_lock(&env->lock);
+	env->quit = 1;
+	pthread_cond_broadcast(&env->start);
+	pthread_mutex_unlock(&env->lock);
+
+	for (k=0; k<env->nthreads; k++){
+		pthread_join(env->tids[k], NULL);
+	}
+	free(env->tids);
+
+	/* Le macchine non inizializzate hanno la VRAM a NULL */
+	if (env->envs){
+		for (k=0; k<env->count && env->envs[k].machine.vram; k++){
+			chip8_release(&env->envs[k].machine);
+		}
+		free(env->envs);
+	}
+
+	chip8_image_release(env->image);
+	pthread_mutex_destroy(&env->lock);
+	pthread_cond_destroy(&env->start);
+	pthread_cond_destroy(&env->done);
+	free(env);
+}
+
+/* Byte dell'osservazione di un ambiente */
+size_t c8env_obs_size(const c8env_t *env){
+	return (env->config.flags & C8ENV_UNPACKED) ? C8ENV_OBS_UNPACKED : C8ENV_OBS_PACKED;
+}
+
+/* Fa ripartire tutti gli ambienti, ognuno con il prossimo seme, e
+ * scrive le osservazioni iniziali in obs se non è NULL
+ * Ritorna 0 */
+int c8env_reset(c8env_t *env, uint8_t *obs){
+	unsigned k;
+
+	for (k=0; k<env->count; k++){
+		restart(env, &env->envs[k]);
+		if (obs){
+			write_obs(env, &env->envs[k], obs + k * c8env_obs_size(env));
+		}
+	}
+
+	return 0;
+}
+
+/* Esegue un passo di tutti gli ambienti: l'ambiente k tiene premuti i
+ * tasti di actions[k] (un bit per tasto) per frame_skip frame, o finché
+ * l'episodio non finisce. In obs (count * c8env_obs_size byte), rewards
+ * e dones (count elementi) vengono scritti osservazione, ricompensa e
+ * C8ENV_DONE/C8ENV_TRUNCATED; ognuno può essere NULL. Senza
+ * C8ENV_AUTORESET un ambiente finito va fatto ripartire con c8env_reset
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita: un
+ * ambiente rimasto senza memoria si è fermato prima dell'istruzione
+ * che scriveva, senza risultati, e al passo dopo riprende da lì */
+int c8env_step(c8env_t *env, const uint16_t *actions, unsigned frame_skip,
+			   uint8_t *obs, float *rewards, uint8_t *dones){
+	env->actions = actions;
+	env->skip = frame_skip ? frame_skip : 1;
+	env->obs = obs;
+	env->rewards = rewards;
+	env->dones = dones;
+	env->next = 0;
+	env->failed = 0;
+
+	pthread_mutex_lock(&env->lock);
+	env->running = env->nthreads;
+	env->generation++;
+	pthread_cond_broadcast(&env->start);
+	pthread_mutex_unlock(&env->lock);
+
+	run_chunks(env);
+
+	/* Il passo dopo può partire solo quando tutti hanno finito questo */
+	pthread_mutex_lock(&env->lock);
+	while (env->running){
+		pthread_cond_wait(&env->done, &env->lock);
+	}
+	pthread_mutex_unlock(&env->lock);
+
+	return env->failed ? -1 : 0;
+}
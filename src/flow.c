@@ -0,0 +1,408 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h> /* snprintf */
+#include <string.h> /* memset */
+#include <stdint.h> /* uint8_t, uint16_t */
+
+#include "chip8.h"
+#include "flow.h"
+
+/* Analisi del flusso di controllo di un programma CHIP-8: a differenza
+ * di una lettura lineare, segue i salti a partire da 0x200, così da
+ * separare il codice dai dati e ricostruire blocchi base e chiamate */
+
+/* Legge l'opcode all'indirizzo addr, i byte fuori dal programma valgono zero */
+static uint16_t fetch(const uint8_t *prog, uint16_t end, uint16_t addr){
+	uint16_t hi, lo;
+
+	hi = (addr >= 0x200 && addr < end) ? prog[addr - 0x200] : 0;
+	lo = (addr >= 0x1FF && addr + 1 < end) ? prog[addr + 1 - 0x200] : 0;
+
+	return (hi << 8) | lo;
+}
+
+/* Classifica un'istruzione in base al suo effetto sul flusso */
+enum flow_op flow_classify(uint16_t opcode){
+	switch (opcode & 0xF000){
+	case 0x0000:
+		if (opcode == 0x00E0){
+			return FLOW_OP_NEXT;
+		} else if (opcode == 0x00EE){
+			return FLOW_OP_RET;
+		}
+		/* Programmi RCA1802 non supportati */
+		return FLOW_OP_INVALID;
+	case 0x1000:
+		return FLOW_OP_JUMP;
+	case 0x2000:
+		return FLOW_OP_CALL;
+	case 0x3000:
+	case 0x4000:
+		return FLOW_OP_SKIP;
+	case 0x5000:
+	case 0x9000:
+		return (opcode & 0x000F) ? FLOW_OP_INVALID : FLOW_OP_SKIP;
+	case 0x8000:
+		switch (opcode & 0x000F){
+		case 0x00: case 0x01: case 0x02: case 0x03: case 0x04:
+		case 0x05: case 0x06: case 0x07: case 0x0E:
+			return FLOW_OP_NEXT;
+		}
+		return FLOW_OP_INVALID;
+	case 0xB000:
+		return FLOW_OP_COMPUTED;
+	case 0xE000:
+		switch (opcode & 0x00FF){
+		case 0x9E: case 0xA1:
+			return FLOW_OP_SKIP;
+		}
+		return FLOW_OP_INVALID;
+	case 0xF000:
+		switch (opcode & 0x00FF){
+		case 0x07: case 0x0A: case 0x15: case 0x18:
+		case 0x1E: case 0x29: case 0x65:
+			return FLOW_OP_NEXT;
+		case 0x33: case 0x55:
+			return FLOW_OP_STORE;
+		}
+		return FLOW_OP_INVALID;
+	}
+
+	/* 6XNN, 7XNN, ANNN, CXNN, DXYN */
+	return FLOW_OP_NEXT;
+}
+
+/* Aggiunge un indirizzo alla lista di quelli da visitare,
+ * ogni indirizzo entra nella lista al più una volta */
+static void enqueue(flow_t *flow, uint16_t *queue, uint8_t *queued, unsigned *count, uint16_t addr){
+	if (addr < 0x200 || addr >= flow->end || queued[addr]){
+		return;
+	}
+
+	queued[addr] = 1;
+	queue[(*count)++] = addr;
+}
+
+/* Prima fase: segue tutti i percorsi a partire da 0x200 marcando il codice */
+static void trace(flow_t *flow, const uint8_t *prog){
+	uint16_t queue[4096];
+	uint8_t queued[4096];
+	unsigned count, t;
+	uint16_t addr, opcode, nnn;
+	int stop;
+
+	count = 0;
+	memset(queued, 0, sizeof(queued));
+	enqueue(flow, queue, queued, &count, 0x200);
+
+	while (count){
+		addr = queue[--count];
+
+		for (stop=0; !stop && addr + 1 < flow->end && !(flow->map[addr] & FLOW_CODE); addr += 2){
+			opcode = fetch(prog, flow->end, addr);
+			nnn = opcode & 0x0FFF;
+
+			switch (flow_classify(opcode)){
+			case FLOW_OP_INVALID:
+				/* Non è codice, lasciamo i byte come dati */
+				stop = 1;
+				continue;
+			case FLOW_OP_NEXT:
+			case FLOW_OP_STORE:
+				if ((opcode & 0xF000) == 0xA000){
+					flow->map[nnn] |= FLOW_DATA;
+				}
+				break;
+			case FLOW_OP_SKIP:
+				enqueue(flow, queue, queued, &count, addr + 4);
+				break;
+			case FLOW_OP_JUMP:
+				flow->map[nnn] |= FLOW_LABEL;
+				enqueue(flow, queue, queued, &count, nnn);
+				stop = 1;
+				break;
+			case FLOW_OP_CALL:
+				flow->map[nnn] |= FLOW_LABEL | FLOW_PROC;
+				enqueue(flow, queue, queued, &count, nnn);
+				break;
+			case FLOW_OP_RET:
+				stop = 1;
+				break;
+			case FLOW_OP_COMPUTED:
+				/* La destinazione dipende da un registro, seguiamo la base
+				 * e, se ci troviamo una tabella di JP, anche le altre voci */
+				flow->map[addr] |= FLOW_COMPUTED;
+				flow->map[nnn] |= FLOW_LABEL;
+				for (t=nnn; t<nnn + 256u && t + 1 < flow->end; t+=2){
+					if (t != nnn && (fetch(prog, flow->end, t) & 0xF000) != 0x1000){
+						break;
+					}
+					enqueue(flow, queue, queued, &count, t);
+				}
+				stop = 1;
+				break;
+			}
+
+			flow->map[addr] |= FLOW_CODE;
+			flow->map[addr + 1] |= FLOW_OPERAND;
+		}
+	}
+}
+
+/* Marca gli inizi dei blocchi base: l'ingresso, le destinazioni
+ * e le istruzioni che seguono salti, skip e chiamate */
+static void mark_leaders(flow_t *flow, const uint8_t *prog){
+	uint16_t addr, opcode;
+
+	flow->map[0x200] |= FLOW_BLOCK;
+
+	for (addr=0x200; addr<flow->end; addr++){
+		if (!(flow->map[addr] & FLOW_CODE)){
+			continue;
+		}
+
+		if (flow->map[addr] & FLOW_LABEL){
+			flow->map[addr] |= FLOW_BLOCK;
+		}
+
+		opcode = fetch(prog, flow->end, addr);
+		switch (flow_classify(opcode)){
+		case FLOW_OP_SKIP:
+			flow->map[(addr + 4) & 0x0FFF] |= FLOW_BLOCK;
+			/* fall-through */
+		case FLOW_OP_JUMP:
+		case FLOW_OP_CALL:
+		case FLOW_OP_RET:
+		case FLOW_OP_COMPUTED:
+			flow->map[(addr + 2) & 0x0FFF] |= FLOW_BLOCK;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Seconda fase: costruisce i blocchi base ed i loro successori */
+static void build_blocks(flow_t *flow, const uint8_t *prog){
+	flow_block_t *block;
+	uint16_t addr, end, opcode;
+	enum flow_op op;
+
+	for (addr=0x200; addr<flow->end && flow->nblocks<FLOW_MAX_BLOCKS; addr++){
+		if ((flow->map[addr] & (FLOW_CODE | FLOW_BLOCK)) != (FLOW_CODE | FLOW_BLOCK)){
+			continue;
+		}
+
+		block = &flow->blocks[flow->nblocks++];
+		block->start = addr;
+
+		/* Il blocco termina al primo salto o all'inizio di un altro blocco */
+		end = addr;
+		do {
+			opcode = fetch(prog, flow->end, end);
+			op = flow_classify(opcode);
+			end += 2;
+		} while ((op == FLOW_OP_NEXT || op == FLOW_OP_STORE) && end < flow->end
+				 && (flow->map[end] & FLOW_CODE) && !(flow->map[end] & FLOW_BLOCK));
+
+		block->end = end;
+		block->exit = op;
+		block->nsucc = 0;
+
+		switch (op){
+		case FLOW_OP_SKIP:
+			block->succ[block->nsucc++] = end;
+			block->succ[block->nsucc++] = end + 2;
+			break;
+		case FLOW_OP_JUMP:
+			block->succ[block->nsucc++] = opcode & 0x0FFF;
+			break;
+		case FLOW_OP_NEXT:
+		case FLOW_OP_STORE:
+		case FLOW_OP_CALL:
+			/* Dopo una chiamata si prosegue, la procedura è nel grafo delle chiamate */
+			if (end < flow->end && (flow->map[end] & FLOW_CODE)){
+				block->succ[block->nsucc++] = end;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Terza fase: segue il valore di I all'interno di ogni blocco
+ * per trovare le scritture che possono modificare il codice */
+static void find_stores(flow_t *flow, const uint8_t *prog, unsigned quirks){
+	unsigned b, count, k;
+	uint16_t addr, opcode, i;
+	int known;
+
+	for (b=0; b<flow->nblocks; b++){
+		known = 0;
+		i = 0;
+
+		for (addr=flow->blocks[b].start; addr<flow->blocks[b].end; addr+=2){
+			opcode = fetch(prog, flow->end, addr);
+			count = 0;
+
+			switch (opcode & 0xF0FF){
+			case 0xF033:
+				count = 3;
+				break;
+			case 0xF055:
+				count = ((opcode >> 8) & 0x0F) + 1;
+				break;
+			case 0xF065:
+				if (known && (quirks & CHIP8_QUIRK_MEM_INC_I)){
+					i = (i + ((opcode >> 8) & 0x0F) + 1) & 0x0FFF;
+				}
+				break;
+			case 0xF01E:
+			case 0xF029:
+				known = 0;
+				break;
+			default:
+				if ((opcode & 0xF000) == 0xA000){
+					i = opcode & 0x0FFF;
+					known = 1;
+				}
+				break;
+			}
+
+			if (!count){
+				continue;
+			}
+
+			if (!known){
+				flow->map[addr] |= FLOW_WILD_STORE;
+				continue;
+			}
+
+			for (k=0; k<count; k++){
+				if (flow->map[(i + k) & 0x0FFF] & (FLOW_CODE | FLOW_OPERAND)){
+					flow->map[addr] |= FLOW_SMC;
+				}
+			}
+
+			if (quirks & CHIP8_QUIRK_MEM_INC_I && (opcode & 0x00FF) == 0x55){
+				i = (i + count) & 0x0FFF;
+			}
+		}
+	}
+}
+
+/* Ritorna il blocco che contiene addr, o NULL */
+const flow_block_t *flow_block_at(const flow_t *flow, uint16_t addr){
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = flow->nblocks;
+
+	/* I blocchi sono ordinati per indirizzo di inizio */
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (flow->blocks[mid].start > addr){
+			hi = mid;
+		} else if (flow->blocks[mid].end <= addr){
+			lo = mid + 1;
+		} else {
+			return &flow->blocks[mid];
+		}
+	}
+
+	return NULL;
+}
+
+/* Quarta fase: costruisce il grafo delle chiamate visitando i blocchi
+ * di ogni procedura senza entrare in quelle chiamate */
+static void build_calls(flow_t *flow, const uint8_t *prog){
+	uint8_t seen[FLOW_MAX_BLOCKS];
+	uint16_t stack[FLOW_MAX_BLOCKS];
+	const flow_block_t *block, *next;
+	unsigned sp, s;
+	uint16_t entry;
+
+	for (entry=0x200; entry<flow->end; entry++){
+		if (entry != 0x200 && !(flow->map[entry] & FLOW_PROC)){
+			continue;
+		}
+
+		if (!(block = flow_block_at(flow, entry))){
+			continue;
+		}
+
+		flow->nprocs++;
+		memset(seen, 0, flow->nblocks);
+		sp = 0;
+		stack[sp++] = block - flow->blocks;
+		seen[block - flow->blocks] = 1;
+
+		while (sp){
+			block = &flow->blocks[stack[--sp]];
+
+			if (block->exit == FLOW_OP_CALL && flow->ncalls < FLOW_MAX_CALLS){
+				flow->calls[flow->ncalls++] = (flow_call_t) {
+					entry,
+					fetch(prog, flow->end, block->end - 2) & 0x0FFF,
+					block->end - 2
+				};
+			}
+
+			for (s=0; s<block->nsucc; s++){
+				next = flow_block_at(flow, block->succ[s]);
+				if (next && !seen[next - flow->blocks]){
+					seen[next - flow->blocks] = 1;
+					stack[sp++] = next - flow->blocks;
+				}
+			}
+		}
+	}
+}
+
+/* Analizza il programma prog di len byte caricato a 0x200, con le
+ * quirk indicate, e scrive il risultato in flow */
+void flow_analyze(flow_t *flow, const uint8_t *prog, size_t len, unsigned quirks){
+	memset(flow, 0, sizeof(flow_t));
+
+	if (len > 0x0E00){
+		len = 0x0E00;
+	}
+	flow->end = 0x200 + len;
+
+	trace(flow, prog);
+	mark_leaders(flow, prog);
+	build_blocks(flow, prog);
+	find_stores(flow, prog, quirks);
+	build_calls(flow, prog);
+}
+
+/* Scrive in buf il nome dell'etichetta sintetizzata per addr */
+void flow_label(const flow_t *flow, uint16_t addr, char *buf, size_t len){
+	uint16_t flags;
+
+	flags = flow->map[addr & 0x0FFF];
+
+	if (flags & FLOW_PROC){
+		snprintf(buf, len, "sub_%03X", addr);
+	} else if (flags & FLOW_CODE){
+		snprintf(buf, len, "L_%03X", addr);
+	} else {
+		snprintf(buf, len, "data_%03X", addr);
+	}
+}
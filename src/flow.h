@@ -0,0 +1,82 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FLOW_H_
+#define _FLOW_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Numero massimo di blocchi e chiamate: al massimo uno per indirizzo
+ * dell'area programma (0x200-0xFFF) */
+#define FLOW_MAX_BLOCKS 0x0E00
+#define FLOW_MAX_CALLS  0x0E00
+
+/* Flag per indirizzo della mappa */
+#define FLOW_CODE       0x0001 /* Inizio di un'istruzione raggiungibile */
+#define FLOW_OPERAND    0x0002 /* Secondo byte di un'istruzione */
+#define FLOW_BLOCK      0x0004 /* Inizio di un blocco base */
+#define FLOW_LABEL      0x0008 /* Destinazione di JP, CALL o BNNN */
+#define FLOW_PROC       0x0010 /* Inizio di una procedura (destinazione di CALL) */
+#define FLOW_DATA       0x0020 /* Indirizzo caricato in I */
+#define FLOW_COMPUTED   0x0040 /* Salto calcolato (BNNN) */
+#define FLOW_SMC        0x0080 /* Scrittura che modifica il codice */
+#define FLOW_WILD_STORE 0x0100 /* Scrittura ad un indirizzo non noto */
+
+/* Effetto di un'istruzione sul flusso di controllo */
+enum flow_op {
+	FLOW_OP_NEXT,     /* Prosegue all'istruzione successiva */
+	FLOW_OP_STORE,    /* Come sopra, ma scrive in memoria all'indirizzo I */
+	FLOW_OP_SKIP,     /* Può saltare l'istruzione successiva */
+	FLOW_OP_JUMP,     /* Salto incondizionato a NNN */
+	FLOW_OP_CALL,     /* Chiamata a procedura NNN */
+	FLOW_OP_RET,      /* Ritorno da procedura */
+	FLOW_OP_COMPUTED, /* Salto calcolato a NNN + V0 */
+	FLOW_OP_INVALID   /* Istruzione non valida */
+};
+
+/* Blocco base: sequenza di istruzioni [start, end) con un solo ingresso */
+typedef struct flow_block {
+	uint16_t start, end;
+	uint16_t succ[2];   /* Successori */
+	uint8_t nsucc;      /* Numero di successori */
+	uint8_t exit;       /* enum flow_op dell'ultima istruzione */
+} flow_block_t;
+
+/* Arco del grafo delle chiamate */
+typedef struct flow_call {
+	uint16_t caller;    /* Procedura chiamante */
+	uint16_t callee;    /* Procedura chiamata */
+	uint16_t site;      /* Indirizzo dell'istruzione CALL */
+} flow_call_t;
+
+/* Risultato dell'analisi, senza puntatori così da poter
+ * essere copiato o salvato su disco così com'è */
+typedef struct flow {
+	uint16_t end;                           /* Fine del programma */
+	uint16_t nblocks, ncalls, nprocs;
+	uint16_t map[4096];                     /* Flag FLOW_* per indirizzo */
+	flow_block_t blocks[FLOW_MAX_BLOCKS];   /* Ordinati per indirizzo */
+	flow_call_t calls[FLOW_MAX_CALLS];
+} flow_t;
+
+extern enum flow_op flow_classify(uint16_t opcode);
+extern void flow_analyze(flow_t *flow, const uint8_t *prog, size_t len, unsigned quirks);
+extern const flow_block_t *flow_block_at(const flow_t *flow, uint16_t addr);
+extern void flow_label(const flow_t *flow, uint16_t addr, char *buf, size_t len);
+
+#endif /* _FLOW_H_ */
@@ -0,0 +1,165 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* memfd_create */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "frames.h"
+
+/*
+ * Gli schermi vanno in una memfd, da passare ai client con SCM_RIGHTS,
+ * oppure in un oggetto POSIX con un nome, che un processo esterno apre
+ * con shm_open senza dover parlare con nessuno. La memfd viene sigillata
+ * perché i client non possano cambiarne la dimensione e, se non devono
+ * scrivere i tasti, neanche il contenuto.
+ *
+ * Lo schermo si scrive con un seqlock: seq diventa dispari, si copia la
+ * VRAM, seq torna pari; chi legge riprova se seq era dispari o è
+ * cambiato durante la copia. I tasti sono una sola parola scritta da
+ * fuori, e qui conta solo quando cambia.
+ */
+
+/* Crea la memoria condivisa con nslots slot vuoti; name è il nome
+ * dell'oggetto POSIX, con o senza la barra iniziale, o NULL per una
+ * memfd. Con keys non zero gli slot accettano i tasti
+ * Ritorna 0 in caso di successo, -1 in caso di errore */
+int frames_open(frames_t *f, const char *name, unsigned nslots, int keys){
+	unsigned slot;
+
+	memset(f, 0, sizeof(frames_t));
+	f->fd = -1;
+	f->nslots = nslots;
+	f->size = nslots * sizeof(c8shm_frame_t);
+	f->keys = keys;
+
+	if ((f->seen = calloc(nslots, sizeof(uint16_t))) == NULL){
+		err("impossibile allocare memoria");
+		goto fail;
+	}
+
+	if (name){
+		if ((f->name = malloc(strlen(name) + 2)) == NULL){
+			err("impossibile allocare memoria");
+			goto fail;
+		}
+		sprintf(f->name, "%s%s", (name[0] == '/') ? "" : "/", name);
+
+		/* Se non si apre non è nostro, e non va rimosso */
+		if ((f->fd = shm_open(f->name, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0){
+			err("impossibile creare la memoria condivisa %s", f->name);
+			free(f->name);
+			f->name = NULL;
+			goto fail;
+		}
+	} else {
+		f->fd = memfd_create("c8shm-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	}
+
+	if (f->fd < 0 || ftruncate(f->fd, f->size)){
+		err("impossibile creare la memoria degli schermi");
+		goto fail;
+	}
+
+	f->slots = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+	if (f->slots == MAP_FAILED){
+		f->slots = NULL;
+		err("impossibile mappare la memoria degli schermi");
+		goto fail;
+	}
+
+	if (!name){
+		fcntl(f->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#ifdef F_SEAL_FUTURE_WRITE
+		if (!keys){
+			fcntl(f->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+		}
+#endif
+		fcntl(f->fd, F_ADD_SEALS, F_SEAL_SEAL);
+	}
+
+	for (slot=0; slot<nslots; slot++){
+		f->slots[slot].flags = keys ? C8SHM_KEYS : 0;
+	}
+
+	return 0;
+
+ fail:
+	frames_close(f);
+	return -1;
+}
+
+/* Copia lo schermo di una sessione nel suo slot; quando lo slot cambia
+ * sessione i tasti lasciati dalla precedente vengono rilasciati */
+void frames_publish(frames_t *f, unsigned slot, uint32_t session, const uint8_t *vram){
+	c8shm_frame_t *frame;
+	uint32_t seq;
+
+	frame = &f->slots[slot];
+	seq = frame->seq;
+
+	__atomic_store_n(&frame->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (frame->session != session){
+		__atomic_store_n(&frame->keys, 0, __ATOMIC_RELAXED);
+		f->seen[slot] = 0;
+		frame->session = session;
+	}
+	memcpy(frame->vram, vram, sizeof(frame->vram));
+	__atomic_store_n(&frame->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Legge i tasti di uno slot in mask, un bit per tasto
+ * Ritorna i tasti cambiati dalla lettura precedente, zero se nessuno o
+ * se gli slot non accettano tasti */
+uint16_t frames_keys(frames_t *f, unsigned slot, uint16_t *mask){
+	uint16_t changed;
+
+	if (!f->keys){
+		return 0;
+	}
+
+	*mask = __atomic_load_n(&f->slots[slot].keys, __ATOMIC_ACQUIRE);
+	changed = *mask ^ f->seen[slot];
+	f->seen[slot] = *mask;
+
+	return changed;
+}
+
+/* Chiude la memoria condivisa; l'oggetto POSIX viene rimosso, ma chi
+ * lo ha già mappato continua a vederlo */
+void frames_close(frames_t *f){
+	if (f->slots){
+		munmap(f->slots, f->size);
+	}
+	if (f->fd >= 0){
+		close(f->fd);
+	}
+	if (f->name){
+		shm_unlink(f->name);
+		free(f->name);
+	}
+	free(f->seen);
+	memset(f, 0, sizeof(frames_t));
+	f->fd = -1;
+}
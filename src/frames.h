@@ -0,0 +1,42 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FRAMES_H_
+#define _FRAMES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "c8shm.h"
+
+/* Lato di chi pubblica gli schermi condivisi descritti in c8shm.h */
+typedef struct frames {
+	c8shm_frame_t *slots;
+	size_t size;
+	unsigned nslots;
+	int fd;
+	char *name;             /* Oggetto POSIX da rimuovere alla chiusura, o NULL */
+	uint16_t *seen;         /* Ultimi tasti letti da ogni slot */
+	int keys;               /* Non zero se i tasti vengono letti */
+} frames_t;
+
+extern int frames_open(frames_t *f, const char *name, unsigned nslots, int keys);
+extern void frames_publish(frames_t *f, unsigned slot, uint32_t session, const uint8_t *vram);
+extern uint16_t frames_keys(frames_t *f, unsigned slot, uint16_t *mask);
+extern void frames_close(frames_t *f);
+
+#endif /* _FRAMES_H_ */
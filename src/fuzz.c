@@ -0,0 +1,226 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "chip8.h"
+
+/*
+ * Bersaglio per il fuzzing dell'emulatore e dei programmi.
+ *
+ * Ogni input è composto da:
+ *   1 byte     quirk
+ *   1 byte     numero N di eventi della tastiera, al massimo FUZZ_KEYS
+ *   N*2 byte   eventi: attesa in scatti dei timer, poi tasto (bit 0-3)
+ *              e pressione (bit 4) o rilascio
+ *   il resto   il programma
+ *
+ * La stessa macchina viene riusata per tutti gli input: chip8_reset
+ * libera solo le pagine scritte dall'input precedente e
+ * chip8_image_update riscrive il programma nella stessa immagine,
+ * quindi un input costa quanto le istruzioni che esegue.
+ *
+ * Compilato con libFuzzer (configure --enable-libfuzzer) gli indirizzi
+ * eseguiti e i salti tra essi sono esportati come contatori di
+ * copertura aggiuntivi; altrimenti c8fuzz esegue i file indicati e
+ * dice quanto codice hanno coperto e quanti input al secondo esegue.
+ */
+
+#define FUZZ_STEPS 100000 /* Istruzioni massime per input */
+#define FUZZ_TICK  16     /* Istruzioni tra due scatti dei timer */
+#define FUZZ_KEYS  32     /* Eventi della tastiera massimi per input */
+#define FUZZ_SEED  0x2545F491
+
+/* Copertura del programma: esecuzioni per indirizzo e per salto
+ * (ogni coppia di indirizzi consecutivi non contigui) */
+#define EDGE_BITS 14
+
+#ifdef C8FUZZ_LIBFUZZER
+#define COUNTERS __attribute__((used, section("__libfuzzer_extra_counters")))
+#else
+#define COUNTERS
+#endif
+
+static uint8_t pc_hits[4096] COUNTERS;
+static uint8_t edge_hits[1 << EDGE_BITS] COUNTERS;
+
+static chip8_machine_t machine;
+static chip8_image_t *image;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* Carica il programma nell'immagine della macchina, riscrivendola solo
+ * se è cambiato; ritorna non zero se la memoria è esaurita */
+static int load(const uint8_t *prog, size_t len){
+	if (!image){
+		if (chip8_try_init(&machine) || (image = chip8_image_new(prog, len)) == NULL){
+			return 1;
+		}
+
+		/* Il riferimento resta solo alla macchina */
+		chip8_attach(&machine, image);
+		chip8_image_release(image);
+	} else if (len != image->len || memcmp(image->ram + 0x200, prog, len)){
+		chip8_image_update(image, prog, len);
+	}
+
+	return 0;
+}
+
+static inline void cover(uint16_t from, uint16_t to){
+	pc_hits[to & 0x0FFF]++;
+
+	if (to != ((from + 2) & 0xFFFF)){
+		edge_hits[((from * 0x9E3779B1u) >> (32 - EDGE_BITS)) ^ (to & ((1 << EDGE_BITS) - 1))]++;
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+	const uint8_t *events;
+	uint8_t keys[16];
+	unsigned nkeys, k, step, due, tick;
+	uint16_t pc;
+
+	if (size < 2){
+		return 0;
+	}
+
+	nkeys = data[1];
+	if (nkeys > FUZZ_KEYS){
+		nkeys = FUZZ_KEYS;
+	}
+	if (2 + 2 * nkeys > size){
+		nkeys = (size - 2) / 2;
+	}
+	events = data + 2;
+
+	if (load(events + 2 * nkeys, size - 2 - 2 * nkeys)){
+		return 0;
+	}
+
+	chip8_set_quirks(&machine, data[0]);
+	chip8_reset(&machine, FUZZ_SEED);
+	memset(keys, 0, sizeof(keys));
+
+	k = 0;
+	due = nkeys ? events[0] * FUZZ_TICK : 0;
+	pc = machine.pc;
+
+	for (step=0, tick=0; step<FUZZ_STEPS; step += machine.retired){
+		for (; k < nkeys && step >= due; k++){
+			if (events[2 * k + 1] & 0x10){
+				keys[events[2 * k + 1] & 0x0F] = 1;
+				chip8_pressed(&machine, events[2 * k + 1] & 0x0F);
+			} else {
+				keys[events[2 * k + 1] & 0x0F] = 0;
+			}
+			chip8_update_keys(&machine, keys);
+
+			if (k + 1 < nkeys){
+				due += events[2 * (k + 1)] * FUZZ_TICK;
+			}
+		}
+
+		/* Un idioma conta come le istruzioni che sostituisce */
+		if (step >= tick){
+			chip8_update_timers(&machine, 17);
+			tick += FUZZ_TICK;
+		}
+
+		/* Un tasto che non arriverà più, o un'istruzione non valida */
+		if ((machine.wait && !machine.last_key && k == nkeys) || chip8_exec(&machine)){
+			break;
+		}
+
+		if (machine.pc != pc){
+			cover(pc, machine.pc);
+			pc = machine.pc;
+		} else if (!machine.wait){
+			/* Salto su se stesso: il programma è finito */
+			break;
+		}
+	}
+
+	return 0;
+}
+
+#ifndef C8FUZZ_LIBFUZZER
+
+/* Riesegue gli input indicati, ad esempio il corpus di un fuzzer */
+int main(int argc, char **argv){
+	static uint8_t buf[2 + 2 * FUZZ_KEYS + 0x0E00];
+	struct timespec start, end;
+	unsigned long runs, repeat, n;
+	unsigned pcs, edges, k;
+	size_t size;
+	double secs;
+	int opt, i;
+
+	repeat = 1;
+	while ((opt = getopt(argc, argv, "n:")) != -1){
+		switch (opt){
+		case 'n':
+			repeat = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind >= argc){
+		goto usage;
+	}
+
+	runs = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=optind; i<argc; i++){
+		if (!(size = read_file(argv[i], buf, sizeof(buf)))){
+			return 1;
+		}
+
+		for (n=0; n<repeat; n++, runs++){
+			LLVMFuzzerTestOneInput(buf, size);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (pcs=k=0; k<sizeof(pc_hits); k++){
+		pcs += pc_hits[k] != 0;
+	}
+	for (edges=k=0; k<sizeof(edge_hits); k++){
+		edges += edge_hits[k] != 0;
+	}
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%lu esecuzioni in %.3fs (%.0f al secondo), coperti %u indirizzi e %u salti\n",
+			runs, secs, secs > 0 ? runs / secs : 0.0, pcs, edges);
+
+	chip8_release(&machine);
+	return 0;
+
+ usage:
+	fprintf(stderr, "Usage: %s [-n VOLTE] INPUT...\n", argv[0]);
+	fprintf(stderr, "  -n  esegue ogni input più volte, per misurare la velocità\n");
+	return 1;
+}
+
+#endif /* C8FUZZ_LIBFUZZER */
@@ -0,0 +1,679 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <string.h>
+
+#include "c8as.h"
+#include "as.h"
+#include "symtab.h"
+#include "debuginfo.h"
+#include "util.h"
+
+/* Interfaccia dello scanner generato da flex (as_lex.l) */
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+
+struct yy_buffer_state;
+
+extern int asm_yylex_init_extra(struct asm_ctx *extra, yyscan_t *scanner);
+extern struct yy_buffer_state *asm_yy_scan_bytes(const char *bytes, int len, yyscan_t scanner);
+extern int asm_yylex_destroy(yyscan_t scanner);
+extern int asm_yyparse(yyscan_t scanner, struct asm_ctx *as);
+
+/* Riferimento ad un'etichetta non ancora risolta: l'indirizzo
+ * viene scritto nell'istruzione alla fine dell'assemblaggio */
+struct asm_fixup {
+	size_t offset;          /* Posizione dell'istruzione nel programma */
+	symbol_t *sym;
+	int line;
+	uint8_t section;        /* Negli oggetti: sezione dell'istruzione */
+	struct asm_fixup *next;
+};
+
+/* Sezione di un oggetto rilocabile */
+struct asm_section {
+	const char *name;
+	uint8_t *data;          /* C8AS_SECTION_SIZE byte */
+	size_t used;            /* Come asm_ctx.used, aggiornato quando si cambia sezione */
+};
+
+/* Stato di un assemblaggio: tutto quello che c8as teneva in variabili
+ * statiche, così che ogni thread possa avere il suo */
+struct asm_ctx {
+	uint8_t *out;           /* Buffer del chiamante */
+	size_t size, used;      /* used può superare size, vedi emit() */
+	arena_t arena;
+	symtab_t symbols;
+	struct asm_fixup *fixups;
+	c8as_result_t *res;
+	int status;             /* Primo errore, C8AS_OK se nessuno */
+	int fatal;              /* Non zero dopo un errore che ferma l'analisi */
+
+	/* Con l'ottimizzatore attivo il programma viene prima registrato
+	 * come sequenza di elementi e scritto solo alla fine */
+	int optimize;
+	asm_item_t *items;
+	size_t nitems, itemsize;
+
+	/* Informazioni di debug, raccolte se richieste */
+	dbginfo_t *dbg;
+
+	/* Negli oggetti ogni sezione ha il suo buffer, e out punta a
+	 * quello della sezione corrente; tutti i riferimenti alle
+	 * etichette restano fixup, scritti come rilocazioni */
+	int object;
+	struct asm_section sections[C8AS_MAX_SECTIONS];
+	unsigned nsections, section;
+};
+
+/* Registra un errore nel risultato; gli errori successivi ad uno
+ * fatale (memoria esaurita) sono solo conseguenze e vengono ignorati */
+void asm_error(struct asm_ctx *as, int code, int line, const char *fmt, ...){
+	c8as_error_t *e;
+	va_list ap;
+
+	if (as->fatal){
+		return;
+	}
+
+	if (as->status == C8AS_OK){
+		as->status = code;
+	}
+
+	if (code == C8AS_E_NOMEM){
+		as->fatal = 1;
+	}
+
+	if (as->res->nerrors++ >= C8AS_MAX_ERRORS){
+		return;
+	}
+
+	e = &as->res->errors[as->res->nerrors - 1];
+	e->code = code;
+	e->line = line;
+	va_start(ap, fmt);
+	vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+	va_end(ap);
+}
+
+static int nomem(struct asm_ctx *as){
+	asm_error(as, C8AS_E_NOMEM, 0, "impossibile allocare memoria");
+	return 1;
+}
+
+/* Scrive un byte nel programma; oltre la fine del buffer conta
+ * solo i byte, così il chiamante sa quanto spazio serve */
+static void emit(struct asm_ctx *as, uint8_t byte){
+	if (as->used < as->size){
+		as->out[as->used] = byte;
+	}
+	as->used++;
+}
+
+/* Copia una stringa del sorgente nell'arena dell'assembler,
+ * ritorna NULL se la memoria è esaurita */
+char *asm_strdup(struct asm_ctx *as, const char *str){
+	char *copy;
+
+	if ((copy = arena_strdup(&as->arena, str)) == NULL){
+		nomem(as);
+	}
+
+	return copy;
+}
+
+/* Scrive l'indirizzo delle etichette in tutte le istruzioni che le usano */
+static void resolve_fixups(struct asm_ctx *as){
+	struct asm_fixup *fix;
+
+	for (fix=as->fixups; fix; fix=fix->next){
+		if (!fix->sym->defined){
+			asm_error(as, C8AS_E_UNDEFINED, fix->line, "label sconosciuto: %s", fix->sym->name);
+			continue;
+		}
+
+		if (fix->offset + 1 < as->size){
+			as->out[fix->offset] |= (fix->sym->addr >> 8) & 0x0F;
+			as->out[fix->offset + 1] |= fix->sym->addr & 0xFF;
+		}
+	}
+}
+
+/* Registra la riga di sorgente che genera il codice all'indirizzo corrente */
+static int add_line(struct asm_ctx *as, int line){
+	if (as->dbg && dbginfo_add_line(as->dbg, 0x200 + as->used, line)){
+		return nomem(as);
+	}
+
+	return 0;
+}
+
+static void add_symbol(symbol_t *sym, void *arg){
+	struct asm_ctx *as = arg;
+
+	if (sym->defined && dbginfo_add_label(as->dbg, sym->addr, sym->name)){
+		nomem(as);
+	}
+}
+
+/* Registra un elemento del programma per l'ottimizzatore */
+static int record(struct asm_ctx *as, uint8_t type, uint16_t value, symbol_t *sym, int line){
+	asm_item_t *items;
+
+	if (as->nitems == as->itemsize){
+		as->itemsize = as->itemsize ? as->itemsize * 2 : 1024;
+		if ((items = realloc(as->items, as->itemsize * sizeof(asm_item_t))) == NULL){
+			return nomem(as);
+		}
+		as->items = items;
+	}
+
+	as->items[as->nitems++] = (asm_item_t) { type, 0, 0x200 + as->used, value, sym, line };
+	return 0;
+}
+
+/* Ottimizza gli elementi registrati e li scrive nel programma */
+static void optimize_items(struct asm_ctx *as){
+	asm_item_t *item;
+	size_t i;
+	int missing;
+
+	missing = 0;
+	for (i=0; i<as->nitems; i++){
+		if (as->items[i].type == ASM_ITEM_INSTR && as->items[i].sym && !as->items[i].sym->defined){
+			asm_error(as, C8AS_E_UNDEFINED, as->items[i].line, "label sconosciuto: %s",
+					  as->items[i].sym->name);
+			missing++;
+		}
+	}
+
+	if (missing){
+		return;
+	}
+
+	asm_optimize(as->items, as->nitems, &as->res->stats);
+
+	as->used = 0;
+	for (i=0; i<as->nitems; i++){
+		item = &as->items[i];
+		if (item->deleted){
+			continue;
+		}
+
+		if (item->type != ASM_ITEM_LABEL && add_line(as, item->line)){
+			return;
+		}
+
+		switch (item->type){
+		case ASM_ITEM_INSTR:
+			item->value |= item->sym ? (item->sym->addr & 0x0FFF) : 0;
+			emit(as, (item->value >> 8) & 0xFF);
+			emit(as, item->value & 0xFF);
+			break;
+		case ASM_ITEM_BYTE:
+			emit(as, item->value);
+			break;
+		case ASM_ITEM_RESB:
+			if (as->used < as->size){
+				memset(as->out + as->used, 0,
+					   as->size - as->used < item->value ? as->size - as->used : item->value);
+			}
+			as->used += item->value;
+			break;
+		}
+	}
+}
+
+int push_resb(struct asm_ctx *as, uint16_t count, int line){
+	uint16_t i;
+
+	if (as->optimize){
+		if (record(as, ASM_ITEM_RESB, count, NULL, line)){
+			return 1;
+		}
+		as->used += count;
+		return 0;
+	}
+
+	if (add_line(as, line)){
+		return 1;
+	}
+
+	for (i=0; i<count; i++){
+		emit(as, 0);
+	}
+	logd("RESB %ud\n", count);
+	return 0;
+}
+
+int push_byte(struct asm_ctx *as, uint8_t byte, int line){
+	if (as->optimize){
+		if (record(as, ASM_ITEM_BYTE, byte, NULL, line)){
+			return 1;
+		}
+		as->used++;
+		return 0;
+	}
+
+	if (add_line(as, line)){
+		return 1;
+	}
+
+	emit(as, byte);
+	logd("PUSHb %02X\n", byte);
+	return 0;
+}
+
+int push_label(struct asm_ctx *as, const char *label, int line){
+	symbol_t *sym;
+
+	if ((sym = symtab_intern(&as->symbols, label)) == NULL){
+		return nomem(as);
+	}
+
+	if (sym->defined){
+		/* Errore non fatale: si continua per trovarne altri */
+		asm_error(as, C8AS_E_REDEFINED, line, "label %s già definito alla riga %d",
+				  label, sym->line);
+		return 0;
+	}
+
+	if (sym->visibility == ASM_SYM_EXTERN){
+		asm_error(as, C8AS_E_REDEFINED, line, "label %s dichiarato EXTERN", label);
+		return 0;
+	}
+
+	sym->defined = 1;
+	sym->addr = as->object ? as->used : 0x200 + as->used;
+	sym->section = as->section;
+	sym->line = line;
+
+	logd("PUSHl %s = %04Xh\n", label, 0x200 + as->used);
+	if (as->optimize){
+		return record(as, ASM_ITEM_LABEL, 0, sym, line);
+	}
+	return 0;
+}
+
+int push_instr(struct asm_ctx *as, asm_instr_t instr){
+	struct asm_fixup *fix;
+	symbol_t *sym;
+
+	sym = NULL;
+	if (instr.label != NULL){
+		if ((sym = symtab_intern(&as->symbols, instr.label)) == NULL){
+			return nomem(as);
+		}
+
+		if (as->optimize){
+			/* Le etichette vengono risolte dopo l'ottimizzazione */
+		} else if (sym->defined && !as->object){
+			/* Etichetta già nota, la risolviamo subito */
+			instr.opcode |= sym->addr & 0x0FFF;
+		} else {
+			/* Riferimento in avanti, lo sistemiamo alla fine; negli
+			 * oggetti lo sistema il linker */
+			if ((fix = arena_alloc(&as->arena, sizeof(struct asm_fixup))) == NULL){
+				return nomem(as);
+			}
+			*fix = (struct asm_fixup) { as->used, sym, instr.line, as->section, as->fixups };
+			as->fixups = fix;
+		}
+	}
+
+	if (as->optimize){
+		if (record(as, ASM_ITEM_INSTR, instr.opcode, sym, instr.line)){
+			return 1;
+		}
+		as->used += 2;
+		return 0;
+	}
+
+	if (add_line(as, instr.line)){
+		return 1;
+	}
+
+	emit(as, (instr.opcode >> 8) & 0xFF);
+	emit(as, instr.opcode & 0xFF);
+
+	logd("PUSHi %04Xh\n", instr.opcode);
+	return 0;
+}
+
+/* Aggiunge una sezione vuota all'oggetto, ritorna non zero se la
+ * memoria è esaurita */
+static int new_section(struct asm_ctx *as, const char *name){
+	struct asm_section *sec;
+
+	sec = &as->sections[as->nsections];
+	if ((sec->data = arena_alloc(&as->arena, C8AS_SECTION_SIZE)) == NULL){
+		return nomem(as);
+	}
+	sec->name = name;
+	sec->used = 0;
+	as->nsections++;
+
+	return 0;
+}
+
+/* Passa alla sezione name, creandola se non esiste; nel programma
+ * piatto le sezioni restano nell'ordine del sorgente e la direttiva
+ * non ha effetto */
+int push_section(struct asm_ctx *as, const char *name, int line){
+	unsigned k;
+
+	if (!as->object){
+		return 0;
+	}
+
+	for (k=0; k<as->nsections && strcmp(as->sections[k].name, name); k++);
+
+	if (k == C8AS_MAX_SECTIONS){
+		asm_error(as, C8AS_E_OPERAND, line, "troppe sezioni, al massimo %d", C8AS_MAX_SECTIONS);
+		return 0;
+	}
+
+	if (k == as->nsections && new_section(as, name)){
+		return 1;
+	}
+
+	as->sections[as->section].used = as->used;
+	as->section = k;
+	as->out = as->sections[k].data;
+	as->used = as->sections[k].used;
+	return 0;
+}
+
+/* Dichiara un'etichetta GLOBAL o EXTERN; nel programma piatto non
+ * cambia niente, ma gli errori vengono segnalati lo stesso */
+int push_visibility(struct asm_ctx *as, const char *name, int visibility, int line){
+	symbol_t *sym;
+
+	if ((sym = symtab_intern(&as->symbols, name)) == NULL){
+		return nomem(as);
+	}
+
+	if (sym->visibility && sym->visibility != visibility){
+		asm_error(as, C8AS_E_REDEFINED, line, "label %s dichiarato sia GLOBAL che EXTERN", name);
+	} else if (visibility == ASM_SYM_EXTERN && sym->defined){
+		asm_error(as, C8AS_E_REDEFINED, line, "label %s dichiarato EXTERN ma definito alla riga %d",
+				  name, sym->line);
+	} else {
+		sym->visibility = visibility;
+	}
+
+	return 0;
+}
+
+/* Scrittura di un oggetto: i simboli vengono visitati due volte nello
+ * stesso ordine, la prima per numerarli e la seconda per scriverli */
+struct obj_writer {
+	struct asm_ctx *as;
+	uint8_t *out;
+	size_t size;
+	size_t symbols;         /* Posizione della tabella dei simboli */
+	size_t strings;         /* Posizione dei nomi */
+	uint32_t count;         /* Simboli visitati */
+	uint32_t strsize;       /* Byte dei nomi visitati */
+};
+
+/* Copia len byte in out alla posizione pos, se ci stanno */
+static void put(const struct obj_writer *w, size_t pos, const void *data, size_t len){
+	if (pos + len <= w->size){
+		memcpy(w->out + pos, data, len);
+	}
+}
+
+/* Nell'oggetto vanno le etichette definite e quelle esterne */
+static int obj_symbol(const symbol_t *sym){
+	return sym->defined || sym->visibility == ASM_SYM_EXTERN;
+}
+
+static void count_symbol(symbol_t *sym, void *arg){
+	struct obj_writer *w = arg;
+
+	if (sym->visibility == ASM_SYM_GLOBAL && !sym->defined){
+		asm_error(w->as, C8AS_E_UNDEFINED, 0, "label %s dichiarato GLOBAL ma mai definito", sym->name);
+	}
+
+	if (obj_symbol(sym)){
+		sym->index = w->count++;
+		w->strsize += strlen(sym->name) + 1;
+	}
+}
+
+static void write_symbol(symbol_t *sym, void *arg){
+	struct obj_writer *w = arg;
+	c8as_obj_symbol_t s;
+	size_t len;
+
+	if (!obj_symbol(sym)){
+		return;
+	}
+
+	len = strlen(sym->name) + 1;
+	s.name = w->strsize;
+	s.value = sym->defined ? sym->addr : 0;
+	s.section = sym->defined ? sym->section : 0;
+	s.flags = (sym->visibility == ASM_SYM_GLOBAL) ? C8AS_SYM_GLOBAL
+		: (sym->visibility == ASM_SYM_EXTERN) ? C8AS_SYM_EXTERN : 0;
+
+	put(w, w->symbols + sym->index * sizeof(s), &s, sizeof(s));
+	put(w, w->strings + w->strsize, sym->name, len);
+	w->strsize += len;
+}
+
+/* Scrive l'oggetto rilocabile in out, vedi c8as.h per il formato.
+ * Ritorna la dimensione dell'oggetto, anche se non entra in out */
+static size_t write_object(struct asm_ctx *as, uint64_t hash, uint8_t *out, size_t size){
+	struct obj_writer w = { as, out, size, 0, 0, 0, 0 };
+	c8as_obj_header_t hdr;
+	c8as_obj_section_t sec;
+	c8as_obj_reloc_t rel;
+	struct asm_fixup *fix;
+	size_t pos, data;
+	unsigned k;
+
+	as->sections[as->section].used = as->used;
+	for (k=0; k<as->nsections; k++){
+		if (as->sections[k].used > C8AS_SECTION_SIZE){
+			asm_error(as, C8AS_E_OVERFLOW, 0, "la sezione %s occupa %zu byte, al massimo %d",
+					  as->sections[k].name, as->sections[k].used, C8AS_SECTION_SIZE);
+		}
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	for (fix=as->fixups; fix; fix=fix->next){
+		if (!obj_symbol(fix->sym)){
+			asm_error(as, C8AS_E_UNDEFINED, fix->line, "label sconosciuto: %s", fix->sym->name);
+		}
+		hdr.nrelocs++;
+	}
+
+	/* I nomi delle sezioni vengono prima di quelli dei simboli */
+	for (k=0; k<as->nsections; k++){
+		w.strsize += strlen(as->sections[k].name) + 1;
+	}
+	symtab_foreach(&as->symbols, count_symbol, &w);
+	if (as->status != C8AS_OK){
+		return 0;
+	}
+
+	memcpy(hdr.magic, C8AS_OBJ_MAGIC, sizeof(hdr.magic));
+	hdr.version = C8AS_OBJ_VERSION;
+	hdr.nsections = as->nsections;
+	hdr.nsymbols = w.count;
+	hdr.strsize = w.strsize;
+	hdr.hash = hash;
+
+	w.symbols = sizeof(hdr) + hdr.nsections * sizeof(sec);
+	pos = w.symbols + hdr.nsymbols * sizeof(c8as_obj_symbol_t);
+	w.strings = pos + hdr.nrelocs * sizeof(rel);
+	data = w.strings + hdr.strsize;
+	for (k=0; k<as->nsections; k++){
+		data += as->sections[k].used;
+	}
+	hdr.size = data;
+	put(&w, 0, &hdr, sizeof(hdr));
+
+	for (fix=as->fixups; fix; fix=fix->next, pos+=sizeof(rel)){
+		rel = (c8as_obj_reloc_t) { fix->sym->index, fix->line, fix->offset, fix->section, 0 };
+		put(&w, pos, &rel, sizeof(rel));
+	}
+
+	w.strsize = 0;
+	data = w.strings + hdr.strsize;
+	for (k=0; k<as->nsections; k++){
+		sec = (c8as_obj_section_t) { w.strsize, data, as->sections[k].used };
+		put(&w, sizeof(hdr) + k * sizeof(sec), &sec, sizeof(sec));
+		put(&w, w.strings + w.strsize, as->sections[k].name, strlen(as->sections[k].name) + 1);
+		put(&w, data, as->sections[k].data, as->sections[k].used);
+		w.strsize += strlen(as->sections[k].name) + 1;
+		data += as->sections[k].used;
+	}
+	symtab_foreach(&as->symbols, write_symbol, &w);
+
+	return hdr.size;
+}
+
+/* Hash FNV-1a a 64 bit di un sorgente, scritto negli oggetti per
+ * sapere se vanno riassemblati; cambia anche col formato */
+uint64_t c8as_hash(const char *src, size_t len){
+	uint64_t h;
+	size_t i;
+
+	h = 14695981039346656037ull ^ C8AS_OBJ_VERSION;
+	for (i=0; i<len; i++){
+		h = (h ^ (uint8_t) src[i]) * 1099511628211ull;
+	}
+
+	return h;
+}
+
+/* Assembla len byte di sorgente in out, che può contenere size byte.
+ * Se dbg non è NULL vi vengono aggiunte etichette e righe del sorgente.
+ * Con C8AS_OBJECT in out viene scritto un oggetto rilocabile, e dbg
+ * non viene usato: etichette e indirizzi sono decisi da c8as_link.
+ * Ritorna C8AS_OK oppure il tipo del primo errore; in res il numero di
+ * byte del programma (quelli necessari, con C8AS_E_OVERFLOW) e gli errori */
+int c8as_assemble(const char *src, size_t len, uint8_t *out, size_t size,
+				  unsigned flags, struct dbginfo *dbg, c8as_result_t *res){
+	c8as_result_t local;
+	struct asm_ctx as;
+	yyscan_t scanner;
+	int parsed;
+
+	if (res == NULL){
+		res = &local;
+	}
+	memset(res, 0, sizeof(c8as_result_t));
+
+	memset(&as, 0, sizeof(struct asm_ctx));
+	as.out = out;
+	as.size = size;
+	as.res = res;
+	as.object = flags & C8AS_OBJECT;
+	as.optimize = (flags & C8AS_OPTIMIZE) && !as.object;
+	as.dbg = as.object ? NULL : dbg;
+	arena_init(&as.arena);
+
+	if (len > INT_MAX){
+		asm_error(&as, C8AS_E_NOMEM, 0, "sorgente troppo grande");
+		return as.status;
+	}
+
+	if (symtab_init(&as.symbols, &as.arena) || asm_yylex_init_extra(&as, &scanner)){
+		nomem(&as);
+		goto fail;
+	}
+
+	/* Negli oggetti si comincia da .text */
+	if (as.object){
+		if (new_section(&as, C8AS_SECTION_TEXT)){
+			asm_yylex_destroy(scanner);
+			goto fail;
+		}
+		as.out = as.sections[0].data;
+		as.size = C8AS_SECTION_SIZE;
+	}
+
+	/* Un solo passaggio: le etichette non ancora definite
+	 * vengono risolte alla fine da resolve_fixups() */
+	if (asm_yy_scan_bytes(src, len, scanner) == NULL){
+		nomem(&as);
+		parsed = 1;
+	} else {
+		parsed = asm_yyparse(scanner, &as);
+	}
+	asm_yylex_destroy(scanner);
+
+	if (!parsed && as.status == C8AS_OK){
+		if (as.object){
+			as.used = write_object(&as, c8as_hash(src, len), out, size);
+		} else if (as.optimize){
+			optimize_items(&as);
+		} else {
+			resolve_fixups(&as);
+		}
+	} else if (parsed && as.status == C8AS_OK){
+		/* YYABORT senza un errore registrato */
+		asm_error(&as, C8AS_E_SYNTAX, 0, "errore di sintassi");
+	}
+
+	if (as.status == C8AS_OK && as.dbg){
+		symtab_foreach(&as.symbols, add_symbol, &as);
+	}
+
+	res->len = as.used;
+	if (as.status == C8AS_OK && as.used > size){
+		asm_error(&as, C8AS_E_OVERFLOW, 0, "%s occupa %zu byte, il buffer %zu",
+				  as.object ? "l'oggetto" : "il programma", as.used, size);
+	}
+
+ fail:
+	free(as.items);
+	symtab_free(&as.symbols);
+	arena_free(&as.arena);
+
+	return as.status;
+}
+
+/* Descrizione di un tipo di errore */
+const char *c8as_strerror(int code){
+	static const char *const names[] = {
+		[C8AS_OK] = "nessun errore",
+		[C8AS_E_SYNTAX] = "errore di sintassi",
+		[C8AS_E_OPERAND] = "operando non valido",
+		[C8AS_E_UNDEFINED] = "etichetta non definita",
+		[C8AS_E_REDEFINED] = "etichetta già definita",
+		[C8AS_E_OVERFLOW] = "buffer troppo piccolo",
+		[C8AS_E_NOMEM] = "memoria esaurita",
+		[C8AS_E_OBJECT] = "oggetto non valido",
+	};
+
+	if (code < 0 || (size_t) code >= sizeof(names) / sizeof(names[0])){
+		return "errore sconosciuto";
+	}
+
+	return names[code];
+}
@@ -0,0 +1,364 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "c8as.h"
+#include "symtab.h"
+#include "debuginfo.h"
+#include "util.h"
+
+/* c8as_link: mette insieme gli oggetti scritti da c8as_assemble con
+ * C8AS_OBJECT. Le sezioni con lo stesso nome vengono accodate a partire
+ * da 0x200, nell'ordine in cui i nomi compaiono scorrendo i moduli,
+ * quindi il programma comincia con la prima sezione del primo modulo;
+ * poi ogni rilocazione riceve l'indirizzo del suo simbolo, cercato tra
+ * quelli GLOBAL di tutti i moduli se è EXTERN */
+
+/* Un oggetto già controllato, con le sue tabelle */
+struct link_obj {
+	const char *name;
+	const c8as_obj_header_t *hdr;
+	const c8as_obj_section_t *sections;
+	const c8as_obj_symbol_t *symbols;
+	const c8as_obj_reloc_t *relocs;
+	const char *strings;
+	const uint8_t *data;
+	uint32_t base[C8AS_MAX_SECTIONS];   /* Indirizzo di ogni sezione, 0 finché non è piazzata */
+};
+
+/* Stato di un collegamento */
+struct link_ctx {
+	c8as_result_t *res;
+	int status;             /* Primo errore, C8AS_OK se nessuno */
+	int fatal;
+	arena_t arena;
+	symtab_t globals;       /* Qui index è il modulo che definisce il simbolo */
+	struct link_obj *objs;
+	unsigned count;
+};
+
+/* Registra un errore nel risultato, come asm_error */
+static void link_error(struct link_ctx *ln, int code, int line, const char *fmt, ...){
+	c8as_error_t *e;
+	va_list ap;
+
+	if (ln->fatal){
+		return;
+	}
+
+	if (ln->status == C8AS_OK){
+		ln->status = code;
+	}
+
+	if (code == C8AS_E_NOMEM){
+		ln->fatal = 1;
+	}
+
+	if (ln->res->nerrors++ >= C8AS_MAX_ERRORS){
+		return;
+	}
+
+	e = &ln->res->errors[ln->res->nerrors - 1];
+	e->code = code;
+	e->line = line;
+	va_start(ap, fmt);
+	vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+	va_end(ap);
+}
+
+/* Controlla intestazione e dimensioni delle tabelle di un oggetto;
+ * ritorna l'intestazione, o NULL se data non è un oggetto di questa
+ * versione. Il contenuto delle tabelle viene controllato da c8as_link */
+const c8as_obj_header_t *c8as_object_header(const void *data, size_t len){
+	const c8as_obj_header_t *hdr;
+	uint64_t tables;
+
+	hdr = data;
+	if (len < sizeof(c8as_obj_header_t) || memcmp(hdr->magic, C8AS_OBJ_MAGIC, sizeof(hdr->magic))
+		|| hdr->version != C8AS_OBJ_VERSION || hdr->size > len || hdr->nsections > C8AS_MAX_SECTIONS){
+		return NULL;
+	}
+
+	tables = sizeof(c8as_obj_header_t) + (uint64_t) hdr->nsections * sizeof(c8as_obj_section_t)
+		+ (uint64_t) hdr->nsymbols * sizeof(c8as_obj_symbol_t)
+		+ (uint64_t) hdr->nrelocs * sizeof(c8as_obj_reloc_t) + hdr->strsize;
+
+	return (tables <= hdr->size) ? hdr : NULL;
+}
+
+/* Prepara un oggetto e controlla che ogni indice e posizione stia nei
+ * limiti, così il resto del linker non deve più farlo */
+static int check_object(struct link_obj *lo, const c8as_object_t *obj){
+	const c8as_obj_reloc_t *r;
+	const c8as_obj_symbol_t *s;
+	const c8as_obj_section_t *sec;
+	const uint8_t *p;
+	uint32_t k;
+
+	if ((lo->hdr = c8as_object_header(obj->data, obj->len)) == NULL){
+		return 1;
+	}
+
+	p = obj->data;
+	lo->name = obj->name;
+	lo->data = p;
+	lo->sections = (const void *) (p + sizeof(c8as_obj_header_t));
+	lo->symbols = (const void *) (lo->sections + lo->hdr->nsections);
+	lo->relocs = (const void *) (lo->symbols + lo->hdr->nsymbols);
+	lo->strings = (const char *) (lo->relocs + lo->hdr->nrelocs);
+	memset(lo->base, 0, sizeof(lo->base));
+
+	if (lo->hdr->strsize && lo->strings[lo->hdr->strsize - 1]){
+		return 1;
+	}
+
+	for (k=0; k<lo->hdr->nsections; k++){
+		sec = &lo->sections[k];
+		if (sec->name >= lo->hdr->strsize || sec->size > C8AS_SECTION_SIZE
+			|| sec->offset > lo->hdr->size || sec->size > lo->hdr->size - sec->offset){
+			return 1;
+		}
+	}
+
+	for (k=0; k<lo->hdr->nsymbols; k++){
+		s = &lo->symbols[k];
+		if (s->name >= lo->hdr->strsize || (!(s->flags & C8AS_SYM_EXTERN)
+			&& (s->section >= lo->hdr->nsections || s->value > lo->sections[s->section].size))){
+			return 1;
+		}
+	}
+
+	for (k=0; k<lo->hdr->nrelocs; k++){
+		r = &lo->relocs[k];
+		if (r->section >= lo->hdr->nsections || r->symbol >= lo->hdr->nsymbols
+			|| r->offset + 2u > lo->sections[r->section].size){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static const char *section_name(const struct link_obj *lo, unsigned k){
+	return lo->strings + lo->sections[k].name;
+}
+
+/* Assegna un indirizzo ad ogni sezione, ritorna la fine del programma */
+static uint32_t layout(struct link_ctx *ln){
+	struct link_obj *lo, *other;
+	unsigned o, k, p, j;
+	uint32_t addr;
+
+	addr = 0x200;
+	for (o=0; o<ln->count; o++){
+		lo = &ln->objs[o];
+		for (k=0; k<lo->hdr->nsections; k++){
+			if (lo->base[k]){
+				continue;
+			}
+
+			/* Nome nuovo: tutte le sezioni con questo nome, da qui in poi */
+			for (p=o; p<ln->count; p++){
+				other = &ln->objs[p];
+				for (j=0; j<other->hdr->nsections; j++){
+					if (!other->base[j] && !strcmp(section_name(lo, k), section_name(other, j))){
+						other->base[j] = addr;
+						addr += other->sections[j].size;
+					}
+				}
+			}
+		}
+	}
+
+	return addr;
+}
+
+/* Raccoglie i simboli GLOBAL di tutti i moduli */
+static void collect_globals(struct link_ctx *ln){
+	const c8as_obj_symbol_t *s;
+	struct link_obj *lo;
+	symbol_t *sym;
+	unsigned o, k;
+
+	for (o=0; o<ln->count; o++){
+		lo = &ln->objs[o];
+		for (k=0; k<lo->hdr->nsymbols; k++){
+			s = &lo->symbols[k];
+			if (!(s->flags & C8AS_SYM_GLOBAL)){
+				continue;
+			}
+
+			if ((sym = symtab_intern(&ln->globals, lo->strings + s->name)) == NULL){
+				link_error(ln, C8AS_E_NOMEM, 0, "impossibile allocare memoria");
+				return;
+			}
+
+			if (sym->defined){
+				link_error(ln, C8AS_E_REDEFINED, 0, "%s: label %s già definito in %s",
+						   lo->name, sym->name, ln->objs[sym->index].name);
+				continue;
+			}
+
+			sym->defined = 1;
+			sym->addr = lo->base[s->section] + s->value;
+			sym->index = o;
+		}
+	}
+}
+
+/* Indirizzo finale di un simbolo, o -1 se è esterno e non definito */
+static long symbol_addr(struct link_ctx *ln, const struct link_obj *lo, const c8as_obj_symbol_t *s){
+	const symbol_t *sym;
+
+	if (!(s->flags & C8AS_SYM_EXTERN)){
+		return lo->base[s->section] + s->value;
+	}
+
+	if ((sym = symtab_lookup(&ln->globals, lo->strings + s->name)) == NULL){
+		return -1;
+	}
+
+	return sym->addr;
+}
+
+/* Copia le sezioni nel programma e applica le rilocazioni */
+static void relocate(struct link_ctx *ln, uint8_t *out, size_t size){
+	const c8as_obj_reloc_t *r;
+	const c8as_obj_section_t *sec;
+	struct link_obj *lo;
+	unsigned o, k;
+	size_t pos;
+	long addr;
+
+	for (o=0; o<ln->count; o++){
+		lo = &ln->objs[o];
+		for (k=0; k<lo->hdr->nsections; k++){
+			sec = &lo->sections[k];
+			pos = lo->base[k] - 0x200;
+			if (pos + sec->size <= size){
+				memcpy(out + pos, lo->data + sec->offset, sec->size);
+			}
+		}
+
+		for (k=0; k<lo->hdr->nrelocs; k++){
+			r = &lo->relocs[k];
+			if ((addr = symbol_addr(ln, lo, &lo->symbols[r->symbol])) < 0){
+				link_error(ln, C8AS_E_UNDEFINED, r->line, "%s: label sconosciuto: %s",
+						   lo->name, lo->strings + lo->symbols[r->symbol].name);
+				continue;
+			}
+
+			pos = lo->base[r->section] - 0x200 + r->offset;
+			if (pos + 1 < size){
+				out[pos] |= (addr >> 8) & 0x0F;
+				out[pos + 1] |= addr & 0xFF;
+			}
+		}
+	}
+}
+
+/* Registra le etichette di tutti i moduli, private comprese */
+static void add_labels(struct link_ctx *ln, dbginfo_t *dbg){
+	const c8as_obj_symbol_t *s;
+	struct link_obj *lo;
+	unsigned o, k;
+
+	for (o=0; o<ln->count; o++){
+		lo = &ln->objs[o];
+		for (k=0; k<lo->hdr->nsymbols; k++){
+			s = &lo->symbols[k];
+			if (!(s->flags & C8AS_SYM_EXTERN)
+				&& dbginfo_add_label(dbg, lo->base[s->section] + s->value, lo->strings + s->name)){
+				link_error(ln, C8AS_E_NOMEM, 0, "impossibile allocare memoria");
+				return;
+			}
+		}
+	}
+}
+
+/* Collega count oggetti nel programma out, che può contenere size byte.
+ * Se dbg non è NULL vi vengono aggiunte le etichette di tutti i moduli.
+ * Come c8as_assemble, ritorna C8AS_OK oppure il tipo del primo errore,
+ * e in res il numero di byte del programma e gli errori */
+int c8as_link(const c8as_object_t *objs, unsigned count, uint8_t *out, size_t size,
+			  struct dbginfo *dbg, c8as_result_t *res){
+	c8as_result_t local;
+	struct link_ctx ln;
+	uint32_t end;
+	unsigned o;
+
+	if (res == NULL){
+		res = &local;
+	}
+	memset(res, 0, sizeof(c8as_result_t));
+
+	memset(&ln, 0, sizeof(struct link_ctx));
+	ln.res = res;
+	ln.count = count;
+	arena_init(&ln.arena);
+
+	if ((ln.objs = calloc(count ? count : 1, sizeof(struct link_obj))) == NULL
+		|| symtab_init(&ln.globals, &ln.arena)){
+		link_error(&ln, C8AS_E_NOMEM, 0, "impossibile allocare memoria");
+		goto done;
+	}
+
+	for (o=0; o<count; o++){
+		if (check_object(&ln.objs[o], &objs[o])){
+			link_error(&ln, C8AS_E_OBJECT, 0, "%s: oggetto non valido", objs[o].name);
+		}
+	}
+
+	if (ln.status != C8AS_OK){
+		goto done;
+	}
+
+	/* Come per l'assembler, gli indirizzi oltre la memoria vengono
+	 * troncati a 12 bit */
+	end = layout(&ln);
+	res->len = end - 0x200;
+
+	collect_globals(&ln);
+	if (ln.status != C8AS_OK){
+		goto done;
+	}
+
+	if (res->len <= size){
+		memset(out, 0, res->len);
+	}
+	relocate(&ln, out, size);
+
+	if (ln.status == C8AS_OK && dbg){
+		add_labels(&ln, dbg);
+	}
+
+	if (ln.status == C8AS_OK && res->len > size){
+		link_error(&ln, C8AS_E_OVERFLOW, 0, "il programma occupa %zu byte, il buffer %zu",
+				   res->len, size);
+	}
+
+ done:
+	free(ln.objs);
+	symtab_free(&ln.globals);
+	arena_free(&ln.arena);
+
+	return ln.status;
+}
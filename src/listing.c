@@ -0,0 +1,149 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "as.h"
+#include "flow.h"
+#include "tcache.h"
+
+/* Scrive in ob il sorgente del programma prog di len byte, seguendo il
+ * flusso di controllo per separare codice e dati, così che sia possibile
+ * riassemblarlo; se stats non è NULL vi scrive le statistiche.
+ * Ritorna non zero se la memoria è esaurita */
+int chip8_disassemble(const uint8_t *prog, size_t len, const char *name,
+					  outbuf_t *ob, struct chip8_dis_stats *stats){
+	char buf[128], label[32], *target;
+	uint8_t *bound;
+	uint16_t addr, end, opcode, flags;
+	size_t i, n;
+	tcache_entry_t entry;
+	const flow_t *flow;
+
+	if ((bound = calloc(4096, 1)) == NULL){
+		return 1;
+	}
+
+	/* L'analisi viene dalla cache su disco, se già fatta in passato */
+	if (tcache_open(&entry, prog, len, 0)){
+		free(bound);
+		return 1;
+	}
+
+	flow = entry.flow;
+	end = flow->end;
+
+	if (stats){
+		memset(stats, 0, sizeof(*stats));
+		stats->blocks = flow->nblocks;
+		stats->procs = flow->nprocs;
+		stats->calls = flow->ncalls;
+	}
+
+	/* Le etichette si possono mettere solo all'inizio di un'istruzione
+	 * o di un byte di dati, non in mezzo ad un'istruzione */
+	for (addr=0x200; addr<end; addr+=((flow->map[addr] & FLOW_CODE) && addr + 1 < end) ? 2 : 1){
+		bound[addr] = 1;
+	}
+
+	outbuf_puts(ob, "; ");
+	outbuf_puts(ob, name);
+	outbuf_puts(ob, ": ");
+	outbuf_dec(ob, flow->nblocks);
+	outbuf_puts(ob, " blocchi, ");
+	outbuf_dec(ob, flow->nprocs);
+	outbuf_puts(ob, " procedure, ");
+	outbuf_dec(ob, flow->ncalls);
+	outbuf_puts(ob, " chiamate\n");
+
+	for (addr=0x200; addr<end; ){
+		flags = flow->map[addr];
+
+		if (flags & (FLOW_LABEL | FLOW_DATA)){
+			flow_label(flow, addr, label, sizeof(label));
+			outbuf_puts(ob, label);
+			outbuf_puts(ob, ":\n");
+		}
+
+		if ((flags & FLOW_CODE) && addr + 1 < end){
+			opcode = (prog[addr - 0x200] << 8) | prog[addr + 1 - 0x200];
+
+			if (stats){
+				stats->hist[chip8_decode_class(opcode)]++;
+				stats->code += 2;
+			}
+
+			/* Usiamo l'etichetta solo se la destinazione ne ha una */
+			target = NULL;
+			switch (opcode & 0xF000){
+			case 0x1000: case 0x2000: case 0xA000: case 0xB000:
+				if (bound[opcode & 0x0FFF]){
+					flow_label(flow, opcode & 0x0FFF, label, sizeof(label));
+					target = label;
+				}
+				break;
+			}
+
+			n = chip8_decode(opcode, target, buf, sizeof(buf));
+			outbuf_putc(ob, '\t');
+			outbuf_write(ob, buf, n);
+			for (; n<24; n++){
+				outbuf_putc(ob, ' ');
+			}
+			outbuf_puts(ob, "; ");
+			outbuf_hex(ob, addr, 3);
+			outbuf_puts(ob, ": ");
+			outbuf_hex(ob, prog[addr - 0x200], 2);
+			outbuf_putc(ob, ' ');
+			outbuf_hex(ob, prog[addr + 1 - 0x200], 2);
+			if (flags & FLOW_COMPUTED){
+				outbuf_puts(ob, " salto calcolato");
+			}
+			if (flags & FLOW_SMC){
+				outbuf_puts(ob, " modifica il codice");
+			}
+			if (flags & FLOW_WILD_STORE){
+				outbuf_puts(ob, " scrittura ad indirizzo ignoto");
+			}
+			outbuf_putc(ob, '\n');
+			addr += 2;
+			continue;
+		}
+
+		/* Dati: raggruppati fino a 8 byte per riga, fino alla prossima etichetta */
+		outbuf_puts(ob, "\tDB");
+		for (i=0; i<8 && addr<end; i++, addr++){
+			if (i && ((flow->map[addr] & (FLOW_LABEL | FLOW_DATA | FLOW_CODE)))){
+				break;
+			}
+			outbuf_puts(ob, " 0x");
+			outbuf_hex(ob, prog[addr - 0x200], 2);
+		}
+		if (stats){
+			stats->data += i;
+		}
+		outbuf_putc(ob, '\n');
+	}
+
+	free(bound);
+	tcache_close(&entry);
+
+	return ob->error;
+}
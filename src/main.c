@@ -15,60 +15,389 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <unistd.h> /* getopt */
 #include <SDL.h>
 
 #include "util.h"
 #include "chip8.h"
 #include "ui.h"
+#include "as.h"
+#include "debuginfo.h"
+#include "debugger.h"
+#include "wall.h"
+#include "catalog.h"
+#include "metrics.h"
+#include "reload.h"
+#include "frames.h"
+
+/* Numero di indirizzi mostrati dal profiler */
+#define PROFILE_TOP 20
+
+/* Massimo numero di frame emulati in anticipo con -R */
+#define RUNAHEAD_MAX 8
 
 static void emulation_loop(chip8_machine_t *chip8);
+static void runahead_loop(chip8_machine_t *chip8);
+static int step(chip8_machine_t *chip8, long cdelta);
+static void render(chip8_machine_t *chip8);
+static void export_metrics(uint64_t now);
+static void shared_keys(chip8_machine_t *chip8);
+static void trace_instr(chip8_machine_t *chip8);
+static void print_profile(const chip8_machine_t *chip8);
+static uint32_t parse_color(const char *str, uint32_t def);
+
+static dbginfo_t dbg;           /* Simboli del programma, se presenti */
+static uint32_t *profile;       /* Istruzioni eseguite per indirizzo, se richiesto */
+static int trace;               /* Non zero per stampare ogni istruzione eseguita */
+static debugger_t debugger;
+static int debugging;           /* Non zero se il debugger è attivo */
+static unsigned speed = 1;      /* Istruzioni per ciclo, dal catalogo */
+static metrics_export_t exporter;
+static int exporting;           /* Non zero se le metriche vanno esportate */
+static reload_t reloader;
+static int reloading;           /* Non zero se il programma va ricaricato quando cambia */
+static unsigned runahead;       /* Frame emulati in anticipo, zero senza -R */
+static frames_t shared;         /* Schermo e tastiera condivisi con -S */
+static int sharing;
+
+/* Metriche dell'emulatore, aggiornate sempre ed esportate con -m */
+static struct {
+	uint64_t instructions;      /* Istruzioni eseguite */
+	uint64_t frames;            /* Frame disegnati */
+	uint64_t idle;              /* Attesa di timer o tastiera, in µs */
+	metrics_hist_t frame_time;  /* Tra due frame */
+	metrics_hist_t present;     /* Dentro ui_render */
+	metrics_hist_t delay;       /* Dentro SDL_Delay */
+	metrics_hist_t latency;     /* Dal tasto al primo frame successivo */
+	metrics_hist_t ahead;       /* Frame emulati in anticipo, ripristino compreso */
+	uint64_t rollbacks;         /* Futuri ricalcolati perché l'input è cambiato */
+} stats;
 
 int main(int argc, char **argv){
 	uint8_t buf[0xE00];
+	char *progname, *symfile, *path, *dsock, *wall, *catfile, *mspec, *shm;
+	const catalog_entry_t *entry;
+	const uint8_t *prog;
 	uint32_t fg, bg;
 	size_t count;
+	unsigned quirks;
+	int opt, quirks_set, source;
 	chip8_machine_t chip8;
+	catalog_t cat;
+
+	progname = argv[0];
+	symfile = dsock = wall = catfile = mspec = shm = NULL;
+	quirks = CHIP8_PROFILE_DEFAULT;
+	quirks_set = source = 0;
+
+	while ((opt = getopt(argc, argv, "aC:dD:m:pq:rR:s:S:tw:")) != -1){
+		switch (opt){
+		case 'q':
+			/* Profilo di quirk: default, cosmac, schip o maschera numerica */
+			if (chip8_parse_quirks(optarg, &quirks)){
+				fprintf(stderr, "Profilo di quirk non valido: %s\n", optarg);
+				return 1;
+			}
+			quirks_set = 1;
+			break;
+		case 'a':
+			source = 1;
+			break;
+		case 'r':
+			reloading = 1;
+			break;
+		case 'R':
+			runahead = atoi(optarg);
+			if (runahead < 1 || runahead > RUNAHEAD_MAX){
+				fprintf(stderr, "Frame di run-ahead non validi: %s (da 1 a %d)\n", optarg, RUNAHEAD_MAX);
+				return 1;
+			}
+			break;
+		case 'C':
+			catfile = optarg;
+			break;
+		case 'm':
+			mspec = optarg;
+			break;
+		case 's':
+			symfile = optarg;
+			break;
+		case 'S':
+			shm = optarg;
+			break;
+		case 'D':
+			dsock = optarg;
+			/* fallthrough */
+		case 'd':
+			debugging = 1;
+			break;
+		case 'p':
+			if ((profile = calloc(4096, sizeof(uint32_t))) == NULL){
+				err("impossibile allocare memoria");
+				return 1;
+			}
+			break;
+		case 't':
+			trace = 1;
+			break;
+		case 'w':
+			wall = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	/* Da qui in poi consideriamo solo gli argomenti posizionali */
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	/* La vista a muro non ha un programma, solo i colori */
+	if (wall){
+		fg = parse_color(argc > 1 ? argv[1] : NULL, 0xFFFFFFFF);
+		bg = parse_color(argc > 2 ? argv[2] : NULL, 0x000000FF);
+		return wall_run(wall, fg, bg);
+	}
 
 	if (argc < 2){
-		fprintf(stderr, "Usage: %s FILE.ch8 [FGCOLOR [BGCOLOR]]\n", argv[0]);
+		goto usage;
+	}
+
+	/* Il debugger ferma la macchina a metà frame, il run-ahead no */
+	if (runahead && debugging){
+		fprintf(stderr, "Il run-ahead non si può usare con il debugger\n");
 		return 1;
 	}
 
-	if (argc > 2){
-		fg = (uint32_t) ((strtol(argv[2], NULL, 16) << 8) | 0xFF);
-	} else {
-		fg = 0xFFFFFFFF;
+	fg = parse_color(argc > 2 ? argv[2] : NULL, 0xFFFFFFFF);
+	bg = parse_color(argc > 3 ? argv[3] : NULL, 0x000000FF);
+	
+	/* Con un catalogo la ROM viene presa per nome direttamente dal
+	 * file mappato, senza leggerne altri; altrimenti si legge il file e
+	 * le impostazioni si cercano nel catalogo per contenuto */
+	entry = NULL;
+	prog = buf;
+	if (catfile){
+		if (catalog_open(&cat, catfile)){
+			return 1;
+		}
+		if ((entry = catalog_find_name(&cat, argv[1])) != NULL){
+			prog = catalog_rom(&cat, entry);
+			count = entry->len;
+		}
 	}
 
-	if (argc > 3){
-		bg = (uint32_t) ((strtol(argv[3], NULL, 16) << 8) | 0xFF);
-	} else {
-		bg = 0x000000FF;
+	/* Un sorgente viene assemblato qui, e porta già i suoi simboli */
+	if (!entry && source){
+		if (reload_build(argv[1], 1, buf, &count, &dbg)){
+			return 1;
+		}
+		if (catfile){
+			entry = catalog_find(&cat, buf, count);
+		}
+	} else if (!entry){
+		if (!(count = read_file(argv[1], buf, 0xE00))){
+			return 1;
+		}
+		if (catfile){
+			entry = catalog_find(&cat, buf, count);
+		}
 	}
-	
-	if (!(count = read_file(argv[1], buf, 0xE00))){
+
+	/* Le opzioni sulla riga di comando valgono più del catalogo */
+	if (entry){
+		if ((entry->flags & CATALOG_QUIRKS) && !quirks_set){
+			quirks = entry->quirks;
+		}
+		if (entry->speed){
+			speed = entry->speed;
+		}
+		if ((entry->flags & CATALOG_KEYMAP) && ui_set_keymap(entry->keymap)){
+			fprintf(stderr, "Tasti del catalogo non validi per %s\n", argv[1]);
+		}
+	}
+
+	/* Senza -s cerchiamo i simboli scritti da c8as -g accanto al programma */
+	if (source){
+		/* Simboli già presi dall'assembler */
+	} else if (symfile){
+		if (dbginfo_load(&dbg, symfile)){
+			err("impossibile leggere il file %s", symfile);
+			return 1;
+		}
+	} else if ((path = malloc(strlen(argv[1]) + 5)) != NULL){
+		sprintf(path, "%s.sym", argv[1]);
+		dbginfo_load(&dbg, path);
+		free(path);
+	}
+
+	if (chip8_try_init(&chip8)){
+		err("impossibile allocare memoria");
+		return 1;
+	}
+	chip8_set_quirks(&chip8, quirks);
+	if (chip8_load(&chip8, prog, count) < 0){
+		err("impossibile allocare memoria");
 		return 1;
 	}
 
-	chip8_init(&chip8);
-	chip8_load(&chip8, buf, 0xE00);
+	if (catfile){
+		catalog_close(&cat);
+	}
 	
+	if (debugging && debugger_init(&debugger, &chip8, &dbg, dsock)){
+		return 1;
+	}
+
+	if (mspec){
+		if (metrics_export_open(&exporter, mspec)){
+			return 1;
+		}
+		exporting = 1;
+	}
+
+	/* Dal catalogo la ROM non ha un file da osservare */
+	if (reloading && (prog != buf
+					  || reload_init(&reloader, &chip8, &dbg, argv[1], source, prog, count))){
+		if (prog != buf){
+			fprintf(stderr, "La ricarica funziona solo con un file, non con una ROM del catalogo\n");
+		}
+		return 1;
+	}
+
+	/* Uno slot solo, la sessione 1, che accetta i tasti */
+	if (shm){
+		if (frames_open(&shared, shm, 1, 1)){
+			return 1;
+		}
+		sharing = 1;
+	}
+
 	if (ui_init_sdl()){
 		return 1;
 	}
 
 	ui_set_colors(fg, bg);
 	
-	emulation_loop(&chip8);
+	if (runahead){
+		runahead_loop(&chip8);
+	} else {
+		emulation_loop(&chip8);
+	}
 
 	ui_quit_sdl();
+
+	if (debugging){
+		debugger_free(&debugger);
+	}
+	if (exporting){
+		metrics_export_close(&exporter);
+	}
+	if (reloading){
+		reload_free(&reloader);
+	}
+	if (sharing){
+		frames_close(&shared);
+	}
+	if (profile){
+		print_profile(&chip8);
+		free(profile);
+	}
+	chip8_release(&chip8);
+	dbginfo_free(&dbg);
 	
+	return 0;
+
+ usage:
+	fprintf(stderr, "Usage: %s [-q QUIRKS] [-C CATALOGO] [-s FILE.sym] [-p] [-t] [-d | -D SOCKET] [-m METRICHE] [-a] [-r] [-R FRAME] [-S NOME] FILE.ch8 [FGCOLOR [BGCOLOR]]\n", progname);
+	fprintf(stderr, "  -q  profilo di quirk: default, cosmac, schip o maschera numerica\n");
+	fprintf(stderr, "  -C  catalogo scritto da c8cat: FILE.ch8 può essere il nome di una sua ROM\n");
+	fprintf(stderr, "  -s  simboli scritti da c8as -g (predefinito FILE.ch8.sym)\n");
+	fprintf(stderr, "  -p  all'uscita mostra le istruzioni più eseguite\n");
+	fprintf(stderr, "  -t  stampa ogni istruzione eseguita\n");
+	fprintf(stderr, "  -d  debugger, con i comandi da stdin\n");
+	fprintf(stderr, "  -D  debugger, con i comandi dal socket Unix SOCKET\n");
+	fprintf(stderr, "  -a  FILE.ch8 è un sorgente, da assemblare all'avvio\n");
+	fprintf(stderr, "  -r  quando FILE.ch8 cambia lo ricarica conservando lo stato della macchina\n");
+	fprintf(stderr, "  -R  mostra lo schermo di FRAME frame nel futuro, per nascondere la latenza dell'input\n");
+	fprintf(stderr, "  -S  pubblica schermo e tastiera nella memoria condivisa POSIX NOME\n");
+	fprintf(stderr, "  -m  esporta le metriche nel file METRICHE, o sul socket se è unix:SOCKET\n");
+	fprintf(stderr, "Vista a muro: %s -w SOCKET [FGCOLOR [BGCOLOR]]\n", progname);
+	fprintf(stderr, "  -w  mostra gli schermi delle sessioni del c8d in ascolto su SOCKET\n");
+	return 1;
+}
+
+/* Converte un colore esadecimale RRGGBB in RGBA, def se str è NULL */
+static uint32_t parse_color(const char *str, uint32_t def){
+	return str ? (uint32_t) ((strtol(str, NULL, 16) << 8) | 0xFF) : def;
+}
+
+/* Tempo massimo di attesa quando niente può risvegliare la macchina
+ * tranne gli eventi SDL, in millisecondi */
+#define IDLE_TIMEOUT 1000
+
+/* Intervallo tra due controlli dei comandi del debugger in pausa */
+#define PAUSE_TIMEOUT 16
+
+/* Pausa dopo un ciclo che non disegna, in millisecondi; un ciclo che
+ * disegna aspetta invece il VSYNC */
+#define CYCLE_MS 8
+
+/* Esegue un'istruzione, con profiler, trace e debugger
+ * Ritorna non zero se il ciclo deve ripartire senza disegnare: la
+ * macchina si è fermata nel debugger, o ha aspettato timer o tastiera */
+static int step(chip8_machine_t *chip8, long cdelta){
+	unsigned pc, idle;
+	uint64_t start;
+	int timeout;
+
+	if (profile){
+		profile[chip8->pc & 0x0FFF]++;
+	}
+
+	if (trace){
+		trace_instr(chip8);
+	}
+
+	pc = chip8->pc;
+	if (chip8_exec(chip8) == 7){
+		/* Fermata prima dell'istruzione, che non è stata eseguita */
+		if (profile){
+			profile[pc & 0x0FFF]--;
+		}
+		debugger_stopped(&debugger);
+		return 1;
+	}
+	METRIC_ADD(stats.instructions, chip8->retired);
+
+	/* Se il programma gira a vuoto aspettando timer o tastiera
+	 * fermiamo il thread fino al prossimo scatto dei timer o
+	 * al prossimo evento, invece di eseguire il ciclo */
+	if ((chip8->wait || chip8->pc < pc) && (idle = chip8_idle(chip8))){
+		if (chip8->dt || chip8->st){
+			timeout = (cdelta < 16) ? 17 - cdelta : 1;
+		} else if (sharing || debugging || reloading || exporting){
+			/* Tastiera condivisa, comandi del debugger, ricarica e
+			 * metriche non sono eventi SDL: li controlliamo ad ogni tick */
+			timeout = 17;
+		} else {
+			timeout = IDLE_TIMEOUT;
+		}
+		logd("idle %u, attesa %dms", idle, timeout);
+		start = metrics_now();
+		SDL_WaitEventTimeout(NULL, timeout);
+		METRIC_ADD(stats.idle, metrics_now() - start);
+		return 1;
+	}
+
 	return 0;
 }
 
 static void emulation_loop(chip8_machine_t *chip8){
-	int beep;
+	int beep, paused, waited;
 	long last, delta, cdelta;
+	uint64_t start;
+	unsigned n;
 	
 	last = SDL_GetTicks();
 	cdelta = beep = 0;
@@ -77,6 +406,32 @@ static void emulation_loop(chip8_machine_t *chip8){
 		if (ui_input(chip8)){
 			break;
 		}
+		if (sharing){
+			shared_keys(chip8);
+		}
+
+		if (exporting && metrics_export_due(&exporter, start = metrics_now())){
+			export_metrics(start);
+		}
+
+		if (reloading){
+			reload_poll(&reloader, SDL_GetTicks());
+		}
+
+		if (debugging && (paused = debugger_poll(&debugger)) != 0){
+			if (paused < 0){
+				break;
+			}
+
+			/* In pausa i timer non devono scattare */
+			if (chip8->drawn){
+				render(chip8);
+				chip8->drawn = 0;
+			}
+			SDL_WaitEventTimeout(NULL, PAUSE_TIMEOUT);
+			last = SDL_GetTicks();
+			continue;
+		}
 		
 		delta = SDL_GetTicks() - last;
 		cdelta += delta;
@@ -94,10 +449,20 @@ static void emulation_loop(chip8_machine_t *chip8){
 			logd("BEEP\n");
 		}
 
-		chip8_exec(chip8);
+		/* Con speed maggiore di uno più istruzioni per ciclo, fino
+		 * alla prima che disegna */
+		for (n=0, waited=0; n<speed && !waited; n += chip8->retired){
+			if ((waited = step(chip8, cdelta)) || chip8->drawn){
+				break;
+			}
+		}
+
+		if (waited){
+			continue;
+		}
 	    
 		if (chip8->drawn){
-			ui_render(chip8);
+			render(chip8);
 
 			/* Qui non c'è sleep perché in init_sdl() abbiamo chiesto
 			 * un renderer con VSYNC, questo significa che avremo una
@@ -105,7 +470,315 @@ static void emulation_loop(chip8_machine_t *chip8){
 			 * dello schermo (tipicamente 60Hz) se bisogna disegnare */
 		} else {
 			/* Evitiamo 100% CPU */
-			SDL_Delay(8);
+			start = metrics_now();
+			SDL_Delay(CYCLE_MS);
+			metrics_record(&stats.delay, metrics_now() - start);
+		}
+	}
+}
+
+/* Con il run-ahead l'emulazione va a frame fissi di un tick dei timer:
+ * ogni frame esegue le istruzioni dei cicli di emulation_loop che
+ * stanno in un tick, speed per ciclo, e come quei cicli finisce prima
+ * alla prima istruzione che disegna o se la macchina si mette ad
+ * aspettare timer o tastiera. Così un frame va alla stessa velocità
+ * del gioco normale, dipende solo dallo stato e dall'input, e si può
+ * ripetere */
+#define FRAME_US     16667
+#define FRAME_MS     17 /* Per chip8_update_timers, è un solo tick */
+#define FRAME_CYCLES (FRAME_US / (CYCLE_MS * 1000))
+
+/* Esegue un frame; profiler, trace e metriche solo se real non è zero,
+ * cioè per la macchina vera e non per quella nel futuro */
+static void run_frame(chip8_machine_t *chip8, int real){
+	unsigned n, pc;
+
+	for (n=0; n<speed * FRAME_CYCLES; ){
+		if (real && profile){
+			profile[chip8->pc & 0x0FFF]++;
+		}
+		if (real && trace){
+			trace_instr(chip8);
+		}
+
+		pc = chip8->pc;
+		chip8_exec(chip8);
+		n += chip8->retired;
+
+		if (chip8->drawn || ((chip8->wait || chip8->pc < pc) && chip8_idle(chip8))){
+			break;
+		}
+	}
+
+	if (chip8_update_timers(chip8, FRAME_MS) && real){
+		logd("BEEP\n");
+	}
+
+	if (real){
+		METRIC_ADD(stats.instructions, n);
+	}
+}
+
+/* Run-ahead: la macchina vera avanza di un frame alla volta, ma lo
+ * schermo mostrato è quello di una copia portata runahead frame più
+ * avanti con lo stesso input, così l'effetto di un tasto si vede
+ * subito invece che dopo i frame che il programma impiega a reagire.
+ * Finché l'input non cambia il futuro calcolato resta valido e basta
+ * farlo avanzare di un frame; quando cambia si riparte dalla macchina
+ * vera e si rifanno tutti i frame in anticipo */
+static void runahead_loop(chip8_machine_t *chip8){
+	chip8_machine_t ahead;
+	uint64_t next, now, start;
+	uint16_t pc;
+	uint8_t last_key;
+	unsigned k;
+	int valid;
+
+	if (chip8_fork(&ahead, chip8)){
+		err("impossibile allocare memoria");
+		return;
+	}
+
+	valid = 0;
+	next = metrics_now();
+
+	while (1){
+		/* Anche un tasto premuto e rilasciato tra due frame cambia
+		 * last_key, ESC cambia il PC */
+		pc = chip8->pc;
+		last_key = chip8->last_key;
+		if (ui_input(chip8)){
+			break;
+		}
+		if (sharing){
+			shared_keys(chip8);
+		}
+		if (chip8->pc != pc || chip8->last_key != last_key
+			|| memcmp(chip8->keys, ahead.keys, sizeof(ahead.keys))){
+			valid = 0;
+		}
+
+		if (exporting && metrics_export_due(&exporter, now = metrics_now())){
+			export_metrics(now);
+		}
+
+		if (reloading && reload_poll(&reloader, SDL_GetTicks())){
+			valid = 0;
+		}
+
+		/* Un frame ogni tick dei timer; dopo una pausa lunga non si
+		 * recuperano i frame persi */
+		if ((now = metrics_now()) < next){
+			start = now;
+			SDL_WaitEventTimeout(NULL, (next - now + 999) / 1000);
+			metrics_record(&stats.delay, metrics_now() - start);
+			continue;
+		}
+		next = (now - next > FRAME_US) ? now + FRAME_US : next + FRAME_US;
+
+		run_frame(chip8, 1);
+
+		start = metrics_now();
+		if (valid){
+			run_frame(&ahead, 0);
+		} else if (chip8_copy(&ahead, chip8) == 0){
+			for (k=0; k<runahead; k++){
+				run_frame(&ahead, 0);
+			}
+			METRIC_ADD(stats.rollbacks, 1);
+			valid = 1;
+		}
+		metrics_record(&stats.ahead, metrics_now() - start);
+
+		/* Senza memoria per la copia si mostra il presente */
+		render(valid ? &ahead : chip8);
+	}
+
+	chip8_release(&ahead);
+}
+
+/* Disegna lo schermo misurando il tempo di presentazione, quello tra due
+ * frame e la latenza dal primo tasto premuto dopo il frame precedente */
+static void render(chip8_machine_t *chip8){
+	static uint64_t last;
+	uint64_t start, now, key;
+
+	start = metrics_now();
+	ui_render(chip8);
+	if (sharing){
+		frames_publish(&shared, 0, 1, chip8->vram);
+	}
+	now = metrics_now();
+
+	metrics_record(&stats.present, now - start);
+	if (last){
+		metrics_record(&stats.frame_time, now - last);
+	}
+	if ((key = ui_key_time()) != 0){
+		metrics_record(&stats.latency, now - key);
+	}
+
+	METRIC_ADD(stats.frames, 1);
+	last = now;
+}
+
+/* Applica i tasti cambiati nella tastiera condivisa; contano solo i
+ * cambiamenti, così i tasti della finestra restano validi */
+static void shared_keys(chip8_machine_t *chip8){
+	uint8_t keys[16];
+	uint16_t mask, changed;
+	unsigned k;
+
+	if (!(changed = frames_keys(&shared, 0, &mask))){
+		return;
+	}
+
+	memcpy(keys, chip8->keys, sizeof(keys));
+	for (k=0; k<16; k++){
+		if (!(changed & (1u << k))){
+			continue;
+		}
+		if ((keys[k] = (mask >> k) & 1) != 0){
+			chip8_pressed(chip8, k);
 		}
 	}
+	chip8_update_keys(chip8, keys);
+}
+
+/* Scrive le metriche e le manda all'esportatore; le istruzioni al
+ * secondo sono calcolate dall'esportazione precedente */
+static void export_metrics(uint64_t now){
+	static uint64_t last_time, last_instr;
+	uint64_t instr;
+	outbuf_t ob;
+
+	if (outbuf_init(&ob, NULL, 4096)){
+		return;
+	}
+
+	instr = METRIC_GET(stats.instructions);
+
+	metrics_family(&ob, "chip8_instructions_total", "counter", "Istruzioni eseguite");
+	metrics_value(&ob, "chip8_instructions_total", NULL, instr);
+	metrics_family(&ob, "chip8_instructions_per_second", "gauge", "Istruzioni al secondo dall'esportazione precedente");
+	metrics_value(&ob, "chip8_instructions_per_second", NULL,
+				  (last_time && now > last_time) ? (instr - last_instr) * 1e6 / (now - last_time) : 0);
+	metrics_family(&ob, "chip8_frames_total", "counter", "Frame disegnati");
+	metrics_value(&ob, "chip8_frames_total", NULL, METRIC_GET(stats.frames));
+	metrics_family(&ob, "chip8_idle_seconds_total", "counter", "Tempo passato ad aspettare timer o tastiera");
+	metrics_value(&ob, "chip8_idle_seconds_total", NULL, METRIC_GET(stats.idle) / 1e6);
+	metrics_family(&ob, "chip8_frame_time_seconds", "histogram", "Tempo tra due frame");
+	metrics_hist(&ob, "chip8_frame_time_seconds", NULL, &stats.frame_time);
+	metrics_family(&ob, "chip8_present_seconds", "histogram", "Tempo passato in ui_render");
+	metrics_hist(&ob, "chip8_present_seconds", NULL, &stats.present);
+	metrics_family(&ob, "chip8_delay_seconds", "histogram", "Tempo passato in SDL_Delay");
+	metrics_hist(&ob, "chip8_delay_seconds", NULL, &stats.delay);
+	metrics_family(&ob, "chip8_input_latency_seconds", "histogram", "Dal tasto premuto al primo frame successivo");
+	metrics_hist(&ob, "chip8_input_latency_seconds", NULL, &stats.latency);
+	if (runahead){
+		metrics_family(&ob, "chip8_runahead_seconds", "histogram", "Tempo per i frame emulati in anticipo");
+		metrics_hist(&ob, "chip8_runahead_seconds", NULL, &stats.ahead);
+		metrics_family(&ob, "chip8_runahead_rollbacks_total", "counter", "Futuri ricalcolati perché l'input è cambiato");
+		metrics_value(&ob, "chip8_runahead_rollbacks_total", NULL, METRIC_GET(stats.rollbacks));
+	}
+
+	metrics_export_send(&exporter, &ob);
+	outbuf_free(&ob);
+
+	last_time = now;
+	last_instr = instr;
+}
+
+/* Stampa l'istruzione che sta per essere eseguita, con etichetta e riga */
+static void trace_instr(chip8_machine_t *chip8){
+	char where[128], instr[64];
+	uint16_t opcode;
+
+	if (chip8->wait){
+		return;
+	}
+
+	opcode = (chip8_peek(chip8, chip8->pc) << 8) | chip8_peek(chip8, chip8->pc + 1);
+	chip8_decode(opcode, NULL, instr, sizeof(instr));
+	dbginfo_format(&dbg, chip8->pc, where, sizeof(where));
+
+	fprintf(stderr, "%03X %-32s %s\n", chip8->pc, where, instr);
+}
+
+static int compare_hits(const void *a, const void *b){
+	uint32_t x, y;
+
+	x = profile[*(const uint16_t *) a];
+	y = profile[*(const uint16_t *) b];
+
+	return (x < y) - (x > y);
+}
+
+/* Stampa gli indirizzi e le etichette dove il programma ha passato più tempo */
+static void print_profile(const chip8_machine_t *chip8){
+	static uint16_t addrs[4096];
+	uint64_t *by_label;
+	const dbg_label_t *label;
+	char where[128];
+	uint64_t total;
+	unsigned n, i, j, best;
+
+	total = n = 0;
+	for (i=0; i<4096; i++){
+		if (profile[i]){
+			addrs[n++] = i;
+			total += profile[i];
+		}
+	}
+
+	if (!total){
+		return;
+	}
+
+	qsort(addrs, n, sizeof(uint16_t), compare_hits);
+
+	fprintf(stderr, "Istruzioni eseguite: %llu\n", (unsigned long long) total);
+	for (i=0; i<n && i<PROFILE_TOP; i++){
+		dbginfo_format(&dbg, addrs[i], where, sizeof(where));
+		fprintf(stderr, "%12lu %6.2f%%  %03X %s\n", (unsigned long) profile[addrs[i]],
+				100.0 * profile[addrs[i]] / total, addrs[i], where);
+	}
+
+	/* Idiomi eseguiti come macro-istruzione unica */
+	for (i=0; i<CHIP8_FUSE_KINDS; i++){
+		if (chip8->fused[i]){
+			fprintf(stderr, "%12lu fusi      %s\n", (unsigned long) chip8->fused[i],
+					chip8_fuse_name(i + 1));
+		}
+	}
+
+	if (!dbg.nlabels || (by_label = calloc(dbg.nlabels, sizeof(uint64_t))) == NULL){
+		return;
+	}
+
+	/* Totali per etichetta, cioè per procedura o ciclo */
+	for (i=0; i<n; i++){
+		if ((label = dbginfo_label(&dbg, addrs[i])) != NULL){
+			by_label[label - dbg.labels] += profile[addrs[i]];
+		}
+	}
+
+	fprintf(stderr, "Per etichetta:\n");
+	for (i=0; i<PROFILE_TOP && i<dbg.nlabels; i++){
+		for (best=0, j=1; j<dbg.nlabels; j++){
+			if (by_label[j] > by_label[best]){
+				best = j;
+			}
+		}
+
+		if (!by_label[best]){
+			break;
+		}
+
+		fprintf(stderr, "%12llu %6.2f%%  %s\n", (unsigned long long) by_label[best],
+				100.0 * by_label[best] / total, dbg.labels[best].name);
+		by_label[best] = 0;
+	}
+
+	free(by_label);
 }
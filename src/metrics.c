@@ -0,0 +1,311 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* Ogni quanto viene riscritto il file, e ogni quanto si controlla se
+ * qualcuno si è collegato al socket, in microsecondi */
+#define FILE_INTERVAL   1000000
+#define SOCKET_INTERVAL 100000
+
+/* Tempo massimo per servire un client, in microsecondi */
+#define CLIENT_TIMEOUT 1000000
+
+/* Intestazione della risposta sul socket: basta un HTTP minimo perché
+ * funzionino sia curl --unix-socket che un semplice socat */
+#define HTTP_HEADER "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n"
+
+/* Tempo monotono in microsecondi */
+uint64_t metrics_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Scrive le righe HELP e TYPE di una metrica, da fare una volta prima
+ * di tutti i suoi valori */
+void metrics_family(outbuf_t *ob, const char *name, const char *type, const char *help){
+	outbuf_puts(ob, "# HELP ");
+	outbuf_puts(ob, name);
+	outbuf_putc(ob, ' ');
+	outbuf_puts(ob, help);
+	outbuf_puts(ob, "\n# TYPE ");
+	outbuf_puts(ob, name);
+	outbuf_putc(ob, ' ');
+	outbuf_puts(ob, type);
+	outbuf_putc(ob, '\n');
+}
+
+/* Scrive un valore; labels è già nel formato chiave="valore", o NULL */
+static void write_sample(outbuf_t *ob, const char *name, const char *suffix,
+						 const char *labels, const char *extra, double value){
+	char num[32];
+
+	outbuf_puts(ob, name);
+	outbuf_puts(ob, suffix);
+	if (labels || extra){
+		outbuf_putc(ob, '{');
+		if (labels){
+			outbuf_puts(ob, labels);
+		}
+		if (labels && extra){
+			outbuf_putc(ob, ',');
+		}
+		if (extra){
+			outbuf_puts(ob, extra);
+		}
+		outbuf_putc(ob, '}');
+	}
+
+	snprintf(num, sizeof(num), " %.15g\n", value);
+	outbuf_puts(ob, num);
+}
+
+void metrics_value(outbuf_t *ob, const char *name, const char *labels, double value){
+	write_sample(ob, name, "", labels, NULL, value);
+}
+
+/* Scrive un istogramma in secondi, con i bucket cumulativi come vuole
+ * Prometheus; i bucket vuoti oltre l'ultimo usato vengono omessi */
+void metrics_hist(outbuf_t *ob, const char *name, const char *labels, const metrics_hist_t *h){
+	char le[32];
+	uint64_t total, count;
+	unsigned k, last;
+
+	/* Letto una volta sola: count viene scritto per ultimo da
+	 * metrics_record, quindi i bucket possono essere un po' avanti */
+	count = METRIC_GET(h->count);
+
+	for (last=0, k=0; k<METRICS_BUCKETS - 1; k++){
+		if (METRIC_GET(h->buckets[k])){
+			last = k;
+		}
+	}
+
+	for (total=0, k=0; k<=last; k++){
+		total += METRIC_GET(h->buckets[k]);
+		snprintf(le, sizeof(le), "le=\"%g\"", (double) (1ULL << k) / 1e6);
+		write_sample(ob, name, "_bucket", labels, le, total < count ? total : count);
+	}
+
+	write_sample(ob, name, "_bucket", labels, "le=\"+Inf\"", count);
+	write_sample(ob, name, "_sum", labels, NULL, METRIC_GET(h->sum) / 1e6);
+	write_sample(ob, name, "_count", labels, NULL, count);
+}
+
+/* Prepara l'esportazione: "unix:PERCORSO" per un socket, altrimenti
+ * il percorso di un file; ritorna non zero in caso di errore */
+int metrics_export_open(metrics_export_t *exp, const char *spec){
+	struct sockaddr_un addr;
+
+	exp->listen = exp->client = -1;
+	exp->reply = NULL;
+	exp->next = 0;
+
+	if (strncmp(spec, "unix:", 5)){
+		exp->interval = FILE_INTERVAL;
+		if ((exp->path = strdup(spec)) == NULL){
+			err("impossibile allocare memoria");
+			return 1;
+		}
+		return 0;
+	}
+
+	spec += 5;
+	exp->interval = SOCKET_INTERVAL;
+	if (strlen(spec) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "Percorso del socket troppo lungo: %s\n", spec);
+		return 1;
+	}
+
+	if ((exp->listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+		err("impossibile creare il socket");
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, spec);
+	unlink(spec);
+
+	if (bind(exp->listen, (struct sockaddr *) &addr, sizeof(addr)) || listen(exp->listen, 8)){
+		err("impossibile ascoltare su %s", spec);
+		close(exp->listen);
+		return 1;
+	}
+
+	if ((exp->path = strdup(spec)) == NULL){
+		err("impossibile allocare memoria");
+		close(exp->listen);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Chiude la connessione con il client */
+static void drop_client(metrics_export_t *exp){
+	close(exp->client);
+	exp->client = -1;
+	free(exp->reply);
+	exp->reply = NULL;
+}
+
+/* Fa avanzare la connessione senza bloccare: legge e scarta la
+ * richiesta, invia quanto può della risposta, poi chiude il lato in
+ * scrittura e aspetta che il client chiuda. Chiudere con dati non letti
+ * nel socket farebbe arrivare al client un reset invece della risposta */
+static void serve_client(metrics_export_t *exp, uint64_t now){
+	char buf[512];
+	ssize_t n;
+	int eof;
+
+	while ((n = read(exp->client, buf, sizeof(buf))) > 0);
+	eof = (n == 0);
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+		drop_client(exp);
+		return;
+	}
+
+	for (; exp->reply && exp->sent < exp->len; exp->sent+=n){
+		if ((n = send(exp->client, exp->reply + exp->sent, exp->len - exp->sent, MSG_NOSIGNAL)) < 0){
+			if (errno != EAGAIN && errno != EWOULDBLOCK){
+				drop_client(exp);
+				return;
+			}
+			break;
+		}
+	}
+
+	if (exp->reply && exp->sent == exp->len){
+		free(exp->reply);
+		exp->reply = NULL;
+		exp->done = 1;
+		shutdown(exp->client, SHUT_WR);
+	}
+
+	if ((exp->done && eof) || now >= exp->deadline){
+		drop_client(exp);
+	}
+}
+
+/* Ritorna non zero se è il momento di scrivere le metriche: per il file
+ * una volta ogni FILE_INTERVAL, per il socket quando si collega un
+ * client, che viene poi servito nelle chiamate successive. Costa un
+ * confronto finché non passa l'intervallo e nessun client è collegato,
+ * quindi si può chiamare ad ogni giro del ciclo principale */
+int metrics_export_due(metrics_export_t *exp, uint64_t now){
+	if (exp->client >= 0){
+		serve_client(exp, now);
+		return 0;
+	}
+
+	if (now < exp->next){
+		return 0;
+	}
+	exp->next = now + exp->interval;
+
+	if (exp->listen < 0){
+		return 1;
+	}
+
+	/* Un client lento non deve bloccare l'emulazione */
+	if ((exp->client = accept4(exp->listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0){
+		return 0;
+	}
+	exp->done = 0;
+	exp->deadline = now + CLIENT_TIMEOUT;
+
+	/* Se ce ne sono altri in coda li serviamo al prossimo giro */
+	exp->next = now;
+	return 1;
+}
+
+/* Invia le metriche preparate in ob, che deve essere in memoria */
+void metrics_export_send(metrics_export_t *exp, outbuf_t *ob){
+	size_t off;
+	ssize_t n;
+	char *tmp;
+	int fd;
+
+	if (ob->error){
+		return;
+	}
+
+	if (exp->listen >= 0){
+		if (exp->client < 0 || exp->reply){
+			return;
+		}
+
+		/* La risposta viene inviata un po' alla volta da serve_client */
+		exp->len = sizeof(HTTP_HEADER) - 1 + ob->used;
+		exp->sent = 0;
+		if ((exp->reply = malloc(exp->len)) == NULL){
+			drop_client(exp);
+			return;
+		}
+		memcpy(exp->reply, HTTP_HEADER, sizeof(HTTP_HEADER) - 1);
+		memcpy(exp->reply + sizeof(HTTP_HEADER) - 1, ob->data, ob->used);
+		serve_client(exp, metrics_now());
+		return;
+	}
+
+	/* Il file viene sostituito in un colpo solo, così chi lo legge non
+	 * vede mai metà delle metriche */
+	if ((tmp = malloc(strlen(exp->path) + 5)) == NULL){
+		return;
+	}
+	sprintf(tmp, "%s.tmp", exp->path);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0){
+		for (off=0; off<ob->used; off+=n){
+			if ((n = write(fd, ob->data + off, ob->used - off)) <= 0){
+				break;
+			}
+		}
+
+		if (close(fd) || off < ob->used || rename(tmp, exp->path)){
+			unlink(tmp);
+		}
+	}
+
+	free(tmp);
+}
+
+void metrics_export_close(metrics_export_t *exp){
+	if (exp->client >= 0){
+		drop_client(exp);
+	}
+	if (exp->listen >= 0){
+		close(exp->listen);
+		unlink(exp->path);
+	}
+	free(exp->path);
+}
@@ -0,0 +1,84 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+#include "util.h"
+
+/* Metriche di esecuzione, esportate nel formato testuale di Prometheus.
+ * Ogni contatore ha un solo scrittore, il thread che esegue la macchina,
+ * quindi non servono lock né operazioni atomiche read-modify-write:
+ * basta che lettura e scrittura non vengano spezzate, e un esportatore
+ * in un altro thread vede sempre un valore coerente */
+#define METRIC_ADD(var, n) \
+	__atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define METRIC_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* Gli istogrammi hanno un bucket per ottava, in microsecondi: il bucket
+ * k conta i valori fino a 2^k µs, l'ultimo tutti quelli maggiori
+ * (2^25 µs sono più di mezzo minuto) */
+#define METRICS_BUCKETS 27
+
+typedef struct metrics_hist {
+	uint64_t count;
+	uint64_t sum;                       /* In microsecondi */
+	uint64_t buckets[METRICS_BUCKETS];  /* Non cumulativi */
+} metrics_hist_t;
+
+/* Registra un valore in microsecondi */
+static inline void metrics_record(metrics_hist_t *h, uint64_t us){
+	unsigned k;
+
+	k = (us <= 1) ? 0 : 64 - __builtin_clzll(us - 1);
+	if (k >= METRICS_BUCKETS){
+		k = METRICS_BUCKETS - 1;
+	}
+
+	METRIC_ADD(h->buckets[k], 1);
+	METRIC_ADD(h->sum, us);
+	METRIC_ADD(h->count, 1);
+}
+
+/* Destinazione delle metriche: un file riscritto periodicamente, o un
+ * socket Unix dove ogni connessione riceve le metriche e viene chiusa.
+ * Il client viene servito senza mai bloccare, un po' ad ogni chiamata
+ * di metrics_export_due */
+typedef struct metrics_export {
+	char *path;
+	int listen;             /* Socket in ascolto, o -1 per il file */
+	int client;             /* Connessione servita, o -1 */
+	char *reply;            /* Risposta ancora da inviare, o NULL */
+	size_t len, sent;
+	int done;               /* Risposta inviata, si aspetta la chiusura */
+	uint64_t deadline;      /* Dopo questo istante il client viene chiuso */
+	uint64_t next;          /* Prossimo controllo, in µs */
+	uint64_t interval;
+} metrics_export_t;
+
+extern uint64_t metrics_now(void);
+extern void metrics_family(outbuf_t *ob, const char *name, const char *type, const char *help);
+extern void metrics_value(outbuf_t *ob, const char *name, const char *labels, double value);
+extern void metrics_hist(outbuf_t *ob, const char *name, const char *labels, const metrics_hist_t *h);
+extern int metrics_export_open(metrics_export_t *exp, const char *spec);
+extern int metrics_export_due(metrics_export_t *exp, uint64_t now);
+extern void metrics_export_send(metrics_export_t *exp, outbuf_t *ob);
+extern void metrics_export_close(metrics_export_t *exp);
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,524 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h> /* memset */
+#include <stdint.h> /* uint8_t, uint16_t */
+
+#include "as.h"
+#include "flow.h"
+
+/* Ottimizzatore peephole: lavora sugli elementi registrati dall'assembler
+ * prima che vengano scritti, usando gli indirizzi originali; alla fine
+ * le etichette e gli indirizzi numerici vengono spostati di conseguenza */
+
+/* Indirizzi che non si possono toccare liberamente */
+#define PIN_TARGET 0x01 /* Etichetta o destinazione numerica */
+#define PIN_TABLE  0x02 /* Dentro una possibile tabella di salti BNNN */
+
+/* Numero massimo di passate e di salti seguiti per ogni istruzione */
+#define OPT_PASSES 8
+#define OPT_HOPS   16
+
+struct opt {
+	asm_item_t *items;
+	long count;
+	uint16_t end;           /* Fine del programma prima dell'ottimizzazione */
+	uint8_t pins[4097];     /* Flag PIN_* per indirizzo */
+	long at[4096];          /* Istruzione che inizia ad ogni indirizzo, o -1 */
+	struct asm_opt_stats *stats;
+};
+
+/* Registri letti e scritti da un'istruzione, come maschere di bit;
+ * le scritture che dipendono dalle quirk non vengono contate */
+static void regs(uint16_t op, uint16_t *rd, uint16_t *wr){
+	uint16_t x, y, f;
+
+	x = 1 << ((op >> 8) & 0x0F);
+	y = 1 << ((op >> 4) & 0x0F);
+	f = 1 << 0x0F;
+	*rd = *wr = 0;
+
+	switch (op & 0xF000){
+	case 0x3000: case 0x4000:
+		*rd = x;
+		break;
+	case 0x5000: case 0x9000:
+		*rd = x | y;
+		break;
+	case 0x6000: case 0xC000:
+		*wr = x;
+		break;
+	case 0x7000:
+		*rd = *wr = x;
+		break;
+	case 0x8000:
+		switch (op & 0x000F){
+		case 0x00:
+			*rd = y;
+			*wr = x;
+			break;
+		case 0x01: case 0x02: case 0x03:
+			*rd = x | y;
+			*wr = x;
+			break;
+		default:
+			/* Somme, sottrazioni e shift, anche V[y] per la quirk */
+			*rd = x | y;
+			*wr = x | f;
+			break;
+		}
+		break;
+	case 0xB000:
+		*rd = 1 | x;
+		break;
+	case 0xD000:
+		*rd = x | y;
+		*wr = f;
+		break;
+	case 0xE000:
+		*rd = x;
+		break;
+	case 0xF000:
+		switch (op & 0x00FF){
+		case 0x07: case 0x0A:
+			*wr = x;
+			break;
+		case 0x55:
+			*rd = (x << 1) - 1;
+			break;
+		case 0x65:
+			*wr = (x << 1) - 1;
+			break;
+		default:
+			*rd = x;
+			break;
+		}
+		break;
+	}
+}
+
+/* Destinazione di JP, CALL, LD I e BNNN */
+static uint16_t target(const asm_item_t *item){
+	return item->sym ? item->sym->addr : item->value & 0x0FFF;
+}
+
+static int has_target(uint16_t op){
+	switch (op & 0xF000){
+	case 0x1000: case 0x2000: case 0xA000: case 0xB000:
+		return 1;
+	}
+	return 0;
+}
+
+/* Prossimo elemento non rimosso dopo i, saltando le etichette; -1 se non c'è */
+static long next_item(const struct opt *o, long i){
+	for (i++; i<o->count; i++){
+		if (!o->items[i].deleted && o->items[i].type != ASM_ITEM_LABEL){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Elemento precedente, come sopra */
+static long prev_item(const struct opt *o, long i){
+	for (i--; i>=0; i--){
+		if (!o->items[i].deleted && o->items[i].type != ASM_ITEM_LABEL){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int is_instr(const struct opt *o, long i){
+	return i >= 0 && o->items[i].type == ASM_ITEM_INSTR;
+}
+
+/* Non zero se l'istruzione i segue uno skip, cioè non è sempre eseguita
+ * passando di lì: non si può né togliere né unire alla precedente */
+static int shadowed(const struct opt *o, long i){
+	long p;
+
+	p = prev_item(o, i);
+	return is_instr(o, p) && flow_classify(o->items[p].value) == FLOW_OP_SKIP;
+}
+
+/* Istruzione effettivamente eseguita saltando ad addr, o -1 */
+static long landing(const struct opt *o, uint16_t addr){
+	long k;
+
+	if (addr < 0x200 || addr >= o->end || (k = o->at[addr]) < 0){
+		return -1;
+	}
+
+	if (o->items[k].deleted){
+		k = next_item(o, k);
+	}
+
+	return is_instr(o, k) ? k : -1;
+}
+
+static void delete(struct opt *o, long i){
+	o->items[i].deleted = 1;
+	o->stats->removed++;
+}
+
+/* Segna etichette, destinazioni numeriche e tabelle di salti */
+static void find_pins(struct opt *o){
+	asm_item_t *item;
+	uint16_t t;
+	unsigned a;
+	long i;
+
+	memset(o->pins, 0, sizeof(o->pins));
+
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+
+		if (item->type == ASM_ITEM_LABEL){
+			o->pins[item->addr] |= PIN_TARGET;
+		} else if (item->type == ASM_ITEM_INSTR && has_target(item->value)){
+			t = target(item);
+			if (t < 0x200 || t > o->end){
+				continue;
+			}
+
+			o->pins[t] |= PIN_TARGET;
+
+			/* Con BNNN le voci della tabella sono raggiunte con V0 fino
+			 * a 255, quella zona non deve cambiare dimensione */
+			if ((item->value & 0xF000) == 0xB000){
+				for (a=t; a<t + 256u && a<o->end; a++){
+					o->pins[a] |= PIN_TABLE;
+				}
+			}
+		}
+	}
+}
+
+/* JP o CALL verso un JP: salta direttamente alla destinazione finale */
+static int thread_jumps(struct opt *o){
+	asm_item_t *item, *dest;
+	int changed, hops;
+	uint16_t t;
+	long i, k;
+
+	changed = 0;
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+		if (item->deleted || item->type != ASM_ITEM_INSTR
+			|| ((item->value & 0xF000) != 0x1000 && (item->value & 0xF000) != 0x2000)){
+			continue;
+		}
+
+		dest = NULL;
+		t = target(item);
+		for (hops=0; hops<OPT_HOPS; hops++){
+			k = landing(o, t);
+			if (k < 0 || k == i || (o->items[k].value & 0xF000) != 0x1000
+				|| target(&o->items[k]) == t){
+				break;
+			}
+			dest = &o->items[k];
+			t = target(dest);
+		}
+
+		if (dest && t != target(item)){
+			item->sym = dest->sym;
+			item->value = (item->value & 0xF000) | (dest->sym ? 0 : (dest->value & 0x0FFF));
+			o->stats->threaded++;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* Istruzioni dopo un salto incondizionato, fino alla prossima
+ * etichetta o ai dati, non vengono mai eseguite; un JP verso
+ * l'istruzione successiva è inutile */
+static int remove_unreachable(struct opt *o){
+	asm_item_t *item;
+	enum flow_op op;
+	int changed;
+	long i, k;
+
+	changed = 0;
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+		if (item->deleted || item->type != ASM_ITEM_INSTR || shadowed(o, i)){
+			continue;
+		}
+
+		op = flow_classify(item->value);
+		if (op != FLOW_OP_JUMP && op != FLOW_OP_RET && op != FLOW_OP_COMPUTED){
+			continue;
+		}
+
+		for (k=next_item(o, i); is_instr(o, k) && !o->pins[o->items[k].addr]; k=next_item(o, k)){
+			delete(o, k);
+			o->stats->unreachable++;
+			changed = 1;
+		}
+
+		if (op == FLOW_OP_JUMP && !(o->pins[item->addr] & PIN_TABLE)
+			&& (k = next_item(o, i)) >= 0 && landing(o, target(item)) == k){
+			delete(o, i);
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* Inverte la condizione di uno skip, ritorna 0 se non è possibile */
+static uint16_t invert_skip(uint16_t op){
+	switch (op & 0xF000){
+	case 0x3000: return 0x4000 | (op & 0x0FFF);
+	case 0x4000: return 0x3000 | (op & 0x0FFF);
+	case 0x5000: return 0x9000 | (op & 0x0FFF);
+	case 0x9000: return 0x5000 | (op & 0x0FFF);
+	case 0xE000:
+		if ((op & 0x00FF) == 0x9E){
+			return (op & 0xFF00) | 0xA1;
+		} else if ((op & 0x00FF) == 0xA1){
+			return (op & 0xFF00) | 0x9E;
+		}
+	}
+	return 0;
+}
+
+/* SKIP cond; JP L; I; L: diventa SKIP !cond; I; L: */
+static int simplify_skips(struct opt *o){
+	asm_item_t *item;
+	uint16_t inv;
+	int changed;
+	long i, j, k, l;
+
+	changed = 0;
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+		if (item->deleted || item->type != ASM_ITEM_INSTR || shadowed(o, i)
+			|| (o->pins[item->addr] & PIN_TABLE) || !(inv = invert_skip(item->value))){
+			continue;
+		}
+
+		j = next_item(o, i);
+		if (!is_instr(o, j) || (o->items[j].value & 0xF000) != 0x1000 || o->pins[o->items[j].addr]){
+			continue;
+		}
+
+		k = next_item(o, j);
+		if (!is_instr(o, k) || (o->pins[o->items[k].addr] & PIN_TABLE)){
+			continue;
+		}
+
+		/* -1 vale per un salto fuori dal programma e per la fine del
+		 * programma: non sono la stessa destinazione */
+		l = next_item(o, k);
+		if (l < 0 || landing(o, target(&o->items[j])) != l){
+			continue;
+		}
+
+		item->value = inv;
+		delete(o, j);
+		o->stats->inverted++;
+		changed = 1;
+	}
+
+	return changed;
+}
+
+/* LD VX seguito da una scrittura di VX prima di qualsiasi lettura */
+static int remove_dead_stores(struct opt *o){
+	asm_item_t *item;
+	uint16_t x, rd, wr;
+	enum flow_op op;
+	int changed, dead;
+	long i, k;
+
+	changed = 0;
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+		if (item->deleted || item->type != ASM_ITEM_INSTR || shadowed(o, i)
+			|| (o->pins[item->addr] & PIN_TABLE)
+			|| ((item->value & 0xF000) != 0x6000 && (item->value & 0xF00F) != 0x8000)){
+			continue;
+		}
+
+		x = 1 << ((item->value >> 8) & 0x0F);
+
+		/* LD VX, VX non fa nulla */
+		dead = ((item->value & 0xF00F) == 0x8000
+				&& ((item->value >> 8) & 0x0F) == ((item->value >> 4) & 0x0F));
+
+		/* Cerchiamo solo in avanti nello stesso blocco, senza etichette o skip */
+		for (k=next_item(o, i); !dead && is_instr(o, k) && !o->pins[o->items[k].addr]; k=next_item(o, k)){
+			op = flow_classify(o->items[k].value);
+			if (op != FLOW_OP_NEXT && op != FLOW_OP_STORE){
+				break;
+			}
+
+			regs(o->items[k].value, &rd, &wr);
+			if (rd & x){
+				break;
+			} else if (wr & x){
+				dead = 1;
+			}
+		}
+
+		if (dead){
+			delete(o, i);
+			o->stats->dead++;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* LD/ADD VX, a seguito da ADD VX, b diventa LD/ADD VX, a + b */
+static int fold_adds(struct opt *o){
+	asm_item_t *item, *next;
+	int changed;
+	long i, j;
+
+	changed = 0;
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+		if (item->deleted || item->type != ASM_ITEM_INSTR || shadowed(o, i)
+			|| (o->pins[item->addr] & PIN_TABLE)
+			|| ((item->value & 0xF000) != 0x6000 && (item->value & 0xF000) != 0x7000)){
+			continue;
+		}
+
+		j = next_item(o, i);
+		if (is_instr(o, j) && !o->pins[o->items[j].addr]
+			&& (o->items[j].value & 0xFF00) == (0x7000 | (item->value & 0x0F00))){
+			next = &o->items[j];
+			item->value = (item->value & 0xFF00) | ((item->value + next->value) & 0x00FF);
+			delete(o, j);
+			o->stats->folded++;
+			changed = 1;
+		}
+
+		/* ADD VX, 0 non fa nulla */
+		if ((item->value & 0xF0FF) == 0x7000){
+			delete(o, i);
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* Sposta etichette e indirizzi numerici in base alle istruzioni rimosse */
+static void relocate(struct opt *o){
+	uint16_t remap[4097], size, cur, a;
+	asm_item_t *item;
+	long i;
+
+	for (a=0; a<0x200; a++){
+		remap[a] = a;
+	}
+
+	cur = 0x200;
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+
+		switch (item->type){
+		case ASM_ITEM_INSTR: size = 2; break;
+		case ASM_ITEM_BYTE: size = 1; break;
+		case ASM_ITEM_RESB: size = item->value; break;
+		default: size = 0; break;
+		}
+
+		for (a=0; a<size && item->addr + a < 4096; a++){
+			remap[item->addr + a] = item->deleted ? cur : cur + a;
+		}
+
+		if (!item->deleted){
+			cur += size;
+		}
+	}
+	remap[o->end] = cur;
+
+	for (i=0; i<o->count; i++){
+		item = &o->items[i];
+
+		if (item->type == ASM_ITEM_LABEL){
+			item->sym->addr = remap[item->addr];
+		} else if (item->type == ASM_ITEM_INSTR && !item->sym && has_target(item->value)
+				   && (item->value & 0x0FFF) >= 0x200 && (item->value & 0x0FFF) <= o->end){
+			item->value = (item->value & 0xF000) | remap[item->value & 0x0FFF];
+		}
+	}
+}
+
+/* Ottimizza gli elementi del programma; le istruzioni rimosse vengono
+ * marcate come tali ed i simboli aggiornati con i nuovi indirizzi */
+void asm_optimize(asm_item_t *items, size_t count, struct asm_opt_stats *stats){
+	struct opt o;
+	asm_item_t *last;
+	int changed, pass;
+	unsigned long end;
+	long i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!count){
+		return;
+	}
+
+	last = &items[count - 1];
+	end = last->addr;
+	switch (last->type){
+	case ASM_ITEM_INSTR: end += 2; break;
+	case ASM_ITEM_BYTE: end += 1; break;
+	case ASM_ITEM_RESB: end += last->value; break;
+	}
+
+	/* Con programmi più grandi della memoria gli indirizzi non hanno senso */
+	if (end > 0x1000){
+		return;
+	}
+
+	o.items = items;
+	o.count = count;
+	o.stats = stats;
+	o.end = end;
+
+	for (i=0; i<4096; i++){
+		o.at[i] = -1;
+	}
+	for (i=0; i<o.count; i++){
+		if (items[i].type == ASM_ITEM_INSTR){
+			o.at[items[i].addr] = i;
+		}
+	}
+
+	find_pins(&o);
+
+	for (pass=0, changed=1; changed && pass<OPT_PASSES; pass++){
+		changed = thread_jumps(&o);
+		changed |= remove_unreachable(&o);
+		changed |= simplify_skips(&o);
+		changed |= remove_dead_stores(&o);
+		changed |= fold_adds(&o);
+	}
+
+	relocate(&o);
+}
@@ -0,0 +1,384 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "util.h"
+#include "c8as.h"
+#include "metrics.h"
+#include "reload.h"
+
+/*
+ * Quando il file cambia il programma viene ricostruito e confrontato
+ * con quello in esecuzione. Se PC, stack ed I si possono seguire nel
+ * nuovo programma, cioè stanno prima della prima modifica oppure dopo
+ * un'etichetta che esiste ancora e non è diventata troppo corta, la
+ * macchina resta quella che è e chip8_patch riscrive solo i byte
+ * cambiati. Altrimenti si torna al più recente degli snapshot presi
+ * ogni RELOAD_INTERVAL per cui questo è possibile, e se non ce ne sono
+ * il nuovo programma riparte dall'inizio.
+ */
+
+/* Come cambiano gli indirizzi tra il vecchio programma e il nuovo */
+struct layout {
+	const dbginfo_t *old, *new;
+	size_t oldlen, newlen;
+	size_t diff;                /* Primo byte diverso */
+};
+
+/* Costruisce il programma: assembla il sorgente con libc8as o legge il
+ * binario e i simboli scritti accanto da c8as -g; info viene
+ * inizializzato anche in caso di errore. Ritorna non zero in caso di
+ * errore, dopo averlo segnalato */
+int reload_build(const char *path, int source, uint8_t *prog, size_t *len, dbginfo_t *info){
+	const c8as_error_t *e;
+	c8as_result_t res;
+	char buf[8192], *sym;
+	outbuf_t src;
+	size_t count;
+	unsigned k;
+	FILE *fp;
+	int status;
+
+	dbginfo_init(info);
+
+	if (!source){
+		if (!(*len = read_file(path, prog, 0xE00))){
+			return 1;
+		}
+		if ((sym = malloc(strlen(path) + 5)) != NULL){
+			sprintf(sym, "%s.sym", path);
+			dbginfo_load(info, sym);
+			free(sym);
+		}
+		return 0;
+	}
+
+	if ((fp = fopen(path, "r")) == NULL){
+		err("impossibile leggere il file %s", path);
+		return 1;
+	}
+
+	if (outbuf_init(&src, NULL, 65536)){
+		err("impossibile allocare memoria");
+		fclose(fp);
+		return 1;
+	}
+
+	while ((count = fread(buf, 1, sizeof(buf), fp)) > 0){
+		outbuf_write(&src, buf, count);
+	}
+
+	status = ferror(fp) || src.error;
+	fclose(fp);
+	if (status){
+		err("impossibile leggere il file %s", path);
+		outbuf_free(&src);
+		return 1;
+	}
+
+	info->source = path;
+	status = c8as_assemble(src.data, src.used, prog, 0xE00, 0, info, &res);
+	outbuf_free(&src);
+
+	for (k=0; k<res.nerrors && k<C8AS_MAX_ERRORS; k++){
+		e = &res.errors[k];
+		if (e->line){
+			fprintf(stderr, "%s:%d: %s\n", path, e->line, e->msg);
+		} else {
+			fprintf(stderr, "%s: %s\n", path, e->msg);
+		}
+	}
+
+	if (status != C8AS_OK){
+		if (!res.nerrors){
+			fprintf(stderr, "%s: %s\n", path, c8as_strerror(status));
+		}
+		return 1;
+	}
+
+	/* libc8as registra le etichette nell'ordine della tabella dei simboli */
+	dbginfo_sort(info);
+	*len = res.len;
+	return 0;
+}
+
+/* Inizia ad osservare path: si osserva la directory, perché molti editor
+ * salvano scrivendo un altro file e rinominandolo.
+ * Ritorna non zero in caso di errore */
+int reload_init(reload_t *r, chip8_machine_t *machine, dbginfo_t *info,
+				const char *path, int source, const uint8_t *prog, size_t len){
+	const char *slash;
+	char *dir;
+
+	memset(r, 0, sizeof(*r));
+	r->machine = machine;
+	r->info = info;
+	r->path = path;
+	r->source = source;
+	r->len = len > sizeof(r->prog) ? sizeof(r->prog) : len;
+	memcpy(r->prog, prog, r->len);
+
+	if ((slash = strrchr(path, '/')) != NULL){
+		r->name = slash + 1;
+		dir = strndup(path, slash == path ? 1 : (size_t) (slash - path));
+	} else {
+		r->name = path;
+		dir = strdup(".");
+	}
+
+	if (!dir){
+		err("impossibile allocare memoria");
+		return 1;
+	}
+
+	if ((r->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+		|| inotify_add_watch(r->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+		err("impossibile osservare %s", dir);
+		if (r->fd >= 0){
+			close(r->fd);
+		}
+		free(dir);
+		return 1;
+	}
+
+	free(dir);
+	return 0;
+}
+
+/* Cerca un'etichetta per nome */
+static const dbg_label_t *find_label(const dbginfo_t *info, const char *name){
+	size_t k;
+
+	for (k=0; k<info->nlabels; k++){
+		if (!strcmp(info->labels[k].name, name)){
+			return &info->labels[k];
+		}
+	}
+
+	return NULL;
+}
+
+/* Indirizzo di addr nel nuovo programma, o -1 se non si può seguire:
+ * senza simboli restano validi solo gli indirizzi prima della prima
+ * modifica, o tutti se la lunghezza non è cambiata */
+static long relocate(const struct layout *lay, uint16_t addr){
+	const dbg_label_t *label, *moved, *next;
+	long target;
+
+	if (addr < 0x200 + lay->diff || addr >= 0x200 + lay->oldlen){
+		return addr;
+	}
+
+	if (!lay->old->nlabels || !lay->new->nlabels){
+		return lay->oldlen == lay->newlen ? addr : -1;
+	}
+
+	if ((label = dbginfo_label(lay->old, addr)) == NULL
+		|| (moved = find_label(lay->new, label->name)) == NULL){
+		return -1;
+	}
+
+	/* Stessa distanza dall'etichetta, ma sempre dentro il suo blocco */
+	target = moved->addr + (addr - label->addr);
+	for (next=moved + 1; next<lay->new->labels + lay->new->nlabels && next->addr == moved->addr; next++);
+
+	if (target >= (next < lay->new->labels + lay->new->nlabels ? next->addr : 0x200 + (long) lay->newlen)){
+		return -1;
+	}
+
+	return target;
+}
+
+/* Porta una macchina al nuovo programma; ritorna 1 se PC o stack non
+ * si possono seguire, e la macchina resta com'era, -1 se la memoria
+ * è esaurita */
+static int apply(const struct layout *lay, chip8_machine_t *m, const uint8_t *prog, size_t len){
+	uint16_t stack[16];
+	long pc, addr;
+	unsigned k;
+
+	if ((pc = relocate(lay, m->pc)) < 0){
+		return 1;
+	}
+
+	for (k=0; k<m->sp && k<16; k++){
+		if ((addr = relocate(lay, m->stack[k])) < 0){
+			return 1;
+		}
+		stack[k] = addr;
+	}
+
+	if (chip8_patch(m, prog, len) < 0){
+		return -1;
+	}
+
+	m->pc = pc;
+	memcpy(m->stack, stack, k * sizeof(uint16_t));
+
+	/* I può essere calcolato, si sposta solo se punta ad un'etichetta */
+	if ((addr = relocate(lay, m->i)) >= 0){
+		m->i = addr;
+	}
+
+	return 0;
+}
+
+/* Riporta la macchina ad uno snapshot, lasciando il debugger collegato */
+static int restore(chip8_machine_t *m, const chip8_machine_t *snap){
+	chip8_debug_t *debug;
+
+	debug = m->debug;
+	chip8_release(m);
+	if (chip8_fork(m, snap)){
+		return -1;
+	}
+	chip8_debug_attach(m, debug);
+	m->drawn = 1;
+
+	return 0;
+}
+
+/* Ricostruisce il programma e lo applica alla macchina */
+static void reload(reload_t *r, uint32_t now){
+	static uint8_t prog[0xE00];
+	chip8_machine_t *m;
+	struct layout lay;
+	dbginfo_t info;
+	uint64_t start;
+	unsigned k, kept;
+	size_t len;
+	int status;
+
+	start = metrics_now();
+	if (reload_build(r->path, r->source, prog, &len, &info)){
+		fprintf(stderr, "Ricarica di %s fallita, continua il programma precedente\n", r->path);
+		dbginfo_free(&info);
+		return;
+	}
+
+	/* Anche se il programma è lo stesso i simboli possono essere cambiati */
+	if (len == r->len && !memcmp(prog, r->prog, len)){
+		dbginfo_free(r->info);
+		*r->info = info;
+		return;
+	}
+
+	lay.old = r->info;
+	lay.new = &info;
+	lay.oldlen = r->len;
+	lay.newlen = len;
+	for (lay.diff=0; lay.diff<len && lay.diff<r->len && prog[lay.diff] == r->prog[lay.diff]; lay.diff++);
+
+	m = r->machine;
+	if ((status = apply(&lay, m, prog, len)) < 0){
+		goto nomem;
+	}
+
+	/* Anche gli snapshot passano al nuovo programma, e quelli che non
+	 * si possono seguire vengono scartati */
+	for (k=0, kept=0; k<r->nsnaps; k++){
+		if (apply(&lay, &r->snaps[k], prog, len)){
+			chip8_release(&r->snaps[k]);
+		} else {
+			r->snaps[kept] = r->snaps[k];
+			r->taken[kept++] = r->taken[k];
+		}
+	}
+	r->nsnaps = kept;
+
+	if (status == 0){
+		fprintf(stderr, "Ricaricato %s: stato conservato", r->path);
+	} else if (r->nsnaps){
+		if (restore(m, &r->snaps[r->nsnaps - 1])){
+			goto nomem;
+		}
+		fprintf(stderr, "Ricaricato %s: codice spostato, ripreso dallo snapshot di %ums fa",
+				r->path, (unsigned) (now - r->taken[r->nsnaps - 1]));
+	} else {
+		if (chip8_patch(m, prog, len) < 0){
+			goto nomem;
+		}
+		chip8_reset(m, m->rng);
+		m->drawn = 1;
+		fprintf(stderr, "Ricaricato %s: codice spostato, ripartito dall'inizio", r->path);
+	}
+	fprintf(stderr, " (%zu byte, %.1fms)\n", len, (metrics_now() - start) / 1000.0);
+
+	memcpy(r->prog, prog, len);
+	r->len = len;
+	dbginfo_free(r->info);
+	*r->info = info;
+	return;
+
+ nomem:
+	err("impossibile allocare memoria");
+	dbginfo_free(&info);
+}
+
+/* Controlla se il file è cambiato, e ogni RELOAD_INTERVAL prende uno
+ * snapshot della macchina; now è il tempo in millisecondi.
+ * Ritorna non zero se il programma è stato ricaricato */
+int reload_poll(reload_t *r, uint32_t now){
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len, off;
+	int changed;
+
+	if (!r->nsnaps || now - r->last >= RELOAD_INTERVAL){
+		if (r->nsnaps == RELOAD_SNAPSHOTS){
+			chip8_release(&r->snaps[0]);
+			memmove(r->snaps, r->snaps + 1, (RELOAD_SNAPSHOTS - 1) * sizeof(chip8_machine_t));
+			memmove(r->taken, r->taken + 1, (RELOAD_SNAPSHOTS - 1) * sizeof(uint32_t));
+			r->nsnaps--;
+		}
+		if (chip8_fork(&r->snaps[r->nsnaps], r->machine) == 0){
+			r->taken[r->nsnaps++] = now;
+		}
+		r->last = now;
+	}
+
+	changed = 0;
+	while ((len = read(r->fd, buf, sizeof(buf))) > 0){
+		for (off=0; off<len; off+=sizeof(struct inotify_event) + ev->len){
+			ev = (const struct inotify_event *) (buf + off);
+			if (ev->len && !strcmp(ev->name, r->name)){
+				changed = 1;
+			}
+		}
+	}
+
+	if (changed){
+		reload(r, now);
+	}
+
+	return changed;
+}
+
+void reload_free(reload_t *r){
+	unsigned k;
+
+	for (k=0; k<r->nsnaps; k++){
+		chip8_release(&r->snaps[k]);
+	}
+	r->nsnaps = 0;
+	close(r->fd);
+}
@@ -0,0 +1,55 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RELOAD_H_
+#define _RELOAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8.h"
+#include "debuginfo.h"
+
+/* Snapshot tenuti per tornare indietro quando il codice si è spostato
+ * troppo, e ogni quanti millisecondi se ne prende uno */
+#define RELOAD_SNAPSHOTS 8
+#define RELOAD_INTERVAL  1000
+
+/* Ricarica a caldo di c8emu: osserva il programma, o il sorgente da
+ * riassemblare, e quando cambia lo applica alla macchina in esecuzione */
+typedef struct reload {
+	chip8_machine_t *machine;
+	dbginfo_t *info;            /* Simboli, sostituiti ad ogni ricarica */
+	const char *path;
+	const char *name;           /* Nome del file dentro la directory osservata */
+	int source;                 /* Non zero se path è un sorgente */
+	int fd;                     /* inotify */
+	uint8_t prog[0xE00];        /* Programma in esecuzione */
+	size_t len;
+	chip8_machine_t snaps[RELOAD_SNAPSHOTS]; /* Dal più vecchio al più recente */
+	uint32_t taken[RELOAD_SNAPSHOTS];       /* Quando è stato preso ognuno, in ms */
+	unsigned nsnaps;
+	uint32_t last;              /* Ultimo snapshot, in ms */
+} reload_t;
+
+extern int reload_build(const char *path, int source, uint8_t *prog, size_t *len, dbginfo_t *info);
+extern int reload_init(reload_t *r, chip8_machine_t *machine, dbginfo_t *info,
+					   const char *path, int source, const uint8_t *prog, size_t len);
+extern int reload_poll(reload_t *r, uint32_t now);
+extern void reload_free(reload_t *r);
+
+#endif /* _RELOAD_H_ */
@@ -0,0 +1,180 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+#include "state.h"
+
+/* Lo hash lavora a parole di 64 bit: ogni parola viene mescolata nello
+ * stato con una moltiplicazione, abbastanza veloce da poter calcolare
+ * lo hash di ogni stato durante una ricerca */
+#define HASH_SEED 0x243F6A8885A308D3ULL
+#define HASH_MUL  0x9E3779B97F4A7C15ULL
+
+static inline uint64_t mix(uint64_t h, uint64_t word){
+	h = (h ^ word) * HASH_MUL;
+	return h ^ (h >> 29);
+}
+
+static inline uint64_t load64(const uint8_t *p){
+	uint64_t word;
+
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *data, size_t len){
+	size_t i;
+
+	for (i=0; i + 8 <= len; i+=8){
+		h = mix(h, load64(data + i));
+	}
+	for (; i<len; i++){
+		h = mix(h, data[i]);
+	}
+
+	return h;
+}
+
+/* Calcola lo hash di len byte qualsiasi */
+uint64_t chip8_hash_bytes(const void *data, size_t len){
+	return mix(hash_bytes(HASH_SEED, data, len), len);
+}
+
+/* Calcola lo hash di una pagina di RAM; pagine con lo stesso contenuto
+ * hanno lo stesso hash sia che siano condivise sia che siano private */
+uint64_t chip8_page_hash(const uint8_t *page){
+	return hash_bytes(HASH_SEED, page, CHIP8_PAGE_SIZE);
+}
+
+/* Calcola lo hash a 64 bit di tutto lo stato della macchina: registri,
+ * stack, timer, tastiera, schermo e RAM. Lo hash delle pagine ancora
+ * condivise è già nell'immagine, e quello delle pagine private e dello
+ * schermo resta nella macchina finché non vengono scritti: vengono
+ * lette solo le pagine cambiate dalla chiamata precedente. Scrive
+ * quindi nella macchina, e non va chiamata mentre un altro thread la
+ * usa, nemmeno per copiarla con chip8_fork */
+uint64_t chip8_hash(chip8_machine_t *ctx){
+	uint64_t h;
+	unsigned page;
+
+	/* I campi uno per uno, per non dipendere dal padding della struttura */
+	h = hash_bytes(HASH_SEED, ctx->v, sizeof(ctx->v));
+	h = mix(h, ctx->i | (uint64_t) ctx->dt << 16 | (uint64_t) ctx->st << 24
+			| (uint64_t) ctx->sp << 32 | (uint64_t) ctx->pc << 40);
+	h = hash_bytes(h, (const uint8_t *) ctx->stack, sizeof(ctx->stack));
+	h = mix(h, (uint64_t) ctx->wait | (uint64_t) ctx->last_key << 8
+			| (uint64_t) ctx->quirks << 16 | (uint64_t) ctx->rng << 32);
+	h = hash_bytes(h, ctx->keys, sizeof(ctx->keys));
+
+	if (!ctx->vram_hashed){
+		ctx->vram_hash = hash_bytes(HASH_SEED, ctx->vram, CHIP8_VRAM_SIZE);
+		ctx->vram_hashed = 1;
+	}
+	h = mix(h, ctx->vram_hash);
+
+	for (page=0; page<CHIP8_PAGES; page++){
+		if (ctx->image && !(ctx->dirty & (1u << page))){
+			h = mix(h, ctx->image->hash[page]);
+			continue;
+		}
+
+		/* Senza immagine anche le pagine condivise sono del font
+		 * vuoto: il loro hash si tiene come quello delle private */
+		if (!(ctx->hashed & (1u << page))){
+			ctx->page_hash[page] = chip8_page_hash(ctx->pages[page]);
+			ctx->hashed |= 1u << page;
+		}
+		h = mix(h, ctx->page_hash[page]);
+	}
+
+	return h;
+}
+
+/* Prepara un insieme per almeno capacity hash
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita */
+int chip8_seen_init(chip8_seen_t *seen, size_t capacity){
+	size_t size;
+
+	/* Teniamo la tabella piena al massimo per tre quarti */
+	for (size=64; size / 4 * 3 < capacity; size*=2);
+
+	if ((seen->slots = calloc(size, sizeof(uint64_t))) == NULL){
+		return -1;
+	}
+
+	seen->mask = size - 1;
+	seen->limit = size / 4 * 3;
+	seen->count = 0;
+
+	return 0;
+}
+
+/* Inserisce uno hash nell'insieme, anche da più thread insieme
+ * Ritorna 1 se lo hash è nuovo, 0 se era già presente,
+ * -1 se l'insieme è pieno */
+int chip8_seen_insert(chip8_seen_t *seen, uint64_t hash){
+	uint64_t old;
+	size_t pos;
+
+	/* Zero indica uno slot libero */
+	if (!hash){
+		hash = 1;
+	}
+
+	for (pos=hash & seen->mask; ; pos=(pos + 1) & seen->mask){
+		old = __atomic_load_n(&seen->slots[pos], __ATOMIC_RELAXED);
+
+		if (old == hash){
+			return 0;
+		}
+
+		if (!old){
+			/* Riserviamo un posto prima di occupare lo slot,
+			 * così la tabella non si riempie mai del tutto */
+			if (__sync_add_and_fetch(&seen->count, 1) > seen->limit){
+				__sync_sub_and_fetch(&seen->count, 1);
+				return -1;
+			}
+
+			old = __sync_val_compare_and_swap(&seen->slots[pos], 0, hash);
+			if (!old){
+				return 1;
+			}
+
+			/* Un altro thread ha preso lo slot */
+			__sync_sub_and_fetch(&seen->count, 1);
+			if (old == hash){
+				return 0;
+			}
+		}
+	}
+}
+
+/* Svuota l'insieme, da non chiamare mentre altri thread inseriscono */
+void chip8_seen_clear(chip8_seen_t *seen){
+	memset(seen->slots, 0, (seen->mask + 1) * sizeof(uint64_t));
+	seen->count = 0;
+}
+
+void chip8_seen_free(chip8_seen_t *seen){
+	free(seen->slots);
+	seen->slots = NULL;
+}
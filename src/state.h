@@ -0,0 +1,44 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chip8.h"
+
+/* Insieme di hash di stati già visti, usabile da più thread insieme:
+ * serve ad espandere una sola volta gli stati identici raggiunti con
+ * sequenze di input diverse */
+typedef struct chip8_seen {
+	uint64_t *slots;        /* Hash, zero indica uno slot libero */
+	size_t mask;            /* Numero di slot meno uno */
+	size_t limit;           /* Massimo numero di hash inseribili */
+	size_t count;
+} chip8_seen_t;
+
+extern uint64_t chip8_hash_bytes(const void *data, size_t len);
+extern uint64_t chip8_page_hash(const uint8_t *page);
+extern uint64_t chip8_hash(chip8_machine_t *ctx);
+extern int chip8_seen_init(chip8_seen_t *seen, size_t capacity);
+extern int chip8_seen_insert(chip8_seen_t *seen, uint64_t hash);
+extern void chip8_seen_clear(chip8_seen_t *seen);
+extern void chip8_seen_free(chip8_seen_t *seen);
+
+#endif /* _STATE_H_ */
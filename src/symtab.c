@@ -0,0 +1,138 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h> /* calloc, free */
+#include <string.h> /* strcmp */
+#include <stdint.h> /* uint32_t */
+
+#include "symtab.h"
+
+/* Numero iniziale di bucket, sempre una potenza di due */
+#define SYMTAB_INITIAL 256
+
+/* Hash FNV-1a del nome */
+static uint32_t hash_name(const char *name){
+	uint32_t h;
+
+	for (h=2166136261u; *name; name++){
+		h = (h ^ (uint8_t) *name) * 16777619u;
+	}
+
+	return h;
+}
+
+/* Inizializza una tabella vuota, ritorna non zero se la memoria è esaurita */
+int symtab_init(symtab_t *tab, arena_t *arena){
+	tab->nbuckets = SYMTAB_INITIAL;
+	tab->count = 0;
+	tab->arena = arena;
+
+	return (tab->buckets = calloc(tab->nbuckets, sizeof(symbol_t *))) == NULL;
+}
+
+/* Cerca un simbolo per nome, ritorna NULL se non esiste */
+symbol_t *symtab_lookup(const symtab_t *tab, const char *name){
+	symbol_t *sym;
+	uint32_t h;
+
+	h = hash_name(name);
+
+	for (sym=tab->buckets[h & (tab->nbuckets - 1)]; sym; sym=sym->next){
+		if (sym->hash == h && !strcmp(sym->name, name)){
+			return sym;
+		}
+	}
+
+	return NULL;
+}
+
+/* Raddoppia il numero di bucket quando la tabella è troppo piena;
+ * se la memoria è esaurita la tabella resta com'è, solo più lenta */
+static void grow(symtab_t *tab){
+	symbol_t **buckets, *sym, *next;
+	size_t i, n;
+
+	n = tab->nbuckets * 2;
+	if ((buckets = calloc(n, sizeof(symbol_t *))) == NULL){
+		return;
+	}
+
+	for (i=0; i<tab->nbuckets; i++){
+		for (sym=tab->buckets[i]; sym; sym=next){
+			next = sym->next;
+			sym->next = buckets[sym->hash & (n - 1)];
+			buckets[sym->hash & (n - 1)] = sym;
+		}
+	}
+
+	free(tab->buckets);
+	tab->buckets = buckets;
+	tab->nbuckets = n;
+}
+
+/* Cerca un simbolo per nome, creandolo non definito se non esiste;
+ * il nome deve restare valido finché esiste la tabella.
+ * Ritorna NULL se la memoria è esaurita */
+symbol_t *symtab_intern(symtab_t *tab, const char *name){
+	symbol_t *sym, **bucket;
+
+	if ((sym = symtab_lookup(tab, name)) != NULL){
+		return sym;
+	}
+
+	if ((sym = arena_alloc(tab->arena, sizeof(symbol_t))) == NULL){
+		return NULL;
+	}
+
+	sym->name = name;
+	sym->hash = hash_name(name);
+	sym->addr = 0;
+	sym->defined = 0;
+	sym->line = 0;
+	sym->section = 0;
+	sym->visibility = 0;
+	sym->index = 0;
+
+	bucket = &tab->buckets[sym->hash & (tab->nbuckets - 1)];
+	sym->next = *bucket;
+	*bucket = sym;
+
+	if (++tab->count > tab->nbuckets){
+		grow(tab);
+	}
+
+	return sym;
+}
+
+/* Chiama fn per ogni simbolo della tabella, in ordine qualsiasi */
+void symtab_foreach(const symtab_t *tab, void (*fn)(symbol_t *sym, void *arg), void *arg){
+	symbol_t *sym;
+	size_t i;
+
+	for (i=0; i<tab->nbuckets; i++){
+		for (sym=tab->buckets[i]; sym; sym=sym->next){
+			fn(sym, arg);
+		}
+	}
+}
+
+/* Libera la tabella, i simboli vengono liberati insieme all'arena */
+void symtab_free(symtab_t *tab){
+	free(tab->buckets);
+	tab->buckets = NULL;
+	tab->nbuckets = tab->count = 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SYMTAB_H_
+#define _SYMTAB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "util.h"
+
+/* Simbolo dell'assembler: un'etichetta ed il suo indirizzo */
+typedef struct symbol {
+	const char *name;
+	uint32_t hash;
+	uint16_t addr;
+	int defined;            /* Non zero se l'etichetta è stata definita */
+	int line;               /* Riga della definizione */
+	uint8_t section;        /* Negli oggetti: sezione, e addr è relativo ad essa */
+	uint8_t visibility;     /* Negli oggetti: ASM_SYM_GLOBAL o ASM_SYM_EXTERN */
+	uint32_t index;         /* Negli oggetti: posizione nella tabella dei simboli */
+	struct symbol *next;    /* Prossimo simbolo nello stesso bucket */
+} symbol_t;
+
+/* Tabella hash dei simboli, i simboli sono allocati nell'arena */
+typedef struct symtab {
+	symbol_t **buckets;
+	size_t nbuckets, count;
+	arena_t *arena;
+} symtab_t;
+
+extern int symtab_init(symtab_t *tab, arena_t *arena);
+extern symbol_t *symtab_lookup(const symtab_t *tab, const char *name);
+extern symbol_t *symtab_intern(symtab_t *tab, const char *name);
+extern void symtab_foreach(const symtab_t *tab, void (*fn)(symbol_t *sym, void *arg), void *arg);
+extern void symtab_free(symtab_t *tab);
+
+#endif /* _SYMTAB_H_ */
@@ -0,0 +1,278 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tcache.h"
+#include "state.h"
+
+/* Cache su disco delle analisi dei programmi: ogni file contiene il
+ * programma e l'analisi in forma compatta (la parte non vuota della
+ * mappa dei flag, i blocchi e le chiamate trovati), con chiave lo
+ * hash di programma e quirk. Un file è di pochi KB: leggerlo, validarlo
+ * e ricostruire il flow_t costa meno che ripetere l'analisi anche per
+ * le ROM piccole, mentre mappare e controllare tutto il flow_t no.
+ * I file vengono scritti con un nome temporaneo e poi rinominati, così
+ * che più processi possano leggere e scrivere insieme senza mai vedere
+ * un file a metà; un file non valido viene ignorato e riscritto */
+
+#define TCACHE_MAGIC "C8TCACHE"
+
+struct tcache_header {
+	char magic[8];
+	uint32_t version;       /* TCACHE_VERSION */
+	uint32_t len;           /* Lunghezza del programma */
+	uint64_t key;           /* Hash di programma e quirk */
+	uint32_t quirks;
+	uint16_t end, nblocks, ncalls, nprocs; /* Campi di flow_t */
+	uint16_t lo, hi;        /* Parte della mappa salvata, [lo, hi) */
+	uint32_t pad;
+	uint64_t check;         /* Hash di tutto ciò che segue l'header */
+};
+
+/* Il programma, poi i flag da lo a hi (fuori sono zero; le etichette
+ * possono stare anche fuori dal programma), i blocchi e le chiamate;
+ * ogni parte inizia ad un multiplo di 8 byte */
+#define ALIGN8(n)        (((n) + 7) & ~(size_t) 7)
+#define MAP_OFFSET(len)  (sizeof(struct tcache_header) + ALIGN8(len))
+#define MAP_SIZE(n)      ALIGN8((n) * sizeof(uint16_t))
+#define BLOCKS_SIZE(n)   ALIGN8((n) * sizeof(flow_block_t))
+#define CALLS_SIZE(n)    ALIGN8((n) * sizeof(flow_call_t))
+#define FILE_SIZE(len, nmap, nblocks, ncalls) \
+	(MAP_OFFSET(len) + MAP_SIZE(nmap) + BLOCKS_SIZE(nblocks) + CALLS_SIZE(ncalls))
+
+/* Sotto questa lunghezza l'analisi costa quanto aprire e leggere un
+ * file, e la cache non viene usata */
+#define TCACHE_MIN_LEN 512
+
+/* Dimensione massima di un file: programma, mappa, blocchi e chiamate */
+#define FILE_MAX FILE_SIZE(0x0E00, 0x1000, FLOW_MAX_BLOCKS, FLOW_MAX_CALLS)
+
+/* Scrive in buf la directory della cache: CHIP8_CACHE_DIR se impostata,
+ * altrimenti $XDG_CACHE_HOME/chip8 o ~/.cache/chip8; con create non zero
+ * la crea se serve, prima di scriverci, e non ad ogni lettura
+ * Ritorna -1 se la cache è disattivata o non disponibile */
+static int cache_dir(char *buf, size_t len, int create){
+	const char *env;
+
+	if ((env = getenv("CHIP8_CACHE_DIR")) != NULL){
+		/* Una variabile vuota disattiva la cache */
+		if (!*env || (size_t) snprintf(buf, len, "%s", env) >= len){
+			return -1;
+		}
+	} else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env){
+		if ((size_t) snprintf(buf, len, "%s/chip8", env) >= len){
+			return -1;
+		}
+		if (create){
+			mkdir(env, 0700);
+		}
+	} else if ((env = getenv("HOME")) != NULL && *env){
+		if ((size_t) snprintf(buf, len, "%s/.cache/chip8", env) >= len){
+			return -1;
+		}
+		/* Creiamo ~/.cache se non c'è */
+		if (create){
+			buf[strlen(buf) - 6] = '\0';
+			mkdir(buf, 0700);
+			buf[strlen(buf)] = '/';
+		}
+	} else {
+		return -1;
+	}
+
+	if (create && mkdir(buf, 0700) && errno != EEXIST){
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Controlla che il file letto sia valido e corrisponda al programma,
+ * poi ricostruisce in flow l'analisi
+ * Ritorna 0 in caso di successo, -1 se il file non vale */
+static int load(flow_t *flow, const uint8_t *data, size_t size, uint64_t key,
+				const uint8_t *prog, size_t len, unsigned quirks){
+	struct tcache_header hdr;
+	const uint8_t *p;
+
+	if (size < sizeof(hdr)){
+		return -1;
+	}
+
+	memcpy(&hdr, data, sizeof(hdr));
+
+	if (memcmp(hdr.magic, TCACHE_MAGIC, sizeof(hdr.magic))
+		|| hdr.version != TCACHE_VERSION || hdr.key != key
+		|| hdr.quirks != quirks || hdr.len != len
+		|| hdr.lo > hdr.hi || hdr.hi > 0x1000
+		|| hdr.nblocks > FLOW_MAX_BLOCKS || hdr.ncalls > FLOW_MAX_CALLS
+		|| size != FILE_SIZE(len, hdr.hi - hdr.lo, hdr.nblocks, hdr.ncalls)){
+		return -1;
+	}
+
+	/* Lo hash potrebbe collidere: confrontiamo anche il programma */
+	if (memcmp(data + sizeof(hdr), prog, len)){
+		return -1;
+	}
+
+	if (hdr.check != chip8_hash_bytes(data + sizeof(hdr), size - sizeof(hdr))){
+		return -1;
+	}
+
+	flow->end = hdr.end;
+	flow->nblocks = hdr.nblocks;
+	flow->ncalls = hdr.ncalls;
+	flow->nprocs = hdr.nprocs;
+
+	/* Dopo nblocks e ncalls i vettori non vengono letti */
+	p = data + MAP_OFFSET(len);
+	memset(flow->map, 0, hdr.lo * sizeof(uint16_t));
+	memcpy(flow->map + hdr.lo, p, (hdr.hi - hdr.lo) * sizeof(uint16_t));
+	memset(flow->map + hdr.hi, 0, (0x1000 - hdr.hi) * sizeof(uint16_t));
+	p += MAP_SIZE(hdr.hi - hdr.lo);
+	memcpy(flow->blocks, p, hdr.nblocks * sizeof(flow_block_t));
+	p += BLOCKS_SIZE(hdr.nblocks);
+	memcpy(flow->calls, p, hdr.ncalls * sizeof(flow_call_t));
+
+	return 0;
+}
+
+/* Scrive l'analisi nella cache, eventuali errori vengono ignorati */
+static void store(const char *dir, const char *path, const flow_t *flow, uint64_t key,
+				  const uint8_t *prog, size_t len, unsigned quirks){
+	struct tcache_header *hdr;
+	uint8_t *data, *p;
+	unsigned lo, hi;
+	size_t size;
+	char *tmp;
+	int fd, failed;
+
+	for (lo=0; lo<0x1000 && !flow->map[lo]; lo++);
+	for (hi=0x1000; hi>lo && !flow->map[hi - 1]; hi--);
+
+	size = FILE_SIZE(len, hi - lo, flow->nblocks, flow->ncalls);
+	data = calloc(size, 1);
+	tmp = malloc(strlen(dir) + 16);
+
+	if (!data || !tmp){
+		goto out;
+	}
+
+	hdr = (struct tcache_header *) data;
+	memcpy(hdr->magic, TCACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = TCACHE_VERSION;
+	hdr->len = len;
+	hdr->key = key;
+	hdr->quirks = quirks;
+	hdr->end = flow->end;
+	hdr->nblocks = flow->nblocks;
+	hdr->ncalls = flow->ncalls;
+	hdr->nprocs = flow->nprocs;
+	hdr->lo = lo;
+	hdr->hi = hi;
+	memcpy(data + sizeof(*hdr), prog, len);
+
+	p = data + MAP_OFFSET(len);
+	memcpy(p, flow->map + lo, (hi - lo) * sizeof(uint16_t));
+	p += MAP_SIZE(hi - lo);
+	memcpy(p, flow->blocks, flow->nblocks * sizeof(flow_block_t));
+	p += BLOCKS_SIZE(flow->nblocks);
+	memcpy(p, flow->calls, flow->ncalls * sizeof(flow_call_t));
+	hdr->check = chip8_hash_bytes(data + sizeof(*hdr), size - sizeof(*hdr));
+
+	sprintf(tmp, "%s/.tmpXXXXXX", dir);
+	if ((fd = mkstemp(tmp)) < 0){
+		goto out;
+	}
+
+	/* Il file diventa visibile solo quando è completo; close va
+	 * chiamata una volta sola, anche se fallisce */
+	failed = write(fd, data, size) != (ssize_t) size || fchmod(fd, 0644);
+	if (close(fd) || failed || rename(tmp, path)){
+		unlink(tmp);
+	}
+
+ out:
+	free(data);
+	free(tmp);
+}
+
+/* Ritorna in entry l'analisi del programma prog di len byte con le
+ * quirk indicate, dalla cache se presente, altrimenti calcolandola e
+ * salvandola; entry va liberata con tcache_close
+ * Ritorna 0 in caso di successo, -1 se la memoria è esaurita */
+int tcache_open(tcache_entry_t *entry, const uint8_t *prog, size_t len, unsigned quirks){
+	char dir[4096], path[4200];
+	uint8_t *data;
+	uint64_t key;
+	ssize_t size;
+	int fd, cached;
+
+	memset(entry, 0, sizeof(*entry));
+
+	if (len > 0x0E00){
+		len = 0x0E00;
+	}
+
+	if ((entry->owned = malloc(sizeof(flow_t))) == NULL){
+		return -1;
+	}
+	entry->flow = entry->owned;
+
+	key = chip8_hash_bytes(prog, len) ^ ((uint64_t) quirks << 56) ^ TCACHE_VERSION;
+	cached = len >= TCACHE_MIN_LEN && !cache_dir(dir, sizeof(dir), 0);
+
+	if (cached){
+		snprintf(path, sizeof(path), "%s/%016llx.flow", dir, (unsigned long long) key);
+
+		/* Il file è piccolo: una sola read, un byte in più del massimo
+		 * per riconoscere quelli troppo lunghi */
+		if ((fd = open(path, O_RDONLY)) >= 0){
+			if ((data = malloc(FILE_MAX + 1)) != NULL){
+				size = read(fd, data, FILE_MAX + 1);
+				if (size > 0 && !load(entry->owned, data, size, key, prog, len, quirks)){
+					free(data);
+					close(fd);
+					return 0;
+				}
+				free(data);
+			}
+			close(fd);
+		}
+	}
+
+	flow_analyze(entry->owned, prog, len, quirks);
+
+	if (cached && !cache_dir(dir, sizeof(dir), 1)){
+		store(dir, path, entry->owned, key, prog, len, quirks);
+	}
+
+	return 0;
+}
+
+void tcache_close(tcache_entry_t *entry){
+	free(entry->owned);
+	memset(entry, 0, sizeof(*entry));
+}
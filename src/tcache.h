@@ -0,0 +1,39 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TCACHE_H_
+#define _TCACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "flow.h"
+
+/* Versione del formato dei file della cache, va incrementata ad ogni
+ * modifica di flow_t o dell'analisi */
+#define TCACHE_VERSION 2
+
+/* Analisi di un programma, letta dalla cache o appena calcolata */
+typedef struct tcache_entry {
+	const flow_t *flow;
+	flow_t *owned;          /* Memoria di flow */
+} tcache_entry_t;
+
+extern int tcache_open(tcache_entry_t *entry, const uint8_t *prog, size_t len, unsigned quirks);
+extern void tcache_close(tcache_entry_t *entry);
+
+#endif /* _TCACHE_H_ */
@@ -20,6 +20,7 @@
 
 #include "chip8.h"
 #include "ui.h"
+#include "metrics.h"
 
 /* Dimensione in pixel reali dello schermo CHIP-8
  * 1: 64x32
@@ -36,6 +37,7 @@ static SDL_Renderer *ren;
 static SDL_Texture *tex;
 static const Uint8 *sdl_keys;
 static uint32_t fg, bg;
+static uint64_t key_time;  /* Primo tasto premuto dopo l'ultimo frame, in µs */
 
 /* Tabella di conversione tasti PC a tasti CHIP-8
  *
@@ -64,6 +66,28 @@ static int keymap[16] = {
 	SDL_SCANCODE_V
 };
 
+/* Sostituisce la tabella dei tasti: keys ha un carattere (a-z, 0-9)
+ * per ogni tasto CHIP-8, ad esempio "x123qweasdzc4rfv" per quella
+ * predefinita. Ritorna non zero se un carattere non è valido */
+int ui_set_keymap(const char *keys){
+	int i, map[16];
+
+	for (i=0; i<16; i++){
+		if (keys[i] >= 'a' && keys[i] <= 'z'){
+			map[i] = SDL_SCANCODE_A + (keys[i] - 'a');
+		} else if (keys[i] >= '1' && keys[i] <= '9'){
+			map[i] = SDL_SCANCODE_1 + (keys[i] - '1');
+		} else if (keys[i] == '0'){
+			map[i] = SDL_SCANCODE_0;
+		} else {
+			return 1;
+		}
+	}
+
+	memcpy(keymap, map, sizeof(keymap));
+	return 0;
+}
+
 int ui_init_sdl(){
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)){
 		fprintf(stderr, "Errore init SDL: %s\n", SDL_GetError());
@@ -137,12 +161,16 @@ int ui_input(chip8_machine_t *chip8){
 
 			if (ev.key.keysym.sym == SDLK_ESCAPE){
 				chip8->pc = chip8->sp = 0;
-				memset(chip8->vram, 0, 256);
+				memset(chip8->vram, 0, CHIP8_VRAM_SIZE);
+				chip8->vram_hashed = 0;
 			}
 				
 			for (i=0; i<16; i++){
 				if (ev.key.keysym.scancode == keymap[i]){
 					chip8_pressed(chip8, i);
+					if (!key_time){
+						key_time = metrics_now();
+					}
 					break;
 				}
 			}
@@ -159,6 +187,16 @@ int ui_input(chip8_machine_t *chip8){
 	return 0;
 }
 
+/* Ritorna quando è stato premuto il primo tasto dall'ultima chiamata,
+ * o zero; chiamata dopo ui_render misura la latenza dell'input */
+uint64_t ui_key_time(void){
+	uint64_t t;
+
+	t = key_time;
+	key_time = 0;
+	return t;
+}
+
 void ui_render(chip8_machine_t *chip8){
 	int i, j, pitch;
 	uint32_t *pixels;
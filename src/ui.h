@@ -23,7 +23,9 @@
 extern int ui_init_sdl();
 extern void ui_quit_sdl();
 extern void ui_set_colors(uint32_t _fg, uint32_t _bg);
+extern int ui_set_keymap(const char *keys);
 extern int ui_input(chip8_machine_t *chip8);
 extern void ui_render(chip8_machine_t *chip8);
+extern uint64_t ui_key_time(void);
 
 #endif /* _UI_H_ */
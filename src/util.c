@@ -19,8 +19,14 @@
 #include <stddef.h> /* size_t */
 #include <stdint.h> /* uint8_t */
 #include <errno.h> /* errno */
-#include <string.h> /* strerror */
+#include <string.h> /* strerror, strlen, memcpy */
 #include <stdarg.h> /* va_list */
+#include <stdlib.h> /* malloc, free */
+
+#include "util.h"
+
+/* Dimensione minima di un blocco dell'arena */
+#define ARENA_CHUNK 65536
 
 /* Conta il numero di bit impostati ad 1 in un byte */
 int popcount(uint8_t b){
@@ -89,3 +95,163 @@ size_t read_file(const char *path, void *buf, size_t len){
  fail:
 	return 0;
 }
+
+/* Inizializza un'arena vuota */
+void arena_init(arena_t *arena){
+	arena->head = NULL;
+}
+
+/* Alloca size byte dall'arena, allineati per qualsiasi tipo;
+ * ritorna NULL se la memoria è esaurita */
+void *arena_alloc(arena_t *arena, size_t size){
+	arena_chunk_t *chunk;
+	size_t units, avail;
+	void *ptr;
+
+	/* Lavoriamo in unità di arena_align_t per mantenere l'allineamento */
+	units = (size + sizeof(arena_align_t) - 1) / sizeof(arena_align_t);
+	chunk = arena->head;
+
+	if (!chunk || chunk->used + units > chunk->size){
+		avail = ARENA_CHUNK / sizeof(arena_align_t);
+		if (units > avail){
+			avail = units;
+		}
+
+		if ((chunk = malloc(sizeof(arena_chunk_t) + avail * sizeof(arena_align_t))) == NULL){
+			return NULL;
+		}
+
+		chunk->size = avail;
+		chunk->used = 0;
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += units;
+
+	return ptr;
+}
+
+/* Copia una stringa nell'arena */
+char *arena_strdup(arena_t *arena, const char *str){
+	size_t len;
+	char *copy;
+
+	len = strlen(str) + 1;
+	if ((copy = arena_alloc(arena, len)) != NULL){
+		memcpy(copy, str, len);
+	}
+
+	return copy;
+}
+
+/* Libera in un colpo solo tutta la memoria dell'arena */
+void arena_free(arena_t *arena){
+	arena_chunk_t *chunk, *next;
+
+	for (chunk=arena->head; chunk; chunk=next){
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena->head = NULL;
+}
+
+/* Prepara un buffer di uscita di size byte verso fp, o in memoria se fp
+ * è NULL; ritorna non zero se la memoria è esaurita */
+int outbuf_init(outbuf_t *ob, FILE *fp, size_t size){
+	ob->fp = fp;
+	ob->size = size;
+	ob->used = 0;
+	ob->error = 0;
+
+	return (ob->data = malloc(size)) == NULL;
+}
+
+/* Scrive il contenuto del buffer nel file, ritorna non zero in caso di errore */
+int outbuf_flush(outbuf_t *ob){
+	if (ob->fp && ob->used){
+		if (fwrite(ob->data, 1, ob->used, ob->fp) < ob->used){
+			ob->error = 1;
+		}
+		ob->used = 0;
+	}
+
+	return ob->error;
+}
+
+/* Aggiunge len byte al buffer */
+void outbuf_write(outbuf_t *ob, const void *data, size_t len){
+	char *bigger;
+	size_t size;
+
+	if (ob->used + len > ob->size){
+		if (ob->fp){
+			outbuf_flush(ob);
+		}
+
+		/* In memoria, o se il blocco è più grande del buffer, cresciamo */
+		if (ob->used + len > ob->size){
+			for (size=ob->size * 2; size<ob->used + len; size*=2);
+
+			if ((bigger = realloc(ob->data, size)) == NULL){
+				ob->error = 1;
+				return;
+			}
+			ob->data = bigger;
+			ob->size = size;
+		}
+	}
+
+	memcpy(ob->data + ob->used, data, len);
+	ob->used += len;
+}
+
+void outbuf_puts(outbuf_t *ob, const char *str){
+	outbuf_write(ob, str, strlen(str));
+}
+
+void outbuf_putc(outbuf_t *ob, char c){
+	if (ob->used < ob->size){
+		ob->data[ob->used++] = c;
+	} else {
+		outbuf_write(ob, &c, 1);
+	}
+}
+
+/* Scrive value in esadecimale maiuscolo con digits cifre */
+void outbuf_hex(outbuf_t *ob, unsigned value, int digits){
+	static const char hex[] = "0123456789ABCDEF";
+	char buf[8];
+	int i;
+
+	for (i=digits-1; i>=0; i--){
+		buf[i] = hex[value & 0x0F];
+		value >>= 4;
+	}
+
+	outbuf_write(ob, buf, digits);
+}
+
+/* Scrive value in decimale */
+void outbuf_dec(outbuf_t *ob, unsigned long value){
+	char buf[24];
+	int i;
+
+	i = sizeof(buf);
+	do {
+		buf[--i] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	outbuf_write(ob, buf + i, sizeof(buf) - i);
+}
+
+/* Libera il buffer senza scriverlo */
+void outbuf_free(outbuf_t *ob){
+	free(ob->data);
+	ob->data = NULL;
+	ob->size = ob->used = 0;
+}
@@ -20,10 +20,49 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
+
+/* Arena: memoria allocata a blocchi e liberata tutta insieme */
+typedef union arena_align {
+	long long l;
+	long double d;
+	void *p;
+} arena_align_t;
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;      /* In unità di arena_align_t */
+	arena_align_t data[];
+} arena_chunk_t;
+
+typedef struct arena {
+	arena_chunk_t *head;
+} arena_t;
+
+/* Buffer di uscita: accumula il testo e lo scrive a grossi blocchi
+ * nel file, oppure lo tiene in memoria se il file è NULL */
+typedef struct outbuf {
+	char *data;
+	size_t size, used;
+	FILE *fp;
+	int error;              /* Non zero dopo un errore di scrittura o memoria */
+} outbuf_t;
 
 extern int popcount(uint8_t b);
 extern void logd(const char *fmt, ...);
 extern void err(const char *fmt, ...);
 extern size_t read_file(const char *path, void *buf, size_t len);
+extern void arena_init(arena_t *arena);
+extern void *arena_alloc(arena_t *arena, size_t size);
+extern char *arena_strdup(arena_t *arena, const char *str);
+extern void arena_free(arena_t *arena);
+extern int outbuf_init(outbuf_t *ob, FILE *fp, size_t size);
+extern void outbuf_write(outbuf_t *ob, const void *data, size_t len);
+extern void outbuf_puts(outbuf_t *ob, const char *str);
+extern void outbuf_putc(outbuf_t *ob, char c);
+extern void outbuf_hex(outbuf_t *ob, unsigned value, int digits);
+extern void outbuf_dec(outbuf_t *ob, unsigned long value);
+extern int outbuf_flush(outbuf_t *ob);
+extern void outbuf_free(outbuf_t *ob);
 
 #endif /* _UTIL_H_ */
@@ -0,0 +1,277 @@
+/*
+ * chip8
+ * Copyright (C) 2016  forsenonlhaimaisentito <titor@catafratta.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <SDL.h>
+
+#include "util.h"
+#include "chip8.h"
+#include "c8d.h"
+#include "wall.h"
+
+/*
+ * Vista a muro: gli schermi di molte sessioni di c8d in una sola
+ * finestra. Gli schermi vengono letti dalla memoria condivisa del
+ * demone e disposti in griglia in un'unica texture (atlante); ad ogni
+ * frame si ricaricano solo le caselle il cui numero di sequenza è
+ * cambiato, e tutto viene disegnato con un solo SDL_RenderCopy.
+ */
+
+#define WALL_MAX 256        /* Slot mostrati al massimo */
+#define TILE_W (64 + 1)     /* Uno schermo più un pixel di separazione */
+#define TILE_H (32 + 1)
+#define WALL_WIDTH 1280     /* Larghezza massima iniziale della finestra */
+#define GAP_COLOR 0x303030FF /* Separatori e slot liberi */
+
+static uint32_t *atlas;     /* Copia dei pixel della texture */
+static unsigned cols, rows, width, height;
+static uint32_t expand[256][8]; /* Pixel di ogni byte della VRAM */
+
+/* Si collega a c8d e mappa gli schermi di tutte le sessioni
+ * Ritorna NULL in caso di errore, altrimenti *nslots è il numero di slot */
+static const c8d_frame_t *map_frames(const char *path, unsigned *nslots){
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	c8d_msg_t req;
+	void *frames;
+	int fd, mfd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)){
+		err("percorso troppo lungo: %s", path);
+		return NULL;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0){
+		err("impossibile creare il socket");
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	memset(&req, 0, sizeof(req));
+	req.op = C8D_OP_MAP;
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) || send(fd, &req, sizeof(req), 0) < 0){
+		err("impossibile collegarsi a c8d su %s", path);
+		goto fail;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) < (ssize_t) sizeof(req) || req.status != C8D_OK
+		|| (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS){
+		err("c8d non ha mandato la memoria degli schermi");
+		goto fail;
+	}
+	memcpy(&mfd, CMSG_DATA(cmsg), sizeof(int));
+
+	/* La mappatura resta valida anche dopo aver chiuso socket e descrittore */
+	frames = mmap(NULL, req.arg * sizeof(c8d_frame_t), PROT_READ, MAP_SHARED, mfd, 0);
+	close(mfd);
+	close(fd);
+
+	if (frames == MAP_FAILED){
+		err("impossibile mappare la memoria degli schermi");
+		return NULL;
+	}
+
+	*nslots = req.arg;
+	return frames;
+
+ fail:
+	close(fd);
+	return NULL;
+}
+
+/* Disegna nell'atlante la casella di uno slot, vuota se è libero */
+static void draw_tile(unsigned slot, const uint8_t *vram){
+	uint32_t *row;
+	unsigned y, x;
+
+	row = atlas + (slot / cols) * TILE_H * width + (slot % cols) * TILE_W;
+
+	for (y=0; y<32; y++, row+=width){
+		if (!vram){
+			for (x=0; x<64; x++){
+				row[x] = GAP_COLOR;
+			}
+			continue;
+		}
+
+		for (x=0; x<8; x++){
+			memcpy(row + x * 8, expand[vram[y * 8 + x]], sizeof(expand[0]));
+		}
+	}
+}
+
+/* Mostra gli schermi dei primi WALL_MAX slot del c8d in ascolto su path
+ * finché la finestra non viene chiusa; ritorna non zero in caso di errore */
+int wall_run(const char *path, uint32_t fg, uint32_t bg){
+	const c8d_frame_t *frames;
+	SDL_Window *win;
+	SDL_Renderer *ren;
+	SDL_Texture *tex;
+	SDL_Rect rect;
+	SDL_Event ev;
+	uint8_t vram[CHIP8_VRAM_SIZE];
+	uint32_t *seen, seq;
+	unsigned nslots, n, slot, r, first, last, scale, k;
+	int quit, ret;
+
+	if ((frames = map_frames(path, &nslots)) == NULL){
+		return 1;
+	}
+
+	/* Le caselle sono larghe il doppio che alte, quindi una griglia
+	 * quadrata dà una finestra di proporzioni 2:1 */
+	n = (nslots < WALL_MAX) ? nslots : WALL_MAX;
+	for (cols=1; cols * cols < n; cols++);
+	rows = (n + cols - 1) / cols;
+	width = cols * TILE_W;
+	height = rows * TILE_H;
+
+	atlas = malloc(width * height * sizeof(uint32_t));
+	seen = malloc(n * sizeof(uint32_t));
+	if (!atlas || !seen){
+		err("impossibile allocare memoria");
+		free(atlas);
+		free(seen);
+		return 1;
+	}
+
+	for (k=0; k<256; k++){
+		for (r=0; r<8; r++){
+			expand[k][r] = (k & (0x80 >> r)) ? fg : bg;
+		}
+	}
+
+	/* I separatori non cambiano più; i numeri di sequenza pari sono
+	 * quelli stabili, quindi ogni casella viene disegnata subito */
+	for (k=0; k<width * height; k++){
+		atlas[k] = GAP_COLOR;
+	}
+	memset(seen, 0xFF, n * sizeof(uint32_t));
+
+	if (SDL_Init(SDL_INIT_VIDEO)){
+		fprintf(stderr, "Errore init SDL: %s\n", SDL_GetError());
+		goto fail;
+	}
+
+	scale = WALL_WIDTH / width;
+	scale = scale ? (scale > 16 ? 16 : scale) : 1;
+
+	ret = 1;
+	win = SDL_CreateWindow("CHIP-8: c8d", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+						   width * scale, height * scale, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+	if (!win){
+		fprintf(stderr, "Errore creazione finestra: %s\n", SDL_GetError());
+		goto fail_sdl;
+	}
+
+	ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	if (!ren){
+		fprintf(stderr, "Errore creazione renderer: %s\n", SDL_GetError());
+		goto fail_win;
+	}
+
+	tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+	if (!tex){
+		fprintf(stderr, "Errore creazione texture: %s\n", SDL_GetError());
+		goto fail_ren;
+	}
+	SDL_UpdateTexture(tex, NULL, atlas, width * sizeof(uint32_t));
+
+	quit = 0;
+	while (!quit){
+		while (SDL_PollEvent(&ev)){
+			if (ev.type == SDL_QUIT || (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_ESCAPE)){
+				quit = 1;
+			}
+		}
+
+		/* Per ogni riga della griglia si ricarica solo l'intervallo
+		 * di caselle cambiate, con una sola copia verso la texture */
+		for (r=0; r<rows; r++){
+			first = cols;
+			last = 0;
+
+			for (slot=r * cols; slot<(r + 1) * cols && slot<n; slot++){
+				if (__atomic_load_n(&frames[slot].seq, __ATOMIC_RELAXED) == seen[slot]){
+					continue;
+				}
+
+				seq = c8d_read_frame(&frames[slot], vram);
+				draw_tile(slot, frames[slot].session ? vram : NULL);
+				seen[slot] = seq;
+
+				first = (slot % cols < first) ? slot % cols : first;
+				last = slot % cols;
+			}
+
+			if (first <= last){
+				rect.x = first * TILE_W;
+				rect.y = r * TILE_H;
+				rect.w = (last - first + 1) * TILE_W;
+				rect.h = TILE_H;
+				SDL_UpdateTexture(tex, &rect, atlas + rect.y * width + rect.x, width * sizeof(uint32_t));
+			}
+		}
+
+		/* Con VSYNC il ciclo gira alla frequenza dello schermo */
+		SDL_RenderCopy(ren, tex, NULL, NULL);
+		SDL_RenderPresent(ren);
+	}
+
+	ret = 0;
+	SDL_DestroyTexture(tex);
+ fail_ren:
+	SDL_DestroyRenderer(ren);
+ fail_win:
+	SDL_DestroyWindow(win);
+ fail_sdl:
+	SDL_Quit();
+	free(atlas);
+	free(seen);
+	munmap((void *) frames, nslots * sizeof(c8d_frame_t));
+	return ret;
+
+ fail:
+	free(atlas);
+	free(seen);
+	munmap((void *) frames, nslots * sizeof(c8d_frame_t));
+	return 1;
+}